@@ -0,0 +1,315 @@
+// Multi-drop bus cable.
+// Connects one transmitter to several stations over an emulated shared
+// serial bus, to test the multi-drop mode of the link layer (LL_STATION)
+// without hardware. Every port is a pseudo terminal, linked from the path
+// given on the command line (e.g. /dev/ttyS10). The bytes the transmitter
+// writes reach every station, each with bit errors of its own, while the
+// frames the stations write reach the transmitter whole, one after the
+// other, as if they took turns on the bus. Both directions are paced at the
+// line rate (10 bits per byte). It runs until interrupted.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FLAG 0x7E
+#define MAX_STATIONS 16
+
+// Relay buffer, and the slice of line time it lets through at once.
+#define RELAY_CHUNK 4096
+#define SLICE_SECONDS 0.002
+// A line that had nothing to send for this long starts over from now.
+#define IDLE_SECONDS 0.01
+// Largest frame kept whole on its way to the transmitter; a longer one is
+// passed on in pieces.
+#define MAX_FRAME_SIZE 4096
+// Bytes waiting for their turn on the bus to the transmitter.
+#define UPSTREAM_SIZE 65536
+
+// A port of the bus: a pseudo terminal linked from `path`.
+typedef struct {
+  const char *path;
+  int master;
+  // Kept open, so the master doesn't fail while nothing uses the port.
+  int slave;
+  int linked; // `path` links to it.
+  unsigned int seed;
+  // Station: the frame being assembled, from its opening flag.
+  unsigned char frame[MAX_FRAME_SIZE];
+  size_t frameSize; // 0 between frames.
+  long bytes;       // Bytes relayed from the port.
+  long frames;      // Frames relayed from the port.
+} BusPort;
+
+// A direction of the bus, paced at the line rate.
+typedef struct {
+  double busyUntil; // When the bytes relayed so far have left the line.
+} BusLine;
+
+static volatile sig_atomic_t stopped;
+
+/**
+ * @brief Returns the CLOCK_MONOTONIC time in seconds.
+ */
+double monotonicSeconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void stop(int number) {
+  (void)number;
+  stopped = 1;
+}
+
+/**
+ * @brief Returns the bytes the line can carry by now, 0 while it is busy.
+ *
+ * The line carries rate bytes per second back to back, so bytes queued while
+ * the relay was busy elsewhere are still sent at the line rate.
+ */
+size_t lineBudget(BusLine *line, double rate) {
+  double now = monotonicSeconds();
+  if (now < line->busyUntil)
+    return 0;
+  if (now - line->busyUntil > IDLE_SECONDS)
+    line->busyUntil = now;
+  size_t allowed = (now - line->busyUntil + SLICE_SECONDS) * rate + 1;
+  return allowed > RELAY_CHUNK ? RELAY_CHUNK : allowed;
+}
+
+/**
+ * @brief Flips each bit of the bytes with probability ber.
+ */
+void corrupt(unsigned char *bytes, size_t size, double ber,
+             unsigned int *seed) {
+  for (size_t i = 0; ber > 0 && i < size; i++) {
+    for (int bit = 0; bit < 8; bit++) {
+      if (rand_r(seed) < ber * RAND_MAX)
+        bytes[i] ^= 1 << bit;
+    }
+  }
+}
+
+/**
+ * @brief Writes bytes to a port. Bytes it doesn't take right away (nobody is
+ * reading them) are dropped, as a line would.
+ */
+void writePort(BusPort *port, const unsigned char *bytes, size_t size) {
+  while (size > 0) {
+    ssize_t written = write(port->master, bytes, size);
+    if (written <= 0)
+      return;
+    bytes += written;
+    size -= written;
+  }
+}
+
+/**
+ * @brief Opens the pseudo terminal of a port and links its path to it,
+ * replacing a link left there before.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int openPort(BusPort *port) {
+  char name[64];
+  if (openpty(&port->master, &port->slave, name, NULL, NULL) == -1) {
+    perror("openpty");
+    return -1;
+  }
+  // No echo or line editing until the link layer configures the port.
+  struct termios settings;
+  if (tcgetattr(port->slave, &settings) == 0) {
+    cfmakeraw(&settings);
+    tcsetattr(port->slave, TCSANOW, &settings);
+  }
+  fcntl(port->master, F_SETFL, fcntl(port->master, F_GETFL) | O_NONBLOCK);
+
+  struct stat info;
+  if (lstat(port->path, &info) == 0) {
+    if (!S_ISLNK(info.st_mode)) {
+      fprintf(stderr, "%s exists and isn't a link\n", port->path);
+      return -1;
+    }
+    unlink(port->path);
+  }
+  if (symlink(name, port->path) == -1) {
+    perror(port->path);
+    return -1;
+  }
+  port->linked = 1;
+  printf("%s -> %s\n", port->path, name);
+  return 0;
+}
+
+/**
+ * @brief Splits the bytes a station wrote into frames, and queues each
+ * complete one for its turn on the bus.
+ *
+ * A frame runs from a FLAG to the next one. Two FLAG bytes in a row end a
+ * frame and start the next, and bytes outside of a frame are dropped.
+ *
+ * @param port The station.
+ * @param bytes The bytes it wrote.
+ * @param size The number of bytes.
+ * @param upstream The queue of the bus to the transmitter.
+ * @param queued Bytes in the queue.
+ */
+void assembleFrames(BusPort *port, const unsigned char *bytes, size_t size,
+                    unsigned char *upstream, size_t *queued) {
+  for (size_t i = 0; i < size; i++) {
+    if (port->frameSize == 0) {
+      if (bytes[i] == FLAG)
+        port->frame[port->frameSize++] = FLAG;
+      continue;
+    }
+    port->frame[port->frameSize++] = bytes[i];
+    int complete = bytes[i] == FLAG;
+    if (complete && port->frameSize == 2) {
+      // An empty frame: this FLAG opens the next one.
+      port->frameSize = 1;
+      continue;
+    }
+    if (!complete && port->frameSize < MAX_FRAME_SIZE)
+      continue;
+    if (*queued + port->frameSize <= UPSTREAM_SIZE) {
+      memcpy(upstream + *queued, port->frame, port->frameSize);
+      *queued += port->frameSize;
+      port->bytes += port->frameSize;
+      port->frames++;
+    }
+    port->frameSize = 0;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int baudRate = 9600;
+  double ber = 0;
+  unsigned int seed = 1;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "b:e:s:")) != -1) {
+    switch (opt) {
+    case 'b':
+      baudRate = atoi(optarg);
+      break;
+    case 'e':
+      ber = atof(optarg);
+      break;
+    case 's':
+      seed = atoi(optarg);
+      break;
+    default:
+      optind = argc;
+      break;
+    }
+  }
+  int nStations = argc - optind - 1;
+  if (nStations < 1 || nStations > MAX_STATIONS || baudRate <= 0) {
+    printf("Usage: %s [-b baud_rate] [-e ber] [-s seed] tx_port "
+           "station_port...\n"
+           "Up to %d stations, numbered from 1 in the order given.\n",
+           argv[0], MAX_STATIONS);
+    return 1;
+  }
+
+  // The transmitter first, then the stations.
+  BusPort ports[MAX_STATIONS + 1];
+  int nPorts = nStations + 1;
+  memset(ports, 0, sizeof(ports));
+  for (int i = 0; i < nPorts; i++) {
+    ports[i].path = argv[optind + i];
+    ports[i].seed = seed + i;
+    ports[i].master = ports[i].slave = -1;
+  }
+  int failed = 0;
+  for (int i = 0; i < nPorts && !failed; i++)
+    failed = openPort(&ports[i]) != 0;
+
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+  if (!failed)
+    printf("Bus of %d stations at %d baud, BER %g. Ctrl-C to stop.\n",
+           nStations, baudRate, ber);
+
+  static unsigned char upstream[UPSTREAM_SIZE];
+  size_t queued = 0;
+  BusLine downstreamLine = {0}, upstreamLine = {0};
+  double rate = baudRate / 10.0;
+  BusPort *transmitter = &ports[0];
+  while (!failed && !stopped) {
+    // The transmitter isn't polled while the bus is still busy with its last
+    // bytes.
+    struct pollfd pollFds[MAX_STATIONS + 1];
+    for (int i = 0; i < nPorts; i++) {
+      pollFds[i].fd = ports[i].master;
+      pollFds[i].events = POLLIN;
+      pollFds[i].revents = 0;
+    }
+    if (monotonicSeconds() < downstreamLine.busyUntil)
+      pollFds[0].fd = -1;
+    if (poll(pollFds, nPorts, 1) == -1 && errno != EINTR) {
+      perror("poll");
+      break;
+    }
+
+    unsigned char buffer[RELAY_CHUNK];
+    size_t allowed;
+    if ((pollFds[0].revents & POLLIN) &&
+        (allowed = lineBudget(&downstreamLine, rate)) > 0) {
+      ssize_t size = read(transmitter->master, buffer, allowed);
+      if (size > 0) {
+        downstreamLine.busyUntil += size / rate;
+        transmitter->bytes += size;
+        for (int i = 1; i < nPorts; i++) {
+          unsigned char copy[RELAY_CHUNK];
+          memcpy(copy, buffer, size);
+          corrupt(copy, size, ber, &ports[i].seed);
+          writePort(&ports[i], copy, size);
+        }
+      }
+    }
+
+    for (int i = 1; i < nPorts; i++) {
+      if (!(pollFds[i].revents & POLLIN))
+        continue;
+      ssize_t size = read(ports[i].master, buffer, sizeof(buffer));
+      if (size > 0)
+        assembleFrames(&ports[i], buffer, size, upstream, &queued);
+    }
+
+    if (queued > 0 && (allowed = lineBudget(&upstreamLine, rate)) > 0) {
+      size_t size = queued < allowed ? queued : allowed;
+      upstreamLine.busyUntil += size / rate;
+      memcpy(buffer, upstream, size);
+      corrupt(buffer, size, ber, &transmitter->seed);
+      writePort(transmitter, buffer, size);
+      memmove(upstream, upstream + size, queued - size);
+      queued -= size;
+    }
+  }
+
+  printf("\n%s: %ld bytes sent to the stations\n", transmitter->path,
+         transmitter->bytes);
+  for (int i = 1; i < nPorts; i++)
+    printf("%s: station %d, %ld frames (%ld bytes) sent to the transmitter\n",
+           ports[i].path, i, ports[i].frames, ports[i].bytes);
+  for (int i = 0; i < nPorts; i++) {
+    if (ports[i].linked)
+      unlink(ports[i].path);
+    if (ports[i].master >= 0) {
+      close(ports[i].master);
+      close(ports[i].slave);
+    }
+  }
+  return failed;
+}
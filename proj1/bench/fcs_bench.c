@@ -0,0 +1,108 @@
+// Frame check sequence microbenchmark.
+// Compares the per-byte cost of the classic XOR BCC2 with CRC-16 (slicing-by-8)
+// and CRC-32C (slicing-by-8 and SSE4.2), alone and fused with byte stuffing.
+
+#include "../include/byte_stuffing.h"
+#include "../include/crc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PAYLOAD_SIZE 1000
+#define ITERATIONS 100000
+
+/**
+ * @brief Folds bytes into a BCC2, as the classic link layer does.
+ */
+uint32_t xorUpdate(uint32_t check, const unsigned char *bytes, size_t size) {
+  unsigned char bcc2 = check;
+  for (size_t i = 0; i < size; i++)
+    bcc2 ^= bytes[i];
+  return bcc2;
+}
+
+/**
+ * @brief Returns the seconds elapsed since start.
+ */
+double elapsedSince(const struct timespec *start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * @brief Checks the CRCs against the standard check values of "123456789".
+ *
+ * @return 0 if they match, 1 otherwise.
+ */
+int checkReferenceValues() {
+  const unsigned char *check = (const unsigned char *)"123456789";
+  uint32_t crc16 = crc16Update(CRC16_INIT, check, 9) ^ CRC16_FINAL_XOR;
+  uint32_t crc32c = crc32cUpdate(CRC32C_INIT, check, 9) ^ CRC32C_FINAL_XOR;
+  if (crc16 != 0x906E || crc32c != 0xE3069283) {
+    printf("Wrong check values (%s): crc16 0x%04X, crc32c 0x%08X\n",
+           crcKernel(), crc16, crc32c);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Measures a checksum alone and fused with stuffing.
+ *
+ * @param name The name printed in the results.
+ * @param update The checksum update function.
+ * @param payload The payload.
+ */
+void measure(const char *name, ChecksumUpdate update,
+             const unsigned char *payload) {
+  unsigned char stuffed[PAYLOAD_SIZE * 2];
+  size_t stuffedSize;
+  volatile uint32_t sink = 0;
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < ITERATIONS; i++)
+    sink ^= update(0xFFFFFFFF, payload, PAYLOAD_SIZE);
+  double checkTime = elapsedSince(&start);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < ITERATIONS; i++) {
+    uint32_t check = 0xFFFFFFFF;
+    stuffPacketWithCheck(payload, PAYLOAD_SIZE, stuffed, &stuffedSize, update,
+                         &check);
+    sink ^= check;
+  }
+  double fusedTime = elapsedSince(&start);
+
+  double bytes = (double)PAYLOAD_SIZE * ITERATIONS;
+  printf("%-16s %12.2f %12.1f %14.1f\n", name, checkTime * 1e9 / bytes,
+         bytes / 1e6 / checkTime, bytes / 1e6 / fusedTime);
+}
+
+int main() {
+  unsigned char payload[PAYLOAD_SIZE];
+  srand(1);
+  for (int i = 0; i < PAYLOAD_SIZE; i++)
+    payload[i] = rand() & 0xFF;
+
+  printf("%-16s %12s %12s %14s\n", "check", "ns/byte", "MB/s",
+         "+stuff MB/s");
+  measure("xor", xorUpdate, payload);
+  measure("crc16/slicing8", crc16Update, payload);
+
+  const char *kernels[] = {"slicing8", "sse4.2"};
+  for (int k = 0; k < 2; k++) {
+    char name[32];
+    snprintf(name, sizeof(name), "crc32c/%s", kernels[k]);
+    if (selectCrcKernel(kernels[k])) {
+      printf("%-16s (not supported by this CPU)\n", name);
+      continue;
+    }
+    if (checkReferenceValues())
+      return 1;
+    measure(name, crc32cUpdate, payload);
+  }
+  return 0;
+}
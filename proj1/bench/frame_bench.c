@@ -0,0 +1,466 @@
+// Frame size benchmark.
+// Measures the goodput of the link layer against the negotiated payload size
+// at several baud rates, bit error rates and FEC (and hybrid ARQ) settings. A transmitter and a
+// receiver run in child processes, connected through two pseudo terminals by
+// a relay that paces the bytes at the line rate (10 bits per byte) and
+// optionally flips bits at random. With several lines, the link is bonded
+// over that many pairs of pseudo terminals, each paced on its own.
+
+#include "../include/link_layer.h"
+#include "../include/link_layer_options.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Bytes sent per point: this many seconds of line time (by default), and at
+// least MIN_FRAMES frames.
+#define LINE_SECONDS 5
+#define MIN_FRAMES 8
+
+// Relay buffer, and the slice of line time it lets through at once.
+#define RELAY_CHUNK 4096
+#define SLICE_SECONDS 0.002
+// A line that had nothing to send for this long starts over from now.
+#define IDLE_SECONDS 0.01
+
+// Values swept when not given on the command line.
+#define MAX_SWEEP 16
+const int defaultPayloadSizes[] = {256, 512, 1000, 2048, 4096, 8192, 16384,
+                                   32768, 65535};
+const int defaultBaudRates[] = {9600, 38400, 115200};
+
+typedef struct {
+  int baudRate;
+  int payloadSize;
+  LinkLayerArq arq;
+  int adaptive; // The payload size is the largest of the adaptive mode.
+  double ber;
+  int fecParity; // 0 for no FEC.
+  int fecDepth;
+  int harqIncrement; // 0 for plain retransmissions.
+  int lines;         // Bonded lines, 1 for a single one.
+  size_t totalBytes;
+} BenchPoint;
+
+// One direction of the cable.
+typedef struct {
+  int from;
+  int to;
+  double busyUntil; // When the bytes relayed so far have left the line.
+  unsigned int seed;
+} RelayDirection;
+
+/**
+ * @brief Returns the CLOCK_MONOTONIC time in seconds.
+ */
+double monotonicSeconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Returns the seconds elapsed since start.
+ */
+double elapsedSince(const struct timespec *start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * @brief Byte of the test data at a given offset.
+ */
+unsigned char patternByte(size_t offset) {
+  return (offset * 2654435761u) >> 24;
+}
+
+/**
+ * @brief Opens the link layer of one end of a benchmark point.
+ *
+ * @param point The benchmark point.
+ * @param ports The serial ports (pseudo terminals) of this end, one per line.
+ * @param role The role of this end.
+ * @return 0 on success, 1 on error.
+ */
+int openEnd(const BenchPoint *point, char ports[][64], LinkLayerRole role) {
+  LinkLayerOptions options;
+  lldefaultoptions(&options);
+  options.arq = point->arq;
+  if (point->arq == LlGoBackN)
+    options.windowSize = MAX_WINDOW_SIZE;
+  else if (point->arq == LlSelectiveRepeat)
+    options.windowSize = MAX_SELECTIVE_WINDOW_SIZE;
+  options.fcs = LlFcsCrc32c;
+  options.payloadSize = point->payloadSize;
+  options.adaptivePayload = point->adaptive;
+  options.fecParity = point->fecParity;
+  options.fecDepth = point->fecDepth;
+  options.harqIncrement = point->harqIncrement;
+  if (llconfigure(&options) < 0)
+    return 1;
+  llbond(NULL);
+  for (int line = 1; line < point->lines; line++) {
+    if (llbond(ports[line]))
+      return 1;
+  }
+
+  // The timeout caps the retransmission timer, which must outlast a window.
+  double frameSeconds = point->payloadSize * 10.0 / point->baudRate;
+  LinkLayer parameters;
+  memset(&parameters, 0, sizeof(parameters));
+  snprintf(parameters.serialPort, sizeof(parameters.serialPort), "%s",
+           ports[0]);
+  parameters.role = role;
+  parameters.baudRate = point->baudRate;
+  parameters.nRetransmissions = 10;
+  parameters.timeout = 3 + (int)(frameSeconds * (MAX_WINDOW_SIZE + 1));
+  return llopen(parameters) < 0;
+}
+
+/**
+ * @brief Sends the test data and reports the transfer time through a pipe.
+ *
+ * @return The exit status of the child process.
+ */
+int runTransmitter(const BenchPoint *point, char ports[][64], int resultFd) {
+  if (openEnd(point, ports, LlTx))
+    return 1;
+
+  unsigned char *packet = malloc(point->payloadSize);
+  if (packet == NULL)
+    return 1;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (size_t sent = 0; sent < point->totalBytes;) {
+    size_t size = point->totalBytes - sent;
+    if (size > (size_t)llnextpayloadsize())
+      size = llnextpayloadsize();
+    for (size_t i = 0; i < size; i++)
+      packet[i] = patternByte(sent + i);
+    if (llwrite(packet, size) < 0) {
+      free(packet);
+      llclose(FALSE);
+      return 1;
+    }
+    sent += size;
+  }
+  free(packet);
+  int closed = llclose(FALSE);
+  double seconds = elapsedSince(&start);
+  if (write(resultFd, &seconds, sizeof(seconds)) != sizeof(seconds))
+    return 1;
+  return closed < 0;
+}
+
+/**
+ * @brief Receives the test data and checks it.
+ *
+ * @return The exit status of the child process.
+ */
+int runReceiver(const BenchPoint *point, char ports[][64]) {
+  if (openEnd(point, ports, LlRx))
+    return 1;
+
+  unsigned char *packet = malloc(llreadbuffersize());
+  if (packet == NULL)
+    return 1;
+  size_t received = 0;
+  int corrupted = 0;
+  while (received < point->totalBytes) {
+    int size = llread(packet);
+    if (size < 0)
+      break;
+    for (int i = 0; i < size; i++)
+      corrupted |= packet[i] != patternByte(received + i);
+    received += size;
+  }
+  free(packet);
+  llclose(FALSE);
+  return received != point->totalBytes || corrupted;
+}
+
+/**
+ * @brief Moves the bytes the line can carry by now.
+ *
+ * The line carries rate bytes per second back to back, so bytes queued while
+ * the relay was busy elsewhere are still sent at the line rate.
+ *
+ * @param direction The direction of the cable.
+ * @param rate The line rate in bytes per second.
+ * @param ber The bit error rate.
+ */
+void relayBytes(RelayDirection *direction, double rate, double ber) {
+  unsigned char buffer[RELAY_CHUNK];
+  double now = monotonicSeconds();
+
+  if (now < direction->busyUntil)
+    return;
+  if (now - direction->busyUntil > IDLE_SECONDS)
+    direction->busyUntil = now;
+  size_t allowed = (now - direction->busyUntil + SLICE_SECONDS) * rate + 1;
+  if (allowed > sizeof(buffer))
+    allowed = sizeof(buffer);
+
+  ssize_t size = read(direction->from, buffer, allowed);
+  if (size <= 0)
+    return;
+  direction->busyUntil += size / rate;
+  for (ssize_t i = 0; ber > 0 && i < size; i++) {
+    for (int bit = 0; bit < 8; bit++) {
+      if (rand_r(&direction->seed) < ber * RAND_MAX)
+        buffer[i] ^= 1 << bit;
+    }
+  }
+  for (ssize_t written = 0; written < size;) {
+    ssize_t bytes = write(direction->to, buffer + written, size - written);
+    if (bytes <= 0)
+      return;
+    written += bytes;
+  }
+}
+
+/**
+ * @brief Runs both ends of a benchmark point through a paced relay.
+ *
+ * @param point The benchmark point.
+ * @param seconds Where the transfer time is stored.
+ * @return 0 if the data arrived intact, 1 otherwise.
+ */
+int runPoint(const BenchPoint *point, double *seconds) {
+  int masters[2][MAX_BOND_LINES], slaves[2][MAX_BOND_LINES];
+  char ports[2][MAX_BOND_LINES][64];
+  int resultPipe[2];
+
+  for (int end = 0; end < 2; end++) {
+    for (int line = 0; line < point->lines; line++) {
+      if (openpty(&masters[end][line], &slaves[end][line], ports[end][line],
+                  NULL, NULL) == -1) {
+        perror("openpty");
+        return 1;
+      }
+    }
+  }
+  if (pipe(resultPipe) == -1) {
+    perror("pipe");
+    return 1;
+  }
+  fflush(stdout);
+
+  pid_t children[2];
+  for (int end = 0; end < 2; end++) {
+    children[end] = fork();
+    if (children[end] == 0) {
+      // The link layer reports its progress on stdout.
+      if (freopen("/dev/null", "w", stdout) == NULL)
+        _exit(1);
+      for (int line = 0; line < point->lines; line++) {
+        close(masters[0][line]);
+        close(masters[1][line]);
+      }
+      close(resultPipe[0]);
+      int status = end == 0 ? runTransmitter(point, ports[0], resultPipe[1])
+                            : runReceiver(point, ports[1]);
+      _exit(status);
+    }
+  }
+  close(resultPipe[1]);
+
+  // Both directions of each line, the line's from even to odd.
+  int nDirections = point->lines * 2;
+  RelayDirection directions[MAX_BOND_LINES * 2];
+  for (int line = 0; line < point->lines; line++) {
+    directions[line * 2] = (RelayDirection){
+        masters[0][line], masters[1][line], 0, line * 2 + 1};
+    directions[line * 2 + 1] = (RelayDirection){
+        masters[1][line], masters[0][line], 0, line * 2 + 2};
+  }
+  double rate = point->baudRate / 10.0;
+  int running = 2;
+  int failed = 0;
+  while (running > 0) {
+    // A direction still busy with the last bytes isn't polled until it's free.
+    struct pollfd pollFds[MAX_BOND_LINES * 2];
+    double now = monotonicSeconds();
+    for (int i = 0; i < nDirections; i++) {
+      pollFds[i].fd =
+          now < directions[i].busyUntil ? -1 : directions[i].from;
+      pollFds[i].events = POLLIN;
+      pollFds[i].revents = 0;
+    }
+    poll(pollFds, nDirections, 1);
+    for (int i = 0; i < nDirections; i++) {
+      if (pollFds[i].revents & POLLIN)
+        relayBytes(&directions[i], rate, point->ber);
+    }
+
+    for (int end = 0; end < 2; end++) {
+      int status;
+      if (children[end] > 0 && waitpid(children[end], &status, WNOHANG) > 0) {
+        failed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+        children[end] = 0;
+        running--;
+      }
+    }
+  }
+
+  if (read(resultPipe[0], seconds, sizeof(*seconds)) != sizeof(*seconds))
+    failed = 1;
+  close(resultPipe[0]);
+  for (int end = 0; end < 2; end++) {
+    for (int line = 0; line < point->lines; line++) {
+      close(masters[end][line]);
+      close(slaves[end][line]);
+    }
+  }
+  return failed;
+}
+
+/**
+ * @brief Prints the first columns of a result line.
+ */
+void printPoint(const BenchPoint *point) {
+  char fec[16] = "-";
+  if (point->harqIncrement > 0)
+    snprintf(fec, sizeof(fec), "%d:%d+%d", point->fecParity, point->fecDepth,
+             point->harqIncrement);
+  else if (point->fecParity > 0)
+    snprintf(fec, sizeof(fec), "%d:%d", point->fecParity, point->fecDepth);
+  printf("%-8d %5d %8d %8.0e %8s %8zu", point->baudRate, point->lines,
+         point->payloadSize, point->ber, fec, point->totalBytes);
+}
+
+int main(int argc, char *argv[]) {
+  BenchPoint point = {0, 0, LlGoBackN, FALSE, 0, 0, 1, 0, 1, 0};
+  double maxSeconds = 30;
+  double lineSeconds = LINE_SECONDS;
+  int payloadSizes[MAX_SWEEP];
+  int nPayloadSizes = 0;
+  double bers[MAX_SWEEP] = {0};
+  int nBers = 0;
+  int fecs[MAX_SWEEP][3] = {{0, 1, 0}};
+  int nFecs = 0;
+  int lines[MAX_SWEEP] = {1};
+  int nLines = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "Aa:e:f:l:p:s:t:")) != -1) {
+    switch (opt) {
+    case 'A':
+      point.adaptive = TRUE;
+      break;
+    case 'a':
+      if (strcmp(optarg, "sw") == 0)
+        point.arq = LlStopAndWait;
+      else if (strcmp(optarg, "sr") == 0)
+        point.arq = LlSelectiveRepeat;
+      else
+        point.arq = LlGoBackN;
+      break;
+    case 'e':
+      if (nBers < MAX_SWEEP)
+        bers[nBers++] = atof(optarg);
+      break;
+    case 'f':
+      if (nFecs < MAX_SWEEP) {
+        fecs[nFecs][1] = 1;
+        fecs[nFecs][2] = 0;
+        if (sscanf(optarg, "%d:%d:%d", &fecs[nFecs][0], &fecs[nFecs][1],
+                   &fecs[nFecs][2]) < 1)
+          fecs[nFecs][0] = 0;
+        nFecs++;
+      }
+      break;
+    case 'l':
+      if (nLines < MAX_SWEEP) {
+        lines[nLines] = atoi(optarg);
+        if (lines[nLines] < 1 || lines[nLines] > MAX_BOND_LINES)
+          lines[nLines] = 1;
+        nLines++;
+      }
+      break;
+    case 'p':
+      if (nPayloadSizes < MAX_SWEEP)
+        payloadSizes[nPayloadSizes++] = atoi(optarg);
+      break;
+    case 's':
+      lineSeconds = atof(optarg);
+      break;
+    case 't':
+      maxSeconds = atof(optarg);
+      break;
+    default:
+      printf("Usage: %s [-A] [-a sw|gbn|sr] [-e ber]... "
+             "[-f parity[:depth[:increment]]]... [-l lines]... "
+             "[-p payload]... [-s line_seconds] [-t max_seconds] "
+             "[baud_rate...]\n"
+             "Options given several times are swept, -f 0 is without FEC, "
+             "an increment\nenables hybrid ARQ, and more than one line bonds "
+             "the link over that many.\n",
+             argv[0]);
+      return 1;
+    }
+  }
+
+  int nBaudRates = argc - optind;
+  if (nBaudRates == 0)
+    nBaudRates = sizeof(defaultBaudRates) / sizeof(defaultBaudRates[0]);
+  if (nPayloadSizes == 0) {
+    nPayloadSizes = sizeof(defaultPayloadSizes) / sizeof(defaultPayloadSizes[0]);
+    memcpy(payloadSizes, defaultPayloadSizes, sizeof(defaultPayloadSizes));
+  }
+  if (nBers == 0)
+    nBers = 1;
+  if (nFecs == 0)
+    nFecs = 1;
+  if (nLines == 0)
+    nLines = 1;
+
+  printf("%-8s %5s %8s %8s %8s %8s %9s %12s %10s\n", "baud", "lines",
+         "payload", "ber", "fec", "bytes", "seconds", "goodput B/s",
+         "efficiency");
+  for (int b = 0; b < nBaudRates; b++) {
+    point.baudRate = optind < argc ? atoi(argv[optind + b]) : defaultBaudRates[b];
+    for (int l = 0; l < nLines; l++) {
+      point.lines = lines[l];
+      // The line time is the same for every number of lines.
+      double rate = point.baudRate / 10.0 * point.lines;
+      for (int p = 0; p < nPayloadSizes; p++) {
+        point.payloadSize = payloadSizes[p];
+        point.totalBytes = rate * lineSeconds;
+        if (point.totalBytes < (size_t)point.payloadSize * MIN_FRAMES)
+          point.totalBytes = (size_t)point.payloadSize * MIN_FRAMES;
+        for (int e = 0; e < nBers; e++) {
+          point.ber = bers[e];
+          for (int f = 0; f < nFecs; f++) {
+            point.fecParity = fecs[f][0];
+            point.fecDepth = fecs[f][1];
+            point.harqIncrement = fecs[f][2];
+            printPoint(&point);
+            if (point.totalBytes / rate > maxSeconds) {
+              printf(" %9s\n", "skipped");
+              continue;
+            }
+
+            double seconds = 0;
+            if (runPoint(&point, &seconds)) {
+              printf(" %9s\n", "failed");
+              continue;
+            }
+            double goodput = point.totalBytes / seconds;
+            printf(" %9.2f %12.0f %9.1f%%\n", seconds, goodput,
+                   goodput * 8 / point.baudRate / point.lines * 100);
+            fflush(stdout);
+          }
+        }
+      }
+    }
+  }
+  return 0;
+}
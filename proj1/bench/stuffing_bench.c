@@ -0,0 +1,131 @@
+// Byte stuffing microbenchmark.
+// Compares the stuffing kernels (scalar, SSE2, AVX2) and COBS framing on
+// random, all-flag and text payloads, for both encoding and decoding, along
+// with the size of the encoded payload.
+
+#include "../include/byte_stuffing.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PAYLOAD_SIZE 1000
+#define ITERATIONS 20000
+
+typedef enum {
+  RandomPayload,
+  FlagPayload,
+  TextPayload,
+} PayloadType;
+
+const char *payloadNames[] = {"random", "all-flag", "text"};
+
+/**
+ * @brief Fills a buffer with one of the benchmark payloads.
+ *
+ * @param buf The buffer to fill.
+ * @param size The size of the buffer.
+ * @param type The payload type.
+ */
+void fillPayload(unsigned char *buf, size_t size, PayloadType type) {
+  const char *text = "The quick brown fox jumps over the lazy dog. ";
+  size_t textSize = strlen(text);
+
+  for (size_t i = 0; i < size; i++) {
+    switch (type) {
+    case RandomPayload:
+      buf[i] = rand() & 0xFF;
+      break;
+    case FlagPayload:
+      buf[i] = FLAG;
+      break;
+    case TextPayload:
+      buf[i] = text[i % textSize];
+      break;
+    }
+  }
+}
+
+/**
+ * @brief Returns the seconds elapsed since start.
+ */
+double elapsedSince(const struct timespec *start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main() {
+  const char *kernels[] = {"scalar", "sse2", "avx2"};
+  unsigned char payload[PAYLOAD_SIZE];
+  unsigned char stuffed[PAYLOAD_SIZE * 2];
+  unsigned char destuffed[PAYLOAD_SIZE * 2];
+  size_t stuffedSize, destuffedSize;
+
+  printf("%-8s %-10s %14s %14s %8s\n", "kernel", "payload", "stuff MB/s",
+         "destuff MB/s", "bytes");
+  for (int k = 0; k < 3; k++) {
+    if (selectStuffingKernel(kernels[k])) {
+      printf("%-8s (not supported by this CPU)\n", kernels[k]);
+      continue;
+    }
+    for (int type = RandomPayload; type <= TextPayload; type++) {
+      srand(1);
+      fillPayload(payload, PAYLOAD_SIZE, type);
+
+      struct timespec start;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      for (int i = 0; i < ITERATIONS; i++)
+        stuffPacket(payload, PAYLOAD_SIZE, stuffed, &stuffedSize);
+      double stuffTime = elapsedSince(&start);
+
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      for (int i = 0; i < ITERATIONS; i++)
+        destuffPacket(stuffed, stuffedSize, destuffed, &destuffedSize);
+      double destuffTime = elapsedSince(&start);
+
+      if (destuffedSize != PAYLOAD_SIZE ||
+          memcmp(payload, destuffed, PAYLOAD_SIZE) != 0) {
+        printf("%-8s %-10s destuffed payload doesn't match\n", kernels[k],
+               payloadNames[type]);
+        return 1;
+      }
+      double megabytes = (double)PAYLOAD_SIZE * ITERATIONS / 1e6;
+      printf("%-8s %-10s %14.1f %14.1f %8zu\n", kernels[k],
+             payloadNames[type], megabytes / stuffTime,
+             megabytes / destuffTime, stuffedSize);
+    }
+  }
+
+  // COBS doesn't use the kernels, its runs are found with memchr().
+  unsigned char encoded[COBS_SIZE(PAYLOAD_SIZE)];
+  unsigned char decoded[COBS_SIZE(PAYLOAD_SIZE)];
+  size_t encodedSize, decodedSize;
+  for (int type = RandomPayload; type <= TextPayload; type++) {
+    srand(1);
+    fillPayload(payload, PAYLOAD_SIZE, type);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < ITERATIONS; i++)
+      cobsEncode(payload, PAYLOAD_SIZE, encoded, &encodedSize);
+    double encodeTime = elapsedSince(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < ITERATIONS; i++)
+      cobsDecode(encoded, encodedSize, decoded, &decodedSize);
+    double decodeTime = elapsedSince(&start);
+
+    if (cobsDecode(encoded, encodedSize, decoded, &decodedSize) ||
+        decodedSize != PAYLOAD_SIZE ||
+        memcmp(payload, decoded, PAYLOAD_SIZE) != 0) {
+      printf("%-8s %-10s decoded payload doesn't match\n", "cobs",
+             payloadNames[type]);
+      return 1;
+    }
+    double megabytes = (double)PAYLOAD_SIZE * ITERATIONS / 1e6;
+    printf("%-8s %-10s %14.1f %14.1f %8zu\n", "cobs", payloadNames[type],
+           megabytes / encodeTime, megabytes / decodeTime, encodedSize);
+  }
+  return 0;
+}
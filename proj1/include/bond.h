@@ -0,0 +1,33 @@
+// Bond header.
+// Link bonding (see `llbond()`): one transfer striped over several serial
+// lines, each one a link of its own with its own ARQ, driven by a thread of
+// its own. A bond header in front of every packet lets the receiver put them
+// back in order, and the packets of a line that goes down are sent again on
+// the others.
+
+#ifndef _BOND_H_
+#define _BOND_H_
+
+#include "link_layer.h"
+
+typedef struct Bond Bond;
+
+// Open the member links of a bonded link, on the port of
+// `connectionParameters` and the ones added by `llbond()`, each in a thread of
+// its own.
+// Returns 0 on success, -1 if no member could be opened.
+int openBond(LinkLayer connectionParameters);
+
+// Queue a packet for the members to send.
+// Returns bufSize, or -1 if every line is down.
+int bondWrite(const unsigned char *buf, int bufSize);
+
+// Read the next packet of the bond, in order.
+// Returns the size of the packet, or -1 if every line is down.
+int bondRead(unsigned char *packet);
+
+// Close a bonded link, once its packets are acknowledged or received.
+// Returns 0 on success, -1 if packets weren't acknowledged.
+int closeBond(int showStatistics);
+
+#endif // _BOND_H_
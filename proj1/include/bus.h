@@ -0,0 +1,45 @@
+// Bus header.
+// Multi-drop bus (see `LinkLayerOptions.station`): a transmitter sends one
+// file to several receivers sharing its line, broadcasting its information
+// frames to every station, each of which acknowledges them with an address of
+// its own. A frame leaves the window once every station acknowledged it, and
+// a station that stops answering is dropped.
+
+#ifndef _BUS_H_
+#define _BUS_H_
+
+// Addresses of a multi-drop bus: the transmitter broadcasts its information
+// frames, and each station answers them, and exchanges the SET, UA and DISC,
+// with an address of its own.
+#define BROADCAST_ADDRESS 0xFF
+#define STATION_ADDRESS(station) ((unsigned char)(0x10 + (station)))
+
+// A station of a multi-drop bus, on the transmitter.
+typedef struct
+{
+    int opened;             // It answered the SET.
+    int up;                 // Opened, and not dropped since.
+    unsigned char expected; // Next frame it expects, from its last RR.
+    int acknowledged;       // Frames it acknowledged.
+    int naks;               // SREJ it sent.
+} Station;
+
+// Open the connection with each station of the bus, skipping the ones that
+// don't answer.
+// Returns 0 on success, -1 if no station answered.
+int openStations();
+
+// Handle a RR or SREJ from a station, if the received frame holds one.
+// Returns 1 if the window advanced, 0 if it didn't, -1 on error.
+int receiveStationResponse();
+
+// Drop the stations that didn't acknowledge the oldest frame of the window
+// once its retransmissions were exhausted.
+// Returns 1 if the window advanced, 0 if it didn't, -1 if no station is left.
+int dropLaggingStations();
+
+// Disconnect each station still up.
+// Returns 0 if every one disconnected, -1 otherwise.
+int closeStations();
+
+#endif // _BUS_H_
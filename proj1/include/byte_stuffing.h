@@ -0,0 +1,92 @@
+// Byte stuffing header.
+// Escapes the FLAG (0x7E) and ESC (0x7D) bytes of the data field of a frame
+// as ESC followed by the byte XOR 0x20 (0x7D5E and 0x7D5D).
+
+#ifndef _BYTE_STUFFING_H_
+#define _BYTE_STUFFING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FLAG 0x7E
+#define ESC 0x7D
+
+// Stuff packetSize bytes of packet into newPacket, which must hold at least
+// 2 * packetSize bytes (the worst case, every byte escaped).
+// Returns 0 on success, 1 if any of the pointers is NULL.
+int stuffPacket(const unsigned char *packet, size_t packetSize,
+                unsigned char *newPacket, size_t *newPacketSize);
+
+// Running checksum over a piece of the data, e.g. crc32cUpdate().
+typedef uint32_t (*ChecksumUpdate)(uint32_t check, const unsigned char *bytes,
+                                   size_t size);
+
+// Like stuffPacket(), also folding the packet into *check with update as it
+// is copied, so the packet is read only once.
+// Returns 0 on success, 1 if any of the pointers is NULL.
+int stuffPacketWithCheck(const unsigned char *packet, size_t packetSize,
+                         unsigned char *newPacket, size_t *newPacketSize,
+                         ChecksumUpdate update, uint32_t *check);
+
+// Remove the escape sequences of packetSize bytes of packet into newPacket,
+// which must hold at least packetSize bytes.
+// Returns 0 on success, 1 if any of the pointers is NULL.
+int destuffPacket(const unsigned char *packet, size_t packetSize,
+                  unsigned char *newPacket, size_t *newPacketSize);
+
+// Consistent Overhead Byte Stuffing (COBS), an alternative to the escape
+// sequences whose overhead doesn't depend on the data. The data is cut at its
+// FLAG bytes into runs of other bytes, of up to COBS_MAX_RUN bytes, and each
+// run is preceded by a code byte, its size plus 1, XORed with FLAG so that it
+// is never a FLAG itself. A run of less than COBS_MAX_RUN bytes is followed
+// by a FLAG, which the code byte stands for, except for the last one. So the
+// encoded data never holds a FLAG and is at most COBS_SIZE(size) bytes,
+// whatever it holds, and ESC bytes are left alone.
+#define COBS_MAX_RUN 254
+#define COBS_SIZE(size) ((size) + (size) / COBS_MAX_RUN + 1)
+
+// Encoder that takes the data in pieces (say, a packet and then its FCS).
+typedef struct
+{
+    unsigned char *next; // Where the next byte is written.
+    unsigned char *code; // Code byte of the current run.
+    size_t run;          // Bytes in the current run.
+    unsigned char *start;
+} CobsEncoder;
+
+// Start encoding into encoded, which must hold COBS_SIZE() of the size of
+// every piece given to cobsUpdate().
+void cobsStart(CobsEncoder *encoder, unsigned char *encoded);
+
+// Encode the next size bytes of data. If update isn't NULL, also fold them
+// into *check as they are copied.
+void cobsUpdate(CobsEncoder *encoder, const unsigned char *data, size_t size,
+                ChecksumUpdate update, uint32_t *check);
+
+// Finish the encoding. Returns the size of the encoded data.
+size_t cobsFinish(CobsEncoder *encoder);
+
+// Encode size bytes of data into encoded, which must hold COBS_SIZE(size)
+// bytes. Returns 0 on success, 1 if any of the pointers is NULL.
+int cobsEncode(const unsigned char *data, size_t size, unsigned char *encoded,
+               size_t *encodedSize);
+
+// Decode size bytes of encoded into data, which must hold size bytes.
+// Returns 0 on success, 1 if any of the pointers is NULL or the encoded data
+// is malformed (a FLAG, or a run cut short).
+int cobsDecode(const unsigned char *encoded, size_t size, unsigned char *data,
+               size_t *dataSize);
+
+// Return the index of the first FLAG or ESC byte in bytes, or size if there
+// is none.
+size_t findEscapeCandidate(const unsigned char *bytes, size_t size);
+
+// Select the kernel used to search for escape candidates: "scalar", "sse2"
+// or "avx2". By default the fastest one supported by the CPU is used.
+// Returns 0 on success, -1 if the CPU doesn't support it.
+int selectStuffingKernel(const char *name);
+
+// Name of the kernel in use.
+const char *stuffingKernel();
+
+#endif // _BYTE_STUFFING_H_
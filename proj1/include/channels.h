@@ -0,0 +1,50 @@
+// Channels header.
+// Logical channels of a transmitter (see `llsend()`): each one queues up to
+// CHANNEL_QUEUE_SIZE packets, and `llschedule()` sends them by weighted round
+// robin, each channel sending as many packets per round as its weight.
+
+#ifndef _CHANNELS_H_
+#define _CHANNELS_H_
+
+#include "link_layer_options.h"
+#include <time.h>
+
+// Queue of a logical channel, a ring of CHANNEL_QUEUE_SIZE packets.
+typedef struct
+{
+    unsigned char *packets; // Slots of `packetLimit()` bytes, allocated when
+                            // the channel is first used.
+    int sizes[CHANNEL_QUEUE_SIZE];
+    struct timespec queuedAt[CHANNEL_QUEUE_SIZE]; // When `llsend()` queued it.
+    int head;   // Slot of the oldest packet.
+    int count;  // Packets queued.
+    int weight; // Packets sent per round.
+} ChannelQueue;
+
+typedef struct
+{
+    int packets;         // Packets sent.
+    int packetBytes;     // Bytes of those packets.
+    int frames;          // Frames sent, redundancy frames included.
+    int resentFrames;    // Frames sent again.
+    double queuedMs;     // Time the packets waited in the queue.
+    int acknowledged;    // Packets acknowledged.
+    double deliveryMs;   // Time from `llsend()` to the acknowledgement.
+} ChannelStatistics;
+
+
+// Empty the channel queues and clear their counters.
+void resetChannels();
+
+// Queue of a channel, its slots allocated when first used.
+// Returns NULL if the channel is invalid or can't be allocated.
+ChannelQueue *channelQueue(int channel);
+
+// Slot of a channel queue.
+unsigned char *queueSlot(const ChannelQueue *queue, int slot);
+
+// Channel of the next packet, by weighted round robin.
+// Returns -1 if no packet is queued.
+int nextChannel();
+
+#endif // _CHANNELS_H_
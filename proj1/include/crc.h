@@ -0,0 +1,34 @@
+// CRC header.
+// Reflected CRCs used as frame check sequences:
+//   CRC-16-CCITT as in HDLC (polynomial 0x1021, init 0xFFFF, final XOR 0xFFFF)
+//   CRC-32C (Castagnoli polynomial 0x1EDC6F41, init and final XOR 0xFFFFFFFF)
+// The update functions don't apply the initial or final XOR, so a CRC can be
+// computed in pieces: crc = update(update(INIT, a), b) ^ FINAL_XOR.
+
+#ifndef _CRC_H_
+#define _CRC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CRC16_INIT 0xFFFF
+#define CRC16_FINAL_XOR 0xFFFF
+#define CRC32C_INIT 0xFFFFFFFF
+#define CRC32C_FINAL_XOR 0xFFFFFFFF
+
+// Fold size bytes into a running CRC-16-CCITT.
+uint32_t crc16Update(uint32_t crc, const unsigned char *bytes, size_t size);
+
+// Fold size bytes into a running CRC-32C.
+uint32_t crc32cUpdate(uint32_t crc, const unsigned char *bytes, size_t size);
+
+// Select the CRC-32C kernel: "slicing8" (table driven, 8 bytes per step) or
+// "sse4.2" (the crc32 instruction). By default the SSE4.2 kernel is used when
+// the CPU has it. CRC-16 always uses slicing-by-8.
+// Returns 0 on success, -1 if the CPU doesn't support it.
+int selectCrcKernel(const char *name);
+
+// Name of the CRC-32C kernel in use.
+const char *crcKernel();
+
+#endif // _CRC_H_
@@ -0,0 +1,101 @@
+// Event loop header.
+// Drives the link layer with a single epoll instance watching the serial port
+// and a set of one-shot timers (timerfds), instead of SIGALRM and blocking
+// reads and writes.
+
+#ifndef _EVENT_LOOP_H_
+#define _EVENT_LOOP_H_
+
+#include <stddef.h>
+
+// Number of timers, identified by 0 to MAX_TIMERS - 1.
+#define MAX_TIMERS 16
+
+// Runs of bytes the queue of the serial port holds, all written with a single
+// writev(). Frames queued by reference take a run each, and copied bytes a run
+// per TX_COPY_SIZE bytes.
+#define TX_QUEUE_RUNS 64
+#define TX_COPY_SIZE 256
+
+typedef struct
+{
+    int readCalls;   // `read()` system calls on the serial port.
+    int writeCalls;  // `write()` and `writev()` system calls on the port.
+    int wakeups;     // Returns from `epoll_wait()`.
+    int copiedBytes; // Bytes copied into the queue.
+} EventLoopCounters;
+
+// Start watching fd, which is switched to non-blocking mode, and create the
+// timers. Returns 0 on success, -1 on error.
+int eventLoopOpen(int fd);
+
+// Write the queued bytes (waiting up to timeoutMs milliseconds for them to
+// drain), then release the epoll instance and the timers.
+void eventLoopClose(int timeoutMs);
+
+// Arm a timer to expire once after the given number of microseconds,
+// replacing any previous deadline and clearing a pending expiry.
+// Returns 0 on success, -1 on error.
+int armTimer(int timer, long microseconds);
+
+// Stop a timer and clear a pending expiry.
+void disarmTimer(int timer);
+
+// Return 1 if the timer expired since it was last armed, clearing the expiry,
+// or 0 otherwise.
+int timerExpired(int timer);
+
+// Queue bytes to be written to the serial port. They are written right away
+// as far as the port takes them, and the rest is copied and written while
+// waiting for input, so the caller never blocks on a slow line unless the
+// queue is full.
+// Returns 0 on success, -1 on error.
+int sendBytes(const unsigned char *bytes, size_t size);
+
+// Like sendBytes(), without copying the bytes: *references is incremented
+// while they are queued, and decremented once they are written (or dropped by
+// eventLoopClose()), so the buffer must be left untouched until then.
+// Returns 0 on success, -1 on error.
+int sendBuffer(const unsigned char *bytes, size_t size, int *references);
+
+// Block until the serial port takes some of the queued bytes.
+// Returns 0 on success (or if nothing is queued), -1 on error.
+int waitForOutput();
+
+// Number of bytes queued but not written yet.
+size_t pendingBytes();
+
+// Wait until bytes are received or a timer expires, writing queued bytes in
+// the meantime. Received bytes are read into buffer.
+// Returns the number of bytes read, 0 if a timer expired, or -1 on error.
+int waitForInput(unsigned char *buffer, size_t size);
+
+// Like waitForInput(), without blocking: handles what is ready and returns
+// the number of bytes read, 0 if none were received, or -1 on error.
+int pollInput(unsigned char *buffer, size_t size);
+
+// Counters of the system calls made on the serial port.
+const EventLoopCounters *eventLoopCounters();
+
+// Every function above acts on the loop selected in the calling thread, a
+// default one unless eventLoopSelect() picked another, so that one process
+// can watch several serial ports, each with its own loop.
+typedef struct EventLoop EventLoop;
+
+// Allocate a closed event loop. Returns NULL on error.
+EventLoop *eventLoopCreate();
+
+// Close the loop (dropping the queued bytes) and free it. The default loop is
+// selected instead if it was selected.
+void eventLoopDestroy(EventLoop *loop);
+
+// Select the loop the other functions act on in the calling thread, or the
+// default loop if loop is NULL.
+void eventLoopSelect(EventLoop *loop);
+
+// Make waitForInput() return -1 on a loop (the default loop if loop is NULL),
+// now if another thread is waiting and on every later call, e.g. to give up
+// on a line that went silent. Safe to call from any thread.
+void eventLoopInterrupt(EventLoop *loop);
+
+#endif // _EVENT_LOOP_H_
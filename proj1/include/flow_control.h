@@ -0,0 +1,35 @@
+// Flow control header.
+// Receiver flow control (see `LinkLayerOptions.receiveQueue`): the receiver
+// reads packets ahead of the application into a receive queue, and answers
+// RNR instead of RR once the queue is close to full. The transmitter then
+// pauses, without counting retransmissions, and polls the receiver until it
+// is ready again.
+
+#ifndef _FLOW_CONTROL_H_
+#define _FLOW_CONTROL_H_
+
+// Allocate the receive queue of a flow controlled receiver, and reset the
+// flow control state of either end.
+// Returns 0 on success, -1 on error.
+int setupReceiveQueue();
+
+// Handle a response of a flow controlled receiver, of `type`, that
+// acknowledged `acknowledged` frames.
+// Returns 1 if frames were acknowledged or the transmission goes on, 0 if
+// not, -1 on error.
+int paceTransmission(int type, int acknowledged);
+
+// Poll a receiver that isn't ready, if the timer of the poll expired.
+// Returns 0 on success, -1 on error or if it wasn't ready for too long.
+int pollReceiver();
+
+// Read the next packet of a flow controlled receiver, from its receive queue.
+// Returns the size of the packet, or -1 on error.
+int readQueuedPacket(unsigned char *packet);
+
+// Drop the packets a closing receiver didn't read, and tell the transmitter
+// it is ready if it was busy.
+// Returns 0 on success, -1 on error.
+int releaseReceiveQueue();
+
+#endif // _FLOW_CONTROL_H_
@@ -0,0 +1,49 @@
+// Histogram header.
+// Log-linear histograms of non-negative integers, in the style of HDR
+// histograms: each power of two is split into HISTOGRAM_SUB_BUCKETS buckets of
+// equal width, so every value is recorded with a relative error below
+// 1 / HISTOGRAM_SUB_BUCKETS (values below 2 * HISTOGRAM_SUB_BUCKETS exactly),
+// over the whole 64-bit range, in a fixed amount of memory and without any
+// allocation. Histograms of the same kind can be merged by adding their
+// bucket counts.
+
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <stdint.h>
+
+#define HISTOGRAM_SUB_BUCKETS 16
+// Buckets of values up to 2^64 - 1.
+#define HISTOGRAM_BUCKETS ((64 - 3) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct
+{
+    uint32_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total; // Values recorded.
+    uint64_t sum;   // Of the values recorded.
+    uint64_t min;   // Smallest value recorded, if any.
+    uint64_t max;   // Largest value recorded, if any.
+} Histogram;
+
+// Empty a histogram.
+void histogramReset(Histogram *histogram);
+
+// Record a value.
+void histogramRecord(Histogram *histogram, uint64_t value);
+
+// Bucket a value is counted in.
+int histogramBucket(uint64_t value);
+
+// Smallest and largest values counted in a bucket.
+uint64_t histogramBucketLow(int bucket);
+uint64_t histogramBucketHigh(int bucket);
+
+// Value below or at which percentile percent of the values recorded are (the
+// largest value of its bucket, at most the largest value recorded), 0 if none
+// was recorded.
+uint64_t histogramPercentile(const Histogram *histogram, double percentile);
+
+// Mean of the values recorded, 0 if none was.
+double histogramMean(const Histogram *histogram);
+
+#endif // _HISTOGRAM_H_
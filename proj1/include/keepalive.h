@@ -0,0 +1,37 @@
+// Keepalive header.
+// Keepalive probes (see `LinkLayerOptions.keepalive`): a transmitter that
+// hears nothing from the receiver for LINK_DOWN_TIMEOUTS timeouts in a row
+// takes the link down, stops retransmitting and probes the receiver instead,
+// until it answers or the link stayed down for `linkDownLimit` seconds.
+
+#ifndef _KEEPALIVE_H_
+#define _KEEPALIVE_H_
+
+// Consecutive timeouts, while nothing was heard from the other end, after
+// which the link is down.
+#define LINK_DOWN_TIMEOUTS 2
+
+// Take the link down, after the other end went silent, and probe it.
+// Returns 0 on success, -1 on error.
+int takeLinkDown();
+
+// Probe the other end while the link is down, if the timer of the next probe
+// expired.
+// Returns 0 on success, -1 on error or once the link was down for too long.
+int probeLink();
+
+// Bring the link back up once a frame came from the other end, resending the
+// frames outstanding.
+// Returns 0 on success, -1 on error.
+int restoreLink();
+
+// Answer the keepalive probe or flow control poll the received frame holds,
+// if it is one.
+// Returns 1 if it was a probe, 0 if not, -1 on error.
+int answerProbe();
+
+// Check how long a receiver heard nothing, if the timer of the check expired.
+// Returns 0 on success, -1 on error or once it heard nothing for too long.
+int checkSilence();
+
+#endif // _KEEPALIVE_H_
@@ -0,0 +1,453 @@
+// Link context header.
+// State of a link, shared by the link layer (link_layer.c) and the modules it
+// is split into. Not part of the interface of the link layer: applications
+// only see a `LinkContext` through the functions of link_layer_options.h.
+
+#ifndef _LINK_CONTEXT_H_
+#define _LINK_CONTEXT_H_
+
+#include "bond.h"
+#include "bus.h"
+#include "byte_stuffing.h"
+#include "channels.h"
+#include "event_loop.h"
+#include "histogram.h"
+#include "link_layer_options.h"
+#include "negotiation.h"
+#include "reed_solomon.h"
+#include "serial_line.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define FLAG_BUFFER_SIZE 5
+
+#define RR0 0xAA
+#define RR1 0xAB
+#define REJ0 0x54
+#define REJ1 0x55
+
+// Extended control field of the sliding window modes (HDLC, modulo 8):
+// I-frames are N(R) P N(S) 0 and S-frames are N(R) P/F S S 0 1. The U-frames
+// (SET, UA, DISC) keep their classic values, which end in 11. N(R) of the
+// I-frames is only used in full duplex, and is 0 otherwise.
+#define I_CONTROL(ns, nr) ((unsigned char)(((nr) << 5) | ((ns) << 1)))
+#define S_CONTROL(type, nr)                                                    \
+  ((unsigned char)(((nr) << 5) | ((type) << 2) | 0x01))
+#define IS_I_CONTROL(c) (((c)&0x01) == 0x00)
+#define IS_S_CONTROL(c) (((c)&0x03) == 0x01)
+#define CONTROL_NS(c) (((c) >> 1) & 0x07)
+#define CONTROL_NR(c) (((c) >> 5) & 0x07)
+#define CONTROL_S_TYPE(c) (((c) >> 2) & 0x03)
+// Full duplex stop-and-wait I-frames carry N(R) next to N(S): 0x00 / 0x80,
+// plus 0x40 for N(R) = 1.
+#define SW_NR(c) (((c) >> 6) & 0x01)
+
+// Supervisory frame types.
+#define S_RR 0
+#define S_RNR 1 // Receiver not ready, only with flow control.
+#define S_REJ 2
+#define S_SREJ 3
+// P/F bit of a REJ or SREJ in the sliding window modes: with hybrid ARQ, the
+// receiver kept the rejected frame and asks for redundancy instead of it.
+#define S_PF 0x10
+
+// Control field of a hybrid ARQ redundancy frame for the frame ns, a U-frame
+// like SET, UA and DISC.
+#define IR_CONTROL(ns) ((unsigned char)(0x13 | ((ns) << 5)))
+#define IS_IR_CONTROL(c) (((c)&0x1F) == 0x13)
+#define IR_NS(c) (((c) >> 5) & 0x07)
+
+// Control field of a keepalive probe, a U-frame sent with the address of the
+// information frames of its sender.
+#define PROBE_CONTROL 0x0F
+
+// Room for the application packet header on top of the payload.
+#define PACKET_HEADER_SIZE 16
+// Smallest payload size, which leaves room for the control packets (a file
+// name of up to 255 bytes).
+#define MIN_NEGOTIATED_PAYLOAD_SIZE 256
+// Largest frame check sequence (CRC-32C).
+#define MAX_FCS_SIZE 4
+
+// Parity bytes per codeword of the hybrid ARQ code, of which the frames carry
+// only some.
+#define HARQ_PARITY RS_MAX_PARITY
+// Data field of a redundancy frame: the first and last (excluded) parity byte
+// it carries, the low 16 bits of the size of the packet and FCS (most
+// significant first) and the XOR of those four bytes, then the parity bytes of
+// every codeword.
+#define REDUNDANCY_HEADER_SIZE 5
+
+enum states
+{
+    START,
+    FLAG_RCV,
+    A_RCV,
+    C_RCV,
+    BCC_OK,
+    STOP,
+    DATA,
+    HEADER_ERROR, // The BCC1 didn't match, the frame is skipped.
+};
+
+// Bytes after a corrupted header that make it an information frame: a control
+// frame ends right after its BCC1, while the data field of an information
+// frame holds at least a packet byte and the FCS.
+#define MIN_DAMAGED_SIZE 2
+
+// Retransmission timeout estimator (Jacobson/Karels, as in RFC 6298), in
+// milliseconds. The timeout backs off up to `parameters.timeout` seconds.
+#define INITIAL_RTO_MS 1000 // Used until the first RTT sample.
+#define MIN_RTO_MS 50
+#define RTT_ALPHA 0.125 // Gain of the smoothed RTT.
+#define RTT_BETA 0.25   // Gain of the RTT variation.
+
+typedef struct
+{
+    double srtt;   // Smoothed round trip time.
+    double rttvar; // Round trip time variation.
+    int rto;       // Current retransmission timeout.
+    int samples;   // Number of RTT samples taken.
+} RtoEstimator;
+
+// Adaptive payload size of the transmitter (`options.adaptivePayload`). Every
+// ADAPT_INTERVAL information frames, the bit error rate is estimated from the
+// frames that were rejected or timed out, and the payload size moves towards
+// the one with the best modelled goodput, by at most a factor of
+// ADAPT_MAX_STEP.
+#define ADAPT_INTERVAL 16
+#define ADAPT_MEMORY 0.75 // Weight of the previous intervals in the estimate.
+#define ADAPT_MAX_STEP 2
+#define ADAPT_GRANULARITY 64 // Candidate sizes are multiples of this.
+
+typedef struct
+{
+    int size;        // Payload size of the next data packets.
+    int frames;      // Frames sent in the current interval.
+    double sent;     // Frames sent, decayed over the intervals.
+    double errors;   // Frames rejected or timed out, decayed.
+    double bits;     // Bits sent, decayed.
+    double ber;      // Last estimated bit error rate.
+    int adjustments; // Times the size changed.
+} PayloadController;
+
+// Event loop timers: each frame of the transmission window has its own, named
+// by its sequence number, and one more is used for the U-frame exchanges.
+#define CONTROL_TIMER SEQUENCE_MODULUS
+// Full duplex: a frame accepted from the other end is acknowledged by the next
+// information frame sent, or by a RR when this timer expires. It runs for the
+// time the bytes already queued take to leave the port, since a RR sent right
+// away would wait for them anyway, plus ACK_DELAY_MS.
+#define ACK_TIMER (SEQUENCE_MODULUS + 1)
+#define ACK_DELAY_MS 5
+// Keepalive: the probes sent while the link is down, or, on a receiver, the
+// checks of how long it heard nothing.
+#define LINK_TIMER (SEQUENCE_MODULUS + 2)
+// Flow control: the polls of a receiver that isn't ready.
+#define FLOW_TIMER (SEQUENCE_MODULUS + 3)
+
+// Size of the buffer used to read from the serial port.
+#define RX_BUFFER_SIZE 4096
+
+// Longest path of the statistics file, see `llstatisticsfile()`.
+#define STATISTICS_PATH_SIZE 256
+
+// Frame pool, allocated by `llopen()` for the negotiated payload size. The
+// information and redundancy frames are built in place in its buffers, with
+// room for the header before the data field, and the event loop writes them
+// without copying them. A buffer is reused once it is neither held by the
+// transmission window nor queued, so there are enough for a full window and
+// as many frames that were acknowledged while still queued.
+#define FRAME_POOL_SIZE (SEQUENCE_MODULUS * 2)
+
+typedef struct
+{
+    unsigned char *frame;
+    int references; // The window slot holding it and its queued copies.
+} FrameBuffer;
+
+typedef struct
+{
+    enum states state;   // Parser state.
+    unsigned char A;     // Address field.
+    unsigned char C;     // Control field.
+    unsigned char *data; // Data field, destuffed while parsed, with the FCS
+                         // (and encoded if FEC is in use).
+    size_t dataSize;     // Size of the data field (0 if control).
+    size_t stuffedSize;  // Size of the data field on the wire.
+    int escaped;         // The last byte parsed was ESC.
+    // COBS: bytes of the current run still to parse, 0 before a code byte, and
+    // whether a FLAG follows the run, written once another run follows.
+    size_t run;
+    int flagPending;
+} Frame;
+
+typedef struct
+{
+    int nBytes;                      // Totla bytes sent / received.
+    int rejectedBytes;               // Bytes that were rejected.
+    int nFrames;                     // Total number of frames sent / received.
+    int rejectedFrames;              // Number of rejected frames.
+    long packetBytes;                // Packet bytes acknowledged / read.
+    size_t filesize;                 // Bytes of the files, `sendFilesize()`.
+    struct timespec globalStart;     // Registered when `llopen()` is called.
+    struct timespec connectionStart; // Registered when `llopen() finishes.`
+    int correctedBytes;              // Bytes corrected by the FEC.
+    int repairedFrames;              // Frames accepted thanks to the FEC.
+    int uncorrectableFrames;         // Frames the FEC couldn't correct.
+    int redundancyFrames;            // Hybrid ARQ redundancy frames.
+    int combinedFrames;              // Frames recovered with redundancy frames.
+    int linkDowns;                   // Times the link went down.
+    double linkDownMs;               // Time it stayed down.
+    int pauses;                      // Times the receiver wasn't ready.
+    double pausedMs;                 // Time it wasn't ready.
+    int overflowFrames;              // Frames dropped by a full queue.
+} Statistics;
+
+// Distributions of the frames sent, exported by `llclose()` (see
+// `llstatisticsfile()`). Times are in microseconds.
+typedef struct
+{
+    Histogram roundTrips;      // RTT samples (Karn's rule).
+    Histogram retransmissions; // Times each acknowledged frame was sent again.
+    Histogram timeouts;        // Time waited by the timeout of each loss event.
+} FrameHistograms;
+
+typedef struct
+{
+    const char *name;
+    ChecksumUpdate update; // Folds bytes into the running check.
+    uint32_t init;         // Initial value of the running check.
+    uint32_t finalXor;     // Applied to the running check to get the FCS.
+    size_t size;           // Bytes of the FCS, sent least significant first.
+} FrameCheck;
+
+// State of a link. Every function acts on the link `context` points to.
+struct LinkContext
+{
+    Statistics statistics;
+    // Counters of the information frames received: `statistics`, except in
+    // full duplex, where those count the frames sent and these the frames
+    // received.
+    Statistics duplexStatistics;
+    Statistics *receiverStatistics;
+    FrameHistograms histograms;
+    // File `llclose()` appends the statistics to, empty for none.
+    char statisticsPath[STATISTICS_PATH_SIZE];
+    // Consecutive timeouts at the largest timeout, limited by
+    // `nRetransmissions`.
+    int timeoutCount;
+    // When `startTimer()` last armed each frame timer and CONTROL_TIMER, and
+    // when the last timeout was counted, once per loss event.
+    struct timespec timerArmedAt[CONTROL_TIMER + 1];
+    struct timespec timedOutAt;
+    RtoEstimator estimator;
+    PayloadController controller;
+    LinkLayer parameters;
+    SerialLine line;
+    EventLoop *eventLoop; // NULL for the default event loop.
+    LinkLayerOptions options;
+    LinkLayerFcs fcs;  // Negotiated by `llopen()`.
+    int payloadSize;   // Negotiated by `llopen()`.
+    int fecParity;     // Negotiated by `llopen()`, 0 if no FEC.
+    int fecDepth;      // Negotiated by `llopen()`.
+    int harqIncrement; // Negotiated by `llopen()`, 0 if no HARQ.
+    int duplex;        // Negotiated by `llopen()`.
+    // Resume offer sent in the UA by the receiver, or received by the
+    // transmitter, if `resumeOffered` is set.
+    LinkLayerResume resumeOffer;
+    int resumeOffered;
+    int keepalive;   // Negotiated by `llopen()`.
+    int flowControl; // Negotiated by `llopen()`.
+    int version;     // Negotiated by `llopen()`, CLASSIC_VERSION if not.
+    int windowSize;  // Negotiated by `llopen()`.
+    LinkLayerFraming framing; // Negotiated by `llopen()`.
+    // Negotiated by `llopen()`, the coarsest of both ends, in microseconds.
+    int timerGranularity;
+    // The UA sent by the receiver, sent again if the SET is repeated.
+    unsigned char uaFrame[MAX_PARAMETERS_SIZE * 2 + 7];
+    size_t uaFrameSize;
+    // The link is down (see `takeLinkDown()`), since `downAt`.
+    int linkDown;
+    struct timespec downAt;
+    // Consecutive timeouts while nothing was heard from the other end.
+    int silentTimeouts;
+    struct timespec heardAt; // When bytes were last received, with keepalive.
+
+    // Bytes read from the serial port that weren't parsed yet.
+    unsigned char rxBuffer[RX_BUFFER_SIZE];
+    size_t rxStart;
+    size_t rxEnd;
+    Frame receivedFrame; // Frame being parsed.
+    // Buffers of the negotiated mode and payload size, allocated in one block
+    // by `llopen()` (see `setupBuffers()`), NULL if the mode doesn't use them.
+    unsigned char *bufferMemory;
+    // Default destination of data fields.
+    unsigned char *frameBuffer;
+    // When set (by `llread()`), data fields are destuffed straight into it.
+    unsigned char *deliveryBuffer;
+
+    // Packet and FCS of the frame being built, before they are encoded.
+    unsigned char *fecData;
+    unsigned char *fecEncoded;
+
+    FrameBuffer framePool[FRAME_POOL_SIZE];
+    unsigned char *framePoolMemory;
+    size_t framePoolFrameSize; // Bytes of each buffer.
+
+    // Transmitter sliding window. Frames are kept stuffed in a buffer of the
+    // frame pool, indexed by their sequence number, until they are
+    // acknowledged.
+    int windowBuffers[SEQUENCE_MODULUS]; // -1 if the slot holds no buffer.
+    size_t windowFrameSizes[SEQUENCE_MODULUS];
+    int windowPacketSizes[SEQUENCE_MODULUS];
+    unsigned char windowBase;   // Oldest unacknowledged sequence number.
+    unsigned char nextSequence; // Sequence number of the next new frame.
+    // When the bytes written so far are expected to have left the port.
+    struct timespec lineFreeAt;
+    size_t lineBytes; // Bytes written since the connection opened.
+    // When the last (re)transmission of each frame was expected to leave the
+    // port.
+    struct timespec windowSentAt[SEQUENCE_MODULUS];
+    int windowTransmissions[SEQUENCE_MODULUS]; // Times each frame was sent.
+    int windowTimeouts[SEQUENCE_MODULUS];      // Times each frame timed out.
+    int windowRto[SEQUENCE_MODULUS]; // Timeout each frame's timer last ran.
+    // `lineBytes` before the first transmission of each frame.
+    size_t windowFirstByte[SEQUENCE_MODULUS];
+    // Hybrid ARQ parity of each frame (every codeword, one after the other),
+    // the size of its packet and FCS, and the parity bytes per codeword sent so
+    // far.
+    unsigned char *windowParity[SEQUENCE_MODULUS];
+    size_t windowBlockSizes[SEQUENCE_MODULUS];
+    int windowParitySent[SEQUENCE_MODULUS];
+
+    // Receiver state.
+    unsigned char expectedSequence; // Sequence number expected next.
+    int rejectSent; // A REJ is outstanding for `expectedSequence`.
+    // Full duplex: a frame was accepted and not acknowledged yet, see
+    // ACK_TIMER.
+    int acknowledgementPending;
+    // Frames whose header was corrupted, counted by `receiveFrame()` until
+    // `rejectDamagedFrames()` answers them, and their bytes.
+    int damagedFrames;
+    size_t damagedBytes;
+
+    // Selective Repeat reorder buffer. Frames that arrive after a gap are kept,
+    // indexed by their sequence number, until the missing frames are resent. In
+    // full duplex every mode keeps the accepted packets there, from
+    // `deliverSequence` to `expectedSequence`, until `llread()` takes them.
+    unsigned char *reorderPackets[SEQUENCE_MODULUS];
+    size_t reorderPacketSizes[SEQUENCE_MODULUS];
+    int reorderReceived[SEQUENCE_MODULUS]; // Slot holds a frame not accepted.
+    int srejSent[SEQUENCE_MODULUS];        // A SREJ is outstanding for it.
+    unsigned char deliverSequence; // Next frame to hand to the application.
+
+    // Hybrid ARQ receiver. Corrupted frames are kept, indexed by their sequence
+    // number, with the parity received for them so far, until they are
+    // corrected.
+    unsigned char *harqData[SEQUENCE_MODULUS];
+    unsigned char *harqParity[SEQUENCE_MODULUS];
+    size_t harqBlockSizes[SEQUENCE_MODULUS]; // 0 if no frame is kept.
+    uint32_t harqKnown[SEQUENCE_MODULUS]; // Bit i: parity byte i was received.
+
+    // Logical channels, scheduled by weighted round robin.
+    ChannelQueue channels[MAX_CHANNELS];
+    ChannelStatistics channelStatistics[MAX_CHANNELS];
+    int channelsUsed;     // `llsend()` was called, so the counters are shown.
+    int scheduledChannel; // Channel of the current round.
+    int channelCredit;    // Packets it can still send in this round.
+    // Channel of the packet `llwrite()` is sending for `llschedule()` (-1 when
+    // called directly) and when it was queued.
+    int writeChannel;
+    struct timespec writeQueuedAt;
+    // Channel of each frame of the transmission window, -1 if none.
+    int windowChannel[SEQUENCE_MODULUS];
+    struct timespec windowQueuedAt[SEQUENCE_MODULUS];
+
+    // Link bonding: the ports added by `llbond()` (names as long as
+    // `LinkLayer.serialPort`), and the bond while the link is open.
+    char bondPorts[MAX_BOND_LINES - 1][50];
+    int bondPortCount;
+    Bond *bond;
+
+    // Multi-drop bus transmitter: its stations, numbered from 1, the frames
+    // resent for their SREJ, and the SREJ a frame resent already answered.
+    Station stations[MAX_STATIONS];
+    int stationsUp;
+    int repairsSent;
+    int naksSuppressed;
+
+    // Flow control receiver: the receive queue, a ring of
+    // `options.receiveQueue` slots of `llreadbuffersize()` bytes allocated by
+    // `llopen()`, and whether it is busy (its RR are sent as RNR) since
+    // `busyAt`. Frames are only read ahead while packets are queued, and a DISC
+    // read ahead is kept for `llclose()`.
+    unsigned char *receiveQueue;
+    size_t queuedSizes[MAX_RECEIVE_QUEUE];
+    int queueHead;
+    int queueCount;
+    int readingAhead;
+    int disconnectPending;
+    int receiverBusy;
+    // Flow control transmitter: the receiver isn't ready since `busyAt`,
+    // answered the last poll, last answered at `answeredAt`, and is polled
+    // every `pollInterval` ms.
+    int peerBusy;
+    int pollAnswered;
+    int pollInterval;
+    struct timespec busyAt;
+    struct timespec answeredAt;
+};
+
+// Link the functions act on, in each thread.
+extern __thread LinkContext *context;
+
+// Frame check sequences, indexed by `LinkLayerFcs`.
+extern const FrameCheck frameChecks[];
+
+// Helpers of the link layer used by its modules, which act on `context` as
+// well. See link_layer.c.
+int maxTimeout();
+double millisecondsSince(const struct timespec *start);
+void countFrameErrors(int frames);
+int sendToLine(const unsigned char *bytes, size_t size, int *references);
+long transmissionTime(size_t inFlight);
+int startTimer(int timer, long drain);
+void resetEstimator();
+int estimatedTimeout();
+int countTimeout(int expiries, int timer);
+unsigned char sequenceModulus();
+int onBus();
+unsigned char transmitAddress();
+unsigned char receiveAddress();
+unsigned char responseAddress();
+unsigned char connectionAddress();
+unsigned char supervisoryControl(int type, unsigned char nr);
+int decodeSupervisoryControl(unsigned char C, int *type, unsigned char *nr);
+size_t packetLimit();
+size_t dataFieldLimit();
+int outstandingFrames();
+int sendControlFrame(unsigned char A, unsigned char C);
+uint32_t xorUpdate(uint32_t check, const unsigned char *bytes, size_t size);
+size_t buildFrame(unsigned char A, unsigned char C, const unsigned char *data,
+                  size_t dataSize, LinkLayerFcs type, LinkLayerFraming framing,
+                  unsigned char *frame);
+int checkFrame(const unsigned char *data, size_t dataSize, LinkLayerFcs type);
+int receiveFrame(int *consumed);
+int sendControlAndAwaitAck(unsigned char A, unsigned char C,
+                           unsigned char expectedA, unsigned char expectedC);
+int resendFrame(unsigned char ns, int combinable);
+int retransmitWindow(int combinable);
+int acknowledgeFrames(unsigned char nr);
+int flushWindow();
+int sendReceiveReady();
+int flushAcknowledgement(int now);
+int rejectDamagedFrames();
+int deliverReorderedPacket(unsigned char *packet);
+int isReceivedInformation(unsigned char *ns, int *redundancy);
+int receiveInformationFrame(unsigned char ns, int redundancy,
+                            unsigned char *packet);
+int receivePeerFrame();
+
+#endif // _LINK_CONTEXT_H_
@@ -0,0 +1,349 @@
+// Link layer options header.
+// Extensions to the interface declared in link_layer.h (which must not be
+// changed). Options are set with llconfigure() before calling llopen().
+
+#ifndef _LINK_LAYER_OPTIONS_H_
+#define _LINK_LAYER_OPTIONS_H_
+
+#include "link_layer.h"
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum
+{
+    LlStopAndWait,     // Classic protocol: one frame in flight, 1-bit numbers.
+    LlGoBackN,         // Sliding window with 3-bit numbers and cumulative RR.
+    LlSelectiveRepeat, // Sliding window where only lost frames are resent.
+} LinkLayerArq;
+
+// Frame check sequence of the information frames, from weakest to strongest.
+// It is negotiated when the connection opens: a transmitter configured with a
+// CRC asks for it in an extended SET, and the receiver answers in the UA with
+// the strongest of the two configurations. A transmitter left with the BCC2
+// sends the classic SET, and BCC2 is used.
+typedef enum
+{
+    LlFcsXor,    // Classic BCC2, the XOR of the data bytes (1 byte).
+    LlFcsCrc16,  // CRC-16-CCITT, as in HDLC (2 bytes).
+    LlFcsCrc32c, // CRC-32C, Castagnoli polynomial (4 bytes).
+} LinkLayerFcs;
+
+// Framing of the data field of the information frames, negotiated when the
+// connection opens like the frame check sequence: the receiver answers with
+// COBS if either end is configured with it. The SET and UA themselves are
+// always byte stuffed.
+typedef enum
+{
+    LlFramingStuffing, // Escape sequences for FLAG and ESC, as in HDLC: up to
+                       // twice the size of the data.
+    LlFramingCobs,     // Consistent Overhead Byte Stuffing: at most a byte
+                       // per 254, see byte_stuffing.h.
+} LinkLayerFraming;
+
+typedef struct
+{
+    LinkLayerArq arq;
+    int windowSize; // Maximum number of unacknowledged frames in flight.
+    LinkLayerFcs fcs;
+    int payloadSize; // Largest payload per data packet, see llpayloadsize().
+    int adaptivePayload; // Transmitter adapts the payload size to the error
+                         // rate, see llnextpayloadsize().
+    int fecParity; // Reed-Solomon parity bytes per codeword, 0 for no FEC.
+    int fecDepth;  // Codewords interleaved together.
+    int harqIncrement; // Parity bytes per codeword sent on each rejection
+                       // (type-II hybrid ARQ), 0 for plain retransmissions.
+    int duplex; // Both ends send information frames, see below.
+    int resume; // The transmitter asks for the receiver's resume offer, see
+                // llresumed().
+    int keepalive; // Milliseconds between keepalive probes while the link is
+                   // down, 0 to disable link-down detection, see below.
+    int linkDownLimit; // Seconds the link may stay down, or a receiver
+                       // not be ready, 0 for no limit.
+    int timerGranularity; // Microseconds, see below.
+    LinkLayerFraming framing;
+    int station; // Multi-drop bus: number of this station on a receiver,
+                 // number of stations on a transmitter, 0 for a
+                 // point-to-point link, see below.
+    int receiveQueue; // Packets the receiver reads ahead of llread(), 0 for
+                      // no flow control, see below.
+} LinkLayerOptions;
+
+// Sequence numbers of the sliding window modes are 3 bits wide (modulo 8).
+#define SEQUENCE_MODULUS 8
+
+// Largest window allowed by the sequence number space.
+#define MAX_WINDOW_SIZE (SEQUENCE_MODULUS - 1)
+
+// Selective Repeat needs the send and receive windows to fit in half of the
+// sequence number space, so a resent frame is never mistaken for a new one.
+#define MAX_SELECTIVE_WINDOW_SIZE (SEQUENCE_MODULUS / 2)
+
+// Largest payload of a data packet, the limit of its 16-bit length field.
+// The payload size is negotiated when the connection opens: each end asks for
+// its configured size (MAX_PAYLOAD_SIZE with the classic SET / UA) and the
+// smallest one is used.
+#define MAX_NEGOTIATED_PAYLOAD_SIZE 65535
+
+// Capability negotiation. A transmitter whose options differ from the
+// classic protocol announces its capabilities in an extended SET, as
+// type-length-value parameters: its protocol version, window size, payload
+// size (which bounds the frame size), frame check sequence, framing, FEC,
+// hybrid ARQ, full duplex, keepalive, flow control and its timer
+// granularity. The receiver settles on the best configuration both ends
+// support and sends it back in an extended UA, and both ends use it.
+// Parameters an end doesn't know are skipped, and a receiver that doesn't
+// know the extended SET (the classic protocol ignores it) gets classic SETs
+// too once two extended ones went unanswered: both ends then keep the classic
+// configuration. So features can be enabled on one end at a time.
+#define LL_PROTOCOL_VERSION 2
+
+// Timer granularity, in microseconds: how late the timers of an end may
+// fire, which delays its acknowledgements as much. The coarsest of both ends
+// is the least variation the retransmission timeout allows for (the G of
+// RFC 6298).
+#define DEFAULT_TIMER_GRANULARITY 1000
+#define MAX_TIMER_GRANULARITY 1000000
+
+// Forward error correction of the information frames. The packet and FCS are
+// encoded with a Reed-Solomon code (see reed_solomon.h) of fecParity parity
+// bytes per codeword, an even number up to MAX_FEC_PARITY, correcting
+// fecParity / 2 corrupted bytes per codeword, and fecDepth codewords (up to
+// MAX_FEC_DEPTH) are interleaved against bursts. The receiver corrects the
+// frame before checking the FCS, and only frames it can't correct are
+// rejected. Errors that create or remove a FLAG or ESC byte shift the rest of
+// the frame and can't be corrected. It is negotiated when the connection
+// opens, the largest parity and depth of both ends are used.
+#define MAX_FEC_PARITY 32
+#define MAX_FEC_DEPTH 16
+
+// Type-II hybrid ARQ with incremental redundancy. Information frames are
+// encoded with MAX_FEC_PARITY parity bytes per codeword but carry only the
+// first fecParity of them (none if fecParity is 0). The receiver keeps a
+// frame it can't correct and rejects it, and the transmitter answers with a
+// redundancy frame carrying the next harqIncrement parity bytes of each
+// codeword instead of the frame, which the receiver combines with the copy it
+// kept. Once every parity byte was sent, or if the receiver kept no copy, the
+// frame itself is sent again. Negotiated like the FEC, the largest increment
+// of both ends is used.
+
+// Full duplex. Both ends send information frames, each direction with its own
+// sequence numbers and window: the transmitter's frames carry the address
+// 0x03 and the receiver's 0x01, and their acknowledgements the address of the
+// frames they acknowledge. Information frames carry N(R), the next frame
+// expected from the other end, so acknowledgements ride on the data going the
+// other way; a RR is only sent when no information frame leaves shortly
+// after. It is negotiated when the connection opens and used only if both
+// ends ask for it. Received packets are kept (up to a sequence number space)
+// until llread() takes them, and llwrite() doesn't wait for its frame to be
+// acknowledged: llclose() does.
+
+// Keepalive. Once the frames sent time out twice in a row while nothing at
+// all comes from the other end, the link is down: the frames in flight are
+// no longer retransmitted, and the other end is probed with a keepalive frame
+// (a 5-byte U-frame) every keepalive milliseconds instead. It answers a probe
+// with a RR for the next frame it expects, and the frames from there on are
+// sent again, so an outage only costs its own length. Calls fail once the
+// link was down for linkDownLimit seconds, and a receiver fails once it heard
+// nothing for as long. It is negotiated when the connection opens and used
+// only if both ends ask for it. Not used by the members of a bonded link,
+// which are dropped when their line goes down.
+
+// Multi-drop bus. One transmitter sends the same information frames to up to
+// MAX_STATIONS receivers sharing its line, numbered from 1: each frame is
+// broadcast (address 0xFF) and every station answers it with its own address
+// (0x10 plus its number), the RR and SREJ of Selective Repeat. The
+// transmitter opens and closes the connection with each station in turn,
+// skipping those that don't answer, and settles on a configuration every
+// station supports: the stations take its frame check sequence, framing and
+// FEC, and it takes the smallest payload size and window. A frame leaves the
+// window once every station acknowledged it. A lost frame is resent once for
+// all the stations that asked for it: a SREJ that arrives within a round trip
+// of the repair is one it already answers. A station that stops answering is
+// dropped once the retransmissions are exhausted, and the transfer goes on
+// with the others. Only Selective Repeat, without hybrid ARQ, full duplex,
+// resume or keepalive, and not on a bonded link.
+#define MAX_STATIONS 16
+
+// Receiver flow control. A receiver with a receive queue reads ahead of
+// llread(): the frames already received are accepted into the queue and
+// acknowledged at once, so a burst that arrived while the application was
+// busy (writing to a slow disk or pipe) is answered without waiting for it.
+// Once the queue holds all but a window of packets, its acknowledgements are
+// RNR (receiver not ready) instead of RR, and frames that find it full are
+// dropped. The transmitter then stops sending, stops the timers of the frames
+// in flight and polls the receiver (with a keepalive frame) instead, from the
+// retransmission timeout, backing off to the largest one. Once llread() took
+// the queue down to half of that, the receiver sends a RR, and the frames it
+// didn't acknowledge are sent again. A pause isn't a loss, and neither are
+// the polls left unanswered while the application stalls, since the receiver
+// answers them from llread(): the transmitter only gives up once the receiver
+// wasn't ready for linkDownLimit seconds. A receiver closed before the
+// application read its queue drops the packets left and tells the
+// transmitter it is ready. It is negotiated when the connection opens and
+// used only if both ends ask for it (with any queue size on the
+// transmitter). Not in full duplex, on a multi-drop bus or on a bonded link.
+#define MAX_RECEIVE_QUEUE 64
+
+// Logical channels. Several streams of packets (files, control messages)
+// can share the link: llsend() queues a packet on its channel, and
+// llschedule() frames the queued packets by weighted round robin, each
+// channel sending up to its weight in packets per round, so a large transfer
+// doesn't hold back the others. The channel of a packet travels in the
+// application packet header; frames sent this way are counted per channel,
+// and the counters printed by llclose().
+#define MAX_CHANNELS 8
+// Packets each channel can queue.
+#define CHANNEL_QUEUE_SIZE 4
+
+// Transfer resume. A receiver that kept the start of a file from an earlier
+// connection offers it with llresumeoffer() before llopen(), and a
+// transmitter with resume set in its options asks for the offer in the SET,
+// which the receiver answers in the UA. The link layer doesn't interpret the
+// offer: the transmitter checks it against its file and skips the bytes the
+// receiver has. Not supported on a bonded link.
+typedef struct
+{
+    uint32_t file;   // Identity of the file, as the application computes it.
+    uint64_t offset; // Bytes of the file the receiver kept.
+    uint32_t hash;   // CRC-32C of those bytes.
+} LinkLayerResume;
+
+// Fill options with the defaults (classic stop-and-wait).
+void lldefaultoptions(LinkLayerOptions *options);
+
+// Set the options used by the next call to llopen().
+// Return "1" on success or "-1" if the options are invalid.
+int llconfigure(const LinkLayerOptions *options);
+
+// Payload size negotiated by llopen(): the largest number of file bytes a data
+// packet may carry. Packets given to llwrite() may exceed it by their header.
+int llpayloadsize();
+
+// Payload size the transmitter should use for the next data packet. It is
+// the negotiated one unless the adaptive payload size is enabled, in which
+// case it follows the error rate seen on the line, up to llpayloadsize().
+int llnextpayloadsize();
+
+// Size of the buffer llread() must be given for the negotiated payload size.
+int llreadbuffersize();
+
+// Set the resume offer the receiver sends in the UA of the next llopen(), or
+// none if offer is NULL.
+void llresumeoffer(const LinkLayerResume *offer);
+
+// Resume offer received by the transmitter in llopen(). Return 1 and fill
+// offer if the receiver sent one, 0 otherwise.
+int llresumed(LinkLayerResume *offer);
+
+// Whether full duplex was negotiated by llopen().
+int llduplex();
+
+// Full duplex: number of packets received from the other end that llread()
+// returns without waiting. While any is pending, llwrite() returns 0 (nothing
+// written) instead of waiting for room in the window, so that both ends can't
+// wait on each other: the packets must be read before writing again.
+int llreceivedpackets();
+
+// Set the weight of a channel, in packets per round (llopen() sets every
+// weight back to 1). Return 0 on success, -1 if the channel or weight is
+// invalid.
+int llchannel(int channel, int weight);
+
+// Free slot of the queue of a channel, where a packet of up to the negotiated
+// payload size plus its header can be built to be queued without a copy, or
+// NULL if the queue is full. Valid after llopen().
+unsigned char *llchannelslot(int channel);
+
+// Queue a packet on a channel (copied, unless it was built in the slot given
+// by llchannelslot()). Return bufSize, 0 if the queue is full, -1 on error.
+int llsend(int channel, const unsigned char *buf, int bufSize);
+
+// Send the next queued packet, picked by weighted round robin, as llwrite()
+// would. Return its frame size, 0 if nothing was sent (no packet is queued
+// or, in full duplex, received packets must be read first), -1 on error.
+int llschedule();
+
+// Packets queued on every channel, not sent yet.
+int llqueuedpackets();
+
+// Statistics. llclose() prints them when asked to, and appends them to the
+// file set by llstatisticsfile() in any case: a JSON object per line if its
+// name ends in ".json", a CSV row otherwise, under a header if the file is
+// empty. Besides the counters of the frames and bytes sent and received,
+// they hold histograms of the RTT samples, of the retransmissions of each
+// frame acknowledged and of the timeouts (in microseconds), whose buckets
+// are 1/16 of a power of two wide, with their percentiles.
+
+// Set the statistics file of the link, or none if path is NULL. Return 0 on
+// success, -1 if the path is too long.
+int llstatisticsfile(const char *path);
+
+// Bytes of the files transferred, which the speed and efficiency are computed
+// from (by default, those of the packets acknowledged and read).
+void sendFilesize(size_t filesize);
+
+// Tracing. While on, the ll functions record timestamped events in a ring of
+// the most recent ones, shared by every link of the process: their calls,
+// frames queued, bytes written and read, waits for the serial port or a timer,
+// acknowledgements, rejections sent and received, timeouts and
+// retransmissions. llclose() writes them to the trace file as Chrome trace
+// events (JSON), which chrome://tracing or Perfetto show as a timeline.
+
+// Start recording events, to be written to path, or stop if path is NULL.
+// Return 0 on success, -1 if the path is too long or out of memory.
+int lltrace(const char *path);
+
+// Write the events recorded so far to the trace file. It may be called from a
+// signal handler, and does nothing if the trace is being written already.
+// Return 0 on success, -1 on error or if nothing was written.
+int lltracedump();
+
+// Links. Every ll function acts on the link selected in the calling thread, a
+// default link unless llselect() picked another, so one process can drive
+// several serial ports, each link with its own state and event loop. The
+// calls block, so each link is driven by its own thread, or links take turns
+// in one thread.
+typedef struct LinkContext LinkContext;
+
+// Allocate a link, with the default options. Returns NULL on error.
+LinkContext *llcreate();
+
+// Free a link allocated by llcreate(), closed by llclose() or never opened.
+// The default link is selected instead if it was selected.
+void lldestroy(LinkContext *link);
+
+// Select the link the ll functions act on in the calling thread, or the
+// default link if link is NULL. Returns the link selected before.
+LinkContext *llselect(LinkContext *link);
+
+// llconfigure(), llopen(), llwrite(), llread() and llclose() on a link, which
+// stays selected.
+int llconfigure_r(LinkContext *link, const LinkLayerOptions *linkOptions);
+int llopen_r(LinkContext *link, LinkLayer connectionParameters);
+int llwrite_r(LinkContext *link, const unsigned char *buf, int bufSize);
+int llread_r(LinkContext *link, unsigned char *packet);
+int llclose_r(LinkContext *link, int showStatistics);
+
+// Make the calls on a link blocked in other threads, and every later call on
+// it until it is destroyed, fail (llclose() still closes its serial port),
+// e.g. to give up on a line that went silent. Safe to call from any thread.
+void llinterrupt(LinkContext *link);
+
+// Link bonding. llbond() adds serial ports to the link before llopen(), which
+// then opens its own port and each bonded one as a member link, every member
+// with its own ARQ (with the same options) and its own thread, connected to
+// the matching port of the other end. Packets are numbered in one sequence
+// space of the bond and striped over the members, each taking the next packet
+// as soon as its window has room, so faster lines take more of them, and the
+// receiver puts them back in order. A member whose line goes down is dropped,
+// and the packets it didn't get acknowledged are sent again by the others, so
+// the transfer goes on while any line is up. The receiver doesn't wait for a
+// member that never opens. Full duplex isn't supported on a bonded link.
+#define MAX_BOND_LINES 8
+
+// Add a serial port to the bond of the link, for the next llopen(), or remove
+// every one if serialPort is NULL. Return 0 on success, -1 if the bond is
+// full or the name too long.
+int llbond(const char *serialPort);
+
+#endif // _LINK_LAYER_OPTIONS_H_
@@ -0,0 +1,86 @@
+// Negotiation header.
+// Capability negotiation: a transmitter whose options need more than the
+// classic protocol asks for them in the parameters of an extended SET, and
+// the receiver answers with the configuration both ends settle on in the
+// parameters of an extended UA. A classic SET or UA keeps the classic
+// configuration, so either end can be the classic protocol.
+
+#ifndef _NEGOTIATION_H_
+#define _NEGOTIATION_H_
+
+#include "link_layer_options.h"
+
+// Parameters carried by the data field of the extended SET and UA frames, as
+// type, length and value. Unknown types are skipped.
+#define PARAM_FCS 0x01     // The frame check sequence (a `LinkLayerFcs`).
+#define PARAM_PAYLOAD 0x02 // Payload size, 16 bits, most significant first.
+#define PARAM_FEC 0x03     // FEC parity bytes and interleaving depth.
+#define PARAM_HARQ 0x04    // Hybrid ARQ parity bytes per redundancy frame.
+#define PARAM_DUPLEX 0x05  // Full duplex, no value.
+// Transfer resume: no value in the SET, the receiver's offer in the UA (file,
+// offset and hash, 4, 8 and 4 bytes, most significant first).
+#define PARAM_RESUME 0x06
+#define RESUME_OFFER_SIZE 16
+#define PARAM_KEEPALIVE 0x07 // Keepalive probes, no value.
+#define PARAM_VERSION 0x08   // Protocol version, 1 byte.
+#define PARAM_WINDOW 0x09    // Window size, 1 byte.
+// Timer granularity in microseconds, 32 bits, most significant first.
+#define PARAM_GRANULARITY 0x0B
+#define PARAM_FRAMING 0x0C // Framing (a `LinkLayerFraming`), 1 byte.
+#define PARAM_FLOW 0x0D    // Receiver flow control (RNR), no value.
+#define MAX_PARAMETERS_SIZE 64
+// Version of the classic SET and UA, and of an extended one that doesn't
+// announce it.
+#define CLASSIC_VERSION 1
+#define EXTENDED_VERSION 2
+// Extended SET frames sent before classic ones are sent as well, in case the
+// receiver only knows the classic protocol.
+#define EXTENDED_SET_TRIES 2
+
+// Capabilities announced by an extended SET or UA, and the configuration
+// both ends settle on.
+typedef struct
+{
+    int version;
+    LinkLayerFcs fcs;
+    int payloadSize; // Largest payload, which bounds the frame size.
+    int windowSize;
+    LinkLayerFraming framing;
+    int fecParity; // 0 if no FEC.
+    int fecDepth;
+    int harqIncrement; // 0 if no HARQ.
+    int duplex;
+    int keepalive;
+    int flowControl;
+    int granularity; // Timer granularity, in microseconds.
+    // The SET asks for the resume offer, which the UA carries if `offered`.
+    int resume;
+    int offered;
+    LinkLayerResume offer;
+} Capabilities;
+
+// Fill the capabilities of the classic protocol.
+void classicCapabilities(Capabilities *capabilities);
+
+// Use a configuration, and the resume offer it carries on a transmitter.
+void applyCapabilities(const Capabilities *settled);
+
+// Whether the options of this end need nothing the classic protocol lacks, so
+// the transmitter sends a classic SET.
+int classicOptions();
+
+// Send an extended SET, with `address`, and store the configuration of the UA
+// in `settled`.
+// Returns 0 on success, -1 on error.
+int negotiateParameters(unsigned char address, Capabilities *settled);
+
+// Wait for a SET and answer it with a UA.
+// Returns 0 on success, -1 on error.
+int acceptParameters();
+
+// Answer a SET the transmitter sent again, if the received frame holds one,
+// with the UA sent before.
+// Returns 1 if it was a SET, 0 if not, -1 on error.
+int answerRepeatedSet();
+
+#endif // _NEGOTIATION_H_
@@ -0,0 +1,103 @@
+// Reed-Solomon header.
+// Systematic Reed-Solomon codes over GF(256) (primitive polynomial 0x11D),
+// whose generator has the roots alpha^0 to alpha^(nParity - 1). A codeword is
+// the data followed by nParity parity bytes, at most 255 bytes in total
+// (shorter ones are shortened codes), and up to nParity / 2 corrupted bytes
+// anywhere in it are corrected.
+//
+// Blocks longer than a codeword are split evenly into the fewest codewords,
+// which are split evenly into groups of up to `depth` consecutive codewords.
+// The codewords of a group are interleaved byte by byte, so a burst of up to
+// (codewords in the group) * nParity / 2 bytes is spread over the group and
+// stays correctable.
+
+#ifndef _REED_SOLOMON_H_
+#define _REED_SOLOMON_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RS_CODEWORD_SIZE 255
+#define RS_MAX_PARITY 32
+#define RS_MAX_DEPTH 16
+
+// Compute the nParity parity bytes of size bytes of data, where
+// size + nParity <= RS_CODEWORD_SIZE.
+void rsEncode(const unsigned char *data, size_t size, int nParity,
+              unsigned char *parity);
+
+// Correct a codeword of size bytes (data and parity) in place.
+// Returns the number of bytes corrected, or -1 if it can't be corrected.
+int rsDecode(unsigned char *codeword, size_t size, int nParity);
+
+// Like rsDecode(), where the bytes at the nErasures indexes in erasures are
+// known to be wrong (e.g. weren't received). e errors and the erasures are
+// corrected as long as 2 * e + nErasures <= nParity.
+// Returns the number of errors corrected, erasures excluded, or -1.
+int rsDecodeErasures(unsigned char *codeword, size_t size, int nParity,
+                     const size_t *erasures, int nErasures);
+
+// Number of codewords a block of size bytes is split into.
+size_t rsCodewordCount(size_t size, int nParity);
+
+// Size of a block of size bytes once encoded.
+size_t rsEncodedSize(size_t size, int nParity);
+
+// Size of the block that encodes to encodedSize bytes, or 0 if none does.
+size_t rsBlockSize(size_t encodedSize, int nParity);
+
+// Encode size bytes of data into encoded, which must hold
+// rsEncodedSize(size, nParity) bytes.
+void rsEncodeBlock(const unsigned char *data, size_t size, int nParity,
+                   int depth, unsigned char *encoded);
+
+// Correct a block encoded by rsEncodeBlock() and move its data to the start of
+// the buffer, rsBlockSize(encodedSize, nParity) bytes.
+// Returns the number of bytes corrected, or -1 if any codeword can't be
+// corrected (or encodedSize isn't the size of an encoded block).
+int rsDecodeBlock(unsigned char *encoded, size_t encodedSize, int nParity,
+                  int depth);
+
+// Punctured blocks, for incremental redundancy: the block is encoded with
+// nParity parity bytes per codeword but sent with only some of them, the
+// others being erasures for the receiver. More of them can be sent later, as
+// long as they're sent in the same order.
+
+// Size of a block of size bytes sent with the first nSent parity bytes of
+// each codeword.
+size_t rsPuncturedSize(size_t size, int nParity, int nSent);
+
+// Size of the block sent in encodedSize bytes with the first nSent parity
+// bytes of each codeword, or 0 if none is.
+size_t rsPuncturedBlockSize(size_t encodedSize, int nParity, int nSent);
+
+// Compute the parity bytes of every codeword of size bytes of data, stored in
+// parity one codeword after the other (rsCodewordCount() * nParity bytes).
+void rsEncodeParity(const unsigned char *data, size_t size, int nParity,
+                    unsigned char *parity);
+
+// Write part of a block in wire order, as rsEncodeBlock() does: the data (if
+// not NULL, in which case from must be 0) followed by the parity bytes from
+// `from` to `to` (excluded) of each codeword, with the codewords of each
+// group interleaved. The part takes rsPuncturedSize(size, nParity, to)
+// bytes with the data, and rsCodewordCount() * (to - from) bytes without.
+void rsInterleave(const unsigned char *data, const unsigned char *parity,
+                  size_t size, int nParity, int from, int to, int depth,
+                  unsigned char *encoded);
+
+// Undo rsInterleave(), storing the data (if not NULL) and the parity bytes
+// from `from` to `to` of each codeword.
+void rsDeinterleave(const unsigned char *encoded, size_t size, int nParity,
+                    int from, int to, int depth, unsigned char *data,
+                    unsigned char *parity);
+
+// Correct the data of a punctured block into corrected, where bit i of known
+// is set if the parity byte i of every codeword was received. The data and
+// parity are left untouched, so more parity can be combined with them later.
+// Returns the number of errors corrected, or -1 if any codeword can't be
+// corrected (its data is copied as is).
+int rsCorrectBlock(const unsigned char *data, const unsigned char *parity,
+                   size_t size, int nParity, uint32_t known,
+                   unsigned char *corrected);
+
+#endif // _REED_SOLOMON_H_
@@ -0,0 +1,25 @@
+// Serial line header.
+// Opens and closes a serial port like serial_port.h, but keeps the port and
+// its original settings in a SerialLine instead of globals, so that one
+// process can hold several lines open.
+
+#ifndef _SERIAL_LINE_H_
+#define _SERIAL_LINE_H_
+
+#include <termios.h>
+
+typedef struct
+{
+    int fd;                 // File descriptor of the open port, -1 if closed.
+    struct termios oldtio;  // Settings restored when the line is closed.
+} SerialLine;
+
+// Open and configure the serial port as openSerialPort() does, in line.
+// Returns the file descriptor, or -1 on error.
+int serialLineOpen(SerialLine *line, const char *serialPort, int baudRate);
+
+// Restore the original settings of the port and close it.
+// Returns -1 on error.
+int serialLineClose(SerialLine *line);
+
+#endif // _SERIAL_LINE_H_
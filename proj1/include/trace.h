@@ -0,0 +1,49 @@
+// Trace header.
+// Timeline of the events of the link layer and the application (frames
+// queued, bytes written, acknowledgements, rejections, timeouts, ...), written
+// as Chrome trace events (JSON, see chrome://tracing or Perfetto).
+//
+// Events are recorded in a ring of TRACE_EVENTS events shared by every
+// thread, without locks: a thread claims a slot with an atomic increment and
+// publishes the event with a release store of its sequence number, so
+// recording an event costs a clock read and a few stores, and nothing at all
+// while tracing is off. Once the ring is full the oldest events are
+// overwritten. Event names and argument names must be string literals, only
+// their addresses are recorded.
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+// Events kept, a power of two.
+#define TRACE_EVENTS 65536
+
+// Start recording events, to be written to path by traceDump(), or stop if
+// path is NULL (the events recorded are kept until the next start).
+// Returns 0 on success, -1 if the ring can't be allocated or the path is too
+// long.
+int traceStart(const char *path);
+
+// Whether events are being recorded.
+int traceEnabled();
+
+// A span of time on the calling thread: the start and the end of name, which
+// nest like calls. The end may carry an argument, if argName isn't NULL.
+void traceBegin(const char *name);
+void traceEnd(const char *name, const char *argName, long arg);
+
+// An event at an instant of the calling thread, with an argument if argName
+// isn't NULL.
+void traceInstant(const char *name, const char *argName, long arg);
+
+// The value of a counter, drawn as a graph of its own.
+void traceCounter(const char *name, long value);
+
+// Write the events in the ring to the file given to traceStart(), replacing
+// it. Only uses async-signal-safe calls, so it may be called from a signal
+// handler; a dump started while another one is running (in another thread or
+// the interrupted one) is skipped, unless wait is set, where it waits for it
+// (not from a signal handler). Returns 0 on success, -1 on error or if
+// skipped.
+int traceDump(int wait);
+
+#endif // _TRACE_H_
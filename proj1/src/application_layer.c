@@ -1,21 +1,43 @@
 // Application layer protocol implementation
 
 #include "../include/application_layer.h"
+#include "../include/crc.h"
 #include "../include/link_layer.h"
+#include "../include/link_layer_options.h"
+#include "../include/trace.h"
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #define MAXFILENAMESIZE 256
+// Bytes of a data packet before its data.
+#define DATA_PACKET_HEADER_SIZE 4
+// The control field of every packet carries its channel in the upper bits,
+// so the packets of channel 0 keep the classic format.
+#define PACKET_CONTROL(type, channel) ((unsigned char)((type) | (channel) << 4))
+#define PACKET_TYPE(control) ((control)&0x0F)
+#define PACKET_CHANNEL(control) ((control) >> 4)
+// The checkpoint of a file being received is kept next to it, under its name
+// followed by this suffix.
+#define CHECKPOINT_SUFFIX ".checkpoint"
+// Seconds between checkpoints.
+#define CHECKPOINT_INTERVAL 1
 
 typedef struct {
   size_t fileSize;
   char filename[MAXFILENAMESIZE];
+  size_t offset; // Byte the transfer resumes at, 0 from the start.
 } FileMetadata;
 
-FileMetadata fileMetadata = {0, ""};
+// File of a channel, as given to `applicationLayer` and by LL_CHANNELS.
+typedef struct {
+  const char *path;
+  int weight;
+} ChannelFile;
 
 /**
  * @brief Generates a hexdump of the specified file.
@@ -41,29 +63,206 @@ int hexdump(const char *filename) {
   return 0;
 }
 
+/**
+ * @brief Reads the link layer options from the environment.
+ *
+ * The options start from the link layer defaults and are overridden by the
+ * following variables, which must be the same on both ends:
+ * - LL_ARQ: retransmission scheme, "sw" (stop-and-wait), "gbn" (Go-Back-N) or
+ *   "sr" (Selective Repeat).
+ * - LL_WINDOW: number of unacknowledged frames allowed in flight.
+ * - LL_FCS: frame check sequence, "xor" (BCC2), "crc16" or "crc32c". It is
+ *   negotiated when the connection opens, see `LinkLayerFcs`.
+ * - LL_FRAMING: framing of the data field, "stuffing" (escape sequences, the
+ *   default) or "cobs". Also negotiated, see `LinkLayerFraming`.
+ * - LL_PAYLOAD: file bytes per data packet, up to 65535. Also negotiated, the
+ *   smallest of both ends is used.
+ * - LL_ADAPTIVE: "1" lets the transmitter shrink or grow the data packets,
+ *   up to the negotiated payload size, to suit the error rate of the line.
+ * - LL_FEC: Reed-Solomon parity bytes per codeword (an even number up to 32),
+ *   which let the receiver correct half as many corrupted bytes per codeword
+ *   without a retransmission. "0" (the default) disables it. Negotiated, the
+ *   largest of both ends is used.
+ * - LL_FEC_DEPTH: codewords interleaved together against bursts of errors,
+ *   from 1 to 16. Also negotiated.
+ * - LL_HARQ: parity bytes per codeword sent in each redundancy frame (up to
+ *   32), which the transmitter sends instead of a rejected frame the receiver
+ *   kept. "0" (the default) disables it. Negotiated, the largest of both ends
+ *   is used.
+ * - LL_DUPLEX: path of a second file, sent back by the receiver while it
+ *   receives (and saved there by the transmitter), in full duplex. Only used
+ *   if both ends set it.
+ * - LL_RESUME: "1" makes the receiver keep a checkpoint of the file it
+ *   receives, and a transfer that was cut resume from it, if both ends set
+ *   it.
+ * - LL_KEEPALIVE: milliseconds between the keepalive probes sent while the
+ *   link is down, instead of retransmitting into a dead line. "0" (the
+ *   default) disables link-down detection. Only used if both ends set it.
+ * - LL_LINK_DOWN: seconds the link may stay down, or a flow controlled
+ *   receiver not be ready, before the transfer fails (60 by default, 0 for
+ *   no limit).
+ * - LL_TIMER_GRANULARITY: microseconds by which the timers of this end may
+ *   fire late (1000 by default). Negotiated, the coarsest of both ends sets
+ *   the least margin of the retransmission timeout.
+ * - LL_STATION: multi-drop bus, on a receiver the number of its station
+ *   (from 1 to 16), on the transmitter the number of stations it sends the
+ *   file to. Needs LL_ARQ=sr. "0" (the default) is a point-to-point link.
+ * - LL_RX_QUEUE: packets the receiver reads ahead into its receive queue (up
+ *   to 64), answering with RNR while the sink doesn't keep up. "0" (the
+ *   default) disables flow control. Only used if both ends set it.
+ *
+ * @param options Pointer to the options to be filled.
+ * @return int Returns 0 on success, or 1 if a variable holds an invalid value.
+ */
+int readLinkLayerOptions(LinkLayerOptions *options) {
+  lldefaultoptions(options);
+
+  const char *arq = getenv("LL_ARQ");
+  if (arq != NULL) {
+    if (strcmp(arq, "sw") == 0) {
+      options->arq = LlStopAndWait;
+    } else if (strcmp(arq, "gbn") == 0) {
+      options->arq = LlGoBackN;
+      options->windowSize = MAX_WINDOW_SIZE;
+    } else if (strcmp(arq, "sr") == 0) {
+      options->arq = LlSelectiveRepeat;
+      options->windowSize = MAX_SELECTIVE_WINDOW_SIZE;
+    } else {
+      return 1;
+    }
+  }
+
+  const char *window = getenv("LL_WINDOW");
+  if (window != NULL) {
+    options->windowSize = atoi(window);
+  }
+
+  const char *fcs = getenv("LL_FCS");
+  if (fcs != NULL) {
+    if (strcmp(fcs, "xor") == 0) {
+      options->fcs = LlFcsXor;
+    } else if (strcmp(fcs, "crc16") == 0) {
+      options->fcs = LlFcsCrc16;
+    } else if (strcmp(fcs, "crc32c") == 0) {
+      options->fcs = LlFcsCrc32c;
+    } else {
+      return 1;
+    }
+  }
+
+  const char *framing = getenv("LL_FRAMING");
+  if (framing != NULL) {
+    if (strcmp(framing, "stuffing") == 0) {
+      options->framing = LlFramingStuffing;
+    } else if (strcmp(framing, "cobs") == 0) {
+      options->framing = LlFramingCobs;
+    } else {
+      return 1;
+    }
+  }
+
+  const char *payload = getenv("LL_PAYLOAD");
+  if (payload != NULL) {
+    options->payloadSize = atoi(payload);
+  }
+
+  const char *adaptive = getenv("LL_ADAPTIVE");
+  if (adaptive != NULL) {
+    if (strcmp(adaptive, "0") == 0) {
+      options->adaptivePayload = FALSE;
+    } else if (strcmp(adaptive, "1") == 0) {
+      options->adaptivePayload = TRUE;
+    } else {
+      return 1;
+    }
+  }
+
+  const char *fec = getenv("LL_FEC");
+  if (fec != NULL) {
+    options->fecParity = atoi(fec);
+  }
+
+  const char *fecDepth = getenv("LL_FEC_DEPTH");
+  if (fecDepth != NULL) {
+    options->fecDepth = atoi(fecDepth);
+  }
+
+  const char *harq = getenv("LL_HARQ");
+  if (harq != NULL) {
+    options->harqIncrement = atoi(harq);
+  }
+
+  options->duplex = getenv("LL_DUPLEX") != NULL;
+
+  const char *keepalive = getenv("LL_KEEPALIVE");
+  if (keepalive != NULL) {
+    options->keepalive = atoi(keepalive);
+  }
+
+  const char *linkDown = getenv("LL_LINK_DOWN");
+  if (linkDown != NULL) {
+    options->linkDownLimit = atoi(linkDown);
+  }
+
+  const char *granularity = getenv("LL_TIMER_GRANULARITY");
+  if (granularity != NULL) {
+    options->timerGranularity = atoi(granularity);
+  }
+
+  const char *resume = getenv("LL_RESUME");
+  if (resume != NULL) {
+    if (strcmp(resume, "0") == 0) {
+      options->resume = FALSE;
+    } else if (strcmp(resume, "1") == 0) {
+      options->resume = TRUE;
+    } else {
+      return 1;
+    }
+  }
+
+  const char *station = getenv("LL_STATION");
+  if (station != NULL) {
+    options->station = atoi(station);
+  }
+
+  const char *receiveQueue = getenv("LL_RX_QUEUE");
+  if (receiveQueue != NULL) {
+    options->receiveQueue = atoi(receiveQueue);
+  }
+  return 0;
+}
+
 /**
  * @brief Sends a control packet containing the file size and filename.
  *
  * This function constructs a control packet with the specified control value,
- * file size, and filename, and sends it using the llwrite function.
+ * file size, and filename, and queues it on its channel using the llsend
+ * function. A start packet of a transfer that resumes also carries the offset
+ * of its first data byte (parameter 2, in as many bytes as the file size,
+ * little-endian), so the classic format is kept otherwise.
  *
+ * @param channel The channel of the file.
  * @param filename The name of the file to be included in the control packet.
  * @param controlValue The control value indicating the type of control packet.
  *                     Typically, 1 for start and 3 for end.
  * @param fileSize The size of the file to be included in the control packet.
- * @return int Returns 0 on success, or -1 if the filename is NULL.
+ * @param offset The offset the transfer resumes at, not included if 0.
+ * @return int Returns the return value of `llsend` (0 if the queue of the
+ * channel is full), or -1 if the filename is NULL.
  */
-int sendControlPacket(const char *filename, unsigned char controlValue,
-                      size_t fileSize) {
+int sendControlPacket(int channel, const char *filename,
+                      unsigned char controlValue, size_t fileSize,
+                      size_t offset) {
   if (filename == NULL) {
     return -1;
   }
 
   unsigned char L1 = sizeof(fileSize);
   unsigned char L2 = strlen(filename);
+  int size = 5 + L1 + L2;
 
-  unsigned char packet[5 + L1 + L2];
-  packet[0] = controlValue; // 1 for start, 3 for end
+  unsigned char packet[size + 2 + L1];
+  packet[0] = PACKET_CONTROL(controlValue, channel); // 1 for start, 3 for end
   packet[1] = 0;            // 0 for file size
   packet[2] = L1;           // size of file size
 
@@ -76,39 +275,48 @@ int sendControlPacket(const char *filename, unsigned char controlValue,
   packet[3 + L1] = 1;                    // 1 for file name
   packet[4 + L1] = L2;                   // size of file name
   memcpy(&packet[5 + L1], filename, L2); // filename
-  return llwrite(packet, 5 + L1 + L2);
+
+  if (offset > 0) {
+    packet[size++] = 2;  // 2 for resume offset
+    packet[size++] = L1; // size of resume offset
+    for (int i = 0; i < L1; i++) {
+      packet[size++] = (offset >> (8 * i)) & 0xFF;
+    }
+  }
+  return llsend(channel, packet, size);
 }
 
 /**
  * @brief Sends a data packet.
  *
- * This function constructs a data packet with the given data and sequence
- * number, and sends it using the `llwrite` function. The packet format is as
- * follows:
- * - Byte 0: Control field (2 for data)
+ * This function fills in the header of a data packet whose data was already
+ * placed after it, and queues it on its channel using the `llsend` function
+ * (so the data isn't copied if the packet is a slot of the channel queue).
+ * The packet format is as follows:
+ * - Byte 0: Control field (2 for data, plus the channel in the upper bits)
  * - Byte 1: Sequence number
  * - Byte 2: Data size (most significant byte)
  * - Byte 3: Data size (least significant byte)
  * - Bytes 4 to (dataSize + 3): Data
  *
- * @param data Pointer to the data to be sent.
+ * @param channel The channel of the file.
+ * @param packet Pointer to the packet, with the data to be sent from byte
+ * DATA_PACKET_HEADER_SIZE onwards.
  * @param dataSize Size of the data to be sent.
  * @param sequenceNumber Sequence number of the packet.
- * @return 0 on success, -1 if the data pointer is NULL, or the return value of
- * `llwrite`.
+ * @return 0 on success, -1 if the packet pointer is NULL, or the return value
+ * of `llsend`.
  */
-int sendDataPacket(unsigned char *data, size_t dataSize, int sequenceNumber) {
-  if (data == NULL) {
+int sendDataPacket(int channel, unsigned char *packet, size_t dataSize,
+                   int sequenceNumber) {
+  if (packet == NULL) {
     return -1;
   }
 
-  unsigned char packet[dataSize + 4];
-
-  packet[0] = 2; // Control field 2 (data)
+  packet[0] = PACKET_CONTROL(2, channel); // Control field 2 (data)
   packet[1] = sequenceNumber;
   packet[2] = (dataSize >> 8) & 0xFF;
   packet[3] = dataSize & 0xFF;
-  memcpy(packet + 4, data, dataSize);
 
 #ifdef DEBUG
   printf("Data packet with size %zu:\n", dataSize + 4);
@@ -118,7 +326,7 @@ int sendDataPacket(unsigned char *data, size_t dataSize, int sequenceNumber) {
   printf("\n");
 #endif
 
-  return llwrite(packet, dataSize + 4);
+  return llsend(channel, packet, dataSize + 4);
 }
 
 /**
@@ -134,15 +342,18 @@ int sendDataPacket(unsigned char *data, size_t dataSize, int sequenceNumber) {
  * - The byte following the file size should be 1, indicating the file name
  * parameter.
  * - The next byte indicates the size of the file name.
- * - The remaining bytes contain the file name.
+ * - The next bytes contain the file name.
+ * - Optionally, when the transfer resumes, the byte 2, the size of the resume
+ *   offset and its value (0 if it is missing).
  *
  * @param packet Pointer to the start control packet.
+ * @param size Size of the packet.
  * @param metadata Pointer to the FileMetadata structure where the extracted
- *                 file size and file name will be stored.
+ *                 file size, file name and resume offset will be stored.
  * @return int Returns 0 on success, or 1 on error (e.g., invalid packet format,
  *             filename too big).
  */
-int receiveStartControlPacket(const unsigned char *packet,
+int receiveStartControlPacket(const unsigned char *packet, int size,
                               FileMetadata *metadata) {
   if (packet == NULL || packet[0] != 1) {
     return 1;
@@ -156,9 +367,9 @@ int receiveStartControlPacket(const unsigned char *packet,
   unsigned char filesizeSize =
       packet[2]; // size in octects of the file size value.
 
-  int fileSize = 0;
+  size_t fileSize = 0;
   for (int i = 0; i < filesizeSize; i++) {
-    fileSize |= (packet[i + 3]) << (i * 8);
+    fileSize |= (size_t)packet[i + 3] << (i * 8);
   }
   metadata->fileSize = fileSize;
 
@@ -177,6 +388,18 @@ int receiveStartControlPacket(const unsigned char *packet,
   }
   metadata->filename[filenameSize] = '\0';
 
+  metadata->offset = 0;
+  int next = filesizeSize + 5 + filenameSize;
+  if (next + 2 <= size && packet[next] == 2) {
+    unsigned char offsetSize = packet[next + 1];
+    if (next + 2 + offsetSize > size || offsetSize > sizeof(size_t)) {
+      return 1;
+    }
+    for (int i = 0; i < offsetSize; i++) {
+      metadata->offset |= (size_t)packet[next + 2 + i] << (i * 8);
+    }
+  }
+
   return 0;
 }
 
@@ -206,7 +429,7 @@ int receiveEndControlPacket(const unsigned char *packet,
 
   size_t fileSize = 0;
   for (size_t i = 0; i < filesizeSize; i++) {
-    fileSize |= (packet[i + 3]) << (i * 8);
+    fileSize |= (size_t)packet[i + 3] << (i * 8);
   }
   if (metadata->fileSize != fileSize) {
     perror("Error: start packet filesize doesn't match end packet filesize.\n");
@@ -242,6 +465,7 @@ int receiveEndControlPacket(const unsigned char *packet,
  * @param packetSize Pointer to an integer where the size of the packet will be
  * stored.
  * @param expectedSequenceNumber The expected sequence number of the packet.
+ * Only its 8 least significant bits are sent, so it is compared modulo 256.
  * @return 0 if the packet is valid and the size is successfully extracted, 1
  * otherwise.
  */
@@ -252,7 +476,7 @@ int receiveDataPacket(unsigned char *packet, int *packetSize,
     return 1;
   }
 
-  if (packet[1] != expectedSequenceNumber) {
+  if (packet[1] != (expectedSequenceNumber & 0xFF)) {
     printf(
         "The data packet received contains an unexpected sequence number.\n");
     return 1;
@@ -273,6 +497,619 @@ int receiveDataPacket(unsigned char *packet, int *packetSize,
   return 0;
 }
 
+
+/**
+ * @brief Reads the files of the logical channels.
+ *
+ * Channel 0 carries the file given to the application. LL_CHANNELS lists the
+ * files of the next channels, separated by commas: the files sent by the
+ * transmitter, each optionally followed by ":weight" (packets sent per round
+ * of the link layer scheduler, 1 by default), or the paths where the receiver
+ * saves them. A small file on a channel of its own isn't held back by a large
+ * one, e.g. LL_CHANNELS=urgent.txt:4.
+ *
+ * @param filename The file of channel 0.
+ * @param list Buffer for the value of LL_CHANNELS, which the files point to.
+ * @param files Array of MAX_CHANNELS files to be filled.
+ * @return int Returns the number of files, or -1 if LL_CHANNELS is invalid.
+ */
+int readChannelFiles(const char *filename, char *list, ChannelFile *files) {
+  files[0] = (ChannelFile){filename, 1};
+  int count = 1;
+
+  const char *channels = getenv("LL_CHANNELS");
+  if (channels == NULL || channels[0] == '\0') {
+    return count;
+  }
+  if (strlen(channels) >= MAXFILENAMESIZE * MAX_CHANNELS) {
+    return -1;
+  }
+  strcpy(list, channels);
+
+  for (char *file = strtok(list, ","); file != NULL;
+       file = strtok(NULL, ",")) {
+    if (count == MAX_CHANNELS) {
+      return -1;
+    }
+    int weight = 1;
+    char *separator = strrchr(file, ':');
+    if (separator != NULL) {
+      *separator = '\0';
+      weight = atoi(separator + 1);
+    }
+    if (weight < 1 || file[0] == '\0') {
+      return -1;
+    }
+    files[count++] = (ChannelFile){file, weight};
+  }
+  return count;
+}
+
+/**
+ * @brief Bonds the serial ports listed in LL_BOND to the link.
+ *
+ * LL_BOND lists more serial ports, separated by commas, each connected to the
+ * port in the same position on the other end. The packets are striped over
+ * the port given to the application and these, e.g.
+ * LL_BOND=/dev/ttyS11,/dev/ttyS12 for three lines.
+ *
+ * @return int Returns 0 on success, or 1 if LL_BOND is invalid.
+ */
+int bondSerialPorts() {
+  llbond(NULL);
+  const char *ports = getenv("LL_BOND");
+  if (ports == NULL || ports[0] == '\0') {
+    return 0;
+  }
+  char list[MAXFILENAMESIZE * MAX_BOND_LINES];
+  if (strlen(ports) >= sizeof(list)) {
+    return 1;
+  }
+  strcpy(list, ports);
+
+  for (char *port = strtok(list, ","); port != NULL;
+       port = strtok(NULL, ",")) {
+    if (llbond(port)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Writes the trace on SIGUSR1.
+ */
+void dumpTrace(int signal) {
+  (void)signal;
+  lltracedump();
+}
+
+/**
+ * @brief Starts tracing the link layer if LL_TRACE is set.
+ *
+ * LL_TRACE is the path of the trace, written by llclose() and whenever the
+ * process gets SIGUSR1, e.g. to look at a transfer that hangs.
+ *
+ * @return int Returns 0 on success, or 1 if the trace can't be started.
+ */
+int startTrace() {
+  const char *path = getenv("LL_TRACE");
+  if (path == NULL || path[0] == '\0') {
+    return 0;
+  }
+  if (lltrace(path)) {
+    return 1;
+  }
+  struct sigaction action = {0};
+  action.sa_handler = dumpTrace;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  return sigaction(SIGUSR1, &action, NULL) != 0;
+}
+
+// Packets of a file being sent, in order.
+typedef enum {
+  SendStart, // Start control packet.
+  SendData,  // Data packets, until the end of the file.
+  SendEnd,   // End control packet.
+  SendDone,
+} SendStage;
+
+typedef struct {
+  int channel;
+  FILE *file;
+  const char *filename;
+  size_t fileSize;
+  size_t offset; // First byte sent, when the transfer resumes.
+  int sequenceNumber;
+  SendStage stage;
+} FileSender;
+
+// Checkpoint of a file being received: the identity of the file, the bytes
+// written to the disk and their CRC-32C, in the format of a resume offer.
+typedef struct {
+  char path[MAXFILENAMESIZE + sizeof(CHECKPOINT_SUFFIX)];
+  LinkLayerResume state;
+  struct timespec savedAt;
+} Checkpoint;
+
+typedef struct {
+  FILE *file;
+  FileMetadata metadata;
+  int sequenceNumber; // Of the next data packet.
+  int done;           // The end control packet was received.
+  int resume;         // A checkpoint is kept (LL_RESUME).
+  int started;        // The start control packet was received.
+  int offered;        // The checkpoint loaded was offered to the transmitter.
+  Checkpoint checkpoint;
+  size_t written; // Bytes of the file written, from its start.
+  uint32_t crc;   // Running CRC-32C of those bytes.
+} FileReceiver;
+
+/**
+ * @brief Returns the identity of a file in a resume offer: the CRC-32C of its
+ * name, as sent in the start control packet, and its size.
+ */
+uint32_t fileIdentity(const char *filename, size_t fileSize) {
+  unsigned char size[sizeof(fileSize)];
+  for (size_t i = 0; i < sizeof(fileSize); i++) {
+    size[i] = (fileSize >> (8 * i)) & 0xFF;
+  }
+  uint32_t crc = crc32cUpdate(CRC32C_INIT, (const unsigned char *)filename,
+                              strlen(filename));
+  return crc32cUpdate(crc, size, sizeof(size)) ^ CRC32C_FINAL_XOR;
+}
+
+/**
+ * @brief Computes the CRC-32C of the first bytes of a file, leaving it
+ * positioned after them.
+ *
+ * @param file The file, read from its start.
+ * @param size The number of bytes.
+ * @param hash Where the CRC-32C will be stored.
+ * @return int Returns 0 on success, or 1 if the file is shorter or can't be
+ * read.
+ */
+int hashFilePrefix(FILE *file, uint64_t size, uint32_t *hash) {
+  unsigned char buffer[16384];
+  uint32_t crc = CRC32C_INIT;
+  rewind(file);
+  while (size > 0) {
+    size_t chunk = size < sizeof(buffer) ? size : sizeof(buffer);
+    if (fread(buffer, 1, chunk, file) != chunk) {
+      return 1;
+    }
+    crc = crc32cUpdate(crc, buffer, chunk);
+    size -= chunk;
+  }
+  *hash = crc ^ CRC32C_FINAL_XOR;
+  return 0;
+}
+
+/**
+ * @brief Loads the checkpoint of a file left by an earlier transfer.
+ *
+ * The checkpoint is a line with the identity of the file (hexadecimal), the
+ * bytes written to the disk and their CRC-32C (hexadecimal). It is only valid
+ * if the file still starts with those bytes.
+ *
+ * @param checkpoint Pointer to the checkpoint, whose path is set.
+ * @param filename Path of the file.
+ * @return int Returns 0 if a valid checkpoint was loaded, or 1 otherwise.
+ */
+int loadCheckpoint(Checkpoint *checkpoint, const char *filename) {
+  snprintf(checkpoint->path, sizeof(checkpoint->path), "%s%s", filename,
+           CHECKPOINT_SUFFIX);
+  memset(&checkpoint->state, 0, sizeof(checkpoint->state));
+  clock_gettime(CLOCK_MONOTONIC, &checkpoint->savedAt);
+
+  FILE *saved = fopen(checkpoint->path, "r");
+  if (saved == NULL) {
+    return 1;
+  }
+  unsigned int file, hash;
+  unsigned long long offset;
+  int fields = fscanf(saved, "%x %llu %x", &file, &offset, &hash);
+  fclose(saved);
+  if (fields != 3) {
+    return 1;
+  }
+
+  FILE *received = fopen(filename, "rb");
+  uint32_t prefixHash;
+  int valid = received != NULL &&
+              !hashFilePrefix(received, offset, &prefixHash) &&
+              prefixHash == hash;
+  if (received != NULL) {
+    fclose(received);
+  }
+  if (!valid) {
+    return 1;
+  }
+  checkpoint->state = (LinkLayerResume){file, offset, hash};
+  return 0;
+}
+
+/**
+ * @brief Saves the checkpoint of a file being received.
+ *
+ * The bytes written so far are flushed to the disk first, then the checkpoint
+ * replaces the previous one at once (it is written to a temporary file that is
+ * renamed), so a checkpoint never counts bytes that could be lost.
+ *
+ * @param receiver Pointer to the receiver of the file.
+ * @return int Returns 0 on success, or 1 on error.
+ */
+int saveCheckpoint(FileReceiver *receiver) {
+  Checkpoint *checkpoint = &receiver->checkpoint;
+  clock_gettime(CLOCK_MONOTONIC, &checkpoint->savedAt);
+  if (fflush(receiver->file) || fdatasync(fileno(receiver->file))) {
+    return 1;
+  }
+  checkpoint->state.offset = receiver->written;
+  checkpoint->state.hash = receiver->crc ^ CRC32C_FINAL_XOR;
+
+  char temporary[sizeof(checkpoint->path) + 4];
+  snprintf(temporary, sizeof(temporary), "%s.tmp", checkpoint->path);
+  FILE *saved = fopen(temporary, "w");
+  if (saved == NULL) {
+    return 1;
+  }
+  fprintf(saved, "%08x %llu %08x\n", checkpoint->state.file,
+          (unsigned long long)checkpoint->state.offset,
+          checkpoint->state.hash);
+  int failed = fflush(saved) || fsync(fileno(saved));
+  failed |= fclose(saved) != 0;
+  if (failed || rename(temporary, checkpoint->path)) {
+    remove(temporary);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Saves the checkpoint of a file being received if CHECKPOINT_INTERVAL
+ * seconds went by since the last one.
+ *
+ * @param receiver Pointer to the receiver of the file.
+ * @return int Returns 0 on success, or 1 on error.
+ */
+int updateCheckpoint(FileReceiver *receiver) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (now.tv_sec - receiver->checkpoint.savedAt.tv_sec < CHECKPOINT_INTERVAL) {
+    return 0;
+  }
+  return saveCheckpoint(receiver);
+}
+
+/**
+ * @brief Offers the transmitter to resume the transfer of the file of channel
+ * 0 from its checkpoint, if LL_RESUME is set and it has a valid one.
+ *
+ * @param checkpoint Pointer to the checkpoint to be loaded.
+ * @param filename Path of the file.
+ * @param resume Whether checkpoints are kept.
+ * @return int Returns TRUE if the checkpoint was offered, FALSE otherwise.
+ */
+int offerCheckpoint(Checkpoint *checkpoint, const char *filename,
+                    int resume) {
+  int offered = resume && !loadCheckpoint(checkpoint, filename);
+  if (offered) {
+    printf("Offering to resume at byte %llu.\n",
+           (unsigned long long)checkpoint->state.offset);
+  }
+  llresumeoffer(offered ? &checkpoint->state : NULL);
+  return offered;
+}
+
+/**
+ * @brief Starts the file of a receiver at the offset of its start control
+ * packet: the bytes of an earlier transfer are kept up to it, when it matches
+ * the checkpoint offered, and the rest is cut.
+ *
+ * @param receiver Pointer to the receiver, whose metadata was received.
+ * @return int Returns 0 on success, or 1 on error.
+ */
+int startReceivedFile(FileReceiver *receiver) {
+  FileMetadata *metadata = &receiver->metadata;
+  uint32_t file = fileIdentity(metadata->filename, metadata->fileSize);
+  if (metadata->offset > 0 &&
+      (!receiver->offered || receiver->checkpoint.state.file != file ||
+       receiver->checkpoint.state.offset != metadata->offset)) {
+    printf("The resume offset doesn't match the checkpoint.\n");
+    return 1;
+  }
+  receiver->started = TRUE;
+  receiver->written = metadata->offset;
+  receiver->crc = metadata->offset > 0
+                      ? receiver->checkpoint.state.hash ^ CRC32C_FINAL_XOR
+                      : CRC32C_INIT;
+  // A file opened for a checkpoint is cut where the transfer resumes, or
+  // overwritten, and any other one was just created, so a sink that can't
+  // seek (a pipe, /dev/null) is fine unless resuming.
+  if (receiver->offered &&
+      (fseek(receiver->file, metadata->offset, SEEK_SET) ||
+       ftruncate(fileno(receiver->file), metadata->offset))) {
+    return 1;
+  }
+  if (metadata->offset > 0) {
+    printf("Resuming at byte %zu.\n", metadata->offset);
+  }
+  if (!receiver->resume) {
+    return 0;
+  }
+  receiver->checkpoint.state.file = file;
+  return saveCheckpoint(receiver);
+}
+
+/**
+ * @brief Skips the bytes of a file the receiver kept from an earlier
+ * transfer, if its resume offer matches the file.
+ *
+ * @param sender Pointer to the sender of the file, just opened.
+ */
+void resumeFileSender(FileSender *sender) {
+  LinkLayerResume offer;
+  if (!llresumed(&offer)) {
+    return;
+  }
+  uint32_t hash;
+  if (offer.file != fileIdentity(sender->filename, sender->fileSize) ||
+      offer.offset > sender->fileSize ||
+      hashFilePrefix(sender->file, offer.offset, &hash) ||
+      hash != offer.hash) {
+    printf("The receiver's checkpoint doesn't match the file, sending it "
+           "from the start.\n");
+    rewind(sender->file);
+    return;
+  }
+  sender->offset = offer.offset;
+  printf("Resuming at byte %zu of %zu.\n", sender->offset, sender->fileSize);
+}
+
+/**
+ * @brief Opens a file to be sent on a channel.
+ *
+ * @param sender Pointer to the sender to be initialized.
+ * @param channel The channel of the file.
+ * @param filename Path of the file.
+ * @return int Returns 0 on success, or 1 if the file can't be opened.
+ */
+int openFileSender(FileSender *sender, int channel, const char *filename) {
+  sender->file = fopen(filename, "r");
+  if (sender->file == NULL) {
+    return 1;
+  }
+
+  fseek(sender->file, 0, SEEK_END);
+  sender->fileSize = ftell(sender->file);
+  rewind(sender->file);
+
+  sender->channel = channel;
+  sender->filename = filename;
+  sender->offset = 0;
+  sender->sequenceNumber = 0;
+  sender->stage = SendStart;
+  return 0;
+}
+
+/**
+ * @brief Queues the next packet of a file on its channel.
+ *
+ * Each data packet carries up to the payload size negotiated by llopen(), and
+ * as much as the link layer asks for the next one. The file is read straight
+ * into a slot of the channel queue, after the packet header, so the data
+ * isn't copied before it is framed.
+ *
+ * @param sender Pointer to the sender.
+ * @return int Returns 1 if a packet was queued, 0 if the queue of the channel
+ * is full (or the file was sent), or -1 on error (the stage tells which
+ * packet failed).
+ */
+int sendNextPacket(FileSender *sender) {
+  int result = 0;
+  switch (sender->stage) {
+  case SendStart:
+    result = sendControlPacket(sender->channel, sender->filename, 1,
+                               sender->fileSize, sender->offset);
+    if (result > 0) {
+      sender->stage = SendData;
+    }
+    break;
+  case SendData: {
+    unsigned char *packet = llchannelslot(sender->channel);
+    if (packet == NULL) {
+      return 0;
+    }
+    traceBegin("read file");
+    size_t dataSize = fread(packet + DATA_PACKET_HEADER_SIZE, 1,
+                            llnextpayloadsize(), sender->file);
+    traceEnd("read file", "bytes", dataSize);
+    if (dataSize == 0) {
+      sender->stage = SendEnd;
+      return sendNextPacket(sender);
+    }
+    result = sendDataPacket(sender->channel, packet, dataSize,
+                            sender->sequenceNumber++);
+    break;
+  }
+  case SendEnd:
+    result = sendControlPacket(sender->channel, sender->filename, 3,
+                               sender->fileSize, 0);
+    if (result > 0) {
+      sender->stage = SendDone;
+    }
+    break;
+  case SendDone:
+    break;
+  }
+  return result < 0 ? -1 : result > 0;
+}
+
+/**
+ * @brief Prints the error of a sender whose packet couldn't be queued.
+ *
+ * @param sender Pointer to the sender.
+ */
+void printSendError(const FileSender *sender) {
+  if (sender->stage == SendStart) {
+    perror("Error sending the start control packet.\n");
+  } else if (sender->stage == SendData) {
+    perror("Error sending data packet");
+  } else {
+    perror("Error sending the end control packet.\n");
+  }
+}
+
+/**
+ * @brief Handles a packet read from the link layer for a file.
+ *
+ * The start control packet fills the metadata of the file, data packets are
+ * written to it and the end control packet is checked against the start one.
+ * With LL_RESUME, the file is checkpointed every CHECKPOINT_INTERVAL seconds
+ * while it is received, and its checkpoint removed once it is complete.
+ *
+ * @param receiver Pointer to the receiver of the file.
+ * @param packet Pointer to the packet, its channel already removed from the
+ * control field.
+ * @param size Size of the packet, as returned by `llread`.
+ * @return int Returns 1 after the end control packet, 0 for other packets, or
+ * -1 on error.
+ */
+int receivePacket(FileReceiver *receiver, unsigned char *packet, int size) {
+  if (packet[0] == 1) {
+    // Start control packet
+    if (receiveStartControlPacket(packet, size, &receiver->metadata)) {
+      perror("Error reading start control packet.\n");
+      return -1;
+    }
+
+    printf("Metadata received:\n\tfilename: %s\n\tsize: %zu bytes\n",
+           receiver->metadata.filename, receiver->metadata.fileSize);
+    if (startReceivedFile(receiver)) {
+      perror("Error starting the file.\n");
+      return -1;
+    }
+  } else if (packet[0] == 3) {
+    // End control packet
+    if (receiveEndControlPacket(packet, &receiver->metadata)) {
+      perror("Error reading end control packet.\n");
+      return -1;
+    }
+    printf("End control packet received, file metadata matches.\n");
+    if (receiver->resume) {
+      remove(receiver->checkpoint.path);
+    }
+    return 1;
+
+  } else if (packet[0] == 2) {
+    // Data packet
+    if (receiveDataPacket(packet, &size, receiver->sequenceNumber++)) {
+      perror("Error reading data packet.\n");
+      return -1;
+    }
+
+#ifdef DEBUG
+    printf("Data packet with size %d\n", size);
+    for (int i = 0; i < size + 4; i++) {
+      printf("%02x ", packet[i]);
+    }
+    printf("\n");
+#endif
+    traceBegin("write file");
+    fwrite(packet + 4, 1, size, receiver->file);
+    traceEnd("write file", "bytes", size);
+    if (receiver->resume) {
+      receiver->crc = crc32cUpdate(receiver->crc, packet + 4, size);
+      receiver->written += size;
+      if (updateCheckpoint(receiver)) {
+        perror("Error saving the checkpoint.\n");
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Sends and receives files until every one is complete.
+ *
+ * The packets of the files sent are queued on their channels, which the link
+ * layer interleaves. Packets received are read as soon as the link layer
+ * keeps them (in full duplex), or once there is nothing left to send, and
+ * handed to the receiver of their channel.
+ *
+ * @param senders The files to be sent, one per channel.
+ * @param nSenders The number of files to be sent.
+ * @param receivers The files to be received, indexed by channel.
+ * @param nReceivers The number of files to be received.
+ * @return int Returns 0 on success, or 1 on error.
+ */
+int transferFiles(FileSender *senders, int nSenders, FileReceiver *receivers,
+                  int nReceivers) {
+  // Sized for the largest packet of the payload size negotiated by llopen().
+  unsigned char *packet = nReceivers > 0 ? malloc(llreadbuffersize()) : NULL;
+  int receiving = nReceivers;
+
+  while (TRUE) {
+    int sending = FALSE;
+    for (int i = 0; i < nSenders; i++) {
+      sending |= senders[i].stage != SendDone;
+    }
+    int idle = !sending && llqueuedpackets() == 0;
+
+    if (receiving > 0 && (llreceivedpackets() > 0 || idle)) {
+      int bytesRead = llread(packet);
+      if (bytesRead == 0) {
+        continue;
+      }
+      if (bytesRead < 0) {
+        perror("Failed to read from packet from link layer.\n");
+        break;
+      }
+
+      int channel = PACKET_CHANNEL(packet[0]);
+      packet[0] = PACKET_TYPE(packet[0]);
+      if (channel >= nReceivers || receivers[channel].done) {
+        printf("Packet received on unexpected channel %d.\n", channel);
+        break;
+      }
+      int status = receivePacket(&receivers[channel], packet, bytesRead);
+      if (status < 0) {
+        break;
+      }
+      if (status > 0) {
+        receivers[channel].done = TRUE;
+        receiving--;
+      }
+      continue;
+    }
+    if (idle) {
+      free(packet);
+      return 0;
+    }
+
+    // Fill the queue of every channel, then send the next packet.
+    int failed = FALSE;
+    for (int i = 0; i < nSenders && !failed; i++) {
+      int queued;
+      while ((queued = sendNextPacket(&senders[i])) > 0) {
+      }
+      if (queued < 0) {
+        printSendError(&senders[i]);
+        failed = TRUE;
+      }
+    }
+    if (failed || llschedule() < 0) {
+      perror("Error sending packet");
+      break;
+    }
+  }
+  free(packet);
+  return 1;
+}
+
 void applicationLayer(const char *serialPort, const char *role, int baudRate,
                       int nTries, int timeout, const char *filename) {
   // Initialize link layer.
@@ -283,6 +1120,38 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
   linkLayer.timeout = timeout;
   linkLayer.role = (!strcmp(role, "tx")) ? LlTx : LlRx;
 
+  LinkLayerOptions options;
+  if (readLinkLayerOptions(&options) || llconfigure(&options) < 0) {
+    printf("Invalid link layer options.\n");
+    return;
+  }
+  if (bondSerialPorts()) {
+    printf("Invalid bonded serial ports.\n");
+    return;
+  }
+  if (llstatisticsfile(getenv("LL_STATS"))) {
+    printf("Invalid statistics file.\n");
+    return;
+  }
+  if (startTrace()) {
+    printf("Invalid trace file.\n");
+    return;
+  }
+
+  char channelList[MAXFILENAMESIZE * MAX_CHANNELS];
+  ChannelFile files[MAX_CHANNELS];
+  int nFiles = readChannelFiles(filename, channelList, files);
+  if (nFiles < 0) {
+    printf("Invalid channels.\n");
+    return;
+  }
+
+  // The receiver offers to resume the file of channel 0 where an earlier
+  // transfer stopped.
+  Checkpoint checkpoint;
+  int offered = offerCheckpoint(&checkpoint, filename,
+                                linkLayer.role == LlRx && options.resume);
+
   // Open serial connection
   if (llopen(linkLayer)) {
     perror("Error opening link layer.\n");
@@ -292,127 +1161,103 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
     return;
   };
 
-  // Transmitter
-  if (linkLayer.role == LlTx) {
+  // Full duplex: the transmitter sends its files and saves the one sent back
+  // (on channel 0), the receiver saves the files and sends back its own.
+  const char *duplexFilename = getenv("LL_DUPLEX");
+  if (duplexFilename != NULL && !llduplex()) {
+    printf("The other end doesn't support full duplex.\n");
+    llclose(FALSE);
+    return;
+  }
 
-    // Open the file
-    FILE *fptr = fopen(filename, "r");
-    if (fptr == NULL) {
-      perror("File not found.\n");
-      fclose(fptr);
-      return;
+  FileSender senders[MAX_CHANNELS];
+  FileReceiver receivers[MAX_CHANNELS];
+  const char *sent[MAX_CHANNELS];
+  const char *received[MAX_CHANNELS];
+  int nSenders = 0;
+  int nReceivers = 0;
+  for (int i = 0; i < nFiles; i++) {
+    if (linkLayer.role == LlTx) {
+      sent[nSenders++] = files[i].path;
+    } else {
+      received[nReceivers++] = files[i].path;
     }
-
-    unsigned char buffer[1000];
-    size_t bytesRead;
-
-    fseek(fptr, 0, SEEK_END);
-    size_t fileSize = ftell(fptr);
-    rewind(fptr);
-
-    if (sendControlPacket(filename, 1, fileSize) < 0) {
-      perror("Error sending the start control packet.\n");
-      fclose(fptr);
-      llclose(FALSE);
-      return;
+  }
+  if (duplexFilename != NULL) {
+    if (linkLayer.role == LlTx) {
+      received[nReceivers++] = duplexFilename;
+    } else {
+      sent[nSenders++] = duplexFilename;
     }
+  }
 
-    int sequenceNumber = 0;
-    while ((bytesRead = fread(buffer, 1, 1000, fptr)) > 0) {
-      if (sendDataPacket(buffer, bytesRead, sequenceNumber++) < 0) {
-        perror("Error sending data packet");
-        fclose(fptr);
-        llclose(FALSE);
-        return;
-      }
+  int failed = FALSE;
+  int opened = 0;
+  for (; opened < nSenders && !failed; opened++) {
+    if (openFileSender(&senders[opened], opened, sent[opened])) {
+      perror("File not found.\n");
+      failed = TRUE;
+      break;
     }
-
-    if (sendControlPacket(filename, 3, fileSize) < 0) {
-      perror("Error sending the end control packet.\n");
-      fclose(fptr);
-      llclose(FALSE);
-      return;
+    if (linkLayer.role == LlTx && opened == 0 && options.resume) {
+      resumeFileSender(&senders[opened]);
     }
-
-    fclose(fptr);
-    llclose(TRUE);
-    return;
+    llchannel(opened, linkLayer.role == LlTx ? files[opened].weight : 1);
   }
-
-  if (linkLayer.role == LlRx) {
-
-    unsigned char packet[1020]; // the data packet should be at most 1000, but
-                                // lets add 20 to be sure.
-
-    FILE *fptr = fopen(filename, "wb");
-
-    if (fptr == NULL) {
+  int created = 0;
+  for (; created < nReceivers && !failed; created++) {
+    FileReceiver *receiver = &receivers[created];
+    *receiver = (FileReceiver){NULL};
+    if (linkLayer.role == LlRx && created == 0 && options.resume) {
+      receiver->resume = TRUE;
+      receiver->offered = offered;
+      receiver->checkpoint = checkpoint;
+    }
+    // A file that may resume is kept until the start control packet.
+    receiver->file = fopen(received[created], receiver->offered ? "r+b" : "wb");
+    if (receiver->file == NULL) {
       perror("Error opening file.\n");
-      fclose(fptr);
-      llclose(FALSE);
-      return;
+      failed = TRUE;
+      break;
     }
+  }
 
-    int receiving = 1;
-    int sequenceNumber = 0;
-
-    while (receiving) {
-      int bytesRead = llread(packet);
-      if (bytesRead == 0) {
-        continue;
-      }
-      if (bytesRead < 0) {
-        perror("Failed to read from packet from link layer.\n");
-        fclose(fptr);
-        llclose(FALSE);
-        return;
-      }
+  if (!failed) {
+    failed = transferFiles(senders, nSenders, receivers, nReceivers);
+  }
 
-      if (packet[0] == 1) {
-        // Start control packet
-        if (receiveStartControlPacket(packet, &fileMetadata)) {
-          perror("Error reading start control packet.\n");
-          fclose(fptr);
-          llclose(FALSE);
-          return;
-        }
-
-        printf("Metadata received:\n\tfilename: %s\n\tsize: %zu bytes\n",
-               fileMetadata.filename, fileMetadata.fileSize);
-      } else if (packet[0] == 3) {
-        // End control packet
-        if (receiveEndControlPacket(packet, &fileMetadata)) {
-          perror("Error reading end control packet.\n");
-          fclose(fptr);
-          llclose(FALSE);
-          return;
-        }
-        printf("End control packet received, file metadata matches.\n");
-        receiving = 0;
-
-      } else if (packet[0] == 2) {
-        // Data packet
-        if (receiveDataPacket(packet, &bytesRead, sequenceNumber++)) {
-          perror("Error reading data packet.\n");
-          fclose(fptr);
-          llclose(FALSE);
-          return;
-        }
+  // A transfer that was cut resumes from the bytes received so far.
+  for (int i = 0; i < created && failed; i++) {
+    if (receivers[i].resume && receivers[i].started && !receivers[i].done &&
+        saveCheckpoint(&receivers[i])) {
+      perror("Error saving the checkpoint.\n");
+    }
+  }
 
-#ifdef DEBUG
-        printf("Data packet with size %d\n", bytesRead);
-        for (int i = 0; i < bytesRead + 4; i++) {
-          printf("%02x ", packet[i]);
-        }
-        printf("\n");
-#endif
-        fwrite(packet + 4, 1, bytesRead, fptr);
-      }
+  // The speed is that of the files, both ways in full duplex, without the
+  // bytes skipped by a resumed transfer. A failed transfer doesn't set the
+  // size, so the link layer uses the bytes of the packets acknowledged and
+  // read instead.
+  if (!failed) {
+    size_t transferred = 0;
+    for (int i = 0; i < opened; i++) {
+      transferred += senders[i].fileSize - senders[i].offset;
     }
-    fclose(fptr);
+    for (int i = 0; i < created; i++) {
+      transferred +=
+          receivers[i].metadata.fileSize - receivers[i].metadata.offset;
+    }
+    sendFilesize(transferred);
+  }
+
+  for (int i = 0; i < opened; i++) {
+    fclose(senders[i].file);
+  }
+  for (int i = 0; i < created; i++) {
+    fclose(receivers[i].file);
   }
 
-  if (llclose(TRUE) == -1) {
+  if (llclose(!failed) == -1) {
     perror("Error closing connection.\n");
     return;
   }
@@ -0,0 +1,589 @@
+// Bond implementation
+
+#include "../include/bond.h"
+#include "../include/link_context.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Bond header, in front of every packet a bonded link sends over a member
+// link: the index of the transmitter's line, with BOND_FIN set on the last
+// packet of the line, then the sequence number of the packet in the bond
+// (most significant byte first), or, in the last packet, the mask of the
+// lines up when the transmitter closed.
+#define BOND_HEADER_SIZE 5
+#define BOND_FIN 0x80
+// Packets the transmitter numbers ahead of the oldest one not acknowledged,
+// and the receiver keeps for reordering.
+#define BOND_WINDOW 64
+
+// Bonded link (see `llbond()`): its member links, each driven by a thread of
+// its own, and the packets they share. Everything but the member links is
+// guarded by `mutex`, and `changed` is broadcast on every change.
+typedef struct {
+  Bond *bond;
+  int index; // Position in the bond, carried by the bond header.
+  LinkContext *link;
+  LinkLayer parameters; // Of its `llopen()`.
+  pthread_t thread;
+  int started;   // The thread was created.
+  int opening;   // Its `llopen()` didn't return yet.
+  int opened;    // Its `llopen()` succeeded.
+  int up;        // Opened, and neither failed nor finished since.
+  int failed;    // The line went down.
+  int finished;  // The thread is done with the link, or about to close it.
+  // Transmitter: sequence numbers of the packets in the window of the member
+  // link, oldest first, and the one being written.
+  uint32_t inFlight[SEQUENCE_MODULUS];
+  int inFlightCount;
+  int packets;      // Packets acknowledged (sent) or received on the line.
+  long packetBytes; // Bytes of those packets.
+} BondMember;
+
+typedef enum {
+  SlotFree,
+  SlotQueued, // Transmitter: waiting for a member (again, if a line failed).
+  SlotSent,   // Transmitter: in the window of a member.
+  SlotDone,   // Transmitter: acknowledged. Receiver: received.
+} BondSlotState;
+
+struct Bond {
+  BondMember members[MAX_BOND_LINES];
+  int memberCount;
+  int linesUp;     // Members up.
+  int opening;     // Members still opening.
+  int closing;     // `llclose()` was called.
+  int payloadSize; // Smallest one negotiated by the members.
+  pthread_mutex_t mutex;
+  pthread_cond_t changed;
+  // Window of BOND_WINDOW packets, indexed by sequence number: the packets
+  // from `base` to `next` on the transmitter (not acknowledged yet), and the
+  // ones received from `base` on (not read yet) on the receiver.
+  unsigned char *slots; // `slotSize` bytes each, the bond header included on
+                        // the transmitter.
+  size_t slotSize;
+  int slotSizes[BOND_WINDOW];
+  BondSlotState slotStates[BOND_WINDOW];
+  uint32_t slotSequences[BOND_WINDOW];
+  int slotResent[BOND_WINDOW]; // Transmitter: sent by a second member.
+  uint32_t base;
+  uint32_t next;
+  uint32_t finMask; // Lines up when the transmitter closed.
+  int finsReceived; // Receiver: lines whose last packet was received.
+  struct timespec start;
+};
+
+int llbond(const char *serialPort) {
+  if (serialPort == NULL) {
+    context->bondPortCount = 0;
+    return 0;
+  }
+  if (context->bondPortCount == MAX_BOND_LINES - 1 ||
+      strlen(serialPort) >= sizeof(context->bondPorts[0]))
+    return -1;
+  strcpy(context->bondPorts[context->bondPortCount++], serialPort);
+  return 0;
+}
+
+/**
+ * @brief Returns the slot of the bond window of a sequence number.
+ */
+unsigned char *bondSlot(Bond *bond, uint32_t sequence) {
+  return bond->slots + (sequence % BOND_WINDOW) * bond->slotSize;
+}
+
+/**
+ * @brief Marks a member as done with its link, and as failed if its line went
+ * down, handing the packets in its window back to the other members. Called
+ * with the bond locked.
+ *
+ * @param member The member.
+ * @param failed Whether the line went down.
+ */
+void leaveBond(BondMember *member, int failed) {
+  Bond *bond = member->bond;
+  if (member->up) {
+    member->up = FALSE;
+    bond->linesUp--;
+  }
+  if (failed && !member->failed) {
+    member->failed = TRUE;
+    printf("Bonded line %s is down, %d left.\n", member->parameters.serialPort,
+           bond->linesUp);
+  }
+  member->finished = TRUE;
+  for (int i = 0; i < member->inFlightCount; i++) {
+    int slot = member->inFlight[i] % BOND_WINDOW;
+    if (bond->slotSequences[slot] == member->inFlight[i] &&
+        bond->slotStates[slot] == SlotSent)
+      bond->slotStates[slot] = SlotQueued;
+  }
+  member->inFlightCount = 0;
+  pthread_cond_broadcast(&bond->changed);
+}
+
+/**
+ * @brief Counts the oldest packets of the window of a member, all but the
+ * ones still outstanding on its link, as acknowledged, unless another member
+ * got them acknowledged first, and slides the bond window past the packets
+ * acknowledged. Called with the bond locked.
+ *
+ * @param member The member.
+ * @param outstanding The frames still unacknowledged on its link.
+ */
+void acknowledgeBondPackets(BondMember *member, int outstanding) {
+  Bond *bond = member->bond;
+  int acknowledged = member->inFlightCount - outstanding;
+  for (int i = 0; i < acknowledged; i++) {
+    int slot = member->inFlight[i] % BOND_WINDOW;
+    if (bond->slotSequences[slot] != member->inFlight[i] ||
+        bond->slotStates[slot] == SlotDone ||
+        bond->slotStates[slot] == SlotFree)
+      continue;
+    bond->slotStates[slot] = SlotDone;
+    member->packets++;
+    member->packetBytes += bond->slotSizes[slot] - BOND_HEADER_SIZE;
+  }
+  memmove(member->inFlight, member->inFlight + acknowledged,
+          outstanding * sizeof(member->inFlight[0]));
+  member->inFlightCount = outstanding;
+  while (bond->base != bond->next &&
+         bond->slotStates[bond->base % BOND_WINDOW] == SlotDone) {
+    bond->slotStates[bond->base % BOND_WINDOW] = SlotFree;
+    bond->base++;
+  }
+  pthread_cond_broadcast(&bond->changed);
+}
+
+/**
+ * @brief Picks the next packet a member sends: the oldest one waiting or,
+ * when the bond window is full or closing, the oldest one, still in the
+ * window of another member, once more. A line that went down then holds the
+ * transfer back only until the others get its packets through, not until
+ * its ARQ gives up. Called with the bond locked.
+ *
+ * @param member The member.
+ * @param sequence Where the sequence number of the packet is stored.
+ * @return TRUE if there is one, FALSE otherwise.
+ */
+int nextBondPacket(BondMember *member, uint32_t *sequence) {
+  Bond *bond = member->bond;
+  for (uint32_t i = bond->base; i != bond->next; i++) {
+    if (bond->slotStates[i % BOND_WINDOW] == SlotQueued) {
+      *sequence = i;
+      return TRUE;
+    }
+  }
+
+  int slot = bond->base % BOND_WINDOW;
+  if (bond->base == bond->next ||
+      (bond->next - bond->base < BOND_WINDOW && !bond->closing) ||
+      bond->slotStates[slot] != SlotSent || bond->slotResent[slot])
+    return FALSE;
+  for (int i = 0; i < member->inFlightCount; i++) {
+    if (member->inFlight[i] == bond->base)
+      return FALSE;
+  }
+  bond->slotResent[slot] = TRUE;
+  *sequence = bond->base;
+  return TRUE;
+}
+
+/**
+ * @brief Sends the packets of the bond over a member link, until the line
+ * goes down or the bond closes, then the last packet of the line.
+ *
+ * The member takes the oldest packet waiting whenever `llwrite()` returns,
+ * which is when its window has room, and counts the packets that left its
+ * window as acknowledged. With nothing to send, it waits for its window to be
+ * acknowledged, so that the bond window can slide. Runs with the bond
+ * locked, and the member link selected.
+ *
+ * @param member The member.
+ */
+void runBondTransmitter(BondMember *member) {
+  Bond *bond = member->bond;
+  while (member->up) {
+    uint32_t sequence;
+    int result;
+    if (nextBondPacket(member, &sequence)) {
+      int slot = sequence % BOND_WINDOW;
+      unsigned char *packet = bondSlot(bond, sequence);
+      // A packet sent again keeps the index of its first line, which may
+      // still be framing it.
+      if (bond->slotStates[slot] == SlotQueued)
+        packet[0] = member->index;
+      bond->slotStates[slot] = SlotSent;
+      member->inFlight[member->inFlightCount++] = sequence;
+      pthread_mutex_unlock(&bond->mutex);
+      result = llwrite(packet, bond->slotSizes[slot]);
+      pthread_mutex_lock(&bond->mutex);
+    } else if (member->inFlightCount > 0) {
+      pthread_mutex_unlock(&bond->mutex);
+      result = flushWindow();
+      pthread_mutex_lock(&bond->mutex);
+    } else if (bond->closing && bond->base == bond->next) {
+      break;
+    } else {
+      pthread_cond_wait(&bond->changed, &bond->mutex);
+      continue;
+    }
+    if (result < 0 || !member->up)
+      leaveBond(member, TRUE);
+    else
+      acknowledgeBondPackets(member, outstandingFrames());
+  }
+  if (!member->up)
+    return;
+
+  unsigned char last[BOND_HEADER_SIZE] = {
+      BOND_FIN | member->index, bond->finMask >> 24, bond->finMask >> 16,
+      bond->finMask >> 8, bond->finMask};
+  pthread_mutex_unlock(&bond->mutex);
+  int result = llwrite(last, sizeof(last)) < 0 || flushWindow() < 0;
+  pthread_mutex_lock(&bond->mutex);
+  leaveBond(member, result);
+}
+
+/**
+ * @brief Receives the packets of the bond over a member link, until its last
+ * packet arrives or the link fails (or is interrupted).
+ *
+ * Each packet is kept in the bond window until the application reads it. A
+ * packet received twice (sent again by another line after its line went
+ * down) is dropped, and one too far ahead of the application waits for it to
+ * read the packets before it. Runs with the bond locked, and the member link
+ * selected.
+ *
+ * @param member The member.
+ */
+void runBondReceiver(BondMember *member) {
+  Bond *bond = member->bond;
+  pthread_mutex_unlock(&bond->mutex);
+  unsigned char *packet = malloc(llreadbuffersize());
+  int size = packet != NULL ? llread(packet) : -1;
+  pthread_mutex_lock(&bond->mutex);
+
+  while (size >= 0) {
+    if (size >= BOND_HEADER_SIZE) {
+      uint32_t sequence = (uint32_t)packet[1] << 24 | packet[2] << 16 |
+                          packet[3] << 8 | packet[4];
+      if (packet[0] & BOND_FIN) {
+        bond->finMask = sequence;
+        bond->finsReceived++;
+        break;
+      }
+      while (!bond->closing && (int32_t)(sequence - bond->base) >= BOND_WINDOW)
+        pthread_cond_wait(&bond->changed, &bond->mutex);
+      int slot = sequence % BOND_WINDOW;
+      if (!bond->closing && (int32_t)(sequence - bond->base) >= 0 &&
+          bond->slotStates[slot] != SlotDone) {
+        memcpy(bondSlot(bond, sequence), packet + BOND_HEADER_SIZE,
+               size - BOND_HEADER_SIZE);
+        bond->slotSizes[slot] = size - BOND_HEADER_SIZE;
+        bond->slotSequences[slot] = sequence;
+        bond->slotStates[slot] = SlotDone;
+        member->packets++;
+        member->packetBytes += size - BOND_HEADER_SIZE;
+        pthread_cond_broadcast(&bond->changed);
+      }
+    }
+    pthread_mutex_unlock(&bond->mutex);
+    size = llread(packet);
+    pthread_mutex_lock(&bond->mutex);
+  }
+  free(packet);
+  leaveBond(member, size < 0 && !bond->closing);
+}
+
+/**
+ * @brief Opens a member link and drives it, in its own thread.
+ *
+ * @param argument The member.
+ * @return NULL.
+ */
+void *runBondMember(void *argument) {
+  BondMember *member = argument;
+  Bond *bond = member->bond;
+  llselect(member->link);
+  int opened = llopen(member->parameters) == 0;
+
+  pthread_mutex_lock(&bond->mutex);
+  member->opening = FALSE;
+  bond->opening--;
+  if (opened) {
+    member->opened = member->up = TRUE;
+    bond->linesUp++;
+    int payloadSize = llpayloadsize() - BOND_HEADER_SIZE;
+    if (bond->payloadSize == 0 || payloadSize < bond->payloadSize)
+      bond->payloadSize = payloadSize;
+    pthread_cond_broadcast(&bond->changed);
+    if (member->parameters.role == LlTx)
+      runBondTransmitter(member);
+    else
+      runBondReceiver(member);
+  } else {
+    leaveBond(member, FALSE);
+  }
+  pthread_mutex_unlock(&bond->mutex);
+
+  // A line that went down isn't disconnected, only its port closed.
+  if (member->failed || !opened)
+    llinterrupt(member->link);
+  llclose(FALSE);
+  return NULL;
+}
+
+/**
+ * @brief Opens the member links of a bonded link, each in a thread of its
+ * own.
+ *
+ * The transmitter waits for every member to open, or fail to, and the
+ * receiver for the first one, since it can't tell a line that is down from
+ * one whose other end isn't started yet.
+ *
+ * @param connectionParameters The parameters of the first member, the others
+ * only differing by their serial port.
+ * @return 0 on success, -1 if no member could be opened.
+ */
+int openBond(LinkLayer connectionParameters) {
+  Bond *bond = calloc(1, sizeof(Bond));
+  if (bond == NULL) {
+    perror("Error allocating the bond.\n");
+    return -1;
+  }
+  context->bond = bond;
+  pthread_mutex_init(&bond->mutex, NULL);
+  pthread_cond_init(&bond->changed, NULL);
+  // The members negotiate at most the configured payload size.
+  bond->slotSize = context->options.payloadSize + PACKET_HEADER_SIZE;
+  bond->slots = malloc(bond->slotSize * BOND_WINDOW);
+  if (bond->slots == NULL) {
+    perror("Error allocating the bond window.\n");
+    closeBond(FALSE);
+    return -1;
+  }
+
+  LinkLayerOptions memberOptions = context->options;
+  memberOptions.duplex = FALSE;
+  memberOptions.resume = FALSE;
+  memberOptions.keepalive = 0;
+  memberOptions.receiveQueue = 0;
+  pthread_mutex_lock(&bond->mutex);
+  for (int i = 0; i <= context->bondPortCount; i++) {
+    BondMember *member = &bond->members[bond->memberCount];
+    member->bond = bond;
+    member->index = i;
+    member->parameters = connectionParameters;
+    if (i > 0)
+      strcpy(member->parameters.serialPort, context->bondPorts[i - 1]);
+    member->link = llcreate();
+    if (member->link == NULL)
+      break;
+    member->link->options = memberOptions;
+    strcpy(member->link->statisticsPath, context->statisticsPath);
+    member->opening = TRUE;
+    bond->opening++;
+    bond->memberCount++;
+    if (pthread_create(&member->thread, NULL, runBondMember, member) != 0) {
+      perror("Error starting a bonded line.\n");
+      member->opening = FALSE;
+      bond->opening--;
+      break;
+    }
+    member->started = TRUE;
+  }
+  while (bond->opening > 0 &&
+         (connectionParameters.role == LlTx || bond->linesUp == 0))
+    pthread_cond_wait(&bond->changed, &bond->mutex);
+  int linesUp = bond->linesUp;
+  context->payloadSize = bond->payloadSize;
+  pthread_mutex_unlock(&bond->mutex);
+
+  if (linesUp == 0) {
+    closeBond(FALSE);
+    return -1;
+  }
+  printf("Bonded link: %d of %d lines up, payload size: %d bytes\n", linesUp,
+         context->bondPortCount + 1, context->payloadSize);
+  clock_gettime(CLOCK_MONOTONIC, &bond->start);
+  clock_gettime(CLOCK_MONOTONIC, &context->statistics.connectionStart);
+  return 0;
+}
+
+/**
+ * @brief Numbers a packet and queues it in the bond window for the members,
+ * waiting for room.
+ *
+ * @param buf The packet.
+ * @param bufSize The size of the packet.
+ * @return bufSize, or -1 if every line is down.
+ */
+int bondWrite(const unsigned char *buf, int bufSize) {
+  Bond *bond = context->bond;
+  pthread_mutex_lock(&bond->mutex);
+  while (bond->next - bond->base == BOND_WINDOW && bond->linesUp > 0)
+    pthread_cond_wait(&bond->changed, &bond->mutex);
+  if (bond->linesUp == 0) {
+    pthread_mutex_unlock(&bond->mutex);
+    printf("Every bonded line is down.\n");
+    return -1;
+  }
+  int slot = bond->next % BOND_WINDOW;
+  unsigned char *packet = bondSlot(bond, bond->next);
+  packet[1] = bond->next >> 24;
+  packet[2] = bond->next >> 16;
+  packet[3] = bond->next >> 8;
+  packet[4] = bond->next;
+  memcpy(packet + BOND_HEADER_SIZE, buf, bufSize);
+  bond->slotSizes[slot] = bufSize + BOND_HEADER_SIZE;
+  bond->slotSequences[slot] = bond->next;
+  bond->slotStates[slot] = SlotQueued;
+  bond->slotResent[slot] = FALSE;
+  bond->next++;
+  pthread_cond_broadcast(&bond->changed);
+  pthread_mutex_unlock(&bond->mutex);
+  return bufSize;
+}
+
+/**
+ * @brief Reads the next packet of the bond, in order, waiting for a member to
+ * receive it.
+ *
+ * @param packet Where the packet is copied.
+ * @return The size of the packet, or -1 if every line is down.
+ */
+int bondRead(unsigned char *packet) {
+  Bond *bond = context->bond;
+  int slot = bond->base % BOND_WINDOW;
+  pthread_mutex_lock(&bond->mutex);
+  while (bond->slotStates[slot] != SlotDone ||
+         bond->slotSequences[slot] != bond->base) {
+    if (bond->linesUp == 0 && bond->opening == 0) {
+      pthread_mutex_unlock(&bond->mutex);
+      printf("Every bonded line is down.\n");
+      return -1;
+    }
+    pthread_cond_wait(&bond->changed, &bond->mutex);
+  }
+  int size = bond->slotSizes[slot];
+  memcpy(packet, bondSlot(bond, bond->base), size);
+  bond->slotStates[slot] = SlotFree;
+  bond->base++;
+  pthread_cond_broadcast(&bond->changed);
+  pthread_mutex_unlock(&bond->mutex);
+  return size;
+}
+
+/**
+ * @brief Prints the packets each line of the bond carried.
+ */
+void printBondStatistics(const Bond *bond) {
+  long bytes = 0;
+  for (int i = 0; i < bond->memberCount; i++)
+    bytes += bond->members[i].packetBytes;
+  double seconds = millisecondsSince(&bond->start) / 1000;
+  printf("\n--- Bonded link ---\n");
+  printf("%ld bytes in %.2f s (%.0f B/s) over %d lines\n", bytes, seconds,
+         seconds > 0 ? bytes / seconds : 0, bond->memberCount);
+  for (int i = 0; i < bond->memberCount; i++) {
+    const BondMember *member = &bond->members[i];
+    printf("%s: %s, %d packets, %ld bytes\n", member->parameters.serialPort,
+           member->failed  ? "went down"
+           : member->opened ? "up"
+                            : "never opened",
+           member->packets, member->packetBytes);
+  }
+}
+
+/**
+ * @brief Closes a bonded link.
+ *
+ * The transmitter sends the packets still queued on the channels and waits
+ * for every packet to be acknowledged, then each member sends the last packet
+ * of its line and closes its link. A line still holding packets, the other
+ * lines got through, a timeout later is taken as down. The receiver waits for
+ * the last packet of every line up when the transmitter closed, as long as
+ * the transmitter can take to notice a line went down, and gives up on the
+ * other lines.
+ *
+ * @param showStatistics Whether the lines are shown.
+ * @return 0 on success, -1 if packets weren't acknowledged.
+ */
+int closeBond(int showStatistics) {
+  Bond *bond = context->bond;
+  int failed = FALSE;
+  if (context->parameters.role == LlTx) {
+    while (bond->memberCount > 0 && llqueuedpackets() > 0) {
+      if (llschedule() <= 0) {
+        printf("Some queued packets were not sent.\n");
+        failed = TRUE;
+        break;
+      }
+    }
+  }
+
+  pthread_mutex_lock(&bond->mutex);
+  if (context->parameters.role == LlTx) {
+    while (bond->base != bond->next && bond->linesUp > 0)
+      pthread_cond_wait(&bond->changed, &bond->mutex);
+    if (bond->base != bond->next) {
+      printf("Some packets were not acknowledged by the other end.\n");
+      failed = TRUE;
+    }
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += context->parameters.timeout;
+    for (int i = 0; i < bond->memberCount; i++) {
+      BondMember *member = &bond->members[i];
+      while (member->up && member->inFlightCount > 0 &&
+             !pthread_cond_timedwait(&bond->changed, &bond->mutex, &deadline)) {
+      }
+      if (member->up && member->inFlightCount > 0) {
+        leaveBond(member, TRUE);
+        llinterrupt(member->link);
+      }
+      bond->finMask |= member->up ? 1u << i : 0;
+    }
+  } else {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += (long)(context->parameters.nRetransmissions + 1) *
+                       context->parameters.timeout;
+    while (bond->finMask == 0 ||
+           bond->finsReceived < __builtin_popcount(bond->finMask)) {
+      if (bond->linesUp == 0 ||
+          pthread_cond_timedwait(&bond->changed, &bond->mutex, &deadline))
+        break;
+    }
+  }
+  bond->closing = TRUE;
+  pthread_cond_broadcast(&bond->changed);
+  // Members still opening, or waiting on a line that went down.
+  for (int i = 0; i < bond->memberCount; i++) {
+    BondMember *member = &bond->members[i];
+    if (member->opening ||
+        (context->parameters.role == LlRx && !member->finished)) {
+      member->failed = member->opened;
+      llinterrupt(member->link);
+    }
+  }
+  pthread_mutex_unlock(&bond->mutex);
+
+  for (int i = 0; i < bond->memberCount; i++) {
+    if (bond->members[i].started)
+      pthread_join(bond->members[i].thread, NULL);
+    lldestroy(bond->members[i].link);
+  }
+  if (showStatistics && bond->memberCount > 0)
+    printBondStatistics(bond);
+  pthread_cond_destroy(&bond->changed);
+  pthread_mutex_destroy(&bond->mutex);
+  free(bond->slots);
+  free(bond);
+  context->bond = NULL;
+  resetChannels();
+  return failed ? -1 : 0;
+}
@@ -0,0 +1,185 @@
+// Bus implementation
+
+#include "../include/bus.h"
+#include "../include/link_context.h"
+#include "../include/trace.h"
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * @brief Opens the connection with each station of a multi-drop bus, as
+ * `negotiateParameters()` does with its address, skipping the stations that
+ * don't answer.
+ *
+ * The stations take the frame check sequence, framing and FEC of the
+ * transmitter, so the configuration used is the one they settled on with the
+ * lowest version, smallest payload size and window and coarsest timer
+ * granularity.
+ *
+ * @return 0 on success, -1 if no station answered.
+ */
+int openStations() {
+  Capabilities combined;
+  context->stationsUp = 0;
+  context->repairsSent = 0;
+  context->naksSuppressed = 0;
+  memset(context->stations, 0, sizeof(context->stations));
+  for (int index = 0; index < context->options.station; index++) {
+    Capabilities settled;
+    // A station that didn't answer left the timeout backed off.
+    resetEstimator();
+    if (negotiateParameters(STATION_ADDRESS(index + 1), &settled)) {
+      printf("Station %d didn't answer, skipped.\n", index + 1);
+      continue;
+    }
+    printf("Station %d connected.\n", index + 1);
+    context->stations[index].opened = TRUE;
+    context->stations[index].up = TRUE;
+    if (context->stationsUp++ == 0) {
+      combined = settled;
+      continue;
+    }
+    if (settled.version < combined.version)
+      combined.version = settled.version;
+    if (settled.payloadSize < combined.payloadSize)
+      combined.payloadSize = settled.payloadSize;
+    if (settled.windowSize < combined.windowSize)
+      combined.windowSize = settled.windowSize;
+    if (settled.granularity > combined.granularity)
+      combined.granularity = settled.granularity;
+  }
+  resetEstimator();
+  if (context->stationsUp == 0)
+    return -1;
+  applyCapabilities(&combined);
+  return 0;
+}
+
+/**
+ * @brief Slides the window up to the oldest frame a station of the
+ * multi-drop bus still expects, once every station acknowledged the frames
+ * before it.
+ *
+ * @return 1 if the window advanced, 0 if it didn't.
+ */
+int acknowledgeStations() {
+  int acknowledged = outstandingFrames();
+  for (int index = 0; index < context->options.station; index++) {
+    if (!context->stations[index].up)
+      continue;
+    int ahead = (context->stations[index].expected - context->windowBase +
+                 SEQUENCE_MODULUS) %
+                SEQUENCE_MODULUS;
+    if (ahead < acknowledged)
+      acknowledged = ahead;
+  }
+  if (acknowledged == 0 ||
+      acknowledgeFrames((context->windowBase + acknowledged) %
+                        SEQUENCE_MODULUS) == 0)
+    return 0;
+  context->timeoutCount = 0;
+  return 1;
+}
+
+/**
+ * @brief Handles a RR or SREJ from a station of the multi-drop bus, if
+ * `receivedFrame` holds one.
+ *
+ * A RR records the next frame the station expects (an older one than it
+ * sent before is stale, and ignored), and the window slides as far as every
+ * station acknowledged (see `acknowledgeStations()`). A SREJ gets the frame
+ * resent once for all the stations that lost it: within a round trip of the
+ * last time the frame was resent (the timeout before the first RTT sample),
+ * the SREJ was sent before that copy arrived, so it is only counted.
+ *
+ * @return 1 if the window advanced, 0 if it didn't (or the frame isn't a
+ * response of a station), -1 on error.
+ */
+int receiveStationResponse() {
+  int type;
+  unsigned char nr;
+  int index = context->receivedFrame.A - STATION_ADDRESS(1);
+  if (context->receivedFrame.dataSize != 0 || index < 0 ||
+      index >= context->options.station || !context->stations[index].up ||
+      decodeSupervisoryControl(context->receivedFrame.C, &type, &nr))
+    return 0;
+  Station *station = &context->stations[index];
+  int ahead = (nr - context->windowBase + SEQUENCE_MODULUS) % SEQUENCE_MODULUS;
+  if (type != S_SREJ) {
+    int known = (station->expected - context->windowBase + SEQUENCE_MODULUS) %
+                SEQUENCE_MODULUS;
+    if (ahead > known && ahead <= outstandingFrames()) {
+      station->acknowledged += ahead - known;
+      station->expected = nr;
+    }
+    return acknowledgeStations();
+  }
+
+  station->naks++;
+  traceInstant("SREJ received", "frame", nr);
+  if (ahead >= outstandingFrames())
+    return 0;
+  double holdoff = context->estimator.samples > 0 ? context->estimator.srtt
+                                                  : context->estimator.rto;
+  if (context->windowTransmissions[nr] > 1 &&
+      millisecondsSince(&context->windowSentAt[nr]) < holdoff) {
+    context->naksSuppressed++;
+    printf("Frame %d rejected by station %d, already sent again\n", nr,
+           index + 1);
+    return 0;
+  }
+  countFrameErrors(1);
+  context->statistics.rejectedFrames++;
+  context->statistics.rejectedBytes += context->windowFrameSizes[nr];
+  context->repairsSent++;
+  printf("Frame %d rejected by station %d, sending it again...\n", nr,
+         index + 1);
+  return resendFrame(nr, FALSE) ? -1 : 0;
+}
+
+/**
+ * @brief Drops the stations of the multi-drop bus that didn't acknowledge the
+ * oldest frame of the window, once its retransmissions were exhausted, so
+ * that the transfer goes on with the others.
+ *
+ * @return 1 if the window advanced, 0 if it didn't, -1 if no station is left.
+ */
+int dropLaggingStations() {
+  for (int index = 0; index < context->options.station; index++) {
+    Station *station = &context->stations[index];
+    if (!station->up || station->expected != context->windowBase)
+      continue;
+    station->up = FALSE;
+    context->stationsUp--;
+    printf("Station %d stopped answering, dropped.\n", index + 1);
+    traceInstant("station dropped", "station", index + 1);
+  }
+  if (context->stationsUp == 0)
+    return -1;
+  context->timeoutCount = 0;
+  return acknowledgeStations();
+}
+
+/**
+ * @brief Disconnects each station of a multi-drop bus still up, as a
+ * point-to-point transmitter does, with the address of the station.
+ *
+ * @return 0 if every one disconnected, -1 otherwise.
+ */
+int closeStations() {
+  int result = 0;
+  for (int index = 0; index < context->options.station; index++) {
+    unsigned char address = STATION_ADDRESS(index + 1);
+    if (!context->stations[index].up)
+      continue;
+    if (sendControlAndAwaitAck(address, 0x0B, address, 0x0B) < 0 ||
+        sendControlFrame(address, 0x07) < 0) {
+      printf("Station %d didn't disconnect.\n", index + 1);
+      result = -1;
+      continue;
+    }
+    context->statistics.nFrames += 2;
+    context->statistics.nBytes += 10;
+  }
+  return result;
+}
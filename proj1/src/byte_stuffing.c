@@ -0,0 +1,405 @@
+// Byte stuffing implementation
+
+#include "../include/byte_stuffing.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+/**
+ * @brief Scalar search for the first FLAG or ESC byte.
+ *
+ * Tests one byte at a time. Used when the CPU has no vector extensions.
+ *
+ * @param bytes The bytes to search.
+ * @param size The number of bytes.
+ * @return The index of the first FLAG or ESC byte, or size if there is none.
+ */
+static size_t findEscapeCandidateScalar(const unsigned char *bytes,
+                                        size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    if (bytes[i] == FLAG || bytes[i] == ESC)
+      return i;
+  }
+  return size;
+}
+
+#ifdef HAVE_X86_KERNELS
+/**
+ * @brief SSE2 search for the first FLAG or ESC byte.
+ *
+ * Compares 16 bytes at a time against both values and uses the mask of
+ * matches to find the first one. The tail is handled by the scalar search.
+ *
+ * @param bytes The bytes to search.
+ * @param size The number of bytes.
+ * @return The index of the first FLAG or ESC byte, or size if there is none.
+ */
+__attribute__((target("sse2"))) static size_t
+findEscapeCandidateSSE2(const unsigned char *bytes, size_t size) {
+  const __m128i flag = _mm_set1_epi8((char)FLAG);
+  const __m128i esc = _mm_set1_epi8((char)ESC);
+  size_t i = 0;
+
+  for (; i + 16 <= size; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *)(bytes + i));
+    __m128i matches = _mm_or_si128(_mm_cmpeq_epi8(block, flag),
+                                   _mm_cmpeq_epi8(block, esc));
+    int mask = _mm_movemask_epi8(matches);
+    if (mask != 0)
+      return i + __builtin_ctz(mask);
+  }
+  return i + findEscapeCandidateScalar(bytes + i, size - i);
+}
+
+/**
+ * @brief AVX2 search for the first FLAG or ESC byte.
+ *
+ * Same as the SSE2 search, 32 bytes at a time.
+ *
+ * @param bytes The bytes to search.
+ * @param size The number of bytes.
+ * @return The index of the first FLAG or ESC byte, or size if there is none.
+ */
+__attribute__((target("avx2"))) static size_t
+findEscapeCandidateAVX2(const unsigned char *bytes, size_t size) {
+  const __m256i flag = _mm256_set1_epi8((char)FLAG);
+  const __m256i esc = _mm256_set1_epi8((char)ESC);
+  size_t i = 0;
+
+  for (; i + 32 <= size; i += 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i *)(bytes + i));
+    __m256i matches = _mm256_or_si256(_mm256_cmpeq_epi8(block, flag),
+                                      _mm256_cmpeq_epi8(block, esc));
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(matches);
+    if (mask != 0)
+      return i + __builtin_ctz(mask);
+  }
+  // The tail is searched here rather than by the SSE2 kernel, whose legacy
+  // encoding would pay an AVX to SSE transition on every call.
+  for (; i < size; i++) {
+    if (bytes[i] == FLAG || bytes[i] == ESC)
+      return i;
+  }
+  return size;
+}
+#endif
+
+typedef struct {
+  const char *name;
+  size_t (*find)(const unsigned char *, size_t);
+} StuffingKernel;
+
+static StuffingKernel kernel = {NULL, NULL};
+static pthread_once_t kernelOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Checks whether the CPU supports a kernel.
+ *
+ * @param name The name of the kernel.
+ * @param selected Where the kernel will be stored if it is supported.
+ * @return 1 if it is supported, 0 otherwise.
+ */
+static int kernelSupported(const char *name, StuffingKernel *selected) {
+  if (strcmp(name, "scalar") == 0) {
+    *selected = (StuffingKernel){"scalar", findEscapeCandidateScalar};
+    return 1;
+  }
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init();
+  if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+    *selected = (StuffingKernel){"sse2", findEscapeCandidateSSE2};
+    return 1;
+  }
+  if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+    *selected = (StuffingKernel){"avx2", findEscapeCandidateAVX2};
+    return 1;
+  }
+#endif
+  return 0;
+}
+
+/**
+ * @brief Picks the fastest kernel supported by the CPU.
+ */
+static void pickKernel() {
+  if (!kernelSupported("avx2", &kernel) && !kernelSupported("sse2", &kernel))
+    kernelSupported("scalar", &kernel);
+}
+
+/**
+ * @brief Picks the kernel on first use, once even with several threads.
+ */
+static void initKernel() { pthread_once(&kernelOnce, pickKernel); }
+
+int selectStuffingKernel(const char *name) {
+  StuffingKernel selected;
+  if (name == NULL || !kernelSupported(name, &selected))
+    return -1;
+  initKernel();
+  kernel = selected;
+  return 0;
+}
+
+const char *stuffingKernel() {
+  initKernel();
+  return kernel.name;
+}
+
+size_t findEscapeCandidate(const unsigned char *bytes, size_t size) {
+  initKernel();
+  return kernel.find(bytes, size);
+}
+
+/**
+ * @brief Stuffs a packet by replacing FLAG and ESC bytes with escape sequences.
+ *
+ * This function processes the input packet and replaces any occurrence of the
+ * FLAG byte (0x7E) with the sequence 0x7D5E and any occurrence of the ESC byte
+ * (0x7D) with the sequence 0x7D5D. The runs of bytes between escape candidates
+ * are found by the selected kernel and copied in bulk.
+ *
+ * @param packet The input packet to be stuffed.
+ * @param packetSize The size of the input packet.
+ * @param newPacket The buffer to store the stuffed packet. It should have at
+ * least double the size of the input packet to accommodate the worst-case
+ * scenario.
+ * @param newPacketSize A pointer to a variable where the size of the stuffed
+ * packet will be stored.
+ * @return 0 on success, 1 if any of the input pointers are NULL.
+ */
+int stuffPacket(const unsigned char *packet, size_t packetSize,
+                unsigned char *newPacket, size_t *newPacketSize) {
+  uint32_t unused = 0;
+  return stuffPacketWithCheck(packet, packetSize, newPacket, newPacketSize,
+                              NULL, &unused);
+}
+
+/**
+ * @brief Stuffs a packet while computing a checksum over it.
+ *
+ * Each run of bytes between escape candidates is folded into the checksum
+ * right after it is found, while it is still in the L1 cache, and the escaped
+ * bytes are folded one at a time. This way the frame check sequence doesn't
+ * need a separate pass over the packet.
+ *
+ * @param packet The input packet to be stuffed.
+ * @param packetSize The size of the input packet.
+ * @param newPacket The buffer to store the stuffed packet, at least double the
+ * size of the input packet.
+ * @param newPacketSize A pointer to a variable where the size of the stuffed
+ * packet will be stored.
+ * @param update The checksum update function, or NULL for none.
+ * @param check The running checksum, updated in place.
+ * @return 0 on success, 1 if any of the input pointers are NULL.
+ */
+int stuffPacketWithCheck(const unsigned char *packet, size_t packetSize,
+                         unsigned char *newPacket, size_t *newPacketSize,
+                         ChecksumUpdate update, uint32_t *check) {
+  if (packet == NULL || newPacket == NULL || newPacketSize == NULL ||
+      check == NULL) {
+    return 1;
+  }
+  initKernel();
+
+  size_t packetIndex = 0;
+  size_t newPacketIndex = 0;
+  uint32_t crc = *check;
+
+  while (packetIndex < packetSize) {
+    // Escape candidates are handled inline, so dense runs of them don't pay
+    // for a kernel call each.
+    unsigned char byte = packet[packetIndex];
+    if (byte == FLAG || byte == ESC) {
+      if (update != NULL)
+        crc = update(crc, &byte, 1);
+      newPacket[newPacketIndex++] = ESC;
+      newPacket[newPacketIndex++] = byte ^ 0x20;
+      packetIndex++;
+      continue;
+    }
+    size_t run = kernel.find(packet + packetIndex, packetSize - packetIndex);
+    if (update != NULL)
+      crc = update(crc, packet + packetIndex, run);
+    memcpy(newPacket + newPacketIndex, packet + packetIndex, run);
+    packetIndex += run;
+    newPacketIndex += run;
+  }
+  *newPacketSize = newPacketIndex;
+  *check = crc;
+
+  return 0;
+}
+
+/**
+ * @brief Destuffs a packet by removing escape sequences.
+ *
+ * This function processes an input packet and removes escape sequences,
+ * producing a new packet with the escape sequences removed. The runs of bytes
+ * between escape sequences are copied in bulk.
+ *
+ * @param packet The input packet to be destuffed.
+ * @param packetSize The size of the input packet.
+ * @param newPacket The output buffer where the destuffed packet will be stored.
+ * @param newPacketSize A pointer to a variable where the size of the destuffed
+ * packet will be stored.
+ * @return 0 on success, 1 if any of the input pointers are NULL.
+ */
+int destuffPacket(const unsigned char *packet, size_t packetSize,
+                  unsigned char *newPacket, size_t *newPacketSize) {
+  if (packet == NULL || newPacket == NULL || newPacketSize == NULL) {
+    return 1;
+  }
+  initKernel();
+
+  size_t packetIndex = 0;
+  size_t newPacketIndex = 0;
+
+  while (packetIndex < packetSize) {
+    unsigned char byte = packet[packetIndex];
+    if (byte == ESC) {
+      // Skip the ESC and restore the escaped byte. A trailing ESC is dropped.
+      packetIndex++;
+      if (packetIndex < packetSize)
+        newPacket[newPacketIndex++] = packet[packetIndex++] ^ 0x20;
+      continue;
+    }
+    if (byte == FLAG) {
+      // Not expected in stuffed data, kept as is.
+      newPacket[newPacketIndex++] = packet[packetIndex++];
+      continue;
+    }
+    size_t run = kernel.find(packet + packetIndex, packetSize - packetIndex);
+    memcpy(newPacket + newPacketIndex, packet + packetIndex, run);
+    packetIndex += run;
+    newPacketIndex += run;
+  }
+
+  *newPacketSize = newPacketIndex;
+
+  return 0;
+}
+
+void cobsStart(CobsEncoder *encoder, unsigned char *encoded) {
+  encoder->start = encoded;
+  encoder->code = encoded;
+  encoder->next = encoded + 1;
+  encoder->run = 0;
+}
+
+/**
+ * @brief Encodes the next bytes of the data.
+ *
+ * The FLAG bytes are found with `memchr()`, which the C library vectorizes,
+ * and the runs between them are copied in bulk and folded into the checksum
+ * right away, like `stuffPacketWithCheck()` does. A run ends at a FLAG, which
+ * closes it, or once it holds COBS_MAX_RUN bytes. Consecutive FLAGs, which
+ * make empty runs, are encoded together.
+ *
+ * @param encoder The encoder.
+ * @param data The bytes to encode.
+ * @param size The number of bytes.
+ * @param update The checksum update function, or NULL for none.
+ * @param check The running checksum, updated in place if update isn't NULL.
+ */
+void cobsUpdate(CobsEncoder *encoder, const unsigned char *data, size_t size,
+                ChecksumUpdate update, uint32_t *check) {
+  while (size > 0) {
+    if (encoder->run == 0 && *data == FLAG) {
+      size_t flags = 1;
+      while (flags < size && data[flags] == FLAG)
+        flags++;
+      memset(encoder->code, 1 ^ FLAG, flags);
+      encoder->code += flags;
+      encoder->next = encoder->code + 1;
+      if (update != NULL)
+        *check = update(*check, data, flags);
+      data += flags;
+      size -= flags;
+      continue;
+    }
+    size_t room = COBS_MAX_RUN - encoder->run;
+    size_t limit = size < room ? size : room;
+    const unsigned char *flag = memchr(data, FLAG, limit);
+    size_t length = flag != NULL ? (size_t)(flag - data) : limit;
+    memcpy(encoder->next, data, length);
+    encoder->next += length;
+    encoder->run += length;
+    // The FLAG closing the run, if any, is folded with it.
+    size_t consumed = flag != NULL ? length + 1 : length;
+    if (update != NULL)
+      *check = update(*check, data, consumed);
+    data += consumed;
+    size -= consumed;
+    if (flag != NULL || encoder->run == COBS_MAX_RUN) {
+      *encoder->code = (encoder->run + 1) ^ FLAG;
+      encoder->code = encoder->next++;
+      encoder->run = 0;
+    }
+  }
+}
+
+size_t cobsFinish(CobsEncoder *encoder) {
+  *encoder->code = (encoder->run + 1) ^ FLAG;
+  return encoder->next - encoder->start;
+}
+
+int cobsEncode(const unsigned char *data, size_t size, unsigned char *encoded,
+               size_t *encodedSize) {
+  if (data == NULL || encoded == NULL || encodedSize == NULL)
+    return 1;
+  CobsEncoder encoder;
+  cobsStart(&encoder, encoded);
+  cobsUpdate(&encoder, data, size, NULL, NULL);
+  *encodedSize = cobsFinish(&encoder);
+  return 0;
+}
+
+/**
+ * @brief Decodes COBS encoded data.
+ *
+ * Each run is copied in bulk, and the FLAG that follows it, if its code byte
+ * stands for one, is only written once another run follows, since the last
+ * run has none.
+ *
+ * @param encoded The encoded data.
+ * @param size The size of the encoded data.
+ * @param data The buffer where the data will be stored, of at least size
+ * bytes.
+ * @param dataSize A pointer to a variable where the size of the data will be
+ * stored.
+ * @return 0 on success, 1 if any of the input pointers are NULL or the data is
+ * malformed.
+ */
+int cobsDecode(const unsigned char *encoded, size_t size, unsigned char *data,
+               size_t *dataSize) {
+  if (encoded == NULL || data == NULL || dataSize == NULL)
+    return 1;
+
+  size_t encodedIndex = 0;
+  size_t dataIndex = 0;
+  int flagPending = 0;
+  while (encodedIndex < size) {
+    unsigned char code = encoded[encodedIndex++] ^ FLAG;
+    size_t run = code - 1;
+    if (code == 0)
+      return 1;
+    if (flagPending)
+      data[dataIndex++] = FLAG;
+    flagPending = run < COBS_MAX_RUN;
+    if (run == 0)
+      continue;
+    if (run > size - encodedIndex ||
+        memchr(encoded + encodedIndex, FLAG, run) != NULL)
+      return 1;
+    memcpy(data + dataIndex, encoded + encodedIndex, run);
+    encodedIndex += run;
+    dataIndex += run;
+  }
+  *dataSize = dataIndex;
+  return 0;
+}
@@ -0,0 +1,133 @@
+// Channels implementation
+
+#include "../include/channels.h"
+#include "../include/link_context.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @brief Empties the channel queues, freeing their slots, and clears their
+ * counters. Every weight goes back to 1.
+ */
+void resetChannels() {
+  for (int channel = 0; channel < MAX_CHANNELS; channel++) {
+    free(context->channels[channel].packets);
+    memset(&context->channels[channel], 0, sizeof(ChannelQueue));
+    context->channels[channel].weight = 1;
+  }
+  memset(context->channelStatistics, 0, sizeof(context->channelStatistics));
+  context->channelsUsed = FALSE;
+  context->scheduledChannel = MAX_CHANNELS - 1;
+  context->channelCredit = 0;
+}
+
+/**
+ * @brief Returns the queue of a channel, allocating its slots, for the
+ * negotiated payload size, when it is first used.
+ *
+ * @param channel The channel.
+ * @return The queue, or NULL if the channel is invalid or its slots can't be
+ * allocated.
+ */
+ChannelQueue *channelQueue(int channel) {
+  if (channel < 0 || channel >= MAX_CHANNELS)
+    return NULL;
+  ChannelQueue *queue = &context->channels[channel];
+  if (queue->packets == NULL) {
+    queue->packets = malloc(packetLimit() * CHANNEL_QUEUE_SIZE);
+    if (queue->packets == NULL) {
+      perror("Error allocating a channel queue.\n");
+      return NULL;
+    }
+  }
+  return queue;
+}
+
+/**
+ * @brief Returns a slot of a channel queue.
+ */
+unsigned char *queueSlot(const ChannelQueue *queue, int slot) {
+  return queue->packets + slot * packetLimit();
+}
+
+/**
+ * @brief Picks the channel of the next packet, by weighted round robin.
+ *
+ * The channel of the current round keeps sending while it has packets queued
+ * and credit left. Then the next channel with packets queued starts a round,
+ * with its weight as credit.
+ *
+ * @return The channel, or -1 if no packet is queued.
+ */
+int nextChannel() {
+  if (context->channelCredit > 0 &&
+      context->channels[context->scheduledChannel].count > 0)
+    return context->scheduledChannel;
+  for (int i = 1; i <= MAX_CHANNELS; i++) {
+    int channel = (context->scheduledChannel + i) % MAX_CHANNELS;
+    if (context->channels[channel].count > 0) {
+      context->scheduledChannel = channel;
+      context->channelCredit = context->channels[channel].weight;
+      return channel;
+    }
+  }
+  return -1;
+}
+
+int llchannel(int channel, int weight) {
+  if (channel < 0 || channel >= MAX_CHANNELS || weight < 1)
+    return -1;
+  context->channels[channel].weight = weight;
+  return 0;
+}
+
+unsigned char *llchannelslot(int channel) {
+  ChannelQueue *queue = channelQueue(channel);
+  if (queue == NULL || queue->count == CHANNEL_QUEUE_SIZE)
+    return NULL;
+  return queueSlot(queue, (queue->head + queue->count) % CHANNEL_QUEUE_SIZE);
+}
+
+int llsend(int channel, const unsigned char *buf, int bufSize) {
+  ChannelQueue *queue = channelQueue(channel);
+  if (queue == NULL || buf == NULL || (size_t)bufSize > packetLimit())
+    return -1;
+  if (queue->count == CHANNEL_QUEUE_SIZE)
+    return 0;
+  int slot = (queue->head + queue->count) % CHANNEL_QUEUE_SIZE;
+  if (buf != queueSlot(queue, slot))
+    memcpy(queueSlot(queue, slot), buf, bufSize);
+  queue->sizes[slot] = bufSize;
+  clock_gettime(CLOCK_MONOTONIC, &queue->queuedAt[slot]);
+  queue->count++;
+  context->channelsUsed = TRUE;
+  return bufSize;
+}
+
+int llschedule() {
+  int channel = nextChannel();
+  if (channel < 0)
+    return 0;
+  ChannelQueue *queue = &context->channels[channel];
+  int size = queue->sizes[queue->head];
+  context->writeChannel = channel;
+  context->writeQueuedAt = queue->queuedAt[queue->head];
+  int result = llwrite(queueSlot(queue, queue->head), size);
+  context->writeChannel = -1;
+  if (result > 0) {
+    context->channelStatistics[channel].packets++;
+    context->channelStatistics[channel].packetBytes += size;
+    queue->head = (queue->head + 1) % CHANNEL_QUEUE_SIZE;
+    queue->count--;
+    context->channelCredit--;
+  }
+  return result;
+}
+
+int llqueuedpackets() {
+  int queued = 0;
+  for (int channel = 0; channel < MAX_CHANNELS; channel++)
+    queued += context->channels[channel].count;
+  return queued;
+}
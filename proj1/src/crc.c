@@ -0,0 +1,206 @@
+// CRC implementation
+
+#include "../include/crc.h"
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+#define CRC16_POLYNOMIAL 0x8408      // 0x1021 reflected.
+#define CRC32C_POLYNOMIAL 0x82F63B78 // 0x1EDC6F41 reflected.
+
+// Slicing-by-8 tables: table[0] is the classic byte at a time table and
+// table[k][b] is the CRC of byte b followed by k zero bytes.
+static uint32_t crc16Table[8][256];
+static uint32_t crc32cTable[8][256];
+static pthread_once_t tablesOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Builds the slicing-by-8 tables of a reflected polynomial.
+ *
+ * @param table The tables to fill.
+ * @param polynomial The reflected polynomial.
+ */
+static void buildTables(uint32_t table[8][256], uint32_t polynomial) {
+  for (int byte = 0; byte < 256; byte++) {
+    uint32_t crc = byte;
+    for (int bit = 0; bit < 8; bit++)
+      crc = (crc & 1) ? (crc >> 1) ^ polynomial : crc >> 1;
+    table[0][byte] = crc;
+  }
+  for (int byte = 0; byte < 256; byte++) {
+    for (int k = 1; k < 8; k++) {
+      uint32_t previous = table[k - 1][byte];
+      table[k][byte] = (previous >> 8) ^ table[0][previous & 0xFF];
+    }
+  }
+}
+
+/**
+ * @brief Builds the tables of both polynomials.
+ */
+static void buildAllTables() {
+  buildTables(crc16Table, CRC16_POLYNOMIAL);
+  buildTables(crc32cTable, CRC32C_POLYNOMIAL);
+}
+
+/**
+ * @brief Builds the tables on first use, once even with several threads.
+ */
+static void initTables() { pthread_once(&tablesOnce, buildAllTables); }
+
+/**
+ * @brief Reads a 32 bit little endian word.
+ */
+static inline uint32_t loadLittleEndian32(const unsigned char *bytes) {
+  return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 |
+         (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+uint32_t crc16Update(uint32_t crc, const unsigned char *bytes, size_t size) {
+  initTables();
+  const uint32_t(*t)[256] = crc16Table;
+  size_t i = 0;
+  crc &= 0xFFFF;
+
+  // Only the first two bytes of each block mix with the CRC, the other six
+  // are looked up directly.
+  for (; i + 8 <= size; i += 8) {
+    const unsigned char *p = bytes + i;
+    crc ^= (uint32_t)p[0] | (uint32_t)p[1] << 8;
+    crc = t[7][crc & 0xFF] ^ t[6][crc >> 8] ^ t[5][p[2]] ^ t[4][p[3]] ^
+          t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+  }
+  for (; i < size; i++)
+    crc = (crc >> 8) ^ t[0][(crc ^ bytes[i]) & 0xFF];
+  return crc;
+}
+
+/**
+ * @brief Table driven CRC-32C, 8 bytes per step.
+ *
+ * @param crc The running CRC.
+ * @param bytes The bytes to fold in.
+ * @param size The number of bytes.
+ * @return The updated CRC.
+ */
+static uint32_t crc32cUpdateSlicing8(uint32_t crc, const unsigned char *bytes,
+                                     size_t size) {
+  initTables();
+  const uint32_t(*t)[256] = crc32cTable;
+  size_t i = 0;
+
+  for (; i + 8 <= size; i += 8) {
+    uint32_t low = crc ^ loadLittleEndian32(bytes + i);
+    uint32_t high = loadLittleEndian32(bytes + i + 4);
+    crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^
+          t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24] ^ t[3][high & 0xFF] ^
+          t[2][(high >> 8) & 0xFF] ^ t[1][(high >> 16) & 0xFF] ^
+          t[0][high >> 24];
+  }
+  for (; i < size; i++)
+    crc = (crc >> 8) ^ t[0][(crc ^ bytes[i]) & 0xFF];
+  return crc;
+}
+
+#ifdef HAVE_X86_KERNELS
+/**
+ * @brief CRC-32C with the SSE4.2 crc32 instruction.
+ *
+ * The instruction implements exactly the reflected Castagnoli polynomial, so
+ * it consumes 8 bytes per instruction on x86-64 (4 on x86).
+ *
+ * @param crc The running CRC.
+ * @param bytes The bytes to fold in.
+ * @param size The number of bytes.
+ * @return The updated CRC.
+ */
+__attribute__((target("sse4.2"))) static uint32_t
+crc32cUpdateSSE42(uint32_t crc, const unsigned char *bytes, size_t size) {
+  size_t i = 0;
+
+#ifdef __x86_64__
+  uint64_t crc64 = crc;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, bytes + i, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = (uint32_t)crc64;
+#else
+  for (; i + 4 <= size; i += 4) {
+    uint32_t word;
+    memcpy(&word, bytes + i, sizeof(word));
+    crc = _mm_crc32_u32(crc, word);
+  }
+#endif
+  for (; i < size; i++)
+    crc = _mm_crc32_u8(crc, bytes[i]);
+  return crc;
+}
+#endif
+
+typedef struct {
+  const char *name;
+  uint32_t (*update)(uint32_t, const unsigned char *, size_t);
+} CrcKernel;
+
+static CrcKernel kernel = {NULL, NULL};
+static pthread_once_t kernelOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Checks whether the CPU supports a kernel.
+ *
+ * @param name The name of the kernel.
+ * @param selected Where the kernel will be stored if it is supported.
+ * @return 1 if it is supported, 0 otherwise.
+ */
+static int kernelSupported(const char *name, CrcKernel *selected) {
+  if (strcmp(name, "slicing8") == 0) {
+    *selected = (CrcKernel){"slicing8", crc32cUpdateSlicing8};
+    return 1;
+  }
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init();
+  if (strcmp(name, "sse4.2") == 0 && __builtin_cpu_supports("sse4.2")) {
+    *selected = (CrcKernel){"sse4.2", crc32cUpdateSSE42};
+    return 1;
+  }
+#endif
+  return 0;
+}
+
+/**
+ * @brief Picks the fastest kernel supported by the CPU.
+ */
+static void pickKernel() {
+  if (!kernelSupported("sse4.2", &kernel))
+    kernelSupported("slicing8", &kernel);
+}
+
+/**
+ * @brief Picks the kernel on first use, once even with several threads.
+ */
+static void initKernel() { pthread_once(&kernelOnce, pickKernel); }
+
+int selectCrcKernel(const char *name) {
+  CrcKernel selected;
+  if (name == NULL || !kernelSupported(name, &selected))
+    return -1;
+  initKernel();
+  kernel = selected;
+  return 0;
+}
+
+const char *crcKernel() {
+  initKernel();
+  return kernel.name;
+}
+
+uint32_t crc32cUpdate(uint32_t crc, const unsigned char *bytes, size_t size) {
+  initKernel();
+  return kernel.update(crc, bytes, size);
+}
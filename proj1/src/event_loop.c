@@ -0,0 +1,446 @@
+// Event loop implementation
+
+#include "../include/event_loop.h"
+#include "../include/trace.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Identifies the serial port in the epoll events, the timers use their index.
+#define SERIAL_EVENT MAX_TIMERS
+// Identifies the eventfd that wakes up an interrupted loop.
+#define WAKE_EVENT (MAX_TIMERS + 1)
+
+// A run of bytes waiting to be written.
+typedef struct {
+  const unsigned char *bytes; // Next byte to write.
+  size_t size;                // Bytes left to write.
+  int *references;            // Released once written, NULL for copies.
+  unsigned char copy[TX_COPY_SIZE]; // Where copied bytes are kept.
+} Run;
+
+struct EventLoop {
+  int serialFd;
+  int epollFd;
+  int timerFds[MAX_TIMERS];
+  int timerPending[MAX_TIMERS]; // Expired since it was last armed.
+  // Runs waiting to be written, a ring starting at firstRun.
+  Run txQueue[TX_QUEUE_RUNS];
+  size_t firstRun;
+  size_t queuedRuns;
+  size_t queuedBytes;
+  int watchingOutput; // EPOLLOUT is set for the serial port.
+  EventLoopCounters counters;
+  // Set by `eventLoopInterrupt()`, from any thread, which also writes to
+  // wakeFd. The eventfd lives as long as the loop, so that it can't be closed
+  // under the thread interrupting it.
+  int interrupted;
+  int wakeFd;
+};
+
+static EventLoop defaultLoop = {.serialFd = -1, .epollFd = -1, .wakeFd = -1};
+// Loop the functions act on, in each thread.
+static __thread EventLoop *loop = &defaultLoop;
+
+/**
+ * @brief Removes the first run from the queue, releasing its buffer.
+ */
+static void dropRun() {
+  Run *run = &loop->txQueue[loop->firstRun];
+  if (run->references != NULL)
+    (*run->references)--;
+  loop->queuedBytes -= run->size;
+  loop->firstRun = (loop->firstRun + 1) % TX_QUEUE_RUNS;
+  loop->queuedRuns--;
+}
+
+/**
+ * @brief Writes as much of the queue as the serial port takes without
+ * blocking, every run in a single `writev()`.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int flushQueue() {
+  struct iovec vectors[TX_QUEUE_RUNS];
+
+  while (loop->queuedRuns > 0) {
+    for (size_t i = 0; i < loop->queuedRuns; i++) {
+      Run *run = &loop->txQueue[(loop->firstRun + i) % TX_QUEUE_RUNS];
+      vectors[i].iov_base = (void *)run->bytes;
+      vectors[i].iov_len = run->size;
+    }
+    loop->counters.writeCalls++;
+    ssize_t written = writev(loop->serialFd, vectors, loop->queuedRuns);
+    if (written < 0) {
+      if (errno == EAGAIN || errno == EINTR)
+        break;
+      perror("Error writing to serial port!\n");
+      return -1;
+    }
+    traceInstant("bytes written", "bytes", written);
+    while (written > 0) {
+      Run *run = &loop->txQueue[loop->firstRun];
+      if ((size_t)written < run->size) {
+        run->bytes += written;
+        run->size -= written;
+        loop->queuedBytes -= written;
+        break;
+      }
+      written -= run->size;
+      dropRun();
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Watches the serial port for writability only while bytes are queued.
+ */
+static void updateOutputWatch() {
+  int wanted = loop->queuedRuns > 0;
+  if (wanted == loop->watchingOutput)
+    return;
+  struct epoll_event event = {0};
+  event.events = EPOLLIN | (wanted ? EPOLLOUT : 0);
+  event.data.u32 = SERIAL_EVENT;
+  if (epoll_ctl(loop->epollFd, EPOLL_CTL_MOD, loop->serialFd, &event) == 0)
+    loop->watchingOutput = wanted;
+}
+
+/**
+ * @brief Blocks until the serial port is writable or the timeout expires.
+ *
+ * @param timeoutMs The timeout in milliseconds, or -1 to wait forever.
+ * @return 1 if it is writable, 0 on timeout, -1 on error.
+ */
+static int waitWritable(int timeoutMs) {
+  struct pollfd pollFd = {loop->serialFd, POLLOUT, 0};
+  int ready = poll(&pollFd, 1, timeoutMs);
+  if (ready < 0 && errno != EINTR)
+    return -1;
+  return ready > 0;
+}
+
+int eventLoopOpen(int fd) {
+  if (loop->epollFd >= 0)
+    eventLoopClose(0);
+
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    perror("fcntl");
+    return -1;
+  }
+  loop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epollFd < 0) {
+    perror("epoll_create1");
+    return -1;
+  }
+
+  loop->serialFd = fd;
+  loop->firstRun = loop->queuedRuns = loop->queuedBytes = 0;
+  loop->watchingOutput = 0;
+  memset(&loop->counters, 0, sizeof(loop->counters));
+
+  struct epoll_event event = {0};
+  event.events = EPOLLIN;
+  event.data.u32 = SERIAL_EVENT;
+  if (epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, fd, &event) == -1) {
+    perror("epoll_ctl");
+    return -1;
+  }
+
+  if (__atomic_load_n(&loop->wakeFd, __ATOMIC_SEQ_CST) < 0)
+    __atomic_store_n(&loop->wakeFd, eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC),
+                     __ATOMIC_SEQ_CST);
+  event.events = EPOLLIN;
+  event.data.u32 = WAKE_EVENT;
+  if (loop->wakeFd < 0 ||
+      epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, loop->wakeFd, &event) == -1) {
+    perror("eventfd");
+    return -1;
+  }
+
+  for (int timer = 0; timer < MAX_TIMERS; timer++) {
+    loop->timerPending[timer] = 0;
+    loop->timerFds[timer] =
+        timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (loop->timerFds[timer] < 0) {
+      perror("timerfd_create");
+      return -1;
+    }
+    event.events = EPOLLIN;
+    event.data.u32 = timer;
+    if (epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, loop->timerFds[timer],
+                  &event) == -1) {
+      perror("epoll_ctl");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void eventLoopClose(int timeoutMs) {
+  if (loop->epollFd < 0)
+    return;
+  while (loop->queuedRuns > 0 && waitWritable(timeoutMs) > 0) {
+    if (flushQueue())
+      break;
+  }
+  while (loop->queuedRuns > 0)
+    dropRun();
+
+  for (int timer = 0; timer < MAX_TIMERS; timer++) {
+    if (loop->timerFds[timer] >= 0)
+      close(loop->timerFds[timer]);
+    loop->timerFds[timer] = -1;
+  }
+  close(loop->epollFd);
+  loop->epollFd = -1;
+}
+
+int armTimer(int timer, long microseconds) {
+  struct itimerspec deadline = {{0, 0}, {0, 0}};
+  if (microseconds <= 0)
+    microseconds = 1; // Zero would disarm it.
+  deadline.it_value.tv_sec = microseconds / 1000000;
+  deadline.it_value.tv_nsec = (microseconds % 1000000) * 1000;
+  loop->timerPending[timer] = 0;
+  if (timerfd_settime(loop->timerFds[timer], 0, &deadline, NULL) == -1) {
+    perror("timerfd_settime");
+    return -1;
+  }
+  return 0;
+}
+
+void disarmTimer(int timer) {
+  struct itimerspec deadline = {{0, 0}, {0, 0}};
+  loop->timerPending[timer] = 0;
+  timerfd_settime(loop->timerFds[timer], 0, &deadline, NULL);
+}
+
+int timerExpired(int timer) {
+  if (!loop->timerPending[timer])
+    return 0;
+  loop->timerPending[timer] = 0;
+  return 1;
+}
+
+/**
+ * @brief Writes bytes straight to the serial port if nothing is queued.
+ *
+ * @return The number of bytes written, or -1 on error.
+ */
+static ssize_t writeNow(const unsigned char *bytes, size_t size) {
+  if (loop->queuedRuns > 0)
+    return 0;
+  loop->counters.writeCalls++;
+  ssize_t written = write(loop->serialFd, bytes, size);
+  if (written < 0) {
+    if (errno == EAGAIN || errno == EINTR)
+      return 0;
+    perror("Error writing to serial port!\n");
+    return -1;
+  }
+  traceInstant("bytes written", "bytes", written);
+  return written;
+}
+
+/**
+ * @brief Appends a run to the queue, waiting for the port if it is full.
+ *
+ * @param bytes The bytes of the run.
+ * @param size The number of bytes, at most TX_COPY_SIZE if they are copied.
+ * @param references The reference count of the buffer, or NULL to copy them.
+ * @return 0 on success, -1 on error.
+ */
+static int queueRun(const unsigned char *bytes, size_t size,
+                    int *references) {
+  while (loop->queuedRuns == TX_QUEUE_RUNS) {
+    if (waitWritable(-1) < 0 || flushQueue())
+      return -1;
+  }
+  Run *run =
+      &loop->txQueue[(loop->firstRun + loop->queuedRuns) % TX_QUEUE_RUNS];
+  if (references == NULL) {
+    memcpy(run->copy, bytes, size);
+    bytes = run->copy;
+    loop->counters.copiedBytes += size;
+  } else {
+    (*references)++;
+  }
+  run->bytes = bytes;
+  run->size = size;
+  run->references = references;
+  loop->queuedRuns++;
+  loop->queuedBytes += size;
+  return 0;
+}
+
+int sendBytes(const unsigned char *bytes, size_t size) {
+  ssize_t written = writeNow(bytes, size);
+  if (written < 0)
+    return -1;
+  bytes += written;
+  size -= written;
+  while (size > 0) {
+    size_t chunk = size < TX_COPY_SIZE ? size : TX_COPY_SIZE;
+    if (queueRun(bytes, chunk, NULL))
+      return -1;
+    bytes += chunk;
+    size -= chunk;
+  }
+  updateOutputWatch();
+  return 0;
+}
+
+int sendBuffer(const unsigned char *bytes, size_t size, int *references) {
+  ssize_t written = writeNow(bytes, size);
+  if (written < 0)
+    return -1;
+  if ((size_t)written < size &&
+      queueRun(bytes + written, size - written, references))
+    return -1;
+  updateOutputWatch();
+  return 0;
+}
+
+int waitForOutput() {
+  if (loop->queuedRuns == 0)
+    return 0;
+  if (waitWritable(-1) < 0 || flushQueue())
+    return -1;
+  updateOutputWatch();
+  return 0;
+}
+
+size_t pendingBytes() { return loop->queuedBytes; }
+
+/**
+ * @brief Waits up to timeoutMs milliseconds (forever if -1) until bytes are
+ * received or a timer expires, as `waitForInput()` does.
+ *
+ * @return The number of bytes read, 0 if a timer expired or the time ran out,
+ * or -1 on error.
+ */
+static int waitEvents(unsigned char *buffer, size_t size, int timeoutMs) {
+  struct epoll_event events[MAX_TIMERS + 2];
+
+  while (1) {
+    if (__atomic_load_n(&loop->interrupted, __ATOMIC_SEQ_CST))
+      return -1;
+    traceBegin("wait");
+    int ready = epoll_wait(loop->epollFd, events, MAX_TIMERS + 2, timeoutMs);
+    traceEnd("wait", "events", ready);
+    loop->counters.wakeups++;
+    if (ready < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait");
+      return -1;
+    }
+    if (ready == 0)
+      return 0;
+
+    int received = 0;
+    int expired = 0;
+    for (int i = 0; i < ready; i++) {
+      uint32_t id = events[i].data.u32;
+      if (id == WAKE_EVENT)
+        continue;
+      if (id != SERIAL_EVENT) {
+        uint64_t expirations;
+        if (read(loop->timerFds[id], &expirations, sizeof(expirations)) > 0) {
+          loop->timerPending[id] = 1;
+          traceInstant("timer expired", "timer", id);
+          expired = 1;
+        }
+        continue;
+      }
+      if ((events[i].events & EPOLLOUT) && flushQueue())
+        return -1;
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        loop->counters.readCalls++;
+        ssize_t bytes = read(loop->serialFd, buffer, size);
+        if (bytes < 0 && errno != EAGAIN && errno != EINTR) {
+          perror("Error reading from serial port!\n");
+          return -1;
+        }
+        if (bytes == 0 && (events[i].events & EPOLLHUP)) {
+          fprintf(stderr, "Serial port hung up.\n");
+          return -1;
+        }
+        if (bytes > 0) {
+          received = bytes;
+          traceInstant("bytes read", "bytes", bytes);
+        }
+      }
+    }
+    updateOutputWatch();
+    if (received > 0)
+      return received;
+    if (expired)
+      return 0;
+  }
+}
+
+int waitForInput(unsigned char *buffer, size_t size) {
+  return waitEvents(buffer, size, -1);
+}
+
+int pollInput(unsigned char *buffer, size_t size) {
+  return waitEvents(buffer, size, 0);
+}
+
+const EventLoopCounters *eventLoopCounters() { return &loop->counters; }
+
+EventLoop *eventLoopCreate() {
+  EventLoop *created = calloc(1, sizeof(EventLoop));
+  if (created == NULL) {
+    perror("Error allocating an event loop");
+    return NULL;
+  }
+  created->serialFd = -1;
+  created->epollFd = -1;
+  created->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (created->wakeFd < 0) {
+    perror("eventfd");
+    free(created);
+    return NULL;
+  }
+  return created;
+}
+
+void eventLoopDestroy(EventLoop *destroyed) {
+  if (destroyed == NULL || destroyed == &defaultLoop)
+    return;
+  EventLoop *selected = loop;
+  loop = destroyed;
+  eventLoopClose(0);
+  loop = selected == destroyed ? &defaultLoop : selected;
+  close(destroyed->wakeFd);
+  free(destroyed);
+}
+
+void eventLoopSelect(EventLoop *selected) {
+  loop = selected != NULL ? selected : &defaultLoop;
+}
+
+void eventLoopInterrupt(EventLoop *interrupted) {
+  if (interrupted == NULL)
+    interrupted = &defaultLoop;
+  __atomic_store_n(&interrupted->interrupted, 1, __ATOMIC_SEQ_CST);
+  // If the loop isn't open yet, it sees the flag before it first waits.
+  int wakeFd = __atomic_load_n(&interrupted->wakeFd, __ATOMIC_SEQ_CST);
+  uint64_t one = 1;
+  if (wakeFd >= 0 && write(wakeFd, &one, sizeof(one)) < 0)
+    perror("eventfd");
+}
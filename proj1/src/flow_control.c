@@ -0,0 +1,330 @@
+// Flow control implementation
+
+#include "../include/flow_control.h"
+#include "../include/keepalive.h"
+#include "../include/link_context.h"
+#include "../include/trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * @brief Allocates the receive queue of a flow controlled receiver for the
+ * negotiated payload size, and resets the flow control state of either end.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int setupReceiveQueue() {
+  context->queueHead = 0;
+  context->queueCount = 0;
+  context->disconnectPending = FALSE;
+  context->receiverBusy = FALSE;
+  context->peerBusy = FALSE;
+  free(context->receiveQueue);
+  context->receiveQueue = NULL;
+  if (!context->flowControl || context->parameters.role != LlRx)
+    return 0;
+  context->receiveQueue =
+      malloc(dataFieldLimit() * (size_t)context->options.receiveQueue);
+  if (context->receiveQueue == NULL) {
+    perror("Error allocating the receive queue.\n");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Handles a response of a flow controlled receiver: a RNR, or any
+ * response while it isn't ready.
+ *
+ * A RNR pauses the transmission: no new frame is sent, and the timers of the
+ * frames in flight are stopped, since it isn't a loss, until the receiver is
+ * ready again. It is polled meanwhile (see `pollReceiver()`). A RR means it
+ * is: the frames it didn't acknowledge (those it dropped) are sent again, and
+ * new ones follow.
+ *
+ * @param type The type of the response.
+ * @param acknowledged The number of frames it acknowledged.
+ * @return 1 if frames were acknowledged or the transmission goes on, 0 if
+ * not, -1 on error.
+ */
+int paceTransmission(int type, int acknowledged) {
+  context->pollAnswered = TRUE;
+  clock_gettime(CLOCK_MONOTONIC, &context->answeredAt);
+  context->timeoutCount = 0;
+  if (type == S_RNR && !context->peerBusy) {
+    printf("Receiver not ready, pausing with %d frames outstanding.\n",
+           outstandingFrames());
+    traceInstant("RNR received", "outstanding", outstandingFrames());
+    context->peerBusy = TRUE;
+    context->statistics.pauses++;
+    clock_gettime(CLOCK_MONOTONIC, &context->busyAt);
+    for (unsigned char ns = context->windowBase; ns != context->nextSequence;
+         ns = (ns + 1) % sequenceModulus())
+      disarmTimer(ns);
+    context->pollInterval = context->estimator.rto;
+    if (armTimer(FLOW_TIMER, context->pollInterval * 1000L))
+      return -1;
+  }
+  if (type != S_RR)
+    return acknowledged > 0;
+
+  double pausedMs = millisecondsSince(&context->busyAt);
+  printf("Receiver ready after %.0f ms, resending %d frames.\n", pausedMs,
+         outstandingFrames());
+  traceInstant("receiver ready", "paused_ms", (long)pausedMs);
+  context->peerBusy = FALSE;
+  context->statistics.pausedMs += pausedMs;
+  disarmTimer(FLOW_TIMER);
+  return retransmitWindow(FALSE) ? -1 : 1;
+}
+
+/**
+ * @brief Polls a receiver that isn't ready, with flow control, when the timer
+ * of the poll expired.
+ *
+ * A poll is a keepalive probe, which the receiver answers with a RR or a RNR
+ * for the next frame it expects, so a lost RR doesn't stall the transfer. The
+ * receiver only answers from `llread()`, so while the application stalls the
+ * polls go unanswered: the receiver is known to be busy, so they aren't
+ * retransmissions and don't count towards `nRetransmissions`. A poll left
+ * unanswered backs off the next one instead, without touching the
+ * retransmission timeout. Whether the polls are answered or not, the
+ * receiver is given up once it wasn't ready for `linkDownLimit` seconds, like
+ * a link that stayed down, since one that keeps answering RNR may never read
+ * its queue again. Once it was given up the timer keeps running without
+ * polls, so the next calls fail as well instead of waiting forever.
+ *
+ * @return 0 on success, -1 on error or if the receiver wasn't ready for too
+ * long.
+ */
+int pollReceiver() {
+  if (!timerExpired(FLOW_TIMER))
+    return 0;
+  if (context->options.linkDownLimit > 0 &&
+      millisecondsSince(&context->busyAt) >=
+          context->options.linkDownLimit * 1000.0) {
+    printf("The receiver wasn't ready for %d s, giving up.\n",
+           context->options.linkDownLimit);
+    armTimer(FLOW_TIMER, context->pollInterval * 1000L);
+    return -1;
+  }
+  if (!context->pollAnswered) {
+    printf("Poll unanswered for %.0f ms.\n",
+           millisecondsSince(&context->answeredAt));
+    traceInstant("poll unanswered", "interval_ms", context->pollInterval);
+    context->pollInterval = context->pollInterval * 2 < maxTimeout()
+                                ? context->pollInterval * 2
+                                : maxTimeout();
+  }
+  context->pollAnswered = FALSE;
+  traceInstant("poll sent", NULL, 0);
+  if (sendControlFrame(transmitAddress(), PROBE_CONTROL))
+    return -1;
+  return armTimer(FLOW_TIMER, context->pollInterval * 1000L);
+}
+
+/**
+ * @brief Returns the slot of the receive queue `index` packets after its
+ * head.
+ */
+unsigned char *receiveQueueSlot(int index) {
+  int slot = (context->queueHead + index) % context->options.receiveQueue;
+  return context->receiveQueue + slot * dataFieldLimit();
+}
+
+/**
+ * @brief Returns the packets waiting for `llread()`: those of the receive
+ * queue, and those Selective Repeat accepted into the reorder buffer that
+ * didn't fit in it yet.
+ */
+int receivedPacketCount() {
+  int waiting = 0;
+  if (context->options.arq == LlSelectiveRepeat)
+    waiting = (context->expectedSequence - context->deliverSequence +
+               SEQUENCE_MODULUS) %
+              SEQUENCE_MODULUS;
+  return context->queueCount + waiting;
+}
+
+/**
+ * @brief Returns the packets waiting for `llread()` that make the receiver
+ * busy: all but a window of the receive queue, so the frames in flight when
+ * the RNR is sent still fit.
+ */
+int queueHighWatermark() {
+  int high = context->options.receiveQueue - context->windowSize + 1;
+  return high > 1 ? high : 1;
+}
+
+/**
+ * @brief Makes the receiver busy, so that its RR are sent as RNR, once the
+ * packets waiting for `llread()`, with `incoming` more, reach the high
+ * watermark.
+ */
+void checkReceiveQueue(int incoming) {
+  if (context->receiverBusy ||
+      receivedPacketCount() + incoming < queueHighWatermark())
+    return;
+  printf("%d packets waiting to be read, the receiver is busy\n",
+         receivedPacketCount());
+  traceInstant("receiver busy", "waiting", receivedPacketCount());
+  context->receiverBusy = TRUE;
+  context->statistics.pauses++;
+  clock_gettime(CLOCK_MONOTONIC, &context->busyAt);
+}
+
+/**
+ * @brief Moves the packets Selective Repeat accepted into the reorder buffer
+ * to the receive queue, as far as they fit.
+ */
+void queueReorderedPackets() {
+  while (context->deliverSequence != context->expectedSequence &&
+         context->queueCount < context->options.receiveQueue) {
+    context->queuedSizes[(context->queueHead + context->queueCount) %
+                         context->options.receiveQueue] =
+        deliverReorderedPacket(receiveQueueSlot(context->queueCount));
+    context->queueCount++;
+  }
+}
+
+/**
+ * @brief Handles an information or redundancy frame of a flow controlled
+ * receiver, accepting its packet into the receive queue.
+ *
+ * While the packets waiting for `llread()` fill the queue, the frame is
+ * dropped and answered with a RNR for the frame expected, which the
+ * transmitter resends once the receiver is ready. Otherwise it is handled as
+ * `llread()` does, acknowledged with a RNR if its packet takes the queue to
+ * the high watermark (see `checkReceiveQueue()`).
+ *
+ * @param ns The sequence number of the frame.
+ * @param redundancy TRUE for a redundancy frame.
+ * @return 0 on success, -1 on error.
+ */
+int queueInformationFrame(unsigned char ns, int redundancy) {
+  if (context->options.arq == LlSelectiveRepeat)
+    queueReorderedPackets();
+  if (receivedPacketCount() >= context->options.receiveQueue) {
+    checkReceiveQueue(0);
+    unsigned char responseC =
+        supervisoryControl(S_RR, context->expectedSequence);
+    printf("Frame %d dropped, the receive queue is full, answering with "
+           "0x%02x\n",
+           ns, responseC);
+    traceInstant("queue full", "frame", ns);
+    context->statistics.overflowFrames++;
+    return sendControlFrame(responseAddress(), responseC);
+  }
+  checkReceiveQueue(1);
+  int size = receiveInformationFrame(ns, redundancy,
+                                     receiveQueueSlot(context->queueCount));
+  if (size < 0)
+    return -1;
+  if (size > 0) {
+    context->queuedSizes[(context->queueHead + context->queueCount) %
+                         context->options.receiveQueue] = size;
+    context->queueCount++;
+  }
+  if (context->options.arq == LlSelectiveRepeat)
+    queueReorderedPackets();
+  return 0;
+}
+
+/**
+ * @brief Reads the next packet of a flow controlled receiver, from its
+ * receive queue.
+ *
+ * Every frame already received is handled first, without waiting for more
+ * (see `queueInformationFrame()`), so the call only blocks while the queue is
+ * empty. Once `llread()` took a busy receiver down to half of the high
+ * watermark, a RR tells the transmitter to go on. A DISC read ahead is kept
+ * for `llclose()`, and fails the call once no packet is left to read.
+ *
+ * @param packet Where the packet is copied.
+ * @return The size of the packet, or -1 on error or once disconnected.
+ */
+int readQueuedPacket(unsigned char *packet) {
+  while (TRUE) {
+    // The data field of a frame that fits is destuffed straight into the
+    // next free slot, which Selective Repeat fills from the reorder buffer
+    // instead.
+    if (context->options.arq != LlSelectiveRepeat &&
+        context->queueCount < context->options.receiveQueue)
+      context->deliveryBuffer = receiveQueueSlot(context->queueCount);
+    context->readingAhead = context->queueCount > 0;
+    int received = receiveFrame(&context->receiverStatistics->nBytes);
+    context->readingAhead = FALSE;
+    context->deliveryBuffer = NULL;
+    if (received < 0 || rejectDamagedFrames() ||
+        (!received && checkSilence()) ||
+        (received && (answerProbe() < 0 || answerRepeatedSet() < 0)))
+      return -1;
+    // Nothing more was received.
+    if (!received && context->queueCount > 0 && context->rxEnd == 0)
+      break;
+    // The transmitter gave up, and only `llclose()` answers it.
+    if (context->disconnectPending && receivedPacketCount() == 0) {
+      printf("Disconnected by the transmitter with no packet left to read\n");
+      return -1;
+    }
+    if (!received)
+      continue;
+    if (context->receivedFrame.dataSize == 0 &&
+        context->receivedFrame.A == connectionAddress() &&
+        context->receivedFrame.C == 0x0B)
+      context->disconnectPending = TRUE;
+    unsigned char ns;
+    int redundancy;
+    if (isReceivedInformation(&ns, &redundancy) &&
+        queueInformationFrame(ns, redundancy))
+      return -1;
+  }
+
+  size_t size = context->queuedSizes[context->queueHead];
+  memcpy(packet, receiveQueueSlot(0), size);
+  context->queueHead = (context->queueHead + 1) % context->options.receiveQueue;
+  context->queueCount--;
+  if (context->options.arq == LlSelectiveRepeat)
+    queueReorderedPackets();
+  if (context->receiverBusy &&
+      receivedPacketCount() <= queueHighWatermark() / 2) {
+    double busyMs = millisecondsSince(&context->busyAt);
+    printf("%d packets waiting to be read, the receiver is ready after %.0f "
+           "ms\n",
+           receivedPacketCount(), busyMs);
+    traceInstant("receiver ready", "busy_ms", (long)busyMs);
+    context->receiverBusy = FALSE;
+    context->statistics.pausedMs += busyMs;
+    if (sendReceiveReady())
+      return -1;
+  }
+  return size;
+}
+
+/**
+ * @brief Drops the packets a closing flow controlled receiver still holds for
+ * `llread()`, which the application won't read, and tells a transmitter it
+ * paused that it is ready, so that the transmitter doesn't wait for the queue
+ * to drain. The frames the transmitter sends again are dropped as well (see
+ * `receiveControlFrame()`), until its retransmissions run out.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int releaseReceiveQueue() {
+  if (!context->flowControl || context->parameters.role != LlRx)
+    return 0;
+  if (receivedPacketCount() > 0)
+    printf("%d packets were never read, dropping them\n",
+           receivedPacketCount());
+  context->queueCount = 0;
+  context->deliverSequence = context->expectedSequence;
+  if (!context->receiverBusy)
+    return 0;
+  double busyMs = millisecondsSince(&context->busyAt);
+  traceInstant("receiver ready", "busy_ms", (long)busyMs);
+  context->receiverBusy = FALSE;
+  context->statistics.pausedMs += busyMs;
+  return sendReceiveReady();
+}
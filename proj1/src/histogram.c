@@ -0,0 +1,74 @@
+// Histogram implementation
+
+#include "../include/histogram.h"
+#include <string.h>
+
+// HISTOGRAM_SUB_BUCKETS is 2^SUB_BUCKET_BITS.
+#define SUB_BUCKET_BITS 4
+
+void histogramReset(Histogram *histogram) {
+  memset(histogram, 0, sizeof(*histogram));
+}
+
+/**
+ * @brief Returns the bucket of a value.
+ *
+ * Values below HISTOGRAM_SUB_BUCKETS have a bucket each. A larger value whose
+ * most significant bit is bit m falls in the range [2^m, 2^(m+1)), split into
+ * HISTOGRAM_SUB_BUCKETS buckets by the SUB_BUCKET_BITS bits after that one.
+ */
+int histogramBucket(uint64_t value) {
+  if (value < HISTOGRAM_SUB_BUCKETS)
+    return value;
+  int msb = 63 - __builtin_clzll(value);
+  int shift = msb - SUB_BUCKET_BITS;
+  return (msb - SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS +
+         (int)(value >> shift) - HISTOGRAM_SUB_BUCKETS;
+}
+
+uint64_t histogramBucketLow(int bucket) {
+  if (bucket < HISTOGRAM_SUB_BUCKETS)
+    return bucket;
+  int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+  return (uint64_t)(HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS)
+         << shift;
+}
+
+uint64_t histogramBucketHigh(int bucket) {
+  if (bucket < HISTOGRAM_SUB_BUCKETS)
+    return bucket;
+  int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+  return histogramBucketLow(bucket) + ((uint64_t)1 << shift) - 1;
+}
+
+void histogramRecord(Histogram *histogram, uint64_t value) {
+  histogram->counts[histogramBucket(value)]++;
+  if (histogram->total == 0 || value < histogram->min)
+    histogram->min = value;
+  if (histogram->total == 0 || value > histogram->max)
+    histogram->max = value;
+  histogram->total++;
+  histogram->sum += value;
+}
+
+uint64_t histogramPercentile(const Histogram *histogram, double percentile) {
+  if (histogram->total == 0)
+    return 0;
+  // Rank of the value, from 1 to `total`.
+  uint64_t rank = (uint64_t)(percentile / 100 * histogram->total + 0.5);
+  if (rank < 1)
+    rank = 1;
+  uint64_t seen = 0;
+  for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+    seen += histogram->counts[bucket];
+    if (seen >= rank) {
+      uint64_t high = histogramBucketHigh(bucket);
+      return high < histogram->max ? high : histogram->max;
+    }
+  }
+  return histogram->max;
+}
+
+double histogramMean(const Histogram *histogram) {
+  return histogram->total > 0 ? (double)histogram->sum / histogram->total : 0;
+}
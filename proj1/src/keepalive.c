@@ -0,0 +1,133 @@
+// Keepalive implementation
+
+#include "../include/keepalive.h"
+#include "../include/link_context.h"
+#include "../include/trace.h"
+#include <stdio.h>
+#include <time.h>
+
+/**
+ * @brief Sends a keepalive probe, and arms the timer of the next one.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int sendProbe() {
+  traceInstant("probe sent", NULL, 0);
+  if (sendControlFrame(transmitAddress(), PROBE_CONTROL))
+    return -1;
+  return armTimer(LINK_TIMER, context->options.keepalive * 1000L);
+}
+
+/**
+ * @brief Takes the link down, after the other end went silent.
+ *
+ * The frames in flight are kept, but their timers are stopped so that they
+ * aren't sent into a dead line again, and the other end is probed instead
+ * (see `probeLink()`).
+ *
+ * @return 0 on success, -1 on error.
+ */
+int takeLinkDown() {
+  printf("Nothing heard for %.0f ms, the link is down.\n",
+         millisecondsSince(&context->heardAt));
+  traceInstant("link down", "outstanding", outstandingFrames());
+  context->linkDown = TRUE;
+  context->statistics.linkDowns++;
+  clock_gettime(CLOCK_MONOTONIC, &context->downAt);
+  for (unsigned char ns = context->windowBase; ns != context->nextSequence;
+       ns = (ns + 1) % sequenceModulus())
+    disarmTimer(ns);
+  return sendProbe();
+}
+
+/**
+ * @brief Probes the other end while the link is down, when the timer of the
+ * next probe expired.
+ *
+ * Once the link was given up the timer keeps running without probes, so the
+ * next calls (from `llclose()`) fail as well instead of waiting forever.
+ *
+ * @return 0 on success, -1 on error or once the link stayed down for
+ * `linkDownLimit` seconds.
+ */
+int probeLink() {
+  if (!timerExpired(LINK_TIMER))
+    return 0;
+  if (context->options.linkDownLimit > 0 &&
+      millisecondsSince(&context->downAt) >=
+          context->options.linkDownLimit * 1000.0) {
+    printf("The link stayed down for %d s, giving up.\n",
+           context->options.linkDownLimit);
+    armTimer(LINK_TIMER, context->options.keepalive * 1000L);
+    return -1;
+  }
+  return sendProbe();
+}
+
+/**
+ * @brief Brings the link back up once a frame came from the other end.
+ *
+ * The frames still outstanding, from the last one acknowledged, are sent
+ * again right away, with the timeout the RTT estimates give (it backed off
+ * while the line was silent).
+ *
+ * @return 0 on success, -1 on error.
+ */
+int restoreLink() {
+  double downMs = millisecondsSince(&context->downAt);
+  printf("Link up again after %.0f ms, resending %d frames.\n", downMs,
+         outstandingFrames());
+  traceInstant("link up", "down_ms", (long)downMs);
+  context->linkDown = FALSE;
+  context->silentTimeouts = 0;
+  context->timeoutCount = 0;
+  context->statistics.linkDownMs += downMs;
+  disarmTimer(LINK_TIMER);
+  if (context->estimator.samples > 0)
+    context->estimator.rto = estimatedTimeout();
+  else
+    resetEstimator();
+  return retransmitWindow(FALSE);
+}
+
+/**
+ * @brief Answers a keepalive probe (or a flow control poll) from the other
+ * end, if `receivedFrame` holds one, with a RR for the next frame expected,
+ * where its sender resumes (a RNR while the receiver is busy).
+ *
+ * @return 1 if it was a probe, 0 if not, -1 on error.
+ */
+int answerProbe() {
+  if ((!context->keepalive && !context->flowControl) ||
+      context->receivedFrame.dataSize != 0 ||
+      context->receivedFrame.A != receiveAddress() ||
+      context->receivedFrame.C != PROBE_CONTROL)
+    return 0;
+  unsigned char responseC = supervisoryControl(S_RR, context->expectedSequence);
+  printf("Keepalive probe, answering with 0x%02x\n", responseC);
+  traceInstant("probe answered", "frame", context->expectedSequence);
+  return sendControlFrame(receiveAddress(), responseC) ? -1 : 1;
+}
+
+/**
+ * @brief Checks how long a receiver heard nothing, with keepalive, when the
+ * timer of the check expired.
+ *
+ * The transmitter probes the link while it is down, so a receiver that heard
+ * nothing for `linkDownLimit` seconds gives up like it does.
+ *
+ * @return 0 on success, -1 on error or once it heard nothing for too long.
+ */
+int checkSilence() {
+  if (!context->keepalive || context->duplex || !timerExpired(LINK_TIMER))
+    return 0;
+  if (context->options.linkDownLimit > 0 &&
+      millisecondsSince(&context->heardAt) >=
+          context->options.linkDownLimit * 1000.0) {
+    printf("Nothing heard for %d s, the link is down.\n",
+           context->options.linkDownLimit);
+    armTimer(LINK_TIMER, context->options.keepalive * 1000L);
+    return -1;
+  }
+  return armTimer(LINK_TIMER, context->options.keepalive * 1000L);
+}
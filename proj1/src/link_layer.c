@@ -1,14 +1,29 @@
 // Link layer protocol implementation
 
 #include "../include/link_layer.h"
-#include "../include/serial_port.h"
+#include "../include/bond.h"
+#include "../include/bus.h"
+#include "../include/byte_stuffing.h"
+#include "../include/channels.h"
+#include "../include/crc.h"
+#include "../include/event_loop.h"
+#include "../include/flow_control.h"
+#include "../include/histogram.h"
+#include "../include/keepalive.h"
+#include "../include/link_context.h"
+#include "../include/link_layer_options.h"
+#include "../include/negotiation.h"
+#include "../include/reed_solomon.h"
+#include "../include/serial_line.h"
+#include "../include/trace.h"
 #include <bits/time.h>
 #include <bits/types/struct_timeval.h>
 #include <fcntl.h>
-#include <signal.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <termios.h>
@@ -17,700 +32,3299 @@
 
 // MISC
 #define _POSIX_SOURCE 1 // POSIX compliant source
-#define FLAG_BUFFER_SIZE 5
-
-#define RR0 0xAA
-#define RR1 0xAB
-#define REJ0 0x54
-#define REJ1 0x55
-
-enum states {
-  START,
-  FLAG_RCV,
-  A_RCV,
-  C_RCV,
-  BCC_OK,
-  STOP,
-  DATA,
+
+// Options of a link until `llconfigure()` is called, the ones set by
+// `lldefaultoptions()`: the classic protocol.
+#define DEFAULT_OPTIONS                                                        \
+  {                                                                            \
+    .arq = LlStopAndWait, .windowSize = 1, .fcs = LlFcsXor,                    \
+    .payloadSize = MAX_PAYLOAD_SIZE, .adaptivePayload = FALSE,                 \
+    .fecParity = 0, .fecDepth = 1, .harqIncrement = 0, .duplex = FALSE,        \
+    .resume = FALSE, .keepalive = 0, .linkDownLimit = 60,                      \
+    .timerGranularity = DEFAULT_TIMER_GRANULARITY,                             \
+    .framing = LlFramingStuffing, .station = 0, .receiveQueue = 0,             \
+  }
+
+// Indexed by `LinkLayerFraming`.
+const char *framingNames[] = {"stuffing", "cobs"};
+
+// Indexed by `LinkLayerFcs`.
+const FrameCheck frameChecks[] = {
+    {"xor", xorUpdate, 0, 0, 1},
+    {"crc16", crc16Update, CRC16_INIT, CRC16_FINAL_XOR, 2},
+    {"crc32c", crc32cUpdate, CRC32C_INIT, CRC32C_FINAL_XOR, 4},
 };
 
-typedef struct {
-  int nBytes;                      // Totla bytes sent / received.
-  int rejectedBytes;               // Bytes that were rejected.
-  int nFrames;                     // Total number of frames sent / received.
-  int rejectedFrames;              // Number of rejected frames.
-  size_t filesize;                 // Size of the file, hardcoded.
-  struct timespec globalStart;     // Registered when `llopen()` is called.
-  struct timespec connectionStart; // Registered when `llopen() finishes.`
-} Statistics;
+// Link of the functions without a context argument, the classic API among
+// them.
+LinkContext defaultContext = {
+    .receiverStatistics = &defaultContext.statistics,
+    .line = {.fd = -1},
+    .options = DEFAULT_OPTIONS,
+    .fcs = LlFcsXor,
+    .payloadSize = MAX_PAYLOAD_SIZE,
+    .fecDepth = 1,
+    .receivedFrame = {START},
+    .scheduledChannel = MAX_CHANNELS - 1,
+    .writeChannel = -1,
+};
+// Link the functions act on, in each thread.
+__thread LinkContext *context = &defaultContext;
+
+/**
+ * @brief Returns the largest retransmission timeout, in milliseconds.
+ */
+int maxTimeout() {
+  int maximum = context->parameters.timeout * 1000;
+  return maximum < MIN_RTO_MS ? MIN_RTO_MS : maximum;
+}
+
+/**
+ * @brief Returns the milliseconds elapsed since a given time.
+ *
+ * @param start The start time, from CLOCK_MONOTONIC.
+ */
+double millisecondsSince(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1e3 +
+         (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/**
+ * @brief Starts the adaptive payload size at the classic payload size, or the
+ * negotiated one if it is smaller.
+ */
+void resetPayloadController() {
+  memset(&context->controller, 0, sizeof(context->controller));
+  context->controller.size = context->payloadSize < MAX_PAYLOAD_SIZE
+                                 ? context->payloadSize
+                                 : MAX_PAYLOAD_SIZE;
+}
+
+/**
+ * @brief Counts a transmitted information frame in the adaptive payload size.
+ *
+ * @param frameSize The size of the frame on the wire.
+ */
+void countFrameSent(size_t frameSize) {
+  context->controller.frames++;
+  context->controller.sent++;
+  context->controller.bits += frameSize * 8.0;
+}
+
+/**
+ * @brief Counts information frames that were rejected or timed out.
+ *
+ * Go-Back-N resends the whole window after a REJ, but only one frame was
+ * corrupted, so each REJ, SREJ and expired timer counts once.
+ *
+ * @param frames The number of frames.
+ */
+void countFrameErrors(int frames) { context->controller.errors += frames; }
+
+/**
+ * @brief Returns the probability that a number of bits cross the line intact.
+ *
+ * Computes (1 - ber)^bits by squaring, since the project isn't linked with
+ * the math library.
+ *
+ * @param ber The bit error rate.
+ * @param bits The number of bits.
+ */
+double successProbability(double ber, long bits) {
+  double result = 1;
+  double base = 1 - ber;
+  for (; bits > 0; bits >>= 1) {
+    if (bits & 1)
+      result *= base;
+    base *= base;
+  }
+  return result;
+}
+
+/**
+ * @brief Returns the size of a packet and FCS once encoded with the
+ * negotiated FEC, as carried by the first transmission of a frame.
+ *
+ * @param size The size of the packet and FCS.
+ */
+size_t encodedDataSize(size_t size) {
+  if (context->harqIncrement > 0)
+    return rsPuncturedSize(size, HARQ_PARITY, context->fecParity);
+  return rsEncodedSize(size, context->fecParity);
+}
+
+/**
+ * @brief Returns the probability that a frame is accepted at a bit error rate.
+ *
+ * Without FEC every bit must cross the line intact. With FEC, each codeword
+ * (of the average length in the frame) may have up to `fecParity / 2`
+ * corrupted bytes, the terms of the binomial distribution of the byte errors.
+ * The header must still be intact, and so must the framing: about 4 in 256
+ * corrupted bytes become or were a FLAG or ESC, which shifts the rest of the
+ * frame, so one bit in 64 of the data field isn't protected either.
+ *
+ * @param frameBytes The size of the frame.
+ * @param ber The bit error rate.
+ */
+double frameSuccess(long frameBytes, double ber) {
+  if (context->fecParity == 0)
+    return successProbability(ber, frameBytes * 8);
+
+  long encodedSize = frameBytes > 5 ? frameBytes - 5 : 1;
+  long codewords = (encodedSize + RS_CODEWORD_SIZE - 1) / RS_CODEWORD_SIZE;
+  long length = encodedSize / codewords;
+  double byteError = 1 - successProbability(ber, 8);
+  double term = successProbability(byteError, length);
+  double codewordSuccess = term;
+  for (int errors = 0; errors < context->fecParity / 2 && errors < length;
+       errors++) {
+    term *= (double)(length - errors) / (errors + 1) * byteError /
+            (1 - byteError);
+    codewordSuccess += term;
+  }
+  if (codewordSuccess > 1)
+    codewordSuccess = 1;
+  return successProbability(ber, 5 * 8 + encodedSize / 8) *
+         successProbability(1 - codewordSuccess, codewords);
+}
+
+/**
+ * @brief Estimates the bit error rate from the frames resent so far.
+ *
+ * Finds, by bisection, the rate at which a frame of the average size sent is
+ * corrupted (beyond what the FEC corrects) as often as the frames were
+ * rejected or timed out.
+ *
+ * @return The bit error rate, 0 if no frame was lost.
+ */
+double estimateBitErrorRate() {
+  if (context->controller.errors <= 0 || context->controller.sent <= 0)
+    return 0;
+  double lost = context->controller.errors / context->controller.sent;
+  if (lost > 0.99)
+    lost = 0.99;
+  long frameBytes = context->controller.bits / context->controller.sent / 8;
+
+  double low = 0, high = 0.5;
+  for (int i = 0; i < 60; i++) {
+    double middle = (low + high) / 2;
+    if (1 - frameSuccess(frameBytes, middle) < lost)
+      low = middle;
+    else
+      high = middle;
+  }
+  return low;
+}
+
+/**
+ * @brief Models the goodput of a payload size at a bit error rate.
+ *
+ * A frame carries the payload plus the header, flags, FCS and FEC parity, at
+ * 10 bits per byte on the line, and gets through with probability
+ * `frameSuccess()`. Stop-and-wait idles for a round trip after each frame,
+ * Go-Back-N resends the rest of the window after each corrupted frame, and
+ * Selective Repeat only resends that frame.
+ *
+ * @param payload The payload size.
+ * @param ber The bit error rate.
+ * @return The goodput in bytes per second.
+ */
+double modelGoodput(int payload, double ber) {
+  double rate = context->parameters.baudRate / 10.0;
+  long frameBytes =
+      encodedDataSize(payload + frameChecks[context->fcs].size) + 5;
+  double success = frameSuccess(frameBytes, ber);
+  double lineShare = (double)payload / frameBytes;
+
+  switch (context->options.arq) {
+  case LlStopAndWait:
+    return payload * success /
+        (frameBytes / rate + context->estimator.srtt / 1000);
+  case LlGoBackN:
+    return lineShare * rate * success /
+           (1 + (context->windowSize - 1) * (1 - success));
+  default:
+    return lineShare * rate * success;
+  }
+}
+
+/**
+ * @brief Moves the adaptive payload size towards the best modelled goodput.
+ *
+ * Runs every ADAPT_INTERVAL frames. While no frame is lost the size keeps
+ * growing, since the line is clean enough for larger frames.
+ */
+void adaptPayloadSize() {
+  if (!context->options.adaptivePayload ||
+      context->controller.frames < ADAPT_INTERVAL)
+    return;
+
+  context->controller.ber = estimateBitErrorRate();
+  int target = context->controller.size * ADAPT_MAX_STEP;
+  if (context->controller.ber > 0) {
+    double best = 0;
+    for (int size = MIN_NEGOTIATED_PAYLOAD_SIZE; size <= context->payloadSize;
+         size += ADAPT_GRANULARITY) {
+      double goodput = modelGoodput(size, context->controller.ber);
+      if (goodput > best) {
+        best = goodput;
+        target = size;
+      }
+    }
+  }
+
+  if (target > context->controller.size * ADAPT_MAX_STEP)
+    target = context->controller.size * ADAPT_MAX_STEP;
+  if (target < context->controller.size / ADAPT_MAX_STEP)
+    target = context->controller.size / ADAPT_MAX_STEP;
+  if (target > context->payloadSize)
+    target = context->payloadSize;
+  if (target < MIN_NEGOTIATED_PAYLOAD_SIZE)
+    target = MIN_NEGOTIATED_PAYLOAD_SIZE;
+  if (target != context->controller.size) {
+    printf("Adaptive payload size: %d -> %d bytes (%.1f of %.1f frames lost, "
+           "estimated BER %.2e)\n",
+           context->controller.size, target, context->controller.errors,
+           context->controller.sent, context->controller.ber);
+    context->controller.size = target;
+    context->controller.adjustments++;
+  }
+
+  context->controller.frames = 0;
+  context->controller.sent *= ADAPT_MEMORY;
+  context->controller.errors *= ADAPT_MEMORY;
+  context->controller.bits *= ADAPT_MEMORY;
+}
+
+/**
+ * @brief Queues bytes for the serial port and books their time on the line.
+ *
+ * Each byte takes 10 bits (start, 8 data bits and stop) at the configured
+ * baud rate, after the bytes written before it.
+ *
+ * @param bytes The bytes to send.
+ * @param size The number of bytes.
+ * @param references The reference count of the frame pool buffer holding the
+ * bytes, which are then queued without being copied, or NULL to copy them.
+ * @return 0 on success, -1 on error.
+ */
+int sendToLine(const unsigned char *bytes, size_t size, int *references) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (context->lineFreeAt.tv_sec < now.tv_sec ||
+      (context->lineFreeAt.tv_sec == now.tv_sec &&
+       context->lineFreeAt.tv_nsec < now.tv_nsec))
+    context->lineFreeAt = now;
+  long long nanoseconds =
+      context->lineFreeAt.tv_nsec +
+          (long long)(size * 10 * 1e9 / context->parameters.baudRate);
+  context->lineFreeAt.tv_sec += nanoseconds / 1000000000;
+  context->lineFreeAt.tv_nsec = nanoseconds % 1000000000;
+  context->lineBytes += size;
+  traceInstant("frame queued", "bytes", size);
+  if (references != NULL)
+    return sendBuffer(bytes, size, references);
+  return sendBytes(bytes, size);
+}
+
+/**
+ * @brief Estimates how long the bytes already written take to leave the port.
+ *
+ * Takes the larger of the time booked on the line by `sendToLine()` and the
+ * time of the bytes still queued by the event loop and by the driver. Drivers
+ * and adapters (USB serial, pseudo terminals) may buffer bytes without
+ * reporting them, so the driver queue alone falls short. The booked time is
+ * capped at the time of the bytes that may still be waiting: on a line
+ * faster than the baud rate, the bookings of the frames already acknowledged
+ * would otherwise pile up with every retransmission. At low baud rates a large
+ * frame takes seconds to go out, which has nothing to do with the round trip
+ * time.
+ *
+ * @param inFlight The bytes that may still be waiting: the ones written since
+ * the first transmission of the oldest outstanding frame (the line is first
+ * in, first out, so the bytes before it arrived), or the control frame.
+ * @return The time in microseconds.
+ */
+long transmissionTime(size_t inFlight) {
+  int driverQueue = 0;
+  if (ioctl(context->line.fd, TIOCOUTQ, &driverQueue) == -1)
+    driverQueue = 0;
+  long queued = (long)((pendingBytes() + driverQueue) * 10 * 1e6 /
+                       context->parameters.baudRate);
+  long booked = (long)(-millisecondsSince(&context->lineFreeAt) * 1000);
+  long limit = (long)(inFlight * 10 * 1e6 / context->parameters.baudRate);
+  if (booked > limit)
+    booked = limit;
+  return booked > queued ? booked : queued;
+}
+
+/**
+ * @brief Arms a timer for a frame that was just written.
+ *
+ * The timer runs for the time the frame takes to leave the port plus the
+ * current retransmission timeout.
+ *
+ * @param timer The timer, a sequence number or CONTROL_TIMER.
+ * @param drain The time the frame takes to leave the port, in microseconds.
+ * @return 0 on success, -1 on error.
+ */
+int startTimer(int timer, long drain) {
+  clock_gettime(CLOCK_MONOTONIC, &context->timerArmedAt[timer]);
+  return armTimer(timer, context->estimator.rto * 1000L + drain);
+}
+
+/**
+ * @brief Resets the retransmission timeout estimator.
+ */
+void resetEstimator() {
+  context->estimator.srtt = 0;
+  context->estimator.rttvar = 0;
+  context->estimator.samples = 0;
+  context->estimator.rto =
+      INITIAL_RTO_MS < maxTimeout() ? INITIAL_RTO_MS : maxTimeout();
+}
+
+/**
+ * @brief Returns the retransmission timeout of the current estimates, SRTT +
+ * max(G, 4 RTTVAR), where G is the negotiated timer granularity, within
+ * MIN_RTO_MS and the largest timeout.
+ */
+int estimatedTimeout() {
+  double variation = 4 * context->estimator.rttvar;
+  if (variation < context->timerGranularity / 1000.0)
+    variation = context->timerGranularity / 1000.0;
+  int rto = (int)(context->estimator.srtt + variation + 0.5);
+  if (rto < MIN_RTO_MS)
+    rto = MIN_RTO_MS;
+  return rto > maxTimeout() ? maxTimeout() : rto;
+}
+
+/**
+ * @brief Updates the retransmission timeout with a round trip time sample.
+ *
+ * The first sample sets SRTT = R and RTTVAR = R / 2. The next ones update
+ * RTTVAR = (1 - beta) RTTVAR + beta |SRTT - R| and then SRTT = (1 - alpha)
+ * SRTT + alpha R. The timeout is then `estimatedTimeout()`, which also undoes
+ * any backoff.
+ *
+ * @param rtt The round trip time, in milliseconds.
+ */
+void sampleRoundTrip(double rtt) {
+  // The transmission time is an estimate, so the sample may come out negative.
+  if (rtt < 0)
+    rtt = 0;
+  histogramRecord(&context->histograms.roundTrips, rtt * 1000);
+  if (context->estimator.samples++ == 0) {
+    context->estimator.srtt = rtt;
+    context->estimator.rttvar = rtt / 2;
+  } else {
+    double error = context->estimator.srtt - rtt;
+    context->estimator.rttvar = (1 - RTT_BETA) * context->estimator.rttvar +
+                       RTT_BETA * (error < 0 ? -error : error);
+    context->estimator.srtt =
+        (1 - RTT_ALPHA) * context->estimator.srtt + RTT_ALPHA * rtt;
+  }
+  context->estimator.rto = estimatedTimeout();
+}
+
+/**
+ * @brief Doubles the retransmission timeout after it expired.
+ *
+ * The backed off timeout is kept until a new RTT sample is taken.
+ */
+void backOffTimer() {
+  context->estimator.rto =
+      context->estimator.rto * 2 > maxTimeout() ? maxTimeout()
+          : context->estimator.rto * 2;
+}
+
+/**
+ * @brief Returns the most times a frame may time out: `nRetransmissions`
+ * times at the largest timeout, after the timeouts that back it off there
+ * from MIN_RTO_MS.
+ */
+int timeoutLimit() {
+  int limit = context->parameters.nRetransmissions;
+  for (int rto = MIN_RTO_MS; rto < maxTimeout(); rto *= 2)
+    limit++;
+  return limit;
+}
+
+/**
+ * @brief Counts an expired retransmission timer and backs off the timeout.
+ *
+ * The consecutive timeouts at the largest timeout count towards
+ * `nRetransmissions`, which bounds the time a dead link is waited for, as the
+ * classic fixed timeout did. The faster adaptive ones before them don't, but
+ * a frame that timed out `timeoutLimit()` times is given up even if new RTT
+ * samples (of the frames after it) kept its timeout below the largest.
+ *
+ * A loss event expires the timer of every frame in flight, one after the
+ * other, but is counted and backs off the timeout once (RFC 6298): by a timer
+ * armed after the last timeout counted. The waits recorded for those don't
+ * overlap, so they add up to the time spent waiting for timeouts.
+ *
+ * @param expiries The times the frame timed out, this one included.
+ * @param timer The expired timer of a new loss event, or -1 if the timers
+ * that expired were armed before the last timeout counted.
+ * @return 0 if the frames may be retransmitted, -1 if the retransmissions
+ * were exhausted.
+ */
+int countTimeout(int expiries, int timer) {
+  if (timer >= 0) {
+    if (context->estimator.rto >= maxTimeout())
+      context->timeoutCount++;
+    printf("Timeout! Count: %d\n", context->timeoutCount);
+    traceInstant("timeout", "rto_ms", context->estimator.rto);
+    double waited = millisecondsSince(&context->timerArmedAt[timer]);
+    histogramRecord(&context->histograms.timeouts, (uint64_t)(waited * 1000));
+    clock_gettime(CLOCK_MONOTONIC, &context->timedOutAt);
+  }
+  if (context->timeoutCount > context->parameters.nRetransmissions ||
+      expiries > timeoutLimit())
+    return -1;
+  if (timer >= 0)
+    backOffTimer();
+  return 0;
+}
+
+/**
+ * @brief Returns the size of the sequence number space of the current mode.
+ *
+ * The classic stop-and-wait protocol numbers frames with a single bit, while
+ * the sliding window modes use the 3-bit numbers of the extended control field.
+ */
+unsigned char sequenceModulus() {
+  return context->options.arq == LlStopAndWait ? 2 : SEQUENCE_MODULUS;
+}
+
+/**
+ * @brief Whether the link is a multi-drop bus, see `options.station`.
+ */
+int onBus() { return context->options.station > 0; }
+
+/**
+ * @brief Returns the address of the information frames this end sends, also
+ * carried by their acknowledgements: 0x03 for the transmitter and 0x01 for
+ * the receiver (which only sends them in full duplex). On a multi-drop bus
+ * the transmitter broadcasts them.
+ */
+unsigned char transmitAddress() {
+  if (context->parameters.role == LlTx)
+    return onBus() ? BROADCAST_ADDRESS : 0x03;
+  return 0x01;
+}
+
+/**
+ * @brief Returns the address of the information frames received from the
+ * other end, which this end acknowledges with the same address (see
+ * `responseAddress()`).
+ */
+unsigned char receiveAddress() {
+  if (context->parameters.role == LlTx)
+    return 0x01;
+  return onBus() ? BROADCAST_ADDRESS : 0x03;
+}
+
+/**
+ * @brief Returns the address of the acknowledgements this end sends: that of
+ * the frames received, except on a station of a multi-drop bus, which
+ * answers with its own.
+ */
+unsigned char responseAddress() {
+  if (onBus() && context->parameters.role == LlRx)
+    return STATION_ADDRESS(context->options.station);
+  return receiveAddress();
+}
+
+/**
+ * @brief Returns the address of the SET and UA of a receiver: 0x03, or the
+ * station's own on a multi-drop bus.
+ */
+unsigned char connectionAddress() {
+  return onBus() ? STATION_ADDRESS(context->options.station) : 0x03;
+}
+
+/**
+ * @brief Builds the control field of an information frame.
+ *
+ * In full duplex it also carries N(R), the next frame expected from the other
+ * end, which acknowledges the frames before it.
+ *
+ * @param ns The sequence number of the frame.
+ * @return The control field (0x00 / 0x80 in the classic protocol).
+ */
+unsigned char informationControl(unsigned char ns) {
+  unsigned char nr = context->duplex ? context->expectedSequence : 0;
+  if (context->options.arq == LlStopAndWait)
+    return ns << 7 | nr << 6;
+  return I_CONTROL(ns, nr);
+}
+
+/**
+ * @brief Returns the N(R) carried by the control field of an information
+ * frame, in full duplex.
+ */
+unsigned char informationAcknowledgement(unsigned char C) {
+  return context->options.arq == LlStopAndWait ? SW_NR(C) : CONTROL_NR(C);
+}
+
+/**
+ * @brief Builds the control field of a supervisory frame.
+ *
+ * While the receiver is busy (see `receiverBusy`), a RR is sent as a RNR,
+ * which has the extended control field in stop-and-wait as well.
+ *
+ * @param type The supervisory frame type (S_RR, S_REJ or S_SREJ).
+ * @param nr The sequence number carried by the frame. For RR it is the next
+ * expected frame, for REJ the first frame to be retransmitted.
+ * @return The control field (RR0, RR1, REJ0 or REJ1 in the classic protocol).
+ */
+unsigned char supervisoryControl(int type, unsigned char nr) {
+  if (type == S_RR && context->receiverBusy)
+    return S_CONTROL(S_RNR, nr);
+  if (context->options.arq == LlStopAndWait)
+    return (type == S_RR ? RR0 : REJ0) | nr;
+  return S_CONTROL(type, nr);
+}
+
+/**
+ * @brief Checks whether a control field belongs to an information frame.
+ *
+ * @param C The control field.
+ * @return TRUE if it is an information frame, FALSE otherwise.
+ */
+int isInformationControl(unsigned char C) {
+  if (context->options.arq == LlStopAndWait)
+    return context->duplex ? (C & 0x3F) == 0x00 : C == 0x00 || C == 0x80;
+  return IS_I_CONTROL(C);
+}
+
+/**
+ * @brief Decodes the control field of a supervisory frame.
+ *
+ * @param C The control field.
+ * @param type Where the supervisory frame type will be stored.
+ * @param nr Where the sequence number will be stored.
+ * @return 0 if C is a RR, REJ, (in Selective Repeat) SREJ or (with flow
+ * control) RNR control field, 1 otherwise.
+ */
+int decodeSupervisoryControl(unsigned char C, int *type, unsigned char *nr) {
+  // The classic REJ1 (0x55) reads as a RNR for frame 2, which stop-and-wait
+  // doesn't number.
+  if (context->flowControl && IS_S_CONTROL(C) &&
+      CONTROL_S_TYPE(C) == S_RNR && CONTROL_NR(C) < sequenceModulus()) {
+    *type = S_RNR;
+    *nr = CONTROL_NR(C);
+    return 0;
+  }
+  if (context->options.arq == LlStopAndWait) {
+    if (C != RR0 && C != RR1 && C != REJ0 && C != REJ1)
+      return 1;
+    *type = (C == RR0 || C == RR1) ? S_RR : S_REJ;
+    *nr = C & 0x01;
+    return 0;
+  }
+  if (!IS_S_CONTROL(C) ||
+      (CONTROL_S_TYPE(C) != S_RR && CONTROL_S_TYPE(C) != S_REJ &&
+       !(CONTROL_S_TYPE(C) == S_SREJ &&
+         context->options.arq == LlSelectiveRepeat)))
+    return 1;
+  *type = CONTROL_S_TYPE(C);
+  *nr = CONTROL_NR(C);
+  return 0;
+}
+
+/**
+ * @brief Returns the largest packet of the negotiated payload size.
+ */
+size_t packetLimit() { return context->payloadSize + PACKET_HEADER_SIZE; }
+
+/**
+ * @brief Returns the largest data field of the negotiated payload size, FCS
+ * and FEC included.
+ */
+size_t dataFieldLimit() {
+  return encodedDataSize(packetLimit() + MAX_FCS_SIZE);
+}
+
+/**
+ * @brief Returns the number of frames sent but not yet acknowledged.
+ */
+int outstandingFrames() {
+  return (context->nextSequence - context->windowBase + sequenceModulus()) %
+      sequenceModulus();
+}
+
+/**
+ * @brief Returns the largest data field on the wire for a data field of
+ * `size` bytes, with the negotiated framing: every byte escaped, or a code
+ * byte per COBS_MAX_RUN bytes.
+ */
+size_t stuffedSizeLimit(size_t size) {
+  return context->framing == LlFramingCobs ? COBS_SIZE(size) : size * 2;
+}
+
+/**
+ * @brief Allocates the frame pool for the negotiated payload size.
+ *
+ * Each buffer holds the largest information or redundancy frame, with the
+ * largest overhead of the negotiated framing.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int setupFramePool() {
+  size_t dataField = dataFieldLimit();
+  size_t redundancy =
+      REDUNDANCY_HEADER_SIZE +
+      rsCodewordCount(packetLimit() + MAX_FCS_SIZE, HARQ_PARITY) * HARQ_PARITY;
+  if (redundancy > dataField)
+    dataField = redundancy;
+  context->framePoolFrameSize = stuffedSizeLimit(dataField) + 5;
+
+  free(context->framePoolMemory);
+  context->framePoolMemory =
+      malloc(context->framePoolFrameSize * FRAME_POOL_SIZE);
+  if (context->framePoolMemory == NULL) {
+    perror("Error allocating the frame pool.\n");
+    return -1;
+  }
+  for (int i = 0; i < FRAME_POOL_SIZE; i++) {
+    context->framePool[i].frame =
+        context->framePoolMemory + i * context->framePoolFrameSize;
+    context->framePool[i].references = 0;
+  }
+  for (int ns = 0; ns < SEQUENCE_MODULUS; ns++)
+    context->windowBuffers[ns] = -1;
+  return 0;
+}
+
+/**
+ * @brief Carves `count` buffers of `size` bytes out of a block.
+ *
+ * @param buffers Where the buffers will be stored, set to NULL if they aren't
+ * used.
+ * @param used Whether the buffers are used.
+ * @param block The next free byte of the block, moved past the buffers.
+ */
+void carveBuffers(unsigned char **buffers, int count, size_t size, int used,
+                  unsigned char **block) {
+  for (int i = 0; i < count; i++) {
+    buffers[i] = used ? *block : NULL;
+    if (used)
+      *block += size;
+  }
+}
+
+/**
+ * @brief Allocates the buffers of the negotiated mode and payload size.
+ *
+ * Every link parses data fields into `frameBuffer`. The FEC encoder is only
+ * allocated with FEC or hybrid ARQ, the reorder buffer on a Selective Repeat
+ * or full duplex receiver, and the hybrid ARQ parity of the frames sent and
+ * the copies kept by the receiver with hybrid ARQ. Called once the serial port
+ * is open, for the classic parameters the SET and UA are parsed with, and
+ * again once the connection is negotiated.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int setupBuffers() {
+  int sending = context->parameters.role == LlTx || context->duplex;
+  int receiving = context->parameters.role == LlRx || context->duplex;
+  int encoding = context->fecParity > 0 || context->harqIncrement > 0;
+  int reordering =
+      receiving &&
+      (context->options.arq == LlSelectiveRepeat || context->duplex);
+  int harq = context->harqIncrement > 0;
+  size_t blockSize = packetLimit() + MAX_FCS_SIZE;
+  size_t paritySize = rsCodewordCount(blockSize, HARQ_PARITY) * HARQ_PARITY;
+  // The encoder also builds the redundancy frames.
+  size_t encodedSize = dataFieldLimit();
+  if (REDUNDANCY_HEADER_SIZE + paritySize > encodedSize)
+    encodedSize = REDUNDANCY_HEADER_SIZE + paritySize;
+
+  size_t total = dataFieldLimit();
+  if (encoding)
+    total += blockSize + encodedSize;
+  if (sending && harq)
+    total += SEQUENCE_MODULUS * paritySize;
+  if (reordering)
+    total += SEQUENCE_MODULUS * packetLimit();
+  if (receiving && harq)
+    total += SEQUENCE_MODULUS * (blockSize + paritySize);
+  free(context->bufferMemory);
+  context->bufferMemory = malloc(total);
+  if (context->bufferMemory == NULL) {
+    perror("Error allocating the link buffers.\n");
+    return -1;
+  }
+
+  unsigned char *block = context->bufferMemory;
+  carveBuffers(&context->frameBuffer, 1, dataFieldLimit(), TRUE, &block);
+  carveBuffers(&context->fecData, 1, blockSize, encoding, &block);
+  carveBuffers(&context->fecEncoded, 1, encodedSize, encoding, &block);
+  carveBuffers(context->windowParity, SEQUENCE_MODULUS, paritySize,
+               sending && harq, &block);
+  carveBuffers(context->reorderPackets, SEQUENCE_MODULUS, packetLimit(),
+               reordering, &block);
+  carveBuffers(context->harqData, SEQUENCE_MODULUS, blockSize,
+               receiving && harq, &block);
+  carveBuffers(context->harqParity, SEQUENCE_MODULUS, paritySize,
+               receiving && harq, &block);
+  return 0;
+}
+
+/**
+ * @brief Takes a free buffer of the frame pool.
+ *
+ * If every buffer is in use, waits for the serial port to take the queued
+ * frames.
+ *
+ * @return The index of the buffer, or -1 on error.
+ */
+int acquireFrameBuffer() {
+  while (TRUE) {
+    for (int i = 0; i < FRAME_POOL_SIZE; i++) {
+      if (context->framePool[i].references == 0) {
+        context->framePool[i].references = 1;
+        return i;
+      }
+    }
+    if (waitForOutput())
+      return -1;
+  }
+}
+
+/**
+ * @brief Gives back a buffer of the frame pool, which is free once the queued
+ * copies of its frame are written.
+ *
+ * @param buffer The index of the buffer, set to -1. Nothing is done if it is
+ * already -1.
+ */
+void releaseFrameBuffer(int *buffer) {
+  if (*buffer < 0)
+    return;
+  context->framePool[*buffer].references--;
+  *buffer = -1;
+}
+
+/**
+ * @brief Sends a control frame.
+ *
+ * This function constructs a control frame with the given address (A) and
+ * control (C) fields, calculates the Block Check Character (BCC), and sends the
+ * frame through a file descriptor.
+ *
+ * @param A The address field of the control frame.
+ * @param C The control field of the control frame.
+ * @return int Returns 0 on success, or -1 on failure.
+ */
+int sendControlFrame(unsigned char A, unsigned char C) {
+  unsigned char frame[5] = {0x7E, A, C, 0, 0x7E};
+  frame[3] = frame[1] ^ frame[2];
+
+  if (sendToLine(frame, 5, NULL)) {
+    perror("Error sending control frame!\n");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Folds bytes into a BCC2, the XOR of every byte.
+ *
+ * @param check The running BCC2.
+ * @param bytes The bytes to fold in.
+ * @param size The number of bytes.
+ * @return The updated BCC2.
+ */
+uint32_t xorUpdate(uint32_t check, const unsigned char *bytes, size_t size) {
+  unsigned char bcc2 = check;
+  for (size_t i = 0; i < size; i++) {
+    bcc2 ^= bytes[i];
+  }
+  return bcc2;
+}
+
+/**
+ * @brief Wraps a stuffed data field with the header and the flags.
+ *
+ * @param A The address field.
+ * @param C The control field.
+ * @param frame The frame, whose data field was stuffed at `frame + 4`.
+ * @param dataFieldSize The size of the stuffed data field.
+ * @return The size of the frame.
+ */
+size_t wrapFrame(unsigned char A, unsigned char C, unsigned char *frame,
+                 size_t dataFieldSize) {
+  size_t frameSize = dataFieldSize + 5;
+  frame[0] = 0x7E;
+  frame[1] = A;
+  frame[2] = C;
+  frame[3] = A ^ C;
+  frame[frameSize - 1] = 0x7E;
+  return frameSize;
+}
+
+/**
+ * @brief Builds a frame with a data field.
+ *
+ * The data is stuffed while its FCS is computed, in a single pass, then the
+ * FCS is stuffed after it and everything is wrapped with the header and the
+ * flags.
+ *
+ * @param A The address field.
+ * @param C The control field.
+ * @param data The data field, without the FCS.
+ * @param dataSize The size of the data field.
+ * @param type The frame check sequence to append.
+ * @param framing The framing of the data field. With COBS the data and the
+ * FCS are encoded in one go, the FCS folded as the data is copied too.
+ * @param frame The buffer where the frame will be built, which must hold
+ * (dataSize + FCS size) * 2 + 5 bytes.
+ * @return The size of the frame, or 0 on error.
+ */
+size_t buildFrame(unsigned char A, unsigned char C, const unsigned char *data,
+                  size_t dataSize, LinkLayerFcs type, LinkLayerFraming framing,
+                  unsigned char *frame) {
+  const FrameCheck *check = &frameChecks[type];
+  uint32_t value = check->init;
+  size_t dataFieldSize, fcsFieldSize;
+  CobsEncoder encoder;
+
+  if (framing == LlFramingCobs) {
+    cobsStart(&encoder, frame + 4);
+    cobsUpdate(&encoder, data, dataSize, check->update, &value);
+  } else if (stuffPacketWithCheck(data, dataSize, frame + 4, &dataFieldSize,
+                                  check->update, &value)) {
+    perror("Error stuffing packet!\n");
+    return 0;
+  }
+  value ^= check->finalXor;
+
+  unsigned char fcsBytes[MAX_FCS_SIZE];
+  for (size_t i = 0; i < check->size; i++)
+    fcsBytes[i] = value >> (8 * i);
+  if (framing == LlFramingCobs) {
+    cobsUpdate(&encoder, fcsBytes, check->size, NULL, NULL);
+    return wrapFrame(A, C, frame, cobsFinish(&encoder));
+  }
+  stuffPacket(fcsBytes, check->size, frame + 4 + dataFieldSize, &fcsFieldSize);
+  return wrapFrame(A, C, frame, dataFieldSize + fcsFieldSize);
+}
+
+/**
+ * @brief Stuffs a data field that is already complete (encoded with FEC, or
+ * of a redundancy frame) with the negotiated framing.
+ *
+ * @param data The data field.
+ * @param dataSize The size of the data field.
+ * @param field Where the stuffed data field will be stored.
+ * @param fieldSize Where its size will be stored.
+ * @return 0 on success, -1 on error.
+ */
+int stuffDataField(const unsigned char *data, size_t dataSize,
+                   unsigned char *field, size_t *fieldSize) {
+  if (context->framing == LlFramingCobs)
+    return cobsEncode(data, dataSize, field, fieldSize) ? -1 : 0;
+  return stuffPacket(data, dataSize, field, fieldSize) ? -1 : 0;
+}
+
+/**
+ * @brief Builds a frame whose data field is protected by the negotiated FEC.
+ *
+ * The data and its FCS are encoded into Reed-Solomon codewords, which are
+ * interleaved, stuffed (with the negotiated framing) and wrapped with the
+ * header and the flags. With hybrid
+ * ARQ the codewords have HARQ_PARITY parity bytes, of which only the first
+ * `fecParity` are sent, and all of them are kept for the redundancy frames.
+ *
+ * @param A The address field.
+ * @param C The control field.
+ * @param data The data field, without the FCS.
+ * @param dataSize The size of the data field.
+ * @param parity Where the hybrid ARQ parity is kept, HARQ_PARITY bytes per
+ * codeword (unused without hybrid ARQ).
+ * @param frame The buffer where the frame will be built, a buffer of the frame
+ * pool.
+ * @return The size of the frame, or 0 on error.
+ */
+size_t buildEncodedFrame(unsigned char A, unsigned char C,
+                         const unsigned char *data, size_t dataSize,
+                         unsigned char *parity, unsigned char *frame) {
+  const FrameCheck *check = &frameChecks[context->fcs];
+  uint32_t value =
+      check->update(check->init, data, dataSize) ^ check->finalXor;
+  memcpy(context->fecData, data, dataSize);
+  for (size_t i = 0; i < check->size; i++)
+    context->fecData[dataSize + i] = value >> (8 * i);
+
+  size_t blockSize = dataSize + check->size;
+  size_t encodedSize = encodedDataSize(blockSize);
+  if (context->harqIncrement > 0) {
+    rsEncodeParity(context->fecData, blockSize, HARQ_PARITY, parity);
+    rsInterleave(context->fecData, parity, blockSize, HARQ_PARITY, 0,
+                 context->fecParity, context->fecDepth, context->fecEncoded);
+  } else {
+    rsEncodeBlock(context->fecData, blockSize, context->fecParity,
+                  context->fecDepth, context->fecEncoded);
+  }
+
+  size_t dataFieldSize;
+  if (stuffDataField(context->fecEncoded, encodedSize, frame + 4,
+                     &dataFieldSize)) {
+    perror("Error stuffing packet!\n");
+    return 0;
+  }
+  return wrapFrame(A, C, frame, dataFieldSize);
+}
+
+/**
+ * @brief Verifies the FCS at the end of a destuffed data field.
+ *
+ * @param data The data field, followed by the FCS.
+ * @param dataSize The size of the data field, FCS included.
+ * @param type The frame check sequence in use.
+ * @return TRUE if the FCS matches, FALSE otherwise.
+ */
+int checkFrame(const unsigned char *data, size_t dataSize, LinkLayerFcs type) {
+  const FrameCheck *check = &frameChecks[type];
+  if (dataSize < check->size)
+    return FALSE;
+
+  size_t packetSize = dataSize - check->size;
+  uint32_t value =
+      check->update(check->init, data, packetSize) ^ check->finalXor;
+  uint32_t received = 0;
+  for (size_t i = 0; i < check->size; i++)
+    received |= (uint32_t)data[packetSize + i] << (8 * i);
+  return value == received;
+}
+
+/**
+ * @brief Corrects a data field with the negotiated FEC and verifies its FCS.
+ *
+ * Without FEC only the FCS is verified. With FEC the codewords are corrected
+ * in place and the packet and FCS are moved to the start of the data field.
+ * The frame is rejected if any codeword has more errors than the FEC
+ * corrects, even if the FCS happens to match.
+ *
+ * @param data The destuffed data field.
+ * @param dataSize The size of the data field, set to the size of the packet
+ * and FCS.
+ * @return TRUE if the FCS matches, FALSE otherwise.
+ */
+int repairFrame(unsigned char *data, size_t *dataSize) {
+  if (context->fecParity == 0)
+    return checkFrame(data, *dataSize, context->fcs);
+
+  int corrected =
+      rsDecodeBlock(data, *dataSize, context->fecParity, context->fecDepth);
+  *dataSize = rsBlockSize(*dataSize, context->fecParity);
+  if (corrected < 0 || !checkFrame(data, *dataSize, context->fcs)) {
+    context->receiverStatistics->uncorrectableFrames++;
+    return FALSE;
+  }
+  if (corrected > 0) {
+    context->receiverStatistics->repairedFrames++;
+    context->receiverStatistics->correctedBytes += corrected;
+    printf("FEC corrected %d bytes\n", corrected);
+  }
+  return TRUE;
+}
+
+/**
+ * @brief Combines a frame with the copy kept for its sequence number, and
+ * verifies its FCS.
+ *
+ * With hybrid ARQ, an information frame replaces the copy kept for its
+ * sequence number, and a redundancy frame adds its parity bytes to it. The
+ * copy is corrected with every parity byte received so far, the others being
+ * erasures, and is kept (until `harqBlockSizes` is cleared) unless it is
+ * valid, or its size doesn't match the one the redundancy frame announces.
+ *
+ * @param ns The sequence number of the frame.
+ * @param redundancy TRUE for a redundancy frame, which needs a kept copy.
+ * @param data The destuffed data field, set to the packet and FCS.
+ * @param dataSize The size of the data field, set to the size of the packet
+ * and FCS.
+ * @return TRUE if the FCS matches, FALSE otherwise.
+ */
+int combineFrame(unsigned char ns, int redundancy, const unsigned char **data,
+                 size_t *dataSize) {
+  const unsigned char *field = *data;
+  size_t blockSize;
+
+  if (redundancy) {
+    blockSize = context->harqBlockSizes[ns];
+    context->receiverStatistics->redundancyFrames++;
+    if (*dataSize < REDUNDANCY_HEADER_SIZE)
+      return FALSE;
+    int from = field[0];
+    int to = field[1];
+    if ((field[0] ^ field[1] ^ field[2] ^ field[3]) != field[4] || from >= to ||
+        to > HARQ_PARITY)
+      return FALSE;
+    // Bytes were inserted into or removed from the copy (an error created or
+    // removed a FLAG or ESC), no parity will correct it.
+    if ((size_t)(field[2] << 8 | field[3]) != (blockSize & 0xFFFF)) {
+      context->harqBlockSizes[ns] = 0;
+      return FALSE;
+    }
+    if (*dataSize != REDUNDANCY_HEADER_SIZE +
+                         rsCodewordCount(blockSize, HARQ_PARITY) * (to - from))
+      return FALSE;
+    rsDeinterleave(field + REDUNDANCY_HEADER_SIZE, blockSize, HARQ_PARITY, from,
+                   to, context->fecDepth, NULL, context->harqParity[ns]);
+    context->harqKnown[ns] |=
+        (uint32_t)(((uint64_t)1 << to) - ((uint64_t)1 << from));
+  } else {
+    blockSize =
+        rsPuncturedBlockSize(*dataSize, HARQ_PARITY, context->fecParity);
+    context->harqBlockSizes[ns] = blockSize;
+    if (blockSize == 0)
+      return FALSE;
+    rsDeinterleave(field, blockSize, HARQ_PARITY, 0, context->fecParity,
+                   context->fecDepth, context->harqData[ns],
+                   context->harqParity[ns]);
+    context->harqKnown[ns] =
+        (uint32_t)(((uint64_t)1 << context->fecParity) - 1);
+  }
+
+  *data = context->harqData[ns];
+  *dataSize = blockSize;
+  int corrected = 0;
+  if (context->harqKnown[ns] != 0) {
+    corrected = rsCorrectBlock(context->harqData[ns], context->harqParity[ns],
+                               blockSize, HARQ_PARITY, context->harqKnown[ns],
+                               context->fecData);
+    *data = context->fecData;
+  }
+  if (corrected < 0 || !checkFrame(*data, blockSize, context->fcs)) {
+    if (context->harqKnown[ns] != 0)
+      context->receiverStatistics->uncorrectableFrames++;
+    return FALSE;
+  }
+  if (corrected > 0) {
+    context->receiverStatistics->repairedFrames++;
+    context->receiverStatistics->correctedBytes += corrected;
+    printf("FEC corrected %d bytes\n", corrected);
+  }
+  if (redundancy) {
+    context->receiverStatistics->combinedFrames++;
+    printf("Frame %d recovered with %d parity bytes per codeword\n", ns,
+           __builtin_popcount(context->harqKnown[ns]));
+  }
+  context->harqBlockSizes[ns] = 0;
+  return TRUE;
+}
+
+/**
+ * @brief Parses the next bytes of a COBS data field in `rxBuffer`, for
+ * `receiveFrame()`.
+ *
+ * A code byte starts a run, which is copied in one go, up to the bytes read
+ * so far, and the FLAG it stands for is written once the next code byte
+ * shows that another run follows. A FLAG ends the frame, even within a run,
+ * whose FCS then fails.
+ */
+void parseCobsData() {
+  Frame *frame = &context->receivedFrame;
+  const unsigned char *bytes = context->rxBuffer + context->rxStart;
+  size_t available = context->rxEnd - context->rxStart;
+
+  if (frame->run == 0) {
+    unsigned char code = bytes[0] ^ FLAG;
+    context->rxStart++;
+    frame->stuffedSize++;
+    if (code == 0) {
+      frame->state = STOP;
+      return;
+    }
+    if (frame->flagPending) {
+      if (frame->dataSize == dataFieldLimit()) {
+        frame->state = START;
+        return;
+      }
+      frame->data[frame->dataSize++] = FLAG;
+    }
+    frame->run = code - 1;
+    frame->flagPending = frame->run < COBS_MAX_RUN;
+    return;
+  }
+
+  size_t limit = available < frame->run ? available : frame->run;
+  const unsigned char *flag = memchr(bytes, FLAG, limit);
+  size_t length = flag != NULL ? (size_t)(flag - bytes) : limit;
+  if (frame->dataSize + length > dataFieldLimit()) {
+    // Too long to be a frame, a flag was lost.
+    frame->state = START;
+    return;
+  }
+  memcpy(frame->data + frame->dataSize, bytes, length);
+  frame->dataSize += length;
+  frame->stuffedSize += length;
+  frame->run -= length;
+  context->rxStart += length;
+  if (flag != NULL) {
+    context->rxStart++;
+    frame->stuffedSize++;
+    frame->state = STOP;
+  }
+}
+
+/**
+ * @brief Parses the received bytes until a frame is complete.
+ *
+ * Bytes are read from the serial port in bulk into `rxBuffer` (only when the
+ * buffer is empty, by the event loop, which may instead return because a timer
+ * expired, leaving the callers to check their timers) and fed to a single
+ * state machine shared by every kind of frame. The header is validated with
+ * BCC1, and the data field of information frames is destuffed on the fly: the
+ * runs between escape candidates are found by the byte stuffing kernel (or
+ * the COBS runs read, see `parseCobsData()`) and copied in one go, straight
+ * into `deliveryBuffer` when it is set. The parser state is kept between
+ * calls, so frames may span several reads. While `readingAhead`, the event
+ * loop isn't waited on, and `rxEnd` is left at 0 if no bytes were received.
+ *
+ * @param consumed If not NULL, the number of bytes parsed is added to it.
+ * @return int Returns 1 if `receivedFrame` holds a complete frame (with an
+ * empty data field for control frames), 0 if more bytes are needed (or a
+ * timer expired, or none were received while reading ahead), or -1 on error.
+ */
+int receiveFrame(int *consumed) {
+  if (context->receivedFrame.state == STOP) {
+    context->receivedFrame.state = START;
+    context->receivedFrame.dataSize = 0;
+  }
+
+  if (context->rxStart == context->rxEnd) {
+    int bytes = context->readingAhead
+                    ? pollInput(context->rxBuffer, RX_BUFFER_SIZE)
+                    : waitForInput(context->rxBuffer, RX_BUFFER_SIZE);
+    if (bytes < 0)
+      return -1;
+    if (bytes > 0 && context->keepalive)
+      clock_gettime(CLOCK_MONOTONIC, &context->heardAt);
+    context->rxStart = 0;
+    context->rxEnd = bytes;
+  }
+
+  size_t start = context->rxStart;
+  while (context->rxStart < context->rxEnd &&
+         context->receivedFrame.state != STOP) {
+    if (context->receivedFrame.state == DATA &&
+        context->framing == LlFramingCobs) {
+      parseCobsData();
+      continue;
+    }
+    if (context->receivedFrame.state == DATA) {
+      size_t run = 0;
+      if (!context->receivedFrame.escaped)
+        run =
+            findEscapeCandidate(context->rxBuffer + context->rxStart,
+                                context->rxEnd - context->rxStart);
+      if (context->receivedFrame.dataSize + run > dataFieldLimit()) {
+        // Too long to be a frame, a flag was lost.
+        context->receivedFrame.state = START;
+        continue;
+      }
+      memcpy(context->receivedFrame.data + context->receivedFrame.dataSize,
+             context->rxBuffer + context->rxStart,
+             run);
+      context->receivedFrame.dataSize += run;
+      context->receivedFrame.stuffedSize += run;
+      context->rxStart += run;
+      if (context->rxStart == context->rxEnd)
+        continue;
+
+      unsigned char byte = context->rxBuffer[context->rxStart++];
+      context->receivedFrame.stuffedSize++;
+      if (byte == FLAG) {
+        context->receivedFrame.state = STOP;
+      } else if (context->receivedFrame.escaped) {
+        if (context->receivedFrame.dataSize == dataFieldLimit()) {
+          context->receivedFrame.state = START;
+          continue;
+        }
+        context->receivedFrame.data[context->receivedFrame.dataSize++] =
+            byte ^ 0x20;
+        context->receivedFrame.escaped = FALSE;
+      } else {
+        context->receivedFrame.escaped = TRUE;
+      }
+      continue;
+    }
+
+    unsigned char byte = context->rxBuffer[context->rxStart++];
+    switch (context->receivedFrame.state) {
+    case START:
+      if (byte == FLAG)
+        context->receivedFrame.state = FLAG_RCV;
+      break;
+    case FLAG_RCV:
+      if (byte != FLAG) {
+        context->receivedFrame.A = byte;
+        context->receivedFrame.state = A_RCV;
+      }
+      break;
+    case A_RCV:
+      if (byte == FLAG) {
+        context->receivedFrame.state = FLAG_RCV;
+      } else {
+        context->receivedFrame.C = byte;
+        context->receivedFrame.state = C_RCV;
+      }
+      break;
+    case C_RCV:
+      if (byte == (context->receivedFrame.A ^ context->receivedFrame.C)) {
+        context->receivedFrame.state = BCC_OK;
+      } else if (byte == FLAG) {
+        context->receivedFrame.state = FLAG_RCV;
+      } else {
+        context->receivedFrame.stuffedSize = 0;
+        context->receivedFrame.state = HEADER_ERROR;
+      }
+      break;
+    case HEADER_ERROR:
+      // The rest of the frame is skipped, but a frame that carried data is
+      // counted, to be rejected without waiting for a timeout.
+      if (byte == FLAG) {
+        if (context->receivedFrame.stuffedSize >= MIN_DAMAGED_SIZE) {
+          context->damagedFrames++;
+          context->damagedBytes += context->receivedFrame.stuffedSize + 5;
+        }
+        context->receivedFrame.state = FLAG_RCV;
+      } else if (++context->receivedFrame.stuffedSize > 2 * dataFieldLimit()) {
+        // Too long to be a frame, a flag was lost.
+        context->receivedFrame.state = START;
+      }
+      break;
+    case BCC_OK:
+      if (byte == FLAG) {
+        context->receivedFrame.state = STOP;
+      } else {
+        // The byte is the first of the data field, parse it as such.
+        context->rxStart--;
+        context->receivedFrame.data =
+            context->deliveryBuffer != NULL ? context->deliveryBuffer
+                : context->frameBuffer;
+        context->receivedFrame.dataSize = 0;
+        context->receivedFrame.stuffedSize = 0;
+        context->receivedFrame.escaped = FALSE;
+        context->receivedFrame.run = 0;
+        context->receivedFrame.flagPending = FALSE;
+        context->receivedFrame.state = DATA;
+      }
+      break;
+    default:
+      context->receivedFrame.state = START;
+    }
+  }
+
+  if (consumed != NULL)
+    *consumed += context->rxStart - start;
+  return context->receivedFrame.state == STOP;
+}
+
+/**
+ * @brief Whether an information frame is one accepted already: one of the
+ * window of frames before the expected one.
+ */
+int isDuplicateFrame(unsigned char ns) {
+  int behind =
+      (context->expectedSequence - ns + sequenceModulus()) % sequenceModulus();
+  return behind > 0 && behind <= context->windowSize;
+}
+
+/**
+ * @brief Receives a control frame and validates it against expected values.
+ *
+ * This function parses the frames arriving through the serial port until a
+ * control frame with the expected address (A) and control (C) values provided
+ * as arguments is received. Any other frame is ignored, except that the
+ * information frames from the other end are still acknowledged: in full
+ * duplex as usual, otherwise again if they are duplicates. A new frame, that
+ * the application won't read, is dropped, so its transmitter gives up once
+ * its retransmissions run out instead of taking the RR for a rejection.
+ *
+ * @param expectedA The expected address byte of the control frame.
+ * @param expectedC The expected control byte of the control frame.
+ * @return int Returns 0 on successful reception and validation of the control
+ * frame, or -1 if an error occurs during reading.
+ */
+int receiveControlFrame(unsigned char expectedA, unsigned char expectedC) {
+  unsigned char ns;
+  int redundancy;
+  while (TRUE) {
+    int received = receiveFrame(NULL);
+    if (received < 0 || (!received && checkSilence()) ||
+        (received && (answerProbe() < 0 || answerRepeatedSet() < 0)))
+      return -1;
+    if (received && context->duplex &&
+        (receivePeerFrame() < 0 || flushAcknowledgement(TRUE)))
+      return -1;
+    // Every packet was read, so an information frame behind the expected one
+    // was sent again because its acknowledgement was lost.
+    if (received && !context->duplex &&
+        isReceivedInformation(&ns, &redundancy) && !redundancy &&
+        isDuplicateFrame(ns)) {
+      printf("Duplicate frame %d, approving again with 0x%02x\n", ns,
+             supervisoryControl(S_RR, context->expectedSequence));
+      if (sendReceiveReady())
+        return -1;
+    }
+    if (received && context->receivedFrame.dataSize == 0 &&
+        context->receivedFrame.A == expectedA &&
+        context->receivedFrame.C == expectedC)
+      return 0;
+  }
+}
+
+/**
+ * @brief Sends a frame and waits for an acknowledgment.
+ *
+ * The frame is retransmitted every time its timer expires, with the timeout
+ * backing off, until a frame with the expected address and control fields is
+ * received or the retransmissions are exhausted (see `countTimeout()`). In
+ * full duplex the information frames from the other end are still
+ * acknowledged meanwhile.
+ *
+ * @param frame The frame to be sent, already built.
+ * @param frameSize The size of the frame.
+ * @param expectedA The expected address field of the acknowledgment frame.
+ * @param expectedC The expected control field of the acknowledgment frame.
+ * @param acceptData TRUE if the acknowledgment may carry a data field, which
+ * is left in `receivedFrame`.
+ * @return int Returns 0 if the acknowledgment is received successfully, -1
+ * otherwise.
+ */
+int sendFrameAndAwaitAck(const unsigned char *frame, size_t frameSize,
+                         unsigned char expectedA, unsigned char expectedC,
+                         int acceptData) {
+  int expiries = 0;
+  context->timeoutCount = 0;
+  if (sendToLine(frame, frameSize, NULL) ||
+      startTimer(CONTROL_TIMER, transmissionTime(frameSize)))
+    return -1;
+
+  while (TRUE) {
+    int received = receiveFrame(NULL);
+    if (received < 0)
+      break;
+    if (received && context->duplex &&
+        (receivePeerFrame() < 0 || flushAcknowledgement(TRUE)))
+      break;
+    if (received && (acceptData || context->receivedFrame.dataSize == 0) &&
+        context->receivedFrame.A == expectedA &&
+        context->receivedFrame.C == expectedC) {
+      disarmTimer(CONTROL_TIMER);
+      context->timeoutCount = 0;
+      return 0;
+    }
+
+    if (timerExpired(CONTROL_TIMER)) {
+      if (countTimeout(++expiries, CONTROL_TIMER))
+        break;
+      printf("Retransmitting...\n");
+      if (sendToLine(frame, frameSize, NULL) ||
+          startTimer(CONTROL_TIMER, transmissionTime(frameSize)))
+        break;
+    }
+  }
+  disarmTimer(CONTROL_TIMER);
+  return -1;
+}
+
+/**
+ * @brief Sends a control frame and waits for an acknowledgment.
+ *
+ * This function sends a control frame with the specified address (A) and
+ * control (C) fields, and waits for an acknowledgment frame with the expected
+ * address (expectedA) and control (expectedC) fields. If the acknowledgment is not received within the specified timeout, the control
+ * frame is retransmitted.
+ *
+ * @param A The address field of the control frame to be sent.
+ * @param C The control field of the control frame to be sent.
+ * @param expectedA The expected address field of the acknowledgment frame.
+ * @param expectedC The expected control field of the acknowledgment frame.
+ * @return int Returns 0 if the acknowledgment is received successfully, -1
+ * otherwise.
+ */
+int sendControlAndAwaitAck(unsigned char A, unsigned char C,
+                           unsigned char expectedA, unsigned char expectedC) {
+  unsigned char frame[5] = {0x7E, A, C, A ^ C, 0x7E};
+  return sendFrameAndAwaitAck(frame, sizeof(frame), expectedA, expectedC,
+                              FALSE);
+}
+
+void sendFilesize(size_t filesize) { context->statistics.filesize = filesize; }
+
+int llstatisticsfile(const char *path) {
+  if (path == NULL) {
+    context->statisticsPath[0] = '\0';
+    return 0;
+  }
+  if (strlen(path) >= STATISTICS_PATH_SIZE)
+    return -1;
+  strcpy(context->statisticsPath, path);
+  return 0;
+}
+
+void lldefaultoptions(LinkLayerOptions *linkOptions) {
+  *linkOptions = (LinkLayerOptions)DEFAULT_OPTIONS;
+}
+
+int llconfigure(const LinkLayerOptions *linkOptions) {
+  if (linkOptions == NULL)
+    return -1;
+  if (linkOptions->arq == LlStopAndWait && linkOptions->windowSize != 1)
+    return -1;
+  if (linkOptions->windowSize < 1 ||
+      linkOptions->windowSize > MAX_WINDOW_SIZE)
+    return -1;
+  if (linkOptions->arq == LlSelectiveRepeat &&
+      linkOptions->windowSize > MAX_SELECTIVE_WINDOW_SIZE)
+    return -1;
+  if (linkOptions->fcs < LlFcsXor || linkOptions->fcs > LlFcsCrc32c)
+    return -1;
+  if (linkOptions->framing < LlFramingStuffing ||
+      linkOptions->framing > LlFramingCobs)
+    return -1;
+  if (linkOptions->payloadSize < MIN_NEGOTIATED_PAYLOAD_SIZE ||
+      linkOptions->payloadSize > MAX_NEGOTIATED_PAYLOAD_SIZE)
+    return -1;
+  if (linkOptions->fecParity < 0 || linkOptions->fecParity % 2 != 0 ||
+      linkOptions->fecParity > MAX_FEC_PARITY)
+    return -1;
+  if (linkOptions->fecDepth < 1 || linkOptions->fecDepth > MAX_FEC_DEPTH)
+    return -1;
+  if (linkOptions->harqIncrement < 0 ||
+      linkOptions->harqIncrement > MAX_FEC_PARITY)
+    return -1;
+  if (linkOptions->keepalive < 0 || linkOptions->linkDownLimit < 0)
+    return -1;
+  if (linkOptions->timerGranularity < 1 ||
+      linkOptions->timerGranularity > MAX_TIMER_GRANULARITY)
+    return -1;
+  if (linkOptions->station < 0 || linkOptions->station > MAX_STATIONS)
+    return -1;
+  if (linkOptions->receiveQueue < 0 ||
+      linkOptions->receiveQueue > MAX_RECEIVE_QUEUE)
+    return -1;
+  // Full duplex keeps the packets received until `llread()` takes them
+  // already, and flow controls them by dropping the frames that don't fit.
+  if (linkOptions->receiveQueue > 0 && linkOptions->duplex)
+    return -1;
+  // Each station of a multi-drop bus acknowledges the broadcast frames on its
+  // own, with the RR and SREJ of Selective Repeat.
+  if (linkOptions->station > 0 &&
+      (linkOptions->arq != LlSelectiveRepeat ||
+       linkOptions->harqIncrement > 0 || linkOptions->duplex ||
+       linkOptions->resume || linkOptions->keepalive > 0 ||
+       linkOptions->receiveQueue > 0))
+    return -1;
+  context->options = *linkOptions;
+  return 1;
+}
+
+int llpayloadsize() { return context->payloadSize; }
+
+int llnextpayloadsize() {
+  if (context->options.adaptivePayload && context->bond == NULL &&
+      (context->parameters.role == LlTx || context->duplex))
+    return context->controller.size;
+  return context->payloadSize;
+}
+
+int llreadbuffersize() { return dataFieldLimit(); }
+
+/**
+ * @brief Returns the bytes the speed and efficiency are computed from: those
+ * of the files given to `sendFilesize()`, or else of the packets acknowledged
+ * and read.
+ */
+long transferredBytes() {
+  if (context->statistics.filesize > 0)
+    return context->statistics.filesize;
+  return context->statistics.packetBytes +
+         (context->duplex ? context->duplexStatistics.packetBytes : 0);
+}
+
+/**
+ * @brief Prints the counters of the information frames sent or received and,
+ * for the ones received, those of the FEC and hybrid ARQ.
+ *
+ * A transmitter counts every frame it sent in `nFrames`, the rejected ones
+ * included, and a receiver only the frames it accepted.
+ *
+ * @param statistics The counters.
+ * @param received Whether they count the frames received.
+ * @param suffix Appended to the names of the counters, to tell those of the
+ * frames received apart in full duplex.
+ */
+void printFrameStatistics(const Statistics *statistics, int received,
+                          const char *suffix) {
+  const char *direction = received ? "received" : "sent";
+  int frames =
+      statistics->nFrames + (received ? statistics->rejectedFrames : 0);
+  printf("\tFrames %s: %d\n", direction, frames);
+  printf("\tAccepted frames%s: %d\n", suffix,
+         frames - statistics->rejectedFrames);
+  printf("\tRejected frames%s: %d\n", suffix, statistics->rejectedFrames);
+  printf("\tBytes %s: %d\n", direction, statistics->nBytes);
+  printf("\tAccepted bytes%s: %d\n", suffix,
+         statistics->nBytes - statistics->rejectedBytes);
+  printf("\tRejected bytes%s: %d\n", suffix, statistics->rejectedBytes);
+  printf("\tAverage frame size%s: %f bytes\n", suffix,
+         (float)statistics->nBytes / frames);
+  if (!received)
+    return;
+  if (context->fecParity > 0)
+    printf("\tFrames repaired by the FEC: %d (%d bytes corrected), %d it "
+           "couldn't repair\n",
+           statistics->repairedFrames, statistics->correctedBytes,
+           statistics->uncorrectableFrames);
+  if (context->harqIncrement > 0)
+    printf("\tHybrid ARQ: %d redundancy frames received, %d frames "
+           "recovered with them\n",
+           statistics->redundancyFrames, statistics->combinedFrames);
+}
+
+void printStatistics() {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  float globalDuration =
+      (end.tv_sec - context->statistics.globalStart.tv_sec) +
+      (end.tv_nsec - context->statistics.globalStart.tv_nsec) / 1e9;
+  float duration =
+      (end.tv_sec - context->statistics.connectionStart.tv_sec) +
+      (end.tv_nsec - context->statistics.connectionStart.tv_nsec) / 1e9;
+  printf("\nSTATISTICS\n");
+  printf("\tRole: %s%s\n",
+         context->parameters.role == LlTx ? "Transmitter" : "Receiver",
+         context->duplex ? " (full duplex)" : "");
+  printf("\tGlobal duration: %fs\n", globalDuration);
+  printf("\tTransmission duration: %fs\n", duration);
+  // In full duplex both ends send frames, and the frames received from the
+  // other end are counted apart.
+  int sends = context->parameters.role == LlTx || context->duplex;
+  printFrameStatistics(&context->statistics, !sends, "");
+  printf("\tSpeed: %f bit/s (filesize divided by time)\n",
+         transferredBytes() * 8.0 / duration);
+  printf("\tEfficiency: %f%% (speed / baudrate)\n",
+         (transferredBytes() * 8.0 / duration) /
+             (context->parameters.baudRate) * 100);
+  printf("\tRead system calls: %d\n", eventLoopCounters()->readCalls);
+  printf("\tWrite system calls: %d\n", eventLoopCounters()->writeCalls);
+  printf("\tEvent loop wakeups: %d\n", eventLoopCounters()->wakeups);
+  printf("\tBytes copied into the write queue: %d\n",
+         eventLoopCounters()->copiedBytes);
+  printf("\tFrame check sequence: %s%s%s\n", frameChecks[context->fcs].name,
+         context->fcs == LlFcsCrc32c ? " " : "",
+         context->fcs == LlFcsCrc32c ? crcKernel() : "");
+  printf("\tFraming: %s%s%s\n", framingNames[context->framing],
+         context->framing == LlFramingStuffing ? " " : "",
+         context->framing == LlFramingStuffing ? stuffingKernel() : "");
+  printf("\tPayload size: %d bytes\n", context->payloadSize);
+  if (context->fecParity > 0)
+    printf("\tFEC: %d parity bytes per codeword, interleaving depth %d\n",
+           context->fecParity, context->fecDepth);
+  if (!sends)
+    return;
+  if (context->harqIncrement > 0)
+    printf("\tHybrid ARQ: %d parity bytes per codeword, %d redundancy "
+           "frames sent\n",
+           context->harqIncrement, context->statistics.redundancyFrames);
+  if (context->options.adaptivePayload)
+    printf("\tAdaptive payload size: %d bytes (%d adjustments, estimated "
+           "BER %.2e)\n",
+           context->controller.size, context->controller.adjustments,
+           context->controller.ber);
+  printf("\tSmoothed RTT: %.2f ms (%d samples)\n", context->estimator.srtt,
+         context->estimator.samples);
+  printf("\tRetransmission timeout: %d ms\n", context->estimator.rto);
+  const FrameHistograms *histograms = &context->histograms;
+  if (histograms->roundTrips.total > 0)
+    printf("\tRTT: %.2f / %.2f / %.2f ms (median / 99th percentile / "
+           "largest)\n",
+           histogramPercentile(&histograms->roundTrips, 50) / 1000.0,
+           histogramPercentile(&histograms->roundTrips, 99) / 1000.0,
+           histograms->roundTrips.max / 1000.0);
+  printf("\tTimeouts: %lu (%.2f s waited)\n",
+         (unsigned long)histograms->timeouts.total,
+         histograms->timeouts.sum / 1e6);
+  if (context->keepalive)
+    printf("\tLink down: %d times, %.2f s in all\n",
+           context->statistics.linkDowns,
+           context->statistics.linkDownMs / 1000);
+  if (context->flowControl)
+    printf("\tReceiver not ready: %d times, %.2f s in all, %d frames "
+           "dropped\n",
+           context->statistics.pauses, context->statistics.pausedMs / 1000,
+           context->statistics.overflowFrames);
+  if (histograms->retransmissions.total > 0)
+    printf("\tRetransmissions per frame: %.3f on average, %lu at most\n",
+           histogramMean(&histograms->retransmissions),
+           (unsigned long)histograms->retransmissions.max);
+  if (onBus())
+    printf("\tMulti-drop bus: %d frames resent for a SREJ, %d SREJ already "
+           "answered\n",
+           context->repairsSent, context->naksSuppressed);
+  for (int index = 0; onBus() && index < context->options.station; index++) {
+    const Station *station = &context->stations[index];
+    printf("\tStation %d: %s, %d frames acknowledged, %d SREJ sent\n",
+           index + 1,
+           !station->opened ? "never connected"
+           : station->up    ? "up"
+                            : "dropped",
+           station->acknowledged, station->naks);
+  }
+  for (int channel = 0; context->channelsUsed && channel < MAX_CHANNELS;
+       channel++) {
+    const ChannelStatistics *counters = &context->channelStatistics[channel];
+    if (counters->packets == 0)
+      continue;
+    printf("\tChannel %d (weight %d): %d packets (%d bytes), %d frames "
+           "sent (%d resent), %.2f ms queued and %.2f ms until "
+           "acknowledged on average\n",
+           channel, context->channels[channel].weight, counters->packets,
+           counters->packetBytes, counters->frames, counters->resentFrames,
+           counters->queuedMs / counters->packets,
+           counters->acknowledged > 0
+               ? counters->deliveryMs / counters->acknowledged
+               : 0.0);
+  }
+  if (context->duplex)
+    printFrameStatistics(&context->duplexStatistics, TRUE, " received");
+}
+
+// A number exported by `exportStatistics()`.
+typedef struct {
+  const char *name;
+  double value;
+} StatisticsField;
+
+/**
+ * @brief Collects the numbers exported by `exportStatistics()`.
+ *
+ * The tx counters are those of the information frames sent and the rx ones
+ * those of the information frames received, 0 on an end that doesn't send or
+ * receive any.
+ *
+ * @param fields Where the numbers are stored.
+ * @param closed Whether the connection was closed gracefully.
+ * @return The number of fields stored.
+ */
+int collectStatistics(StatisticsField *fields, int closed) {
+  const Statistics none = {0};
+  const Statistics *sent = context->parameters.role == LlTx || context->duplex
+                               ? &context->statistics
+                               : &none;
+  const Statistics *received =
+      context->duplex                    ? &context->duplexStatistics
+      : context->parameters.role == LlRx ? &context->statistics
+                                         : &none;
+  double duration =
+      millisecondsSince(&context->statistics.connectionStart) / 1000;
+  double speed = duration > 0 ? transferredBytes() * 8.0 / duration : 0;
+  int count = 0;
+#define FIELD(fieldName, fieldValue)                                           \
+  fields[count++] = (StatisticsField){fieldName, fieldValue}
+  FIELD("closed", closed);
+  FIELD("baud_rate", context->parameters.baudRate);
+  FIELD("protocol_version", context->version);
+  FIELD("window", context->windowSize);
+  FIELD("payload_size", context->payloadSize);
+  FIELD("fec_parity", context->fecParity);
+  FIELD("fec_depth", context->fecDepth);
+  FIELD("harq_increment", context->harqIncrement);
+  FIELD("duplex", context->duplex);
+  FIELD("global_duration_s",
+        millisecondsSince(&context->statistics.globalStart) / 1000);
+  FIELD("duration_s", duration);
+  FIELD("tx_frames", sent->nFrames);
+  FIELD("tx_rejected_frames", sent->rejectedFrames);
+  FIELD("tx_bytes", sent->nBytes);
+  FIELD("tx_rejected_bytes", sent->rejectedBytes);
+  FIELD("tx_packet_bytes", sent->packetBytes);
+  FIELD("tx_redundancy_frames", sent->redundancyFrames);
+  FIELD("rx_frames", received->nFrames + received->rejectedFrames);
+  FIELD("rx_rejected_frames", received->rejectedFrames);
+  FIELD("rx_bytes", received->nBytes);
+  FIELD("rx_rejected_bytes", received->rejectedBytes);
+  FIELD("rx_packet_bytes", received->packetBytes);
+  FIELD("rx_repaired_frames", received->repairedFrames);
+  FIELD("rx_uncorrectable_frames", received->uncorrectableFrames);
+  FIELD("rx_combined_frames", received->combinedFrames);
+  FIELD("file_bytes", context->statistics.filesize);
+  FIELD("speed_bps", speed);
+  FIELD("efficiency_percent", speed / context->parameters.baudRate * 100);
+  FIELD("srtt_ms", context->estimator.srtt);
+  FIELD("rto_ms", context->estimator.rto);
+  FIELD("link_downs", context->statistics.linkDowns);
+  FIELD("link_down_s", context->statistics.linkDownMs / 1000);
+  FIELD("rnr_pauses", context->statistics.pauses);
+  FIELD("rnr_paused_s", context->statistics.pausedMs / 1000);
+  FIELD("rx_overflow_frames", context->statistics.overflowFrames);
+  FIELD("read_calls", eventLoopCounters()->readCalls);
+  FIELD("write_calls", eventLoopCounters()->writeCalls);
+#undef FIELD
+  return count;
+}
+
+/**
+ * @brief Writes a string quoted for JSON or CSV.
+ */
+void writeQuoted(FILE *out, const char *string, int json) {
+  fputc('"', out);
+  for (; *string != '\0'; string++) {
+    if (*string == '"')
+      fputc(json ? '\\' : '"', out);
+    else if (json && *string == '\\')
+      fputc('\\', out);
+    fputc(*string, out);
+  }
+  fputc('"', out);
+}
+
+/**
+ * @brief Writes a record of the statistics of the link, in JSON or CSV.
+ *
+ * A JSON record is an object on a line of its own, with each histogram as an
+ * object holding its count, mean, percentiles, largest value and the buckets
+ * that hold any value, as [low, high, count], so that runs can be merged. A
+ * CSV row holds the same without the buckets, in the columns of the header
+ * written first if `header` is set.
+ *
+ * @param out Where the record is written.
+ * @param json TRUE for JSON, FALSE for CSV.
+ * @param header Whether the CSV header is written first.
+ * @param closed Whether the connection was closed gracefully.
+ */
+void writeStatistics(FILE *out, int json, int header, int closed) {
+  static const double percentiles[] = {50, 90, 99, 99.9};
+  static const char *percentileNames[] = {"p50", "p90", "p99", "p999"};
+  static const char *arqNames[] = {"sw", "gbn", "sr"};
+  const int nPercentiles = sizeof(percentiles) / sizeof(percentiles[0]);
+  const struct {
+    const char *name;
+    const Histogram *histogram;
+  } histograms[] = {
+      {"rtt_us", &context->histograms.roundTrips},
+      {"retransmissions", &context->histograms.retransmissions},
+      {"timeout_us", &context->histograms.timeouts},
+  };
+  const int nHistograms = sizeof(histograms) / sizeof(histograms[0]);
+  StatisticsField fields[48];
+  int nFields = collectStatistics(fields, closed);
+
+  char time[32];
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  strftime(time, sizeof(time), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now.tv_sec));
+  const char *strings[][2] = {
+      {"time", time},
+      {"serial_port", context->parameters.serialPort},
+      {"role", context->parameters.role == LlTx ? "tx" : "rx"},
+      {"arq", arqNames[context->options.arq]},
+      {"fcs", frameChecks[context->fcs].name},
+      {"framing", framingNames[context->framing]},
+  };
+  const int nStrings = sizeof(strings) / sizeof(strings[0]);
+
+  if (!json && header) {
+    for (int i = 0; i < nStrings; i++)
+      fprintf(out, "%s,", strings[i][0]);
+    for (int i = 0; i < nFields; i++)
+      fprintf(out, "%s,", fields[i].name);
+    for (int i = 0; i < nHistograms; i++) {
+      const char *name = histograms[i].name;
+      fprintf(out, "%s_count,%s_mean,", name, name);
+      for (int p = 0; p < nPercentiles; p++)
+        fprintf(out, "%s_%s,", name, percentileNames[p]);
+      fprintf(out, "%s_max%s", name, i < nHistograms - 1 ? "," : "\n");
+    }
+  }
+
+  fputs(json ? "{" : "", out);
+  for (int i = 0; i < nStrings; i++) {
+    if (i > 0)
+      fputc(',', out);
+    if (json)
+      fprintf(out, "\"%s\":", strings[i][0]);
+    writeQuoted(out, strings[i][1], json);
+  }
+  for (int i = 0; i < nFields; i++) {
+    if (json)
+      fprintf(out, ",\"%s\":%.15g", fields[i].name, fields[i].value);
+    else
+      fprintf(out, ",%.15g", fields[i].value);
+  }
+  for (int i = 0; i < nHistograms; i++) {
+    const Histogram *histogram = histograms[i].histogram;
+    if (json)
+      fprintf(out, ",\"%s\":{\"count\":%lu,\"mean\":%.15g", histograms[i].name,
+              (unsigned long)histogram->total, histogramMean(histogram));
+    else
+      fprintf(out, ",%lu,%.15g", (unsigned long)histogram->total,
+              histogramMean(histogram));
+    for (int p = 0; p < nPercentiles; p++) {
+      if (json)
+        fprintf(out, ",\"%s\":", percentileNames[p]);
+      else
+        fputc(',', out);
+      fprintf(out, "%lu",
+              (unsigned long)histogramPercentile(histogram, percentiles[p]));
+    }
+    fprintf(out, json ? ",\"max\":%lu" : ",%lu",
+            (unsigned long)histogram->max);
+    if (!json)
+      continue;
+    fputs(",\"buckets\":[", out);
+    const char *separator = "";
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+      if (histogram->counts[bucket] == 0)
+        continue;
+      fprintf(out, "%s[%lu,%lu,%u]", separator,
+              (unsigned long)histogramBucketLow(bucket),
+              (unsigned long)histogramBucketHigh(bucket),
+              histogram->counts[bucket]);
+      separator = ",";
+    }
+    fputs("]}", out);
+  }
+  fputs(json ? "}\n" : "\n", out);
+}
+
+/**
+ * @brief Appends the statistics of the link to the file set by
+ * `llstatisticsfile()`, if any.
+ *
+ * A path ending in ".json" gets a JSON object per line, any other a CSV row,
+ * under a header if the file was empty (see `writeStatistics()`). The record
+ * is built in memory and written with a single write() to the file opened for
+ * appending, so the records of ends closing at once don't mix, and a mutex
+ * keeps the links of this process from both writing a header.
+ *
+ * @param closed Whether the connection was closed gracefully.
+ */
+void exportStatistics(int closed) {
+  static pthread_mutex_t exportMutex = PTHREAD_MUTEX_INITIALIZER;
+  const char *path = context->statisticsPath;
+  if (path[0] == '\0')
+    return;
+  size_t length = strlen(path);
+  int json = length >= 5 && strcmp(path + length - 5, ".json") == 0;
+
+  pthread_mutex_lock(&exportMutex);
+  int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  struct stat status;
+  char *record = NULL;
+  size_t recordSize = 0;
+  FILE *out = fd >= 0 && fstat(fd, &status) == 0
+                  ? open_memstream(&record, &recordSize)
+                  : NULL;
+  if (out == NULL) {
+    perror("Error exporting the statistics");
+  } else {
+    writeStatistics(out, json, status.st_size == 0, closed);
+    fclose(out);
+    if (write(fd, record, recordSize) != (ssize_t)recordSize)
+      perror("Error exporting the statistics");
+  }
+  free(record);
+  if (fd >= 0)
+    close(fd);
+  pthread_mutex_unlock(&exportMutex);
+}
+
+////////////////////////////////////////////////
+// LLOPEN
+////////////////////////////////////////////////
+
+/**
+ * @brief Opens the link: its serial port, or the member links of a bond, and
+ * the connection, negotiating the parameters.
+ *
+ * @param connectionParameters The parameters of the connection.
+ * @return 0 on success, -1 on error.
+ */
+int openLink(LinkLayer connectionParameters) {
+  context->parameters = connectionParameters;
+  context->windowBase = 0;
+  context->nextSequence = 0;
+  context->expectedSequence = 0;
+  context->rejectSent = FALSE;
+  context->acknowledgementPending = FALSE;
+  context->deliverSequence = 0;
+  context->rxStart = context->rxEnd = 0;
+  context->lineFreeAt = (struct timespec){0, 0};
+  context->lineBytes = 0;
+  context->receivedFrame.state = START;
+  memset(context->reorderReceived, 0, sizeof(context->reorderReceived));
+  memset(context->srejSent, 0, sizeof(context->srejSent));
+  context->timeoutCount = 0;
+  Capabilities classic;
+  classicCapabilities(&classic);
+  applyCapabilities(&classic);
+  context->uaFrameSize = 0;
+  resetEstimator();
+  resetChannels();
+  clock_gettime(CLOCK_MONOTONIC, &context->statistics.globalStart);
+  if (context->bondPortCount > 0)
+    return onBus() ? -1 : openBond(connectionParameters);
+
+  int fd = serialLineOpen(&context->line, connectionParameters.serialPort,
+                          connectionParameters.baudRate);
+  if (fd < 0 || eventLoopOpen(fd) || setupBuffers()) {
+    return -1;
+  }
+
+  context->linkDown = FALSE;
+  context->silentTimeouts = 0;
+  memset(context->harqBlockSizes, 0, sizeof(context->harqBlockSizes));
+  if (connectionParameters.role == LlTx) { // Transmitter
+    Capabilities settled;
+    if (onBus()) {
+      if (openStations())
+        return -1;
+    } else if (classicOptions()) {
+      // Sends control frame with A=0x03 and C=0x03 and waits for a response
+      // with A=0x03 and C=0x07.
+      if (sendControlAndAwaitAck(0x03, 0x03, 0x03, 0x07))
+        return -1;
+    } else if (negotiateParameters(0x03, &settled)) {
+      return -1;
+    } else {
+      applyCapabilities(&settled);
+    }
+    context->statistics.nFrames++;
+    context->statistics.nBytes += 5;
+    printf("Control frame sent and received correctly, connection established "
+           "successfully.\n");
+  } else {
+    // Waits for a SET (A=0x03, C=0x03) and responds with a UA (A=0x03,
+    // C=0x07), extended if the SET was. A station of a multi-drop bus uses
+    // its own address instead.
+    if (acceptParameters())
+      return -1;
+    context->statistics.nFrames++;
+    context->statistics.nBytes += 5;
+    printf("Control frame received and sent correctly, connection established "
+           "successfully.\n");
+  }
+  printf("Frame check sequence: %s, payload size: %d bytes\n",
+         frameChecks[context->fcs].name, context->payloadSize);
+  if (context->framing == LlFramingCobs)
+    printf("COBS framing\n");
+  if (context->fecParity > 0)
+    printf("FEC: %d parity bytes per codeword, interleaving depth %d\n",
+           context->fecParity, context->fecDepth);
+  if (context->harqIncrement > 0)
+    printf("Hybrid ARQ: %d parity bytes per codeword per redundancy frame\n",
+           context->harqIncrement);
+  if (context->version > CLASSIC_VERSION)
+    printf("Protocol version %d, window size: %d, timer granularity: %d us\n",
+           context->version, context->windowSize, context->timerGranularity);
+  if (context->duplex)
+    printf("Full duplex\n");
+  if (context->flowControl && connectionParameters.role == LlRx)
+    printf("Flow control, receive queue of %d packets\n",
+           context->options.receiveQueue);
+  else if (context->flowControl)
+    printf("Flow control\n");
+  if (onBus() && connectionParameters.role == LlTx)
+    printf("Multi-drop bus, %d of %d stations connected\n",
+           context->stationsUp, context->options.station);
+  else if (onBus())
+    printf("Multi-drop bus, station %d\n", context->options.station);
+  if (context->keepalive) {
+    printf("Keepalive probes every %d ms\n", context->options.keepalive);
+    clock_gettime(CLOCK_MONOTONIC, &context->heardAt);
+    // A receiver checks how long it heard nothing at the same pace.
+    if (connectionParameters.role == LlRx && !context->duplex &&
+        armTimer(LINK_TIMER, context->options.keepalive * 1000L))
+      return -1;
+  }
+  memset(&context->duplexStatistics, 0, sizeof(context->duplexStatistics));
+  context->receiverStatistics =
+      context->duplex ? &context->duplexStatistics : &context->statistics;
+  if (setupFramePool() || setupBuffers() || setupReceiveQueue())
+    return -1;
+  resetPayloadController();
+  context->damagedFrames = 0;
+  context->damagedBytes = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &context->statistics.connectionStart);
+  return 0;
+}
+
+int llopen(LinkLayer connectionParameters) {
+  traceBegin("llopen");
+  int result = openLink(connectionParameters);
+  traceEnd("llopen", "result", result);
+  return result;
+}
+
+/**
+ * @brief Builds an information frame in the transmission window.
+ *
+ * The packet is followed by the negotiated FCS, encoded with the negotiated
+ * FEC if any, stuffed, and wrapped with the header and the flags, in place in
+ * a buffer of the frame pool. The buffer is held by the window slot of its
+ * sequence number so it can be retransmitted until it is acknowledged, along
+ * with its hybrid ARQ parity.
+ *
+ * @param buf The packet to be sent.
+ * @param bufSize The size of the packet.
+ * @param ns The sequence number of the frame.
+ * @return 0 on success, -1 on error.
+ */
+int buildInformationFrame(const unsigned char *buf, int bufSize,
+                          unsigned char ns) {
+  releaseFrameBuffer(&context->windowBuffers[ns]);
+  context->windowBuffers[ns] = acquireFrameBuffer();
+  if (context->windowBuffers[ns] < 0)
+    return -1;
+  unsigned char *frame = context->framePool[context->windowBuffers[ns]].frame;
+  context->windowBlockSizes[ns] = bufSize + frameChecks[context->fcs].size;
+  context->windowParitySent[ns] = context->fecParity;
+  if (context->fecParity > 0 || context->harqIncrement > 0)
+    context->windowFrameSizes[ns] =
+        buildEncodedFrame(transmitAddress(), informationControl(ns), buf,
+                          bufSize,
+                          context->windowParity[ns], frame);
+  else
+    context->windowFrameSizes[ns] =
+        buildFrame(transmitAddress(), informationControl(ns), buf, bufSize,
+                   context->fcs, context->framing, frame);
+  return context->windowFrameSizes[ns] == 0 ? -1 : 0;
+}
+
+/**
+ * @brief Builds the next hybrid ARQ redundancy frame of a frame in the window.
+ *
+ * The frame carries the next `harqIncrement` parity bytes of every codeword
+ * not sent yet, interleaved as in the information frame.
+ *
+ * @param ns The sequence number of the frame.
+ * @param frame The buffer where the frame will be built, a buffer of the frame
+ * pool.
+ * @return The size of the redundancy frame, or 0 on error.
+ */
+size_t buildRedundancyFrame(unsigned char ns, unsigned char *frame) {
+  int from = context->windowParitySent[ns];
+  int to = from + context->harqIncrement < HARQ_PARITY
+               ? from + context->harqIncrement
+               : HARQ_PARITY;
+  size_t blockSize = context->windowBlockSizes[ns];
+  size_t size = REDUNDANCY_HEADER_SIZE +
+                rsCodewordCount(blockSize, HARQ_PARITY) * (to - from);
+  context->fecEncoded[0] = from;
+  context->fecEncoded[1] = to;
+  context->fecEncoded[2] = blockSize >> 8;
+  context->fecEncoded[3] = blockSize;
+  context->fecEncoded[4] = context->fecEncoded[0] ^ context->fecEncoded[1] ^
+                           context->fecEncoded[2] ^ context->fecEncoded[3];
+  rsInterleave(NULL, context->windowParity[ns], blockSize, HARQ_PARITY, from,
+               to, context->fecDepth,
+               context->fecEncoded + REDUNDANCY_HEADER_SIZE);
+
+  size_t dataFieldSize;
+  if (stuffDataField(context->fecEncoded, size, frame + 4, &dataFieldSize))
+    return 0;
+  context->windowParitySent[ns] = to;
+  return wrapFrame(transmitAddress(), IR_CONTROL(ns), frame, dataFieldSize);
+}
+
+/**
+ * @brief Writes a frame for a sequence number of the transmission window to
+ * the serial port, and (re)starts its timer.
+ *
+ * @param ns The sequence number of the frame.
+ * @param buffer The frame pool buffer holding the frame, the information frame
+ * or one of its redundancy frames, which is queued without being copied.
+ * @param frameSize The size of the frame.
+ * @return 0 on success, -1 on error.
+ */
+int transmitFrame(unsigned char ns, int buffer, size_t frameSize) {
+  if (sendToLine(context->framePool[buffer].frame, frameSize,
+                 &context->framePool[buffer].references)) {
+    perror("Error writing stuffed packet.\n");
+    return -1;
+  }
+  if (context->windowTransmissions[ns] == 0)
+    context->windowFirstByte[ns] = context->lineBytes - frameSize;
+  if (context->windowChannel[ns] >= 0) {
+    context->channelStatistics[context->windowChannel[ns]].frames++;
+    if (context->windowTransmissions[ns] > 0)
+      context->channelStatistics[context->windowChannel[ns]].resentFrames++;
+  }
+  // The round trip starts when the frame is expected to have left the port.
+  long drain =
+      transmissionTime(context->lineBytes -
+                       context->windowFirstByte[context->windowBase]);
+  struct timespec *sentAt = &context->windowSentAt[ns];
+  clock_gettime(CLOCK_MONOTONIC, sentAt);
+  long microseconds = sentAt->tv_nsec / 1000 + drain;
+  sentAt->tv_sec += microseconds / 1000000;
+  sentAt->tv_nsec = microseconds % 1000000 * 1000;
+  if (startTimer(ns, drain))
+    return -1;
+  context->windowRto[ns] = context->estimator.rto;
+  context->windowTransmissions[ns]++;
+  context->statistics.nFrames++;
+  context->statistics.nBytes += frameSize;
+  return 0;
+}
+
+/**
+ * @brief Updates the N(R) of a frame of the transmission window, in full
+ * duplex, before it is sent again.
+ *
+ * The N(R) the frame was built with may be stale by now, and in stop-and-wait
+ * it would even acknowledge the wrong frame. If a copy of the frame is still
+ * queued, the frame is first moved to another buffer of the pool, so that the
+ * queued copy is written as it was.
+ *
+ * @param ns The sequence number of the frame.
+ * @return 0 on success, -1 on error.
+ */
+int refreshAcknowledgement(unsigned char ns) {
+  if (context->framePool[context->windowBuffers[ns]].references > 1) {
+    int buffer = acquireFrameBuffer();
+    if (buffer < 0)
+      return -1;
+    memcpy(context->framePool[buffer].frame,
+           context->framePool[context->windowBuffers[ns]].frame,
+           context->windowFrameSizes[ns]);
+    releaseFrameBuffer(&context->windowBuffers[ns]);
+    context->windowBuffers[ns] = buffer;
+  }
+  unsigned char *frame = context->framePool[context->windowBuffers[ns]].frame;
+  frame[2] = informationControl(ns);
+  frame[3] = frame[1] ^ frame[2];
+  return 0;
+}
+
+/**
+ * @brief Writes a frame of the transmission window to the serial port.
+ *
+ * In full duplex the frame acknowledges the frames received so far, so the
+ * deferred RR is no longer needed.
+ *
+ * @param ns The sequence number of the frame.
+ * @return 0 on success, -1 on error.
+ */
+int sendWindowFrame(unsigned char ns) {
+  if (context->duplex && refreshAcknowledgement(ns))
+    return -1;
+  if (transmitFrame(ns, context->windowBuffers[ns],
+                    context->windowFrameSizes[ns]))
+    return -1;
+  countFrameSent(context->windowFrameSizes[ns]);
+  if (context->duplex) {
+    context->acknowledgementPending = FALSE;
+    disarmTimer(ACK_TIMER);
+  }
+  return 0;
+}
+
+/**
+ * @brief Answers the rejection of a frame of the transmission window.
+ *
+ * With hybrid ARQ, if the receiver kept the frame and parity bytes are left,
+ * the next redundancy frame is sent instead of the frame. Otherwise the frame
+ * itself is sent again, and the receiver starts over from it.
+ *
+ * @param ns The sequence number of the frame.
+ * @param combinable TRUE if the receiver kept the rejected frame.
+ * @return 0 on success, -1 on error.
+ */
+int resendFrame(unsigned char ns, int combinable) {
+  traceInstant("retransmit", "frame", ns);
+  if (combinable && context->harqIncrement > 0 &&
+      context->windowParitySent[ns] < HARQ_PARITY) {
+    // The buffer is only held while the redundancy frame is queued.
+    int buffer = acquireFrameBuffer();
+    if (buffer < 0)
+      return -1;
+    size_t frameSize =
+        buildRedundancyFrame(ns, context->framePool[buffer].frame);
+    int failed = frameSize == 0 || transmitFrame(ns, buffer, frameSize);
+    releaseFrameBuffer(&buffer);
+    if (failed)
+      return -1;
+    context->statistics.redundancyFrames++;
+    printf("Sent redundancy for frame %d, %d parity bytes per codeword\n", ns,
+           context->windowParitySent[ns]);
+    return 0;
+  }
+  context->windowParitySent[ns] = context->fecParity;
+  return sendWindowFrame(ns);
+}
+
+/**
+ * @brief Retransmits every outstanding frame, starting at the window base.
+ *
+ * In stop-and-wait there is a single outstanding frame. In Go-Back-N the whole
+ * window is sent again, in order.
+ *
+ * @param combinable TRUE if the receiver kept the frame at the window base,
+ * which may get a redundancy frame instead (see `resendFrame()`).
+ * @return 0 on success, -1 on error.
+ */
+int retransmitWindow(int combinable) {
+  for (unsigned char ns = context->windowBase; ns != context->nextSequence;
+       ns = (ns + 1) % sequenceModulus()) {
+    if (resendFrame(ns, combinable && ns == context->windowBase))
+      return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Slides the window base up to a received sequence number.
+ *
+ * Acknowledgements are cumulative: a RR or REJ carrying `nr` acknowledges
+ * every frame before `nr`. Numbers outside of the outstanding frames (stale or
+ * duplicate acknowledgements) are ignored. Acknowledgements also feed the
+ * retransmission timeout estimator.
+ *
+ * @param nr The sequence number carried by the supervisory frame.
+ * @return The number of frames acknowledged.
+ */
+int acknowledgeFrames(unsigned char nr) {
+  int acknowledged =
+      (nr - context->windowBase + sequenceModulus()) % sequenceModulus();
+  if (acknowledged > outstandingFrames())
+    return 0;
+  // The newest frame acknowledged gives the RTT sample, unless it was resent
+  // (Karn's rule), since the acknowledgement may be for any of its copies.
+  if (acknowledged > 0) {
+    unsigned char newest = (nr + sequenceModulus() - 1) % sequenceModulus();
+    if (context->windowTransmissions[newest] == 1)
+      sampleRoundTrip(millisecondsSince(&context->windowSentAt[newest]));
+  }
+  for (unsigned char ns = context->windowBase; ns != nr;
+       ns = (ns + 1) % sequenceModulus()) {
+    disarmTimer(ns);
+    releaseFrameBuffer(&context->windowBuffers[ns]);
+    context->statistics.packetBytes += context->windowPacketSizes[ns];
+    histogramRecord(&context->histograms.retransmissions,
+                    context->windowTransmissions[ns] - 1);
+    if (context->windowChannel[ns] >= 0) {
+      context->channelStatistics[context->windowChannel[ns]].acknowledged++;
+      context->channelStatistics[context->windowChannel[ns]].deliveryMs +=
+          millisecondsSince(&context->windowQueuedAt[ns]);
+    }
+  }
+  context->windowBase = nr;
+  if (acknowledged > 0) {
+    traceInstant("acknowledged", "frames", acknowledged);
+    traceCounter("outstanding frames", outstandingFrames());
+  }
+  return acknowledged;
+}
+
+/**
+ * @brief Handles the next frame received, or the timers that expired.
+ *
+ * Parses the supervisory frames sent by the receiver. A RR slides the window.
+ * A REJ (or, in stop-and-wait, a RR for the frame in flight) makes every
+ * outstanding frame from the requested one onwards be sent again, while a
+ * SREJ resends only the requested frame. With hybrid ARQ, a rejection of a
+ * frame the receiver kept (any REJ in stop-and-wait, the P/F bit set in the
+ * sliding window modes) gets a redundancy frame instead of the frame (see
+ * `resendFrame()`). Each frame has its own timer: when
+ * it expires, Selective Repeat resends only that frame and the other modes
+ * the whole window, and the timeout backs off until the retransmissions are
+ * exhausted (see `countTimeout()`). In full duplex the frames from the other
+ * end are handled too (see `receivePeerFrame()`), and the deferred RR is sent
+ * when its timer expires. With keepalive, timeouts while the other end is
+ * silent take the link down, and while it is down the other end is probed
+ * instead, until any frame comes back (see `takeLinkDown()`). On a multi-drop
+ * bus the responses come from the stations (see `receiveStationResponse()`),
+ * and the stations that don't acknowledge the oldest frame by the time its
+ * retransmissions were exhausted are dropped (see `dropLaggingStations()`).
+ * With flow control, a RNR pauses the transmission until the receiver is
+ * ready again, polling it instead of retransmitting (see
+ * `paceTransmission()`).
+ *
+ * @return 1 when the window advanced (or, in full duplex, a packet was
+ * received, or, with flow control, the receiver got ready), 0 if it didn't,
+ * -1 on error or if the retransmissions were exhausted.
+ */
+int pollLink() {
+  int type;
+  unsigned char nr;
+  int rejected = FALSE;
+  int combinable = FALSE;
+
+  int received = receiveFrame(
+      context->duplex ? &context->receiverStatistics->nBytes : NULL);
+  if (received < 0 || (context->duplex && rejectDamagedFrames()))
+    return -1;
+  int progress = received && context->duplex ? receivePeerFrame() : 0;
+  if (progress < 0 ||
+      (received && (answerProbe() < 0 || answerRepeatedSet() < 0)))
+    return -1;
+  if (context->duplex && flushAcknowledgement(FALSE))
+    return -1;
+  if (received)
+    context->silentTimeouts = 0;
+  if (context->linkDown) {
+    if (!received)
+      return probeLink() ? -1 : progress;
+    // The answer to a probe acknowledges the frames received meanwhile.
+    if (context->receivedFrame.dataSize == 0 &&
+        context->receivedFrame.A == transmitAddress() &&
+        !decodeSupervisoryControl(context->receivedFrame.C, &type, &nr) &&
+        type != S_SREJ && acknowledgeFrames(nr) > 0)
+      progress = TRUE;
+    if (restoreLink())
+      return -1;
+    return progress || outstandingFrames() == 0;
+  }
+  if (received && onBus()) {
+    progress = receiveStationResponse();
+    if (progress != 0)
+      return progress;
+  }
+  if (received && context->receivedFrame.dataSize == 0 &&
+      context->receivedFrame.A == transmitAddress() &&
+      !decodeSupervisoryControl(context->receivedFrame.C, &type, &nr)) {
+    printf("Received response.\n");
+    combinable = context->options.arq == LlStopAndWait
+                     ? type == S_REJ
+                     : (context->receivedFrame.C & S_PF) != 0;
+    // SREJ doesn't acknowledge anything, `nr` is the missing frame.
+    int acknowledged = type == S_SREJ ? 0 : acknowledgeFrames(nr);
+    if (type == S_RNR || context->peerBusy)
+      return paceTransmission(type, acknowledged);
+
+    if (type == S_RR && acknowledged > 0) {
+      printf("Packet accepted by receiver, proceding to the next.\n");
+      context->timeoutCount = 0;
+      return 1;
+    }
+    if (outstandingFrames() == 0) {
+      context->timeoutCount = 0;
+      return 1;
+    }
+    if (type == S_SREJ) {
+      int missing =
+          (nr - context->windowBase + SEQUENCE_MODULUS) % SEQUENCE_MODULUS;
+      if (missing < outstandingFrames()) {
+        context->timeoutCount = 0;
+        countFrameErrors(1);
+        context->statistics.rejectedFrames++;
+        context->statistics.rejectedBytes += context->windowFrameSizes[nr];
+        printf("Frame %d rejected by receiver, sending it again...\n", nr);
+        traceInstant("SREJ received", "frame", nr);
+        if (resendFrame(nr, combinable))
+          return -1;
+      }
+    } else if (type == S_REJ || context->options.arq == LlStopAndWait) {
+      rejected = TRUE;
+      context->timeoutCount = 0;
+      countFrameErrors(1);
+      context->statistics.rejectedFrames += outstandingFrames();
+      for (unsigned char ns = context->windowBase; ns != context->nextSequence;
+           ns = (ns + 1) % sequenceModulus())
+        context->statistics.rejectedBytes += context->windowFrameSizes[ns];
+      printf("Packet rejected by receiver, trying again...\n");
+      traceInstant("REJ received", "frame", nr);
+    }
+  }
+
+  // The frames aren't timed while the receiver isn't ready.
+  if (context->peerBusy)
+    return pollReceiver() ? -1 : progress;
+
+  // Collect the expired timers first, resending a frame restarts its timer.
+  int expired[SEQUENCE_MODULUS] = {FALSE};
+  int anyExpired = FALSE;
+  int silent = FALSE; // Whether nothing was heard for a whole expired timer.
+  int expiries = 0;   // Most times an expired frame timed out.
+  int lossTimer = -1; // Expired timer armed after the last timeout counted.
+  for (unsigned char ns = context->windowBase; ns != context->nextSequence;
+       ns = (ns + 1) % sequenceModulus()) {
+    expired[ns] = timerExpired(ns);
+    if (expired[ns] && ++context->windowTimeouts[ns] > expiries)
+      expiries = context->windowTimeouts[ns];
+    // The silence is measured against the timeout the timer ran for, which
+    // the expiries of the frames before it may have backed off since.
+    if (expired[ns] &&
+        millisecondsSince(&context->heardAt) >= context->windowRto[ns])
+      silent = TRUE;
+    if (expired[ns] && lossTimer < 0 &&
+        millisecondsSince(&context->timerArmedAt[ns]) <
+            millisecondsSince(&context->timedOutAt))
+      lossTimer = ns;
+    // Only Selective Repeat resends just the expired frames.
+    if (expired[ns] &&
+        (context->options.arq == LlSelectiveRepeat || !anyExpired))
+      countFrameErrors(1);
+    anyExpired |= expired[ns];
+  }
+  if (anyExpired && context->keepalive) {
+    if (silent)
+      context->silentTimeouts++;
+    if (context->silentTimeouts >= LINK_DOWN_TIMEOUTS)
+      return takeLinkDown() ? -1 : progress;
+  }
+  if (anyExpired && countTimeout(expiries, lossTimer)) {
+    int dropped = onBus() ? dropLaggingStations() : -1;
+    if (dropped < 0)
+      return -1;
+    progress = dropped;
+  }
+
+  // A rejection resends the frames right away, without backing off.
+  if (anyExpired || rejected) {
+    printf("Retransmitting packet...\n");
+    if (context->options.arq == LlSelectiveRepeat && !rejected) {
+      for (unsigned char ns = context->windowBase; ns != context->nextSequence;
+           ns = (ns + 1) % sequenceModulus()) {
+        if (expired[ns] && resendFrame(ns, FALSE))
+          return -1;
+      }
+    } else if (retransmitWindow(rejected && combinable)) {
+      return -1;
+    }
+  }
+  return progress;
+}
+
+/**
+ * @brief Waits until at least one outstanding frame is acknowledged, or (in
+ * full duplex) a packet is received from the other end.
+ *
+ * @return 0 on success, -1 on error or if the retransmissions were exhausted.
+ */
+int awaitAcknowledgement() {
+  while (TRUE) {
+    int progress = pollLink();
+    if (progress != 0)
+      return progress < 0 ? -1 : 0;
+  }
+}
+
+/**
+ * @brief Drops the outstanding frames, which the link can no longer deliver.
+ */
+void dropWindow() {
+  for (unsigned char ns = context->windowBase; ns != context->nextSequence;
+       ns = (ns + 1) % sequenceModulus()) {
+    disarmTimer(ns);
+    releaseFrameBuffer(&context->windowBuffers[ns]);
+  }
+  context->windowBase = context->nextSequence;
+}
+
+/**
+ * @brief Waits until every outstanding frame is acknowledged.
+ *
+ * If the receiver stops responding, the outstanding frames are dropped, since
+ * the link can no longer deliver them.
+ *
+ * @return 0 on success, -1 if the retransmissions were exhausted.
+ */
+int flushWindow() {
+  while (outstandingFrames() > 0) {
+    if (awaitAcknowledgement()) {
+      dropWindow();
+      return -1;
+    }
+  }
+  return 0;
+}
+
+////////////////////////////////////////////////
+// LLWRITE
+////////////////////////////////////////////////
+
+/**
+ * @brief Frames a packet and sends it, as `llwrite()` does.
+ *
+ * @param buf The packet.
+ * @param bufSize The size of the packet.
+ * @return The size of the frame, 0 if nothing was written (in full duplex),
+ * or -1 on error.
+ */
+int writePacket(const unsigned char *buf, int bufSize) {
+  if (buf == NULL || (size_t)bufSize > packetLimit()) {
+    return -1;
+  }
+  if (context->bond != NULL)
+    return bondWrite(buf, bufSize);
+
+  // Wait for room in the window (only in Go-Back-N, stop-and-wait always
+  // drains it before returning, except in full duplex, where nothing is
+  // written while the packets received wait to be read), for the link to be
+  // up and for the receiver to be ready.
+  while (outstandingFrames() >= context->windowSize || context->linkDown ||
+         context->peerBusy) {
+    if (llreceivedpackets() > 0)
+      return 0;
+    if (awaitAcknowledgement()) {
+      dropWindow();
+      return -1;
+    }
+  }
 
-Statistics statistics = {0, 0, 0, 0, 10968, 0, 0};
-int alarmEnabled;
-int alarmCount = 0;
-enum states current_state = START;
-LinkLayer parameters;
-int fd;
-unsigned char informationFrameNumber =
-    0; // Used to generate the information frame.
+  unsigned char ns = context->nextSequence;
+  traceBegin("build frame");
+  int built = buildInformationFrame(buf, bufSize, ns);
+  traceEnd("build frame", "bytes", bufSize);
+  if (built)
+    return -1;
+  context->windowTransmissions[ns] = 0;
+  context->windowTimeouts[ns] = 0;
+  context->windowPacketSizes[ns] = bufSize;
+  context->windowChannel[ns] = context->writeChannel;
+  context->windowQueuedAt[ns] = context->writeQueuedAt;
+
+  // Send the packet, which also starts its timer.
+  if (sendWindowFrame(ns))
+    return -1;
+  if (context->writeChannel >= 0)
+    context->channelStatistics[context->writeChannel].queuedMs +=
+        millisecondsSince(&context->writeQueuedAt);
+  context->nextSequence = (context->nextSequence + 1) % sequenceModulus();
+  traceCounter("outstanding frames", outstandingFrames());
+  printf("Packet sent!\n");
+  adaptPayloadSize();
+
+  // A full window must be acknowledged before returning, so stop-and-wait
+  // only returns once the frame was accepted by the receiver. In full duplex
+  // the next call waits for it instead, so that the packets received in the
+  // meantime can be read.
+  while (!context->duplex &&
+         outstandingFrames() >= context->windowSize) {
+    if (awaitAcknowledgement()) {
+      dropWindow();
+      return -1;
+    }
+  }
+  return context->windowFrameSizes[ns];
+}
 
+int llwrite(const unsigned char *buf, int bufSize) {
+  traceBegin("llwrite");
+  int result = writePacket(buf, bufSize);
+  traceEnd("llwrite", "result", result);
+  return result;
+}
 /**
- * @brief Signal handler for alarm signals.
+ * @brief Checks whether the receiver keeps a frame it can't correct, for the
+ * hybrid ARQ redundancy frames.
  *
- * This function is called when an alarm signal is received. It increments the
- * alarm count, enables the alarm flag, and prints the current alarm count.
+ * Stop-and-wait keeps every frame, Go-Back-N only the expected one and
+ * Selective Repeat those in the receive window not received yet.
  *
- * @param signal The signal number.
+ * @param ns The sequence number of the frame.
+ * @return TRUE if the frame is kept, FALSE otherwise.
  */
-void alarmHandler(int signal) {
-  alarmCount++;
-  alarmEnabled = TRUE;
-  printf("Alarm! Count: %d\n", alarmCount);
+int keepsFrame(unsigned char ns) {
+  if (context->harqIncrement == 0)
+    return FALSE;
+  if (context->options.arq == LlStopAndWait)
+    return TRUE;
+  int ahead =
+      (ns - context->expectedSequence + SEQUENCE_MODULUS) % SEQUENCE_MODULUS;
+  if (context->options.arq == LlGoBackN)
+    return ahead == 0;
+  return ahead < context->windowSize && !context->reorderReceived[ns];
 }
 
 /**
- * @brief Disables the alarm.
+ * @brief Builds the control field of a REJ or SREJ in the sliding window
+ * modes, with the P/F bit set if the rejected frame was kept (see
+ * `keepsFrame()`).
  *
- * This function disables the alarm by setting the global variable
- * `alarmEnabled` to FALSE, stopping any active alarm by calling `alarm(0)`, and
- * resetting the `alarmCount` to 0.
+ * @param type S_REJ or S_SREJ.
+ * @param nr The rejected frame.
+ * @return The control field.
  */
-void disableAlarm() {
-  alarmEnabled = FALSE;
-  alarm(0);
-  alarmCount = 0;
+unsigned char rejectControl(int type, unsigned char nr) {
+  unsigned char C = supervisoryControl(type, nr);
+  return context->harqBlockSizes[nr] > 0 ? C | S_PF : C;
 }
 
 /**
- * @brief Stuffs a packet by replacing FLAG and ESC bytes with escape sequences.
+ * @brief Acknowledges the frames accepted from the other end with a RR for
+ * the expected frame.
  *
- * This function processes the input packet and replaces any occurrence of the
- * FLAG byte (0x7E) with the sequence 0x7D5E and any occurrence of the ESC byte
- * (0x7D) with the sequence 0x7D5D. The resulting packet is stored in the
- * provided newPacket buffer.
+ * In full duplex the RR is deferred (see ACK_TIMER), since the next
+ * information frame sent acknowledges them as well.
  *
- * @param packet The input packet to be stuffed.
- * @param packetSize The size of the input packet.
- * @param newPacket The buffer to store the stuffed packet. It should have at
- * least double the size of the input packet to accommodate the worst-case
- * scenario.
- * @param newPacketSize A pointer to a variable where the size of the stuffed
- * packet will be stored.
- * @return 0 on success, 1 if any of the input pointers are NULL.
+ * @return 0 on success, -1 on error.
  */
-int stuffPacket(const unsigned char *packet, size_t packetSize,
-                unsigned char *newPacket, size_t *newPacketSize) {
-  // Assumes newPacket has at least double the size of the packet.
+int sendReceiveReady() {
+  if (!context->duplex)
+    return sendControlFrame(
+        responseAddress(), supervisoryControl(S_RR, context->expectedSequence));
+  if (context->acknowledgementPending)
+    return 0;
+  context->acknowledgementPending = TRUE;
+  return armTimer(ACK_TIMER, transmissionTime(pendingBytes()) +
+                                 ACK_DELAY_MS * 1000L);
+}
 
-  if (packet == NULL || newPacket == NULL || newPacketSize == NULL) {
-    return 1;
-  }
+/**
+ * @brief Sends the RR deferred in full duplex once its timer expired.
+ *
+ * @param now TRUE to send it right away, when no information frame will carry
+ * the acknowledgement.
+ * @return 0 on success, -1 on error.
+ */
+int flushAcknowledgement(int now) {
+  if (!context->acknowledgementPending || (!now && !timerExpired(ACK_TIMER)))
+    return 0;
+  context->acknowledgementPending = FALSE;
+  disarmTimer(ACK_TIMER);
+  unsigned char responseC = supervisoryControl(S_RR, context->expectedSequence);
+  printf("Acknowledging with 0x%02x\n", responseC);
+  return sendControlFrame(responseAddress(), responseC);
+}
 
-  size_t newPacketIndex = 0;
+/**
+ * @brief Checks whether a frame from the other end can be accepted without
+ * overwriting a packet `llread()` didn't take yet, in full duplex.
+ *
+ * The packets waiting for `llread()` and the frame must fit in the sequence
+ * number space, less one number, or a full reorder buffer would look empty.
+ *
+ * @param ns The sequence number of the frame, in the receive window.
+ * @return TRUE if it can, FALSE otherwise.
+ */
+int hasRoomFor(unsigned char ns) {
+  if (!context->duplex)
+    return TRUE;
+  unsigned char modulus = sequenceModulus();
+  int waiting =
+      (context->expectedSequence - context->deliverSequence + modulus) %
+      modulus;
+  int ahead = (ns - context->expectedSequence + modulus) % modulus;
+  return waiting + ahead < modulus - 1;
+}
 
-  for (size_t packetIndex = 0; packetIndex < packetSize;
-       packetIndex++, newPacketIndex++) {
-    // Replace FLAG (0x7E) with 0x7D5E.
-    if (packet[packetIndex] == 0x7E) {
-      newPacket[newPacketIndex++] = 0x7D;
-      newPacket[newPacketIndex] = 0x5E;
-    }
-    // Replace ESC (0x7D) with 0x7D5E.
-    else if (packet[packetIndex] == 0x7D) {
-      newPacket[newPacketIndex++] = 0x7D;
-      newPacket[newPacketIndex] = 0x5D;
-    } else {
-      newPacket[newPacketIndex] = packet[packetIndex];
+/**
+ * @brief Decides whether a Go-Back-N frame is delivered and acknowledges it.
+ *
+ * Only the frame carrying the expected sequence number is accepted, and it is
+ * acknowledged with a cumulative RR. A corrupted or out of order frame means
+ * frames were lost, so the receiver asks for everything from the expected
+ * frame onwards with a single REJ, which stays outstanding until the expected
+ * frame arrives. Duplicates (frames before the expected one, resent because a
+ * RR was lost) are discarded and acknowledged again. In full duplex the valid
+ * stop-and-wait frames are handled here too, as a window of one frame, so
+ * that the N(R) sent back is right; and a frame is discarded, as if it were
+ * lost, while there's no room for it (see `hasRoomFor()`).
+ *
+ * @param ns The sequence number of the received frame.
+ * @param valid TRUE if the FCS matched.
+ * @param frameSize The size of the frame, used for the statistics.
+ * @return 0 if the frame must be delivered, 1 if it was discarded, -1 on error.
+ */
+int receiveWindowFrame(unsigned char ns, int valid, size_t frameSize) {
+  unsigned char responseC;
+
+  if (valid && ns == context->expectedSequence) {
+    if (!hasRoomFor(ns)) {
+      printf("Frame %d discarded, the packets received weren't read\n", ns);
+      return 1;
     }
+    context->expectedSequence =
+        (context->expectedSequence + 1) % sequenceModulus();
+    context->rejectSent = FALSE;
+    printf("Frame %d accepted, approving with 0x%02x\n", ns,
+           supervisoryControl(S_RR, context->expectedSequence));
+    if (sendReceiveReady())
+      return -1;
+    return 0;
   }
-  *newPacketSize = newPacketIndex;
 
-  return 0;
+  int ahead =
+      (ns - context->expectedSequence + sequenceModulus()) % sequenceModulus();
+  if (valid && ahead >= context->windowSize) {
+    printf("Duplicate frame %d, approving again with 0x%02x\n", ns,
+           supervisoryControl(S_RR, context->expectedSequence));
+    traceInstant("duplicate", "frame", ns);
+    return sendReceiveReady() ? -1 : 1;
+  }
+
+  context->receiverStatistics->rejectedFrames++;
+  context->receiverStatistics->rejectedBytes += frameSize + 5;
+  // The expected frame itself was corrupted again, so the previous REJ
+  // already did its job and a new one is needed.
+  if (context->rejectSent && ns != context->expectedSequence) {
+    printf("Frame %d discarded, waiting for frame %d\n", ns,
+           context->expectedSequence);
+    return 1;
+  }
+  context->rejectSent = TRUE;
+  responseC = rejectControl(S_REJ, context->expectedSequence);
+  traceInstant("REJ sent", "frame", context->expectedSequence);
+  printf("Frame %d %s, rejecting with 0x%02x\n", ns,
+         valid ? "out of order" : "corrupted", responseC);
+  if (sendControlFrame(responseAddress(), responseC))
+    return -1;
+  return 1;
 }
 
 /**
- * @brief Destuffs a packet by removing escape sequences.
+ * @brief Stores a Selective Repeat frame in the reorder buffer and acks it.
  *
- * This function processes an input packet and removes escape sequences,
- * producing a new packet with the escape sequences removed.
+ * Any valid frame inside the receive window is kept, even if earlier frames
+ * are missing. When the expected frame arrives, the window slides over every
+ * contiguous frame already buffered and a cumulative RR is sent. A gap in the
+ * sequence numbers causes a SREJ for each missing frame, and a corrupted frame
+ * a SREJ for itself, so only those frames are resent. Duplicates (frames
+ * before the window) are discarded and acknowledged again. In full duplex a
+ * frame is discarded, as if it were lost, while there's no room for it (see
+ * `hasRoomFor()`).
  *
- * @param packet The input packet to be destuffed.
- * @param packetSize The size of the input packet.
- * @param newPacket The output buffer where the destuffed packet will be stored.
- * @param newPacketSize A pointer to a variable where the size of the destuffed
- * packet will be stored.
- * @return 0 on success, 1 if any of the input pointers are NULL.
+ * @param ns The sequence number of the received frame.
+ * @param valid TRUE if the FCS matched.
+ * @param data The destuffed packet, without the FCS.
+ * @param dataSize The size of the packet.
+ * @param frameSize The size of the frame, used for the statistics.
+ * @return 0 on success, -1 on error.
  */
-int destuffPacket(const unsigned char *packet, size_t packetSize,
-                  unsigned char *newPacket, size_t *newPacketSize) {
-  if (packet == NULL || newPacket == NULL || newPacketSize == NULL) {
-    return 1;
+int receiveSelectiveFrame(unsigned char ns, int valid,
+                          const unsigned char *data, size_t dataSize,
+                          size_t frameSize) {
+  int ahead =
+      (ns - context->expectedSequence + SEQUENCE_MODULUS) % SEQUENCE_MODULUS;
+  int inWindow = ahead < context->windowSize;
+
+  if (!valid) {
+    context->receiverStatistics->rejectedFrames++;
+    context->receiverStatistics->rejectedBytes += frameSize + 5;
+    if (!inWindow || context->reorderReceived[ns]) {
+      printf("Frame %d corrupted, already received\n", ns);
+      return 0;
+    }
+    context->srejSent[ns] = TRUE;
+    printf("Frame %d corrupted, rejecting with 0x%02x\n", ns,
+           rejectControl(S_SREJ, ns));
+    traceInstant("SREJ sent", "frame", ns);
+    return sendControlFrame(responseAddress(), rejectControl(S_SREJ, ns));
   }
 
-  size_t newPacketIndex = 0;
+  if (!inWindow) {
+    printf("Duplicate frame %d, approving again with 0x%02x\n", ns,
+           supervisoryControl(S_RR, context->expectedSequence));
+    traceInstant("duplicate", "frame", ns);
+    return sendReceiveReady();
+  }
 
-  for (size_t packetIndex = 0; packetIndex < packetSize;
-       packetIndex++, newPacketIndex++) {
-    if (packet[packetIndex] != 0x7D) {
-      newPacket[newPacketIndex] = packet[packetIndex];
-    } else {
-      if (packet[packetIndex + 1] == 0x5E) {
-        newPacket[newPacketIndex] = 0x7E;
-      } else if (packet[packetIndex + 1] == 0x5D) {
-        newPacket[newPacketIndex] = 0x7D;
-      }
-      packetIndex++;
+  if (!context->reorderReceived[ns]) {
+    if (!hasRoomFor(ns)) {
+      printf("Frame %d discarded, the packets received weren't read\n", ns);
+      return 0;
     }
+    memcpy(context->reorderPackets[ns], data, dataSize);
+    context->reorderPacketSizes[ns] = dataSize;
+    context->reorderReceived[ns] = TRUE;
+    context->srejSent[ns] = FALSE;
+    context->receiverStatistics->nFrames++;
   }
 
-  *newPacketSize = newPacketIndex;
+  if (ns != context->expectedSequence) {
+    // Ask for every missing frame before this one that wasn't asked for yet.
+    for (unsigned char missing = context->expectedSequence; missing != ns;
+         missing = (missing + 1) % SEQUENCE_MODULUS) {
+      if (context->reorderReceived[missing] || context->srejSent[missing])
+        continue;
+      context->srejSent[missing] = TRUE;
+      printf("Frame %d missing, rejecting with 0x%02x\n", missing,
+             rejectControl(S_SREJ, missing));
+      traceInstant("SREJ sent", "frame", missing);
+      if (sendControlFrame(responseAddress(), rejectControl(S_SREJ, missing)))
+        return -1;
+    }
+    return 0;
+  }
 
-  return 0;
+  while (context->reorderReceived[context->expectedSequence]) {
+    context->reorderReceived[context->expectedSequence] = FALSE;
+    context->expectedSequence =
+        (context->expectedSequence + 1) % SEQUENCE_MODULUS;
+  }
+  printf("Frame %d accepted, approving with 0x%02x\n", ns,
+         supervisoryControl(S_RR, context->expectedSequence));
+  return sendReceiveReady();
 }
 
 /**
- * @brief Sends a control frame.
+ * @brief Rejects the information frames whose header was corrupted, counted
+ * by `receiveFrame()`.
  *
- * This function constructs a control frame with the given address (A) and
- * control (C) fields, calculates the Block Check Character (BCC), and sends the
- * frame through a file descriptor.
+ * Their sequence number is unknown, but a frame was lost, so the expected one
+ * is asked for right away instead of letting the transmitter wait for its
+ * timer: with a REJ in stop-and-wait and Go-Back-N (unless one is
+ * outstanding already) and a SREJ in Selective Repeat (unless one was sent
+ * for it). A spurious rejection, if the lost frame was a duplicate, only
+ * resends frames the transmitter holds anyway. With hybrid ARQ a
+ * stop-and-wait frame that wasn't kept is asked for with a RR, as when its
+ * FCS doesn't match.
  *
- * @param A The address field of the control frame.
- * @param C The control field of the control frame.
- * @return int Returns 0 on success, or -1 on failure.
+ * @return 0 on success, -1 on error.
  */
-int sendControlFrame(unsigned char A, unsigned char C) {
-  unsigned char frame[5] = {0x7E, A, C, 0, 0x7E};
-  frame[3] = frame[1] ^ frame[2];
+int rejectDamagedFrames() {
+  if (context->damagedFrames == 0)
+    return 0;
+  context->receiverStatistics->rejectedFrames += context->damagedFrames;
+  context->receiverStatistics->rejectedBytes += context->damagedBytes;
+  context->damagedFrames = 0;
+  context->damagedBytes = 0;
 
-  if (write(fd, frame, 5) < 0) {
-    perror("Error sending control frame!\n");
-    return -1;
+  unsigned char expected = context->expectedSequence;
+  unsigned char responseC;
+  if (context->options.arq == LlSelectiveRepeat) {
+    if (context->srejSent[expected])
+      return 0;
+    context->srejSent[expected] = TRUE;
+    responseC = rejectControl(S_SREJ, expected);
+  } else if (context->options.arq == LlGoBackN || context->duplex) {
+    if (context->rejectSent)
+      return 0;
+    context->rejectSent = TRUE;
+    responseC = rejectControl(S_REJ, expected);
+  } else {
+    responseC = context->harqIncrement > 0 &&
+                        context->harqBlockSizes[expected] == 0
+                    ? supervisoryControl(S_RR, expected)
+                    : supervisoryControl(S_REJ, expected);
   }
-  return 0;
+  printf("Frame with a corrupted header, rejecting with 0x%02x\n", responseC);
+  traceInstant("header corrupted", "frame", expected);
+  return sendControlFrame(responseAddress(), responseC);
 }
 
 /**
- * @brief Receives a control frame and validates it against expected values.
+ * @brief Hands the next in-order packet of the reorder buffer (Selective
+ * Repeat and full duplex) to the application.
  *
- * This function reads bytes from a file descriptor and processes them to
- * validate a control frame. The frame is validated based on the expected
- * address (A) and control (C) values provided as arguments.
- *
- * @param expectedA The expected address byte of the control frame.
- * @param expectedC The expected control byte of the control frame.
- * @return int Returns 0 on successful reception and validation of the control
- * frame, or -1 if an error occurs during reading.
+ * @param packet The buffer where the packet will be copied.
+ * @return The size of the packet, or 0 if the next packet hasn't arrived yet.
  */
-int receiveControlFrame(unsigned char expectedA, unsigned char expectedC) {
-  enum states currentState = START;
-
-  while (currentState != STOP) {
-    unsigned char byte = 0;
-    int bytes;
-    if ((bytes = read(fd, &byte, sizeof(byte))) < 0) {
-      perror("Error reading byte from control frame!\n");
-      return -1;
-    }
-    if (bytes > 0) {
-      switch (currentState) {
-      case START:
-        if (byte == 0x7E)
-          currentState = FLAG_RCV;
-        break;
-      case FLAG_RCV:
-        if (byte == 0x7E)
-          continue;
-        if (byte == expectedA)
-          currentState = A_RCV;
-        break;
-      case A_RCV:
-        if (byte == 0x7E)
-          currentState = FLAG_RCV;
-        else if (byte == expectedC)
-          currentState = C_RCV;
-        else
-          currentState = START;
-        break;
-      case C_RCV:
-        if (byte == 0x7E)
-          currentState = FLAG_RCV;
-        else if (byte == (expectedC ^ expectedA))
-          currentState = BCC_OK;
-        else
-          currentState = START;
-        break;
+int deliverReorderedPacket(unsigned char *packet) {
+  if (context->deliverSequence == context->expectedSequence)
+    return 0;
+  size_t size = context->reorderPacketSizes[context->deliverSequence];
+  memcpy(packet, context->reorderPackets[context->deliverSequence], size);
+  context->deliverSequence = (context->deliverSequence + 1) % sequenceModulus();
+  return size;
+}
 
-      case BCC_OK:
-        if (byte == 0x7E)
-          currentState = STOP;
-        else
-          currentState = START;
-        break;
-      default:
-        currentState = START;
-      }
-    }
+/**
+ * @brief Checks whether `receivedFrame` is an information frame from the other
+ * end, or a redundancy frame for a frame that was kept.
+ *
+ * @param ns Where the sequence number of the frame will be stored.
+ * @param redundancy Where TRUE will be stored for a redundancy frame.
+ * @return TRUE if it is, FALSE otherwise.
+ */
+int isReceivedInformation(unsigned char *ns, int *redundancy) {
+  if (context->receivedFrame.dataSize == 0 ||
+      context->receivedFrame.A != receiveAddress())
+    return FALSE;
+  unsigned char receivedC = context->receivedFrame.C;
+  *redundancy = context->harqIncrement > 0 && IS_IR_CONTROL(receivedC);
+  if (!*redundancy && !isInformationControl(receivedC))
+    return FALSE;
+  *ns = *redundancy ? IR_NS(receivedC)
+        : context->options.arq == LlStopAndWait ? receivedC >> 7
+                                        : CONTROL_NS(receivedC);
+  if (*redundancy && (!keepsFrame(*ns) || context->harqBlockSizes[*ns] == 0)) {
+    printf("Redundancy for frame %d ignored, it wasn't kept\n", *ns);
+    return FALSE;
   }
-  return 0;
+  return TRUE;
 }
 
 /**
- * @brief Sends a control frame and waits for an acknowledgment.
+ * @brief Handles the information or redundancy frame held by `receivedFrame`.
  *
- * This function sends a control frame with the specified address (A) and
- * control (C) fields, and waits for an acknowledgment frame with the expected
- * address (expectedA) and control (expectedC) fields. It uses a state machine
- * to process the received bytes and verify the acknowledgment. If the
- * acknowledgment is not received within the specified timeout, the control
- * frame is retransmitted.
+ * The frame is corrected and checked, then accepted, discarded or rejected,
+ * and acknowledged, as the retransmission scheme does.
  *
- * @param A The address field of the control frame to be sent.
- * @param C The control field of the control frame to be sent.
- * @param expectedA The expected address field of the acknowledgment frame.
- * @param expectedC The expected control field of the acknowledgment frame.
- * @return int Returns 0 if the acknowledgment is received successfully, -1
- * otherwise.
+ * @param ns The sequence number of the frame.
+ * @param redundancy TRUE for a redundancy frame.
+ * @param packet Where an accepted packet is copied, or NULL in full duplex,
+ * where it is kept in the reorder buffer instead (as in Selective Repeat).
+ * @return The size of the packet copied, 0 if none was, or -1 on error.
  */
-int sendControlAndAwaitAck(unsigned char A, unsigned char C,
-                           unsigned char expectedA, unsigned char expectedC) {
-  enum states currentState = START;
-  (void)signal(SIGALRM, alarmHandler);
-  if (sendControlFrame(A, C))
-    return -1;
-  alarm(parameters.timeout);
-
-  while (currentState != STOP && alarmCount <= parameters.nRetransmissions) {
-    unsigned char byte = 0;
-    int bytes;
+int receiveInformationFrame(unsigned char ns, int redundancy,
+                            unsigned char *packet) {
+  int keep = keepsFrame(ns);
+  size_t packetIndex = context->receivedFrame.stuffedSize;
+  const unsigned char *destuffedPacket = context->receivedFrame.data;
+  size_t destuffedPacketSize = context->receivedFrame.dataSize;
 
-    if ((bytes = read(fd, &byte, sizeof(byte))) < 0) {
-      perror("Error reading byte from control frame!\n");
+  int valid =
+      context->harqIncrement > 0
+          ? combineFrame(ns, redundancy, &destuffedPacket, &destuffedPacketSize)
+          : repairFrame(context->receivedFrame.data, &destuffedPacketSize);
+  if (!keep)
+    context->harqBlockSizes[ns] = 0;
+  size_t destuffedDataSize =
+      valid ? destuffedPacketSize - frameChecks[context->fcs].size : 0;
+  if (context->options.arq == LlSelectiveRepeat) {
+    if (receiveSelectiveFrame(ns, valid, destuffedPacket, destuffedDataSize,
+                              packetIndex))
       return -1;
-    }
-    if (bytes > 0) {
-      switch (currentState) {
-      case START:
-        if (byte == 0x7E)
-          currentState = FLAG_RCV;
-        break;
-      case FLAG_RCV:
-        if (byte == 0x7E)
-          continue;
-        if (byte == expectedA)
-          currentState = A_RCV;
-        break;
-      case A_RCV:
-        if (byte == 0x7E)
-          currentState = FLAG_RCV;
-        else if (byte == expectedC)
-          currentState = C_RCV;
-        else
-          currentState = START;
-        break;
-      case C_RCV:
-        if (byte == 0x7E)
-          currentState = FLAG_RCV;
-        else if (byte == (expectedC ^ expectedA))
-          currentState = BCC_OK;
-        else
-          currentState = START;
-        break;
-
-      case BCC_OK:
-        if (byte == 0x7E)
-          currentState = STOP;
-        else
-          currentState = START;
-        break;
-      default:
-        currentState = START;
-      }
-    }
-    if (currentState == STOP) {
-      disableAlarm();
+    return context->duplex ? 0 : deliverReorderedPacket(packet);
+  } else if (context->options.arq == LlGoBackN || (context->duplex && valid)) {
+    int discarded = receiveWindowFrame(ns, valid, packetIndex);
+    if (discarded)
+      return discarded < 0 ? -1 : 0;
+  } else {
+    unsigned char responseC;
+    if (valid && ns != context->expectedSequence) {
+      // Sent again because the RR was lost: acknowledged again, and
+      // discarded.
+      responseC = supervisoryControl(S_RR, context->expectedSequence);
+      printf("Duplicate frame %d, approving again with 0x%02x\n", ns,
+             responseC);
+      traceInstant("duplicate", "frame", ns);
+      return sendControlFrame(responseAddress(), responseC) ? -1 : 0;
+    } else if (valid) {
+      // if the current frame is 0, ready to receive 1.
+      context->expectedSequence = ns ^ 1;
+      responseC = supervisoryControl(S_RR, context->expectedSequence);
+      printf("FCS matches, approving with 0x%02x\n", responseC);
+    } else {
+      // The classic REJ has no P/F bit: with hybrid ARQ, a frame that
+      // wasn't kept is asked for again with a RR for itself.
+      responseC = context->harqIncrement > 0 && context->harqBlockSizes[ns] == 0
+                      ? supervisoryControl(S_RR, ns)
+                      : supervisoryControl(S_REJ, ns);
+      printf("FCS doesn't match, rejecting with 0x%02x\n", responseC);
+      context->receiverStatistics->rejectedFrames++;
+      context->receiverStatistics->rejectedBytes += packetIndex + 5;
+      if (sendControlFrame(responseAddress(), responseC))
+        return -1;
       return 0;
     }
-
-    if (alarmEnabled) {
-      alarmEnabled = FALSE;
-      if (alarmCount <= parameters.nRetransmissions) {
-        printf("Retransmitting...\n");
-        if (sendControlFrame(A, C))
-          return -1;
-        alarm(parameters.timeout);
-      }
-      currentState = START;
+    if (sendControlFrame(responseAddress(), responseC)) {
+      return -1;
     }
   }
-  disableAlarm();
-  return -1;
+  context->receiverStatistics->nFrames++;
+  if (context->duplex) {
+    memcpy(context->reorderPackets[ns], destuffedPacket, destuffedDataSize);
+    context->reorderPacketSizes[ns] = destuffedDataSize;
+    return 0;
+  }
+  // A frame that started before this call was parsed into `frameBuffer`.
+  if (destuffedPacket != packet)
+    memcpy(packet, destuffedPacket, destuffedDataSize);
+  return destuffedDataSize;
 }
 
-void sendFilesize(size_t filesize) { statistics.filesize = filesize; }
+/**
+ * @brief Handles a frame from the other end in full duplex.
+ *
+ * The N(R) of an information frame acknowledges the frames sent before it,
+ * like a RR, and the frame itself is received as `llread()` does, its packet
+ * kept in the reorder buffer.
+ *
+ * @return 1 if frames were acknowledged or a packet was accepted, 0 if not (or
+ * `receivedFrame` isn't an information frame from the other end), -1 on error.
+ */
+int receivePeerFrame() {
+  unsigned char ns;
+  int redundancy;
+  if (!isReceivedInformation(&ns, &redundancy))
+    return 0;
 
-void printStatistics() {
-  struct timespec end;
-  clock_gettime(CLOCK_MONOTONIC, &end);
-  float globalDuration = (end.tv_sec - statistics.globalStart.tv_sec) +
-                         (end.tv_nsec - statistics.globalStart.tv_nsec) / 1e9;
-  float duration = (end.tv_sec - statistics.connectionStart.tv_sec) +
-                   (end.tv_nsec - statistics.connectionStart.tv_nsec) / 1e9;
-  printf("\nSTATISTICS\n");
-  printf("\tRole: %s\n", parameters.role == LlTx ? "Transmitter" : "Receiver");
-  if (parameters.role == LlTx) {
-    printf("\tGlobal duration: %fs\n", globalDuration);
-    printf("\tTransmission duration: %fs\n", duration);
-    printf("\tFrames sent: %d\n", statistics.nFrames);
-    printf("\tAccepted frames: %d\n",
-           statistics.nFrames - statistics.rejectedFrames);
-    printf("\tRejected frames: %d\n", statistics.rejectedFrames);
-    printf("\tBytes sent: %d\n", statistics.nBytes);
-    printf("\tAccepted bytes: %d\n",
-           statistics.nBytes - statistics.rejectedBytes);
-    printf("\tRejected bytes: %d\n", statistics.rejectedBytes);
-    printf("\tAverage frame size: %f bytes\n",
-           (float)statistics.nBytes / statistics.nFrames);
-    printf("\tSpeed: %f bit/s (filesize divided by time)\n",
-           statistics.filesize * 8.0 / duration);
-    printf("\tEfficiency: %f%% (speed / baudrate)\n",
-           (statistics.filesize * 8.0 / duration) / (parameters.baudRate) *
-               100);
-  } else if (parameters.role == LlRx) {
-    printf("\tGlobal duration: %fs\n", globalDuration);
-    printf("\tTransmission duration: %fs\n", duration);
-    printf("\tFrames received: %d\n",
-           statistics.nFrames + statistics.rejectedFrames);
-    printf("\tAccepted frames: %d\n", statistics.nFrames);
-    printf("\tRejected frames: %d\n", statistics.rejectedFrames);
-    printf("\tBytes received: %d\n", statistics.nBytes);
-    printf("\tAccepted bytes: %d\n",
-           statistics.nBytes - statistics.rejectedBytes);
-    printf("\tRejected bytes: %d\n", statistics.rejectedBytes);
-    printf("\tAverage frame size: %f bytes\n",
-           (float)statistics.nBytes /
-               (statistics.nFrames + statistics.rejectedFrames));
-    printf("\tSpeed: %f bit/s (filesize divided by time)\n",
-           statistics.filesize * 8.0 / duration);
-    printf("\tEfficiency: %f%% (speed / baudrate)\n",
-           (statistics.filesize * 8.0 / duration) / (parameters.baudRate) *
-               100);
+  int progress = FALSE;
+  unsigned char nr = informationAcknowledgement(context->receivedFrame.C);
+  if (!redundancy && acknowledgeFrames(nr) > 0) {
+    printf("Frames acknowledged by the other end's frame %d\n", ns);
+    context->timeoutCount = 0;
+    progress = TRUE;
   }
+  unsigned char expected = context->expectedSequence;
+  if (receiveInformationFrame(ns, redundancy, NULL) < 0)
+    return -1;
+  return progress || context->expectedSequence != expected;
 }
 
-////////////////////////////////////////////////
-// LLOPEN
-////////////////////////////////////////////////
-int llopen(LinkLayer connectionParameters) {
-  parameters = connectionParameters;
-  (void)signal(SIGALRM, alarmHandler);
-  clock_gettime(CLOCK_MONOTONIC, &statistics.globalStart);
+void llresumeoffer(const LinkLayerResume *offer) {
+  context->resumeOffered = offer != NULL;
+  if (offer != NULL)
+    context->resumeOffer = *offer;
+}
 
-  fd = openSerialPort(connectionParameters.serialPort,
-                      connectionParameters.baudRate);
-  if (fd < 0) {
-    return -1;
-  }
+int llresumed(LinkLayerResume *offer) {
+  if (!context->resumeOffered)
+    return 0;
+  *offer = context->resumeOffer;
+  return 1;
+}
 
-  if (connectionParameters.role == LlTx) { // Transmitter
-    // Sends control frame with A=0x03 and C=0x03 and waits for a response with
-    // A=0x03 and C=0x07.
-    if (sendControlAndAwaitAck(0x03, 0x03, 0x03, 0x07))
-      return -1;
-    statistics.nFrames++;
-    statistics.nBytes += 5;
-    printf("Control frame sent and received correctly, connection established "
-           "successfully.\n");
-  } else {
-    // Waits for a control frame with A=0x03 and C=0x03.
-    if (receiveControlFrame(0x03, 0x03))
-      return -1;
-    // Responds with a control frame with A=0x03 and C=0x07.
-    if (sendControlFrame(0x03, 0x07))
-      return -1;
-    statistics.nFrames++;
-    statistics.nBytes += 5;
-    printf("Control frame received and sent correctly, connection established "
-           "successfully.\n");
-  }
+int llduplex() { return context->duplex; }
 
-  clock_gettime(CLOCK_MONOTONIC, &statistics.connectionStart);
-  return 0;
+int llreceivedpackets() {
+  if (!context->duplex)
+    return 0;
+  unsigned char modulus = sequenceModulus();
+  return (context->expectedSequence - context->deliverSequence + modulus) %
+         modulus;
 }
 
 ////////////////////////////////////////////////
-// LLWRITE
+// LLREAD
 ////////////////////////////////////////////////
-int llwrite(const unsigned char *buf, int bufSize) {
-  if (buf == NULL) {
-    return -1;
-  }
-
-  // Add header and footer to packet (A, C, BCC1, ..., BCC2). The flags will be
-  // added later.
-  unsigned char newPacket[bufSize + 1];
-  memcpy(&newPacket, buf, bufSize);
-
-  unsigned char bcc2 = 0;
-  for (int i = 0; i < bufSize; i++) {
-    bcc2 ^= buf[i];
-  }
-  newPacket[bufSize] = bcc2;
-
-  unsigned char stuffedPacket[(bufSize + 1) * 2 + 5];
-  size_t stuffedPacketSize;
-
-  if (stuffPacket(newPacket, bufSize + 1, stuffedPacket + 4,
-                  &stuffedPacketSize)) {
-    perror("Error stuffing packet!\n");
-    return -1;
-  }
-  stuffedPacketSize += 5;
+/**
+ * @brief Reads the next packet of a link that isn't bonded.
+ *
+ * @param packet Where the packet is copied.
+ * @return The size of the packet, 0 if none was read (in full duplex), or -1
+ * on error.
+ */
+int readPacket(unsigned char *packet) {
+  if (context->receiveQueue != NULL)
+    return readQueuedPacket(packet);
 
-  // Insert the flags.
-  stuffedPacket[0] = 0x7E;
-  stuffedPacket[1] = 0x03;
-  stuffedPacket[2] = informationFrameNumber;
-  stuffedPacket[3] = 0x03 ^ informationFrameNumber;
-  stuffedPacket[stuffedPacketSize - 1] = 0x7E;
-  informationFrameNumber ^=
-      0x80; // Toggle informationFrameNumber between 0x00 and 0x80.
+  // Frames already reordered are delivered before reading any more.
+  if ((context->options.arq == LlSelectiveRepeat || context->duplex) &&
+      context->deliverSequence != context->expectedSequence)
+    return deliverReorderedPacket(packet);
 
-  // Send the packet.
-  if (write(fd, stuffedPacket, stuffedPacketSize) < 0) {
-    perror("Error writing stuffed packet.\n");
-    return -1;
+  // In full duplex the frames sent are handled (acknowledgements and
+  // retransmissions) while waiting, and no information frame will carry the
+  // acknowledgement of the frames received in the meantime.
+  if (context->duplex) {
+    if (flushAcknowledgement(TRUE))
+      return -1;
+    while (context->deliverSequence == context->expectedSequence) {
+      if (pollLink() < 0)
+        return -1;
+    }
+    return deliverReorderedPacket(packet);
   }
-  statistics.nFrames++;
-  statistics.nBytes += stuffedPacketSize;
-  printf("Packet sent!\n");
-
-  // Verify response
-  enum states currentState = START;
-  (void)signal(SIGALRM, alarmHandler);
-  alarm(parameters.timeout);
 
-  unsigned char receivedA = 0;
-  unsigned char receivedC = 0;
+  // Information frames are destuffed straight into the packet, which must
+  // hold `llreadbuffersize()` bytes (FCS and FEC included). Selective Repeat keeps them
+  // in the reorder buffer instead.
+  if (context->options.arq != LlSelectiveRepeat)
+    context->deliveryBuffer = packet;
 
-  while (currentState != STOP && alarmCount <= parameters.nRetransmissions) {
-    unsigned char byte = 0;
-    int bytes;
-
-    if ((bytes = read(fd, &byte, sizeof(byte))) < 0) {
-      perror("Error reading byte from control frame!\n");
+  while (TRUE) {
+    int received = receiveFrame(&context->receiverStatistics->nBytes);
+    if (received < 0 || rejectDamagedFrames() ||
+        (!received && checkSilence()) ||
+        (received && (answerProbe() < 0 || answerRepeatedSet() < 0))) {
+      context->deliveryBuffer = NULL;
       return -1;
     }
-    if (bytes > 0) {
-      switch (currentState) {
-      case START:
-        receivedA = 0;
-        receivedC = 0;
-        if (byte == 0x7E)
-          currentState = FLAG_RCV;
-        break;
-      case FLAG_RCV:
-        if (byte == 0x7E)
-          continue;
-        if (byte == 0x03) {
-          receivedA = byte;
-          currentState = A_RCV;
-        } else {
-          currentState = START;
-        }
-        break;
-      case A_RCV:
-        if (byte == RR0 || byte == RR1 || byte == REJ0 || byte == REJ1) {
-          receivedC = byte;
-          currentState = C_RCV;
-        } else if (byte == 0x7E)
-          currentState = FLAG_RCV;
-        else
-          currentState = START;
-        break;
-      case C_RCV:
-        if (byte == (receivedA ^ receivedC)) {
-          currentState = BCC_OK;
-        } else if (byte == 0x7E)
-          currentState = FLAG_RCV;
-        else
-          currentState = START;
-        break;
-      case BCC_OK:
-        if (byte == 0x7E) {
-          currentState = STOP;
-        } else
-          currentState = START;
-        break;
-      default:
-        currentState = START;
-      }
-    }
-    if (currentState == STOP) {
-      printf("Received response.\n");
-      // if the information number is 0, it means the packet was sent with
-      // information number 0x80, thus it is expecting a RR0.
-      if ((informationFrameNumber == 0 && receivedC == RR0) ||
-          (informationFrameNumber == 0x80 && receivedC == RR1)) {
-        printf("Packet accepted by receiver, proceding to the next.\n");
-        disableAlarm();
-        return stuffedPacketSize;
-      }
-      alarmEnabled = TRUE;
-      alarmCount = 0;
-      statistics.rejectedFrames++;
-      statistics.rejectedBytes += stuffedPacketSize;
-      printf("Packet rejected by receiver, trying again...\n");
-    }
-    // Verify if the alarm fired
-    if (alarmEnabled) {
-      alarmEnabled = FALSE;
-      if (alarmCount <= parameters.nRetransmissions) {
-        printf("Retransmitting packet...\n");
-        if (write(fd, stuffedPacket, stuffedPacketSize) < 0) {
-          perror("Error writing stuffed packet.\n");
-          return -1;
-        }
-        statistics.nFrames++;
-        statistics.nBytes += stuffedPacketSize;
-        alarm(parameters.timeout);
-      }
-      currentState = START;
-    }
+    // Only information frames (and their redundancy frames, for a frame that
+    // was kept) are handled here.
+    unsigned char ns;
+    int redundancy;
+    if (!received || !isReceivedInformation(&ns, &redundancy))
+      continue;
+    context->deliveryBuffer = NULL;
+    return receiveInformationFrame(ns, redundancy, packet);
   }
-  disableAlarm();
-  return -1;
 }
 
-////////////////////////////////////////////////
-// LLREAD
-////////////////////////////////////////////////
 int llread(unsigned char *packet) {
-  enum states currentState = START;
-  size_t packetIndex = 0;
-
-  unsigned char receivedA = 0;
-  unsigned char receivedC = 0;
-
-  while (currentState != STOP) {
-    unsigned char byte = 0;
-    int bytes;
-
-    if ((bytes = read(fd, &byte, sizeof(byte))) < 0) {
-      perror("Error reading byte from control frame!\n");
-      return -1;
-    }
-    if (bytes > 0) {
-      statistics.nBytes++;
-      switch (currentState) {
-      case START:
-        receivedC = 0;
-        receivedA = 0;
-        if (byte == 0x7E)
-          currentState = FLAG_RCV;
-        break;
-      case FLAG_RCV:
-        if (byte == 0x7E)
-          continue;
-        if (byte == 0x03) {
-          receivedA = byte;
-          currentState = A_RCV;
-        } else
-          currentState = START;
-        break;
-      case A_RCV:
-        if (byte == 0x00 || byte == 0x80) {
-          receivedC = byte;
-          currentState = C_RCV;
-        } else if (byte == 0x7E)
-          currentState = FLAG_RCV;
-        else
-          currentState = START;
-        break;
-      case C_RCV:
-        if (byte == (receivedC ^ receivedA)) {
-          currentState = DATA;
-        } else if (byte == 0x7E)
-          currentState = FLAG_RCV;
-        else
-          currentState = START;
-        break;
-      case DATA:
-        if (byte == 0x7E) {
-          unsigned char destuffedPacket[packetIndex];
-          size_t destuffedPacketSize;
-
-          if (destuffPacket(packet, packetIndex, destuffedPacket,
-                            &destuffedPacketSize)) {
-            return -1;
-          }
-          unsigned char receivedBCC2 = destuffedPacket[destuffedPacketSize - 1];
-          unsigned char bcc2 = 0;
-          for (size_t i = 0; i < destuffedPacketSize - 1; i++) {
-            bcc2 ^= destuffedPacket[i];
-          }
-          unsigned char responseC;
-          if (bcc2 == receivedBCC2) {
-            // if the current frame is 0, ready to receive 1.
-            responseC = (receivedC == 0x00) ? RR1 : RR0;
-            printf("BCC2 matches, approving with 0x%02x\n", responseC);
-          } else {
-            responseC = (receivedC == 0x00) ? REJ0 : REJ1;
-            printf("BCC2 doesn't match, rejecting with 0x%02x\n", responseC);
-            statistics.rejectedFrames++;
-            statistics.rejectedBytes += packetIndex + 5;
-            if (sendControlFrame(0x03, responseC))
-              return -1;
-            return 0;
-          }
-          if (sendControlFrame(0x03, responseC)) {
-            return -1;
-          }
-          memcpy(packet, destuffedPacket, destuffedPacketSize - 1);
-          statistics.nFrames++;
-          return destuffedPacketSize - 1; // -1 to remove BCC2
-        } else {
-          packet[packetIndex++] = byte;
-        }
-        break;
-      default:
-        currentState = START;
-      }
-    }
-  }
+  traceBegin("llread");
+  int size = context->bond != NULL ? bondRead(packet) : readPacket(packet);
+  if (size > 0)
+    context->receiverStatistics->packetBytes += size;
+  traceEnd("llread", "bytes", size);
+  return size;
+}
 
-  return -1;
+/**
+ * @brief Writes the frames still queued, exports the statistics, frees the
+ * frame pool and the other buffers of the link and closes the serial port.
+ *
+ * @param closed Whether the connection was closed gracefully.
+ * @return The result of `serialLineClose()`.
+ */
+int closeLink(int closed) {
+  eventLoopClose(maxTimeout());
+  exportStatistics(closed);
+  free(context->framePoolMemory);
+  context->framePoolMemory = NULL;
+  free(context->bufferMemory);
+  context->bufferMemory = NULL;
+  free(context->receiveQueue);
+  context->receiveQueue = NULL;
+  resetChannels();
+  return serialLineClose(&context->line);
 }
 
 ////////////////////////////////////////////////
 // LLCLOSE
 ////////////////////////////////////////////////
-int llclose(int showStatistics) {
+
+/**
+ * @brief Disconnects and closes the link, as `llclose()` does.
+ *
+ * @param showStatistics Whether the statistics are printed.
+ * @return The result of `closeLink()`, or of `closeBond()` for a bond.
+ */
+int closeConnection(int showStatistics) {
   printf("Attempting to close connection...\n");
+  if (context->bond != NULL)
+    return closeBond(showStatistics);
   // Transmitter sends disc, receiver sends disc and waits for response.
-  if (parameters.role == LlTx) {
+  // Every frame in the window must be acknowledged before disconnecting, and
+  // the frames received acknowledged at once.
+  if (context->parameters.role == LlTx || context->duplex) {
+    // The packets still queued on the channels are sent first.
+    while (llqueuedpackets() > 0) {
+      if (llschedule() <= 0) {
+        printf("Some queued packets were not sent.\n");
+        break;
+      }
+    }
+    if (flushWindow() < 0)
+      printf("Some frames were not acknowledged by the other end.\n");
+    // A link given up while down can't carry the DISC either.
+    if (context->linkDown)
+      return closeLink(FALSE);
+  }
+  if (flushAcknowledgement(TRUE) < 0)
+    return closeLink(FALSE);
+  if (context->parameters.role == LlTx && onBus()) {
+    if (closeStations() < 0)
+      return closeLink(FALSE);
+    printf("Disconnected!\n");
+
+  } else if (context->parameters.role == LlTx) {
     // Sends A=0x03 and C=0x0B, waits for response A=0x01, C=0x0B (disconnect
     // frames).
     if (sendControlAndAwaitAck(0x03, 0x0B, 0x01, 0x0B) < 0)
-      return closeSerialPort();
+      return closeLink(FALSE);
     if (sendControlFrame(0x01, 0x07) < 0)
-      return closeSerialPort();
-    statistics.nFrames += 2;
-    statistics.nBytes += 10;
+      return closeLink(FALSE);
+    context->statistics.nFrames += 2;
+    context->statistics.nBytes += 10;
     printf("Disconnected!\n");
 
-  } else if (parameters.role == LlRx) {
-    if (receiveControlFrame(0x03, 0x0B) < 0)
-      return closeSerialPort();
-    if (sendControlAndAwaitAck(0x01, 0x0B, 0x01, 0x07) < 0)
-      return closeSerialPort();
-    statistics.nFrames += 2;
-    statistics.nBytes += 10;
+  } else if (context->parameters.role == LlRx) {
+    // A station of a multi-drop bus uses its own address for all three.
+    unsigned char address = onBus() ? connectionAddress() : 0x01;
+    if (releaseReceiveQueue() < 0)
+      return closeLink(FALSE);
+    if (!context->disconnectPending &&
+        receiveControlFrame(connectionAddress(), 0x0B) < 0)
+      return closeLink(FALSE);
+    if (sendControlAndAwaitAck(address, 0x0B, address, 0x07) < 0)
+      return closeLink(FALSE);
+    context->statistics.nFrames += 2;
+    context->statistics.nBytes += 10;
     printf("Disconnected!\n");
   }
 
   if (showStatistics) {
     printStatistics();
   }
-  int clstat = closeSerialPort();
-  return clstat;
+  return closeLink(TRUE);
+}
+
+int llclose(int showStatistics) {
+  traceBegin("llclose");
+  int result = closeConnection(showStatistics);
+  traceEnd("llclose", "result", result);
+  // Every link closing rewrites the trace, so the last one holds every event.
+  if (traceEnabled() && traceDump(TRUE))
+    perror("Error writing the trace");
+  return result;
+}
+
+int lltrace(const char *path) { return traceStart(path); }
+
+int lltracedump() { return traceDump(FALSE); }
+
+////////////////////////////////////////////////
+// LINKS
+////////////////////////////////////////////////
+LinkContext *llcreate() {
+  LinkContext *created = calloc(1, sizeof(LinkContext));
+  if (created == NULL) {
+    perror("Error allocating a link.\n");
+    return NULL;
+  }
+  created->eventLoop = eventLoopCreate();
+  if (created->eventLoop == NULL) {
+    free(created);
+    return NULL;
+  }
+  // The initial state of `defaultContext`.
+  created->receiverStatistics = &created->statistics;
+  created->line.fd = -1;
+  lldefaultoptions(&created->options);
+  created->fcs = LlFcsXor;
+  created->payloadSize = MAX_PAYLOAD_SIZE;
+  created->fecDepth = 1;
+  created->receivedFrame.state = START;
+  created->scheduledChannel = MAX_CHANNELS - 1;
+  created->writeChannel = -1;
+  return created;
+}
+
+void lldestroy(LinkContext *link) {
+  if (link == NULL || link == &defaultContext)
+    return;
+  if (context == link)
+    llselect(NULL);
+  for (int channel = 0; channel < MAX_CHANNELS; channel++)
+    free(link->channels[channel].packets);
+  free(link->framePoolMemory);
+  free(link->bufferMemory);
+  free(link->receiveQueue);
+  eventLoopDestroy(link->eventLoop);
+  free(link);
+}
+
+LinkContext *llselect(LinkContext *link) {
+  LinkContext *previous = context;
+  context = link != NULL ? link : &defaultContext;
+  eventLoopSelect(context->eventLoop);
+  return previous;
+}
+
+int llconfigure_r(LinkContext *link, const LinkLayerOptions *linkOptions) {
+  llselect(link);
+  return llconfigure(linkOptions);
+}
+
+int llopen_r(LinkContext *link, LinkLayer connectionParameters) {
+  llselect(link);
+  return llopen(connectionParameters);
+}
+
+int llwrite_r(LinkContext *link, const unsigned char *buf, int bufSize) {
+  llselect(link);
+  return llwrite(buf, bufSize);
+}
+
+int llread_r(LinkContext *link, unsigned char *packet) {
+  llselect(link);
+  return llread(packet);
+}
+
+int llclose_r(LinkContext *link, int showStatistics) {
+  llselect(link);
+  return llclose(showStatistics);
 }
+
+void llinterrupt(LinkContext *link) { eventLoopInterrupt(link->eventLoop); }
@@ -0,0 +1,468 @@
+// Negotiation implementation
+
+#include "../include/link_context.h"
+#include "../include/negotiation.h"
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * @brief Writes a value of `size` bytes, most significant first.
+ *
+ * @return The size of the value.
+ */
+size_t putValue(unsigned char *buffer, uint64_t value, int size) {
+  for (int i = 0; i < size; i++)
+    buffer[i] = value >> (8 * (size - 1 - i));
+  return size;
+}
+
+/**
+ * @brief Reads a value of `size` bytes, most significant first.
+ */
+uint64_t getValue(const unsigned char *buffer, int size) {
+  uint64_t value = 0;
+  for (int i = 0; i < size; i++)
+    value = value << 8 | buffer[i];
+  return value;
+}
+
+/**
+ * @brief Writes a parameter of an extended SET or UA frame, whose value is a
+ * number of `length` bytes.
+ *
+ * @return The size of the parameter.
+ */
+size_t putParameter(unsigned char *parameter, unsigned char type, int length,
+                    uint64_t value) {
+  parameter[0] = type;
+  parameter[1] = length;
+  return 2 + putValue(&parameter[2], value, length);
+}
+
+/**
+ * @brief Builds the parameters of an extended SET or UA frame.
+ *
+ * The framing, FEC, hybrid ARQ, full duplex, transfer resume, keepalive and
+ * flow control are only announced when used, so a UA carries nothing more
+ * about them than the transmitter asked for.
+ *
+ * @param parameters The buffer where they will be stored, of at least
+ * MAX_PARAMETERS_SIZE bytes.
+ * @param capabilities The capabilities to announce.
+ * @return The size of the parameters.
+ */
+size_t buildParameters(unsigned char *parameters,
+                       const Capabilities *capabilities) {
+  size_t size = 0;
+  size += putParameter(&parameters[size], PARAM_VERSION, 1,
+                       capabilities->version);
+  size += putParameter(&parameters[size], PARAM_FCS, 1, capabilities->fcs);
+  size += putParameter(&parameters[size], PARAM_PAYLOAD, 2,
+                       capabilities->payloadSize);
+  size += putParameter(&parameters[size], PARAM_WINDOW, 1,
+                       capabilities->windowSize);
+  if (capabilities->framing != LlFramingStuffing)
+    size += putParameter(&parameters[size], PARAM_FRAMING, 1,
+                         capabilities->framing);
+  if (capabilities->fecParity > 0 || capabilities->harqIncrement > 0) {
+    parameters[size++] = PARAM_FEC;
+    parameters[size++] = 2;
+    parameters[size++] = capabilities->fecParity;
+    parameters[size++] = capabilities->fecDepth;
+  }
+  if (capabilities->harqIncrement > 0)
+    size += putParameter(&parameters[size], PARAM_HARQ, 1,
+                         capabilities->harqIncrement);
+  if (capabilities->duplex)
+    size += putParameter(&parameters[size], PARAM_DUPLEX, 0, 0);
+  if (capabilities->resume) {
+    parameters[size++] = PARAM_RESUME;
+    parameters[size++] = capabilities->offered ? RESUME_OFFER_SIZE : 0;
+    if (capabilities->offered) {
+      size += putValue(&parameters[size], capabilities->offer.file, 4);
+      size += putValue(&parameters[size], capabilities->offer.offset, 8);
+      size += putValue(&parameters[size], capabilities->offer.hash, 4);
+    }
+  }
+  if (capabilities->keepalive)
+    size += putParameter(&parameters[size], PARAM_KEEPALIVE, 0, 0);
+  if (capabilities->flowControl)
+    size += putParameter(&parameters[size], PARAM_FLOW, 0, 0);
+  size += putParameter(&parameters[size], PARAM_GRANULARITY, 4,
+                       capabilities->granularity);
+  return size;
+}
+
+/**
+ * @brief Parses the parameters of an extended SET or UA frame.
+ *
+ * The data field is protected by a BCC2, since the FCS isn't negotiated yet.
+ * The capabilities that aren't announced are the classic ones (see
+ * `classicCapabilities()`), with EXTENDED_VERSION as the version.
+ *
+ * @param data The destuffed data field, with the BCC2.
+ * @param dataSize The size of the data field.
+ * @param capabilities Where the announced capabilities will be stored.
+ * @return 0 on success, -1 if the data field is corrupted or malformed.
+ */
+int parseParameters(const unsigned char *data, size_t dataSize,
+                    Capabilities *capabilities) {
+  if (!checkFrame(data, dataSize, LlFcsXor))
+    return -1;
+  size_t size = dataSize - frameChecks[LlFcsXor].size;
+  classicCapabilities(capabilities);
+  capabilities->version = EXTENDED_VERSION;
+
+  for (size_t i = 0; i + 2 <= size; i += 2 + data[i + 1]) {
+    unsigned char type = data[i];
+    unsigned char length = data[i + 1];
+    const unsigned char *value = &data[i + 2];
+    if (i + 2 + length > size)
+      return -1;
+    if (type == PARAM_VERSION) {
+      if (length != 1 || value[0] < EXTENDED_VERSION)
+        return -1;
+      capabilities->version = value[0];
+    } else if (type == PARAM_FCS) {
+      if (length != 1 || value[0] > LlFcsCrc32c)
+        return -1;
+      capabilities->fcs = value[0];
+    } else if (type == PARAM_PAYLOAD) {
+      if (length != 2 || getValue(value, 2) < MIN_NEGOTIATED_PAYLOAD_SIZE)
+        return -1;
+      capabilities->payloadSize = getValue(value, 2);
+    } else if (type == PARAM_WINDOW) {
+      if (length != 1 || value[0] < 1 || value[0] > MAX_WINDOW_SIZE)
+        return -1;
+      capabilities->windowSize = value[0];
+    } else if (type == PARAM_FRAMING) {
+      if (length != 1 || value[0] > LlFramingCobs)
+        return -1;
+      capabilities->framing = value[0];
+    } else if (type == PARAM_FEC) {
+      if (length != 2 || value[0] % 2 != 0 || value[0] > MAX_FEC_PARITY ||
+          value[1] < 1 || value[1] > MAX_FEC_DEPTH)
+        return -1;
+      capabilities->fecParity = value[0];
+      capabilities->fecDepth = value[1];
+    } else if (type == PARAM_HARQ) {
+      if (length != 1 || value[0] > MAX_FEC_PARITY)
+        return -1;
+      capabilities->harqIncrement = value[0];
+    } else if (type == PARAM_DUPLEX) {
+      if (length != 0)
+        return -1;
+      capabilities->duplex = TRUE;
+    } else if (type == PARAM_RESUME) {
+      if (length != 0 && length != RESUME_OFFER_SIZE)
+        return -1;
+      capabilities->resume = TRUE;
+      if (length == 0)
+        continue;
+      capabilities->offered = TRUE;
+      capabilities->offer.file = getValue(value, 4);
+      capabilities->offer.offset = getValue(value + 4, 8);
+      capabilities->offer.hash = getValue(value + 12, 4);
+    } else if (type == PARAM_KEEPALIVE) {
+      if (length != 0)
+        return -1;
+      capabilities->keepalive = TRUE;
+    } else if (type == PARAM_FLOW) {
+      if (length != 0)
+        return -1;
+      capabilities->flowControl = TRUE;
+    } else if (type == PARAM_GRANULARITY) {
+      if (length != 4 || getValue(value, 4) < 1 ||
+          getValue(value, 4) > MAX_TIMER_GRANULARITY)
+        return -1;
+      capabilities->granularity = getValue(value, 4);
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Fills the capabilities of the classic protocol, which a classic SET
+ * or UA settles on.
+ *
+ * The window and timer granularity aren't negotiated by the classic protocol,
+ * so both ends use their own.
+ */
+void classicCapabilities(Capabilities *capabilities) {
+  memset(capabilities, 0, sizeof(*capabilities));
+  capabilities->version = CLASSIC_VERSION;
+  capabilities->fcs = LlFcsXor;
+  capabilities->payloadSize = MAX_PAYLOAD_SIZE;
+  capabilities->windowSize = context->options.windowSize;
+  capabilities->fecDepth = 1;
+  capabilities->granularity = context->options.timerGranularity;
+}
+
+/**
+ * @brief Fills the capabilities of this end, from its options.
+ *
+ * A Go-Back-N receiver accepts frames in order only, so it announces the
+ * largest window, while with Selective Repeat (the frames it can keep out of
+ * order) or full duplex (where it sends as well) it announces its own. The
+ * resume offer of a receiver is the one set by `llresumeoffer()`.
+ */
+void localCapabilities(Capabilities *capabilities) {
+  const LinkLayerOptions *options = &context->options;
+  classicCapabilities(capabilities);
+  capabilities->version = LL_PROTOCOL_VERSION;
+  capabilities->fcs = options->fcs;
+  capabilities->payloadSize = options->payloadSize;
+  capabilities->framing = options->framing;
+  if (context->parameters.role == LlRx && options->arq == LlGoBackN &&
+      !options->duplex)
+    capabilities->windowSize = MAX_WINDOW_SIZE;
+  capabilities->fecParity = options->fecParity;
+  capabilities->fecDepth = options->fecDepth;
+  capabilities->harqIncrement = options->harqIncrement;
+  capabilities->duplex = options->duplex;
+  capabilities->keepalive = options->keepalive > 0;
+  capabilities->flowControl = options->receiveQueue > 0;
+  capabilities->resume = options->resume;
+  if (context->parameters.role == LlRx) {
+    capabilities->offered = context->resumeOffered;
+    capabilities->offer = context->resumeOffer;
+  }
+}
+
+/**
+ * @brief Settles on the best configuration of the capabilities of both ends.
+ *
+ * That is the lowest version, the strongest frame check sequence, COBS if
+ * either end asks for it, the strongest FEC and hybrid ARQ increment, the
+ * smallest payload size and window, full duplex, keepalive and flow control
+ * if both ends support them (flow control only without full duplex) and the
+ * coarsest timer granularity, along with the receiver's resume offer if the
+ * transmitter asked for it.
+ *
+ * @param local The capabilities of the receiver.
+ * @param peer The capabilities the transmitter announced.
+ * @param settled Where the configuration will be stored.
+ */
+void settleCapabilities(const Capabilities *local, const Capabilities *peer,
+                        Capabilities *settled) {
+  *settled = *local;
+  if (peer->version < local->version)
+    settled->version = peer->version;
+  if (peer->fcs > local->fcs)
+    settled->fcs = peer->fcs;
+  if (peer->framing > local->framing)
+    settled->framing = peer->framing;
+  if (peer->payloadSize < local->payloadSize)
+    settled->payloadSize = peer->payloadSize;
+  if (peer->windowSize < local->windowSize)
+    settled->windowSize = peer->windowSize;
+  if (peer->fecParity > local->fecParity)
+    settled->fecParity = peer->fecParity;
+  if (peer->fecDepth > local->fecDepth)
+    settled->fecDepth = peer->fecDepth;
+  if (peer->harqIncrement > local->harqIncrement)
+    settled->harqIncrement = peer->harqIncrement;
+  settled->duplex = peer->duplex && local->duplex;
+  settled->keepalive = peer->keepalive && local->keepalive;
+  settled->flowControl =
+      peer->flowControl && local->flowControl && !settled->duplex;
+  if (peer->granularity > local->granularity)
+    settled->granularity = peer->granularity;
+  settled->resume = peer->resume && local->offered;
+  settled->offered = settled->resume;
+}
+
+/**
+ * @brief Uses a configuration, and the resume offer it carries on a
+ * transmitter.
+ */
+void applyCapabilities(const Capabilities *settled) {
+  context->version = settled->version;
+  context->fcs = settled->fcs;
+  context->payloadSize = settled->payloadSize;
+  context->windowSize = settled->windowSize;
+  context->framing = settled->framing;
+  context->fecParity = settled->fecParity;
+  context->fecDepth = settled->fecDepth;
+  context->harqIncrement = settled->harqIncrement;
+  context->duplex = settled->duplex;
+  context->keepalive = settled->keepalive;
+  context->flowControl = settled->flowControl;
+  context->timerGranularity = settled->granularity;
+  if (context->parameters.role == LlTx) {
+    context->resumeOffered = settled->offered;
+    context->resumeOffer = settled->offer;
+  }
+}
+
+/**
+ * @brief Whether the options of this end need nothing the classic protocol
+ * lacks, so the transmitter sends a classic SET.
+ */
+int classicOptions() {
+  const LinkLayerOptions *options = &context->options;
+  return options->arq == LlStopAndWait && options->fcs == LlFcsXor &&
+         options->framing == LlFramingStuffing &&
+         options->payloadSize == MAX_PAYLOAD_SIZE &&
+         options->fecParity == 0 && options->harqIncrement == 0 &&
+         !options->duplex && !options->resume && options->keepalive == 0 &&
+         options->receiveQueue == 0 &&
+         options->timerGranularity == DEFAULT_TIMER_GRANULARITY;
+}
+
+/**
+ * @brief Sends an extended SET and returns the configuration of the UA.
+ *
+ * The SET is sent again every time the timer expires, like
+ * `sendFrameAndAwaitAck()` does, but once EXTENDED_SET_TRIES of them went
+ * unanswered, every other one is a classic SET, for a receiver that only
+ * knows the classic protocol (except to a station of a multi-drop bus). A
+ * classic UA, to either, keeps the classic configuration. A UA whose
+ * parameters are corrupted is ignored, like a lost one.
+ *
+ * @param address The address of the SET and UA: 0x03, or that of a station.
+ * @param settled Where the configuration will be stored.
+ * @return 0 on success, -1 on error.
+ */
+int negotiateParameters(unsigned char address, Capabilities *settled) {
+  Capabilities local;
+  localCapabilities(&local);
+  unsigned char parameters[MAX_PARAMETERS_SIZE];
+  unsigned char extendedFrame[MAX_PARAMETERS_SIZE * 2 + 7];
+  size_t extendedSize =
+      buildFrame(address, 0x03, parameters,
+                 buildParameters(parameters, &local), LlFcsXor,
+                 LlFramingStuffing, extendedFrame);
+  const unsigned char classicFrame[5] = {0x7E, 0x03, 0x03, 0x03 ^ 0x03, 0x7E};
+  if (extendedSize == 0)
+    return -1;
+
+  int sent = 0;
+  const unsigned char *frame = extendedFrame;
+  size_t frameSize = extendedSize;
+  context->timeoutCount = 0;
+  while (TRUE) {
+    if (sent > 0) {
+      if (countTimeout(sent, CONTROL_TIMER))
+        break;
+      int classic = address == 0x03 && sent >= EXTENDED_SET_TRIES &&
+                    (sent - EXTENDED_SET_TRIES) % 2 == 0;
+      frame = classic ? classicFrame : extendedFrame;
+      frameSize = classic ? sizeof(classicFrame) : extendedSize;
+      printf(classic ? "Retransmitting as a classic SET...\n"
+                     : "Retransmitting...\n");
+    }
+    if (sendToLine(frame, frameSize, NULL) ||
+        startTimer(CONTROL_TIMER, transmissionTime(frameSize)))
+      break;
+    sent++;
+
+    int answered = FALSE;
+    while (!answered && !timerExpired(CONTROL_TIMER)) {
+      int received = receiveFrame(NULL);
+      if (received < 0) {
+        disarmTimer(CONTROL_TIMER);
+        return -1;
+      }
+      if (!received || context->receivedFrame.A != address ||
+          context->receivedFrame.C != 0x07)
+        continue;
+      if (context->receivedFrame.dataSize == 0)
+        classicCapabilities(settled);
+      else if (parseParameters(context->receivedFrame.data,
+                               context->receivedFrame.dataSize, settled)) {
+        printf("Corrupted UA parameters, ignored.\n");
+        continue;
+      }
+      answered = TRUE;
+    }
+    if (!answered)
+      continue;
+
+    disarmTimer(CONTROL_TIMER);
+    context->timeoutCount = 0;
+    // The receiver settles on them, but nothing larger than asked for is
+    // taken.
+    if (settled->payloadSize > local.payloadSize)
+      settled->payloadSize = local.payloadSize;
+    if (settled->windowSize > local.windowSize)
+      settled->windowSize = local.windowSize;
+    if (settled->version == CLASSIC_VERSION)
+      printf("Classic UA, the classic configuration is used.\n");
+    return 0;
+  }
+  disarmTimer(CONTROL_TIMER);
+  return -1;
+}
+
+/**
+ * @brief Waits for a SET and answers it with a UA.
+ *
+ * A classic SET gets a classic UA and keeps the classic configuration. An
+ * extended SET gets an extended UA with the configuration settled on by
+ * `settleCapabilities()`. SET frames with corrupted parameters are ignored.
+ * A station of a multi-drop bus only answers the SET sent to its address.
+ * The UA is kept for `answerRepeatedSet()`.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int acceptParameters() {
+  Capabilities peer;
+  while (TRUE) {
+    int received = receiveFrame(NULL);
+    if (received < 0)
+      return -1;
+    if (received && context->receivedFrame.A == connectionAddress() &&
+        context->receivedFrame.C == 0x03 &&
+        (context->receivedFrame.dataSize == 0 ||
+         !parseParameters(context->receivedFrame.data,
+                          context->receivedFrame.dataSize, &peer)))
+      break;
+  }
+
+  Capabilities settled;
+  if (context->receivedFrame.dataSize == 0) {
+    const unsigned char address = connectionAddress();
+    const unsigned char classicFrame[5] = {0x7E, address, 0x07,
+                                           address ^ 0x07, 0x7E};
+    classicCapabilities(&settled);
+    memcpy(context->uaFrame, classicFrame, sizeof(classicFrame));
+    context->uaFrameSize = sizeof(classicFrame);
+  } else {
+    Capabilities local;
+    localCapabilities(&local);
+    settleCapabilities(&local, &peer, &settled);
+    // The frames of a multi-drop bus are broadcast, so every station decodes
+    // them as the transmitter encodes them.
+    if (onBus()) {
+      settled.fcs = peer.fcs;
+      settled.framing = peer.framing;
+      settled.fecParity = peer.fecParity;
+      settled.fecDepth = peer.fecDepth;
+    }
+    unsigned char parameters[MAX_PARAMETERS_SIZE];
+    context->uaFrameSize = buildFrame(connectionAddress(), 0x07, parameters,
+                                      buildParameters(parameters, &settled),
+                                      LlFcsXor, LlFramingStuffing,
+                                      context->uaFrame);
+    if (context->uaFrameSize == 0)
+      return -1;
+  }
+  applyCapabilities(&settled);
+  return sendToLine(context->uaFrame, context->uaFrameSize, NULL) ? -1 : 0;
+}
+
+/**
+ * @brief Answers a SET the transmitter sent again, because the UA was lost,
+ * if `receivedFrame` holds one, with the same UA.
+ *
+ * @return 1 if it was a SET, 0 if not, -1 on error.
+ */
+int answerRepeatedSet() {
+  if (context->parameters.role != LlRx || context->uaFrameSize == 0 ||
+      context->receivedFrame.A != connectionAddress() ||
+      context->receivedFrame.C != 0x03)
+    return 0;
+  printf("SET received again, answering with the same UA\n");
+  return sendToLine(context->uaFrame, context->uaFrameSize, NULL) ? -1 : 1;
+}
@@ -0,0 +1,466 @@
+// Reed-Solomon implementation
+
+#include "../include/reed_solomon.h"
+#include <pthread.h>
+#include <string.h>
+
+#define GF_POLYNOMIAL 0x11D // x^8 + x^4 + x^3 + x^2 + 1
+
+// gfExp[i] is alpha^i, doubled so the sum of two logarithms needs no modulo.
+static unsigned char gfExp[512];
+static unsigned char gfLog[256];
+static pthread_once_t tablesOnce = PTHREAD_ONCE_INIT;
+
+// Generator polynomial of the last parity size used, highest degree first.
+// Kept per thread, since links on different threads may use different sizes.
+static __thread unsigned char generator[RS_MAX_PARITY + 1];
+static __thread int generatorParity = 0;
+
+/**
+ * @brief Builds the exponential and logarithm tables.
+ */
+static void buildTables() {
+  int x = 1;
+  for (int i = 0; i < 255; i++) {
+    gfExp[i] = x;
+    gfLog[x] = i;
+    x <<= 1;
+    if (x & 0x100)
+      x ^= GF_POLYNOMIAL;
+  }
+  for (int i = 255; i < 512; i++)
+    gfExp[i] = gfExp[i - 255];
+}
+
+/**
+ * @brief Builds the tables on first use, once even with several threads.
+ */
+static void initTables() { pthread_once(&tablesOnce, buildTables); }
+
+/**
+ * @brief Multiplies two elements of GF(256).
+ */
+static inline unsigned char gfMultiply(unsigned char a, unsigned char b) {
+  if (a == 0 || b == 0)
+    return 0;
+  return gfExp[gfLog[a] + gfLog[b]];
+}
+
+/**
+ * @brief Divides two elements of GF(256), b must not be 0.
+ */
+static inline unsigned char gfDivide(unsigned char a, unsigned char b) {
+  if (a == 0)
+    return 0;
+  return gfExp[gfLog[a] + 255 - gfLog[b]];
+}
+
+/**
+ * @brief Evaluates a polynomial, lowest degree first, at alpha^power.
+ *
+ * @param polynomial The coefficients.
+ * @param degree The degree of the polynomial.
+ * @param power The logarithm of the point, from 0 to 254.
+ */
+static unsigned char evaluate(const unsigned char *polynomial, int degree,
+                              int power) {
+  unsigned char value = 0;
+  for (int i = 0; i <= degree; i++) {
+    if (polynomial[i])
+      value ^= gfExp[(gfLog[polynomial[i]] + power * i) % 255];
+  }
+  return value;
+}
+
+/**
+ * @brief Builds the generator polynomial, the product of (x - alpha^i) for
+ * i from 0 to nParity - 1, unless it was built for the same size last time.
+ *
+ * @param nParity The number of parity bytes.
+ */
+static void buildGenerator(int nParity) {
+  if (generatorParity == nParity)
+    return;
+  memset(generator, 0, sizeof(generator));
+  generator[0] = 1;
+  for (int i = 0; i < nParity; i++) {
+    for (int j = i + 1; j > 0; j--)
+      generator[j] ^= gfMultiply(generator[j - 1], gfExp[i]);
+  }
+  generatorParity = nParity;
+}
+
+void rsEncode(const unsigned char *data, size_t size, int nParity,
+              unsigned char *parity) {
+  initTables();
+  buildGenerator(nParity);
+  memset(parity, 0, nParity);
+
+  // Division by the generator with a shift register: the remainder is the
+  // parity.
+  for (size_t i = 0; i < size; i++) {
+    unsigned char feedback = data[i] ^ parity[0];
+    for (int j = 0; j < nParity - 1; j++)
+      parity[j] = parity[j + 1] ^ gfMultiply(feedback, generator[j + 1]);
+    parity[nParity - 1] = gfMultiply(feedback, generator[nParity]);
+  }
+}
+
+/**
+ * @brief Decodes a codeword, correcting errors and erasures in place.
+ *
+ * The syndromes are the codeword evaluated at the roots of the generator, all
+ * 0 if it is intact. Otherwise the Berlekamp-Massey algorithm, started from
+ * the locator of the erasures, finds the locator polynomial of every error
+ * and erasure, whose roots are found by trying every position (Chien search),
+ * and the Forney algorithm gives the error value at each of them. The byte at
+ * index j is the coefficient of x^(size - 1 - j).
+ */
+int rsDecodeErasures(unsigned char *codeword, size_t size, int nParity,
+                     const size_t *erasures, int nErasures) {
+  initTables();
+  if (nErasures > nParity)
+    return -1;
+  unsigned char syndromes[RS_MAX_PARITY];
+  int clean = 1;
+  for (int i = 0; i < nParity; i++) {
+    unsigned char syndrome = 0;
+    for (size_t j = 0; j < size; j++)
+      syndrome = (syndrome ? gfExp[gfLog[syndrome] + i] : 0) ^ codeword[j];
+    syndromes[i] = syndrome;
+    clean &= syndrome == 0;
+  }
+  if (clean)
+    return 0;
+
+  // The erasure locator, the product of (1 - X x) for each erased position.
+  unsigned char locator[RS_MAX_PARITY + 1] = {1};
+  for (int k = 0; k < nErasures; k++) {
+    unsigned char position = gfExp[size - 1 - erasures[k]];
+    for (int i = k + 1; i > 0; i--)
+      locator[i] ^= gfMultiply(locator[i - 1], position);
+  }
+
+  // Berlekamp-Massey, polynomials lowest degree first.
+  unsigned char previous[RS_MAX_PARITY + 1];
+  unsigned char saved[RS_MAX_PARITY + 1];
+  memcpy(previous, locator, sizeof(previous));
+  unsigned char previousDiscrepancy = 1;
+  int errata = nErasures;
+  int shift = 1;
+  for (int n = nErasures; n < nParity; n++) {
+    unsigned char discrepancy = syndromes[n];
+    for (int i = 1; i <= errata; i++)
+      discrepancy ^= gfMultiply(locator[i], syndromes[n - i]);
+    if (discrepancy == 0) {
+      shift++;
+      continue;
+    }
+    unsigned char scale = gfDivide(discrepancy, previousDiscrepancy);
+    int grow = 2 * errata <= n + nErasures;
+    if (grow)
+      memcpy(saved, locator, sizeof(saved));
+    for (int i = 0; i + shift <= nParity; i++)
+      locator[i + shift] ^= gfMultiply(scale, previous[i]);
+    if (grow) {
+      errata = n + 1 + nErasures - errata;
+      memcpy(previous, saved, sizeof(previous));
+      previousDiscrepancy = discrepancy;
+      shift = 1;
+    } else {
+      shift++;
+    }
+  }
+  // Each error takes two parity bytes to correct, each erasure one.
+  int errors = errata - nErasures;
+  if (2 * errors + nErasures > nParity)
+    return -1;
+
+  // Chien search: an error at power e makes alpha^-e a root of the locator.
+  size_t positions[RS_MAX_PARITY];
+  int found = 0;
+  for (size_t j = 0; j < size; j++) {
+    int power = size - 1 - j;
+    if (evaluate(locator, errata, (255 - power) % 255) != 0)
+      continue;
+    if (found == errata)
+      return -1;
+    positions[found++] = j;
+  }
+  // Roots outside of the (shortened) codeword mean too many errors.
+  if (found != errata)
+    return -1;
+
+  // Forney: the error value is X Omega(X^-1) / Lambda'(X^-1), where the
+  // evaluator Omega is the syndromes times the locator, modulo x^nParity.
+  unsigned char evaluator[RS_MAX_PARITY];
+  for (int k = 0; k < nParity; k++) {
+    evaluator[k] = 0;
+    for (int i = 0; i <= errata && i <= k; i++)
+      evaluator[k] ^= gfMultiply(locator[i], syndromes[k - i]);
+  }
+  // The formal derivative keeps the odd terms (the even ones cancel out).
+  unsigned char derivative[RS_MAX_PARITY];
+  for (int i = 0; i < errata; i++)
+    derivative[i] = (i % 2 == 0) ? locator[i + 1] : 0;
+
+  // The codeword is left untouched unless every error value is found.
+  unsigned char values[RS_MAX_PARITY];
+  for (int k = 0; k < found; k++) {
+    int power = size - 1 - positions[k];
+    int inverse = (255 - power) % 255;
+    unsigned char denominator = evaluate(derivative, errata - 1, inverse);
+    if (denominator == 0)
+      return -1;
+    values[k] = gfMultiply(
+        gfDivide(evaluate(evaluator, nParity - 1, inverse), denominator),
+        gfExp[power]);
+  }
+  for (int k = 0; k < found; k++)
+    codeword[positions[k]] ^= values[k];
+  return errors;
+}
+
+int rsDecode(unsigned char *codeword, size_t size, int nParity) {
+  return rsDecodeErasures(codeword, size, nParity, NULL, 0);
+}
+
+size_t rsCodewordCount(size_t size, int nParity) {
+  size_t capacity = RS_CODEWORD_SIZE - nParity;
+  return (size + capacity - 1) / capacity;
+}
+
+/**
+ * @brief Returns the number of codewords of a group.
+ *
+ * The codewords are split evenly into the groups, so the last group isn't
+ * left with a few codewords and a short reach against bursts.
+ *
+ * @param count The number of codewords.
+ * @param groups The number of groups, enough for groups of at most the depth.
+ * @param group The index of the group.
+ */
+static size_t groupSize(size_t count, size_t groups, size_t group) {
+  return count / groups + (group < count % groups);
+}
+
+size_t rsEncodedSize(size_t size, int nParity) {
+  return rsPuncturedSize(size, nParity, nParity);
+}
+
+size_t rsBlockSize(size_t encodedSize, int nParity) {
+  return rsPuncturedBlockSize(encodedSize, nParity, nParity);
+}
+
+size_t rsPuncturedSize(size_t size, int nParity, int nSent) {
+  if (nSent == 0)
+    return size;
+  return size + rsCodewordCount(size, nParity) * nSent;
+}
+
+size_t rsPuncturedBlockSize(size_t encodedSize, int nParity, int nSent) {
+  if (nSent == 0)
+    return encodedSize;
+  // Each codeword takes at most this many bytes, so there are at least
+  // `count` of them, and the encoded size grows with the block size, so at
+  // most one count fits.
+  size_t sent = RS_CODEWORD_SIZE - nParity + nSent;
+  for (size_t count = (encodedSize + sent - 1) / sent;
+       count * nSent < encodedSize; count++) {
+    size_t size = encodedSize - count * nSent;
+    if (rsCodewordCount(size, nParity) == count)
+      return size;
+  }
+  return 0;
+}
+
+void rsEncodeBlock(const unsigned char *data, size_t size, int nParity,
+                   int depth, unsigned char *encoded) {
+  if (nParity == 0) {
+    memcpy(encoded, data, size);
+    return;
+  }
+  size_t count = rsCodewordCount(size, nParity);
+  // The first `longer` codewords carry one more data byte than the others.
+  size_t base = size / count, longer = size % count;
+  const unsigned char *codewordData[RS_MAX_DEPTH];
+  size_t dataSizes[RS_MAX_DEPTH];
+  unsigned char parity[RS_MAX_DEPTH][RS_MAX_PARITY];
+
+  size_t groups = (count + depth - 1) / depth, group = 0;
+  for (size_t g = 0, first = 0; g < groups; g++, first += group) {
+    group = groupSize(count, groups, g);
+    for (size_t c = 0; c < group; c++) {
+      dataSizes[c] = base + (first + c < longer);
+      codewordData[c] = data;
+      data += dataSizes[c];
+      rsEncode(codewordData[c], dataSizes[c], nParity, parity[c]);
+    }
+    // Byte j of every codeword of the group, then byte j + 1.
+    size_t columns = dataSizes[0] + nParity;
+    for (size_t j = 0; j < columns; j++) {
+      for (size_t c = 0; c < group; c++) {
+        if (j < dataSizes[c])
+          *encoded++ = codewordData[c][j];
+        else if (j < dataSizes[c] + nParity)
+          *encoded++ = parity[c][j - dataSizes[c]];
+      }
+    }
+  }
+}
+
+int rsDecodeBlock(unsigned char *encoded, size_t encodedSize, int nParity,
+                  int depth) {
+  if (nParity == 0)
+    return 0;
+  size_t size = rsBlockSize(encodedSize, nParity);
+  if (size == 0)
+    return -1;
+  size_t count = rsCodewordCount(size, nParity);
+  size_t base = size / count, longer = size % count;
+  unsigned char codewords[RS_MAX_DEPTH][RS_CODEWORD_SIZE];
+  size_t lengths[RS_MAX_DEPTH];
+  const unsigned char *in = encoded;
+  unsigned char *out = encoded;
+  int corrected = 0;
+  int failed = 0;
+
+  // The data of a group is written back only after the whole group was read,
+  // and never past it, since it is shorter than the encoded group.
+  size_t groups = (count + depth - 1) / depth, group = 0;
+  for (size_t g = 0, first = 0; g < groups; g++, first += group) {
+    group = groupSize(count, groups, g);
+    for (size_t c = 0; c < group; c++)
+      lengths[c] = base + (first + c < longer) + nParity;
+    for (size_t j = 0; j < lengths[0]; j++) {
+      for (size_t c = 0; c < group; c++) {
+        if (j < lengths[c])
+          codewords[c][j] = *in++;
+      }
+    }
+    for (size_t c = 0; c < group; c++) {
+      int fixed = rsDecode(codewords[c], lengths[c], nParity);
+      if (fixed < 0)
+        failed = 1;
+      else
+        corrected += fixed;
+      memcpy(out, codewords[c], lengths[c] - nParity);
+      out += lengths[c] - nParity;
+    }
+  }
+  return failed ? -1 : corrected;
+}
+
+void rsEncodeParity(const unsigned char *data, size_t size, int nParity,
+                    unsigned char *parity) {
+  size_t count = rsCodewordCount(size, nParity);
+  size_t base = size / count, longer = size % count;
+  for (size_t c = 0; c < count; c++) {
+    size_t dataSize = base + (c < longer);
+    rsEncode(data, dataSize, nParity, parity + c * nParity);
+    data += dataSize;
+  }
+}
+
+/**
+ * @brief Copies part of a block between its codewords and the wire order.
+ *
+ * The part of each codeword is its data (if data isn't NULL), followed by its
+ * parity bytes from `from` to `to`. The parts of the codewords of each group
+ * are interleaved byte by byte, as by rsEncodeBlock().
+ *
+ * @param data The data of the block, or NULL if it isn't part of it.
+ * @param parity The parity bytes of each codeword, one after the other.
+ * @param size The size of the data.
+ * @param nParity The parity bytes per codeword.
+ * @param from The first parity byte of the part.
+ * @param to The parity byte after the last one of the part.
+ * @param depth The interleaving depth.
+ * @param encoded The part in wire order.
+ * @param toWire TRUE to copy to encoded, FALSE to copy from it.
+ */
+static void interleave(unsigned char *data, unsigned char *parity, size_t size,
+                       int nParity, int from, int to, int depth,
+                       unsigned char *encoded, int toWire) {
+  size_t count = rsCodewordCount(size, nParity);
+  size_t base = size / count, longer = size % count;
+  size_t groups = (count + depth - 1) / depth, group = 0;
+  unsigned char *codewordData[RS_MAX_DEPTH];
+  size_t dataSizes[RS_MAX_DEPTH];
+
+  for (size_t g = 0, first = 0; g < groups; g++, first += group) {
+    group = groupSize(count, groups, g);
+    for (size_t c = 0; c < group; c++) {
+      dataSizes[c] = data == NULL ? 0 : base + (first + c < longer);
+      codewordData[c] = data;
+      if (data != NULL)
+        data += dataSizes[c];
+    }
+    size_t columns = dataSizes[0] + to - from;
+    for (size_t j = 0; j < columns; j++) {
+      for (size_t c = 0; c < group; c++) {
+        unsigned char *byte;
+        if (j < dataSizes[c])
+          byte = &codewordData[c][j];
+        else if (j < dataSizes[c] + to - from)
+          byte = &parity[(first + c) * nParity + from + j - dataSizes[c]];
+        else
+          continue;
+        if (toWire)
+          *encoded++ = *byte;
+        else
+          *byte = *encoded++;
+      }
+    }
+  }
+}
+
+void rsInterleave(const unsigned char *data, const unsigned char *parity,
+                  size_t size, int nParity, int from, int to, int depth,
+                  unsigned char *encoded) {
+  interleave((unsigned char *)data, (unsigned char *)parity, size, nParity,
+             from, to, depth, encoded, 1);
+}
+
+void rsDeinterleave(const unsigned char *encoded, size_t size, int nParity,
+                    int from, int to, int depth, unsigned char *data,
+                    unsigned char *parity) {
+  interleave(data, parity, size, nParity, from, to, depth,
+             (unsigned char *)encoded, 0);
+}
+
+int rsCorrectBlock(const unsigned char *data, const unsigned char *parity,
+                   size_t size, int nParity, uint32_t known,
+                   unsigned char *corrected) {
+  size_t count = rsCodewordCount(size, nParity);
+  size_t base = size / count, longer = size % count;
+  unsigned char codeword[RS_CODEWORD_SIZE];
+  size_t erasures[RS_MAX_PARITY];
+  int errors = 0;
+  int failed = 0;
+
+  for (size_t c = 0; c < count; c++) {
+    size_t dataSize = base + (c < longer);
+    int nErasures = 0;
+    memcpy(codeword, data, dataSize);
+    for (int i = 0; i < nParity; i++) {
+      if (known & (1u << i)) {
+        codeword[dataSize + i] = parity[c * nParity + i];
+      } else {
+        codeword[dataSize + i] = 0;
+        erasures[nErasures++] = dataSize + i;
+      }
+    }
+    int fixed =
+        rsDecodeErasures(codeword, dataSize + nParity, nParity, erasures,
+                         nErasures);
+    if (fixed < 0)
+      failed = 1;
+    else
+      errors += fixed;
+    memcpy(corrected, fixed < 0 ? data : codeword, dataSize);
+    data += dataSize;
+    corrected += dataSize;
+  }
+  return failed ? -1 : errors;
+}
@@ -0,0 +1,107 @@
+// Serial line implementation
+
+#include "../include/serial_line.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * @brief Converts a baud rate to its termios flag.
+ *
+ * @param baudRate The baud rate.
+ * @return The flag, or 0 if the baud rate isn't supported.
+ */
+speed_t baudRateFlag(int baudRate) {
+  switch (baudRate) {
+  case 1200:
+    return B1200;
+  case 1800:
+    return B1800;
+  case 2400:
+    return B2400;
+  case 4800:
+    return B4800;
+  case 9600:
+    return B9600;
+  case 19200:
+    return B19200;
+  case 38400:
+    return B38400;
+  case 57600:
+    return B57600;
+  case 115200:
+    return B115200;
+  default:
+    return 0;
+  }
+}
+
+int serialLineOpen(SerialLine *line, const char *serialPort, int baudRate) {
+  // Open with O_NONBLOCK to avoid hanging when CLOCAL is not yet set on the
+  // serial port (changed later).
+  int oflags = O_RDWR | O_NOCTTY | O_NONBLOCK;
+  line->fd = open(serialPort, oflags);
+  if (line->fd < 0) {
+    perror(serialPort);
+    return -1;
+  }
+
+  if (tcgetattr(line->fd, &line->oldtio) == -1) {
+    perror("tcgetattr");
+    close(line->fd);
+    line->fd = -1;
+    return -1;
+  }
+
+  speed_t br = baudRateFlag(baudRate);
+  if (br == 0) {
+    fprintf(stderr, "Unsupported baud rate (must be one of 1200, 1800, 2400, "
+                    "4800, 9600, 19200, 38400, 57600, 115200)\n");
+    close(line->fd);
+    line->fd = -1;
+    return -1;
+  }
+
+  // Non-canonical, no echo, reads return whatever was received.
+  struct termios newtio;
+  memset(&newtio, 0, sizeof(newtio));
+  newtio.c_cflag = br | CS8 | CLOCAL | CREAD;
+  newtio.c_iflag = IGNPAR;
+  newtio.c_oflag = 0;
+  newtio.c_lflag = 0;
+  newtio.c_cc[VTIME] = 0;
+  newtio.c_cc[VMIN] = 0;
+
+  tcflush(line->fd, TCIOFLUSH);
+  if (tcsetattr(line->fd, TCSANOW, &newtio) == -1) {
+    perror("tcsetattr");
+    close(line->fd);
+    line->fd = -1;
+    return -1;
+  }
+
+  // The event loop switches the port to non-blocking mode itself.
+  oflags ^= O_NONBLOCK;
+  if (fcntl(line->fd, F_SETFL, oflags) == -1) {
+    perror("fcntl");
+    close(line->fd);
+    line->fd = -1;
+    return -1;
+  }
+  return line->fd;
+}
+
+int serialLineClose(SerialLine *line) {
+  if (line->fd < 0)
+    return -1;
+  int result = 0;
+  if (tcsetattr(line->fd, TCSANOW, &line->oldtio) == -1) {
+    perror("tcsetattr");
+    result = -1;
+  }
+  if (close(line->fd) == -1)
+    result = -1;
+  line->fd = -1;
+  return result;
+}
@@ -0,0 +1,234 @@
+// Trace implementation
+
+#include "../include/trace.h"
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRACE_PATH_SIZE 256
+// Bytes of JSON formatted before they are written to the file.
+#define DUMP_BUFFER_SIZE 4096
+
+typedef struct {
+  uint64_t sequence;  // Index of the event plus 1 once published, else 0.
+  uint64_t timestamp; // Nanoseconds since `traceStart()`.
+  const char *name;
+  const char *argName; // NULL if the event has no argument.
+  long arg;
+  int thread;
+  char phase; // 'B', 'E', 'i' or 'C', as in the trace event format.
+} TraceEvent;
+
+// The ring, allocated by the first `traceStart()`, and the index of the next
+// event (counted from 0, the slot is that modulo TRACE_EVENTS).
+static TraceEvent *events;
+static uint64_t nextEvent;
+static int enabled;
+static struct timespec start;
+static char tracePath[TRACE_PATH_SIZE];
+static int dumping; // A dump is running.
+// Id of the calling thread in the trace, 0 until its first event.
+static __thread int threadId;
+
+int traceStart(const char *path) {
+  if (path == NULL) {
+    __atomic_store_n(&enabled, 0, __ATOMIC_RELEASE);
+    return 0;
+  }
+  if (strlen(path) >= TRACE_PATH_SIZE)
+    return -1;
+  if (events == NULL) {
+    events = calloc(TRACE_EVENTS, sizeof(TraceEvent));
+    if (events == NULL)
+      return -1;
+  }
+  strcpy(tracePath, path);
+  memset(events, 0, TRACE_EVENTS * sizeof(TraceEvent));
+  nextEvent = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  __atomic_store_n(&enabled, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+int traceEnabled() { return __atomic_load_n(&enabled, __ATOMIC_RELAXED); }
+
+/**
+ * @brief Records an event in the next slot of the ring.
+ *
+ * The slot is claimed with an atomic increment, so threads never wait on each
+ * other. Its sequence number is cleared while the event is written and set
+ * once it is complete, so `traceDump()` skips an event being written.
+ */
+static void record(char phase, const char *name, const char *argName,
+                   long arg) {
+  if (!__atomic_load_n(&enabled, __ATOMIC_RELAXED))
+    return;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (threadId == 0)
+    threadId = syscall(SYS_gettid);
+
+  uint64_t index = __atomic_fetch_add(&nextEvent, 1, __ATOMIC_RELAXED);
+  TraceEvent *event = &events[index % TRACE_EVENTS];
+  __atomic_store_n(&event->sequence, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  event->timestamp = (now.tv_sec - start.tv_sec) * 1000000000ULL +
+                     now.tv_nsec - start.tv_nsec;
+  event->name = name;
+  event->argName = argName;
+  event->arg = arg;
+  event->thread = threadId;
+  event->phase = phase;
+  __atomic_store_n(&event->sequence, index + 1, __ATOMIC_RELEASE);
+}
+
+void traceBegin(const char *name) { record('B', name, NULL, 0); }
+
+void traceEnd(const char *name, const char *argName, long arg) {
+  record('E', name, argName, arg);
+}
+
+void traceInstant(const char *name, const char *argName, long arg) {
+  record('i', name, argName, arg);
+}
+
+void traceCounter(const char *name, long value) {
+  record('C', name, name, value);
+}
+
+// JSON being written by `traceDump()`, formatted without stdio, which isn't
+// async-signal-safe.
+typedef struct {
+  char bytes[DUMP_BUFFER_SIZE];
+  size_t size;
+  int fd;
+  int failed;
+} DumpBuffer;
+
+/**
+ * @brief Writes the bytes of the buffer to the file.
+ */
+static void flush(DumpBuffer *buffer) {
+  size_t written = 0;
+  while (!buffer->failed && written < buffer->size) {
+    ssize_t bytes =
+        write(buffer->fd, buffer->bytes + written, buffer->size - written);
+    if (bytes <= 0)
+      buffer->failed = 1;
+    else
+      written += bytes;
+  }
+  buffer->size = 0;
+}
+
+static void appendString(DumpBuffer *buffer, const char *string) {
+  for (; *string != '\0'; string++) {
+    if (buffer->size == DUMP_BUFFER_SIZE)
+      flush(buffer);
+    buffer->bytes[buffer->size++] = *string;
+  }
+}
+
+/**
+ * @brief Appends a number, with `decimals` of its digits after a point.
+ */
+static void appendNumber(DumpBuffer *buffer, long value, int decimals) {
+  char digits[24];
+  int count = 0;
+  unsigned long magnitude =
+      value < 0 ? -(unsigned long)value : (unsigned long)value;
+  do {
+    if (count == decimals && decimals > 0)
+      digits[count++] = '.';
+    digits[count++] = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude > 0 || count <= decimals);
+  if (value < 0)
+    digits[count++] = '-';
+  char reversed[sizeof(digits) + 1];
+  for (int i = 0; i < count; i++)
+    reversed[i] = digits[count - 1 - i];
+  reversed[count] = '\0';
+  appendString(buffer, reversed);
+}
+
+/**
+ * @brief Copies the event of index `index`, if it is in the ring and
+ * complete.
+ *
+ * @return 1 if it was copied, 0 if it was overwritten or is being written.
+ */
+static int readEvent(uint64_t index, TraceEvent *copy) {
+  const TraceEvent *event = &events[index % TRACE_EVENTS];
+  if (__atomic_load_n(&event->sequence, __ATOMIC_ACQUIRE) != index + 1)
+    return 0;
+  *copy = *event;
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&event->sequence, __ATOMIC_RELAXED) == index + 1;
+}
+
+int traceDump(int wait) {
+  while (__atomic_exchange_n(&dumping, 1, __ATOMIC_ACQUIRE)) {
+    if (!wait)
+      return -1;
+    sched_yield();
+  }
+  if (events == NULL) {
+    __atomic_store_n(&dumping, 0, __ATOMIC_RELEASE);
+    return -1;
+  }
+  DumpBuffer buffer;
+  buffer.size = 0;
+  buffer.failed = 0;
+  buffer.fd = open(tracePath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (buffer.fd < 0) {
+    __atomic_store_n(&dumping, 0, __ATOMIC_RELEASE);
+    return -1;
+  }
+
+  long pid = getpid();
+  uint64_t end = __atomic_load_n(&nextEvent, __ATOMIC_ACQUIRE);
+  uint64_t first = end > TRACE_EVENTS ? end - TRACE_EVENTS : 0;
+  const char *separator = "\n";
+  appendString(&buffer, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  for (uint64_t index = first; index < end; index++) {
+    TraceEvent event;
+    if (!readEvent(index, &event))
+      continue;
+    char phase[2] = {event.phase, '\0'};
+    appendString(&buffer, separator);
+    appendString(&buffer, "{\"name\":\"");
+    appendString(&buffer, event.name);
+    appendString(&buffer, "\",\"ph\":\"");
+    appendString(&buffer, phase);
+    // Timestamps are in microseconds.
+    appendString(&buffer, "\",\"ts\":");
+    appendNumber(&buffer, event.timestamp, 3);
+    appendString(&buffer, ",\"pid\":");
+    appendNumber(&buffer, pid, 0);
+    appendString(&buffer, ",\"tid\":");
+    appendNumber(&buffer, event.thread, 0);
+    if (event.phase == 'i')
+      appendString(&buffer, ",\"s\":\"t\"");
+    if (event.argName != NULL) {
+      appendString(&buffer, ",\"args\":{\"");
+      appendString(&buffer, event.argName);
+      appendString(&buffer, "\":");
+      appendNumber(&buffer, event.arg, 0);
+      appendString(&buffer, "}");
+    }
+    appendString(&buffer, "}");
+    separator = ",\n";
+  }
+  appendString(&buffer, "\n]}\n");
+  flush(&buffer);
+  int failed = buffer.failed;
+  close(buffer.fd);
+  __atomic_store_n(&dumping, 0, __ATOMIC_RELEASE);
+  return failed ? -1 : 0;
+}